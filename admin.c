@@ -0,0 +1,265 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include "util.h"
+#include "socks5.h"
+#include "topk.h"
+#include "lag.h"
+#include "tcpinfo.h"
+#include "upstream.h"
+#include "conf.h"
+#include "conntab.h"
+#include "admin.h"
+
+#define ADMIN_TOP_DEFAULT	(10)
+
+static struct event *g_admin_ev = NULL;
+static const char *g_admin_path = NULL;
+
+/*
+ * admin_top
+ * top clients|destinations [connections|bytes] [n]
+ */
+static void admin_top(struct evbuffer *out, char *args)
+{
+	char *tok;
+	int kind, metric = TOPK_CONNS;
+	unsigned int n = ADMIN_TOP_DEFAULT;
+
+	tok = strtok(args, " \t");
+	if (tok && strcmp(tok, "clients") == 0)
+		kind = TOPK_CLIENTS;
+	else if (tok && strcmp(tok, "destinations") == 0)
+		kind = TOPK_DSTS;
+	else {
+		evbuffer_add_printf(out,
+				"error: top clients|destinations [connections|bytes] [n]\n");
+		return;
+	}
+
+	while ((tok = strtok(NULL, " \t")) != NULL) {
+		if (strcmp(tok, "connections") == 0)
+			metric = TOPK_CONNS;
+		else if (strcmp(tok, "bytes") == 0)
+			metric = TOPK_BYTES;
+		else
+			n = (unsigned int)strtoul(tok, NULL, 10);
+	}
+
+	topk_report(out, kind, metric, n);
+}
+
+/*
+ * admin_command
+ * Run one command line, appending the answer to out.
+ */
+static void admin_command(struct evbuffer *out, char *line)
+{
+	char *cmd, *args;
+
+	cmd = line + strspn(line, " \t");
+	args = cmd + strcspn(cmd, " \t");
+	if (*args)
+		*args++ = '\0';
+
+	if (strcmp(cmd, "top") == 0)
+		admin_top(out, args);
+	else if (strcmp(cmd, "lag") == 0)
+		lag_report(out);
+	else if (strcmp(cmd, "tcpinfo") == 0)
+		tcpinfo_report(out, args);
+	else if (strcmp(cmd, "upstream") == 0)
+		upstream_report(out);
+	else if (strcmp(cmd, "reload") == 0)
+		conf_reload(out);
+	else if (strcmp(cmd, "conns") == 0)
+		conntab_list(out, args);
+	else if (strcmp(cmd, "kill") == 0)
+		conntab_kill(out, args);
+	else
+		evbuffer_add_printf(out, "error: unknown command '%s'\n", cmd);
+}
+
+/*
+ * admin_writecb
+ * The answer is out; close.
+ */
+static void admin_writecb(struct bufferevent *bev, void *arg)
+{
+	bufferevent_free(bev);
+}
+
+/*
+ * admin_eventcb
+ */
+static void admin_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	bufferevent_free(bev);
+}
+
+/*
+ * admin_readcb
+ */
+static void admin_readcb(struct bufferevent *bev, void *arg)
+{
+	struct evbuffer *input = bufferevent_get_input(bev);
+	char *line;
+
+	line = evbuffer_readln(input, NULL, EVBUFFER_EOL_ANY);
+	if (!line) {
+		if (evbuffer_get_length(input) >= ADMIN_LINE_MAX)
+			bufferevent_free(bev);
+		return;
+	}
+
+	bufferevent_disable(bev, EV_READ);
+	bufferevent_setcb(bev, NULL, admin_writecb, admin_eventcb, NULL);
+	admin_command(bufferevent_get_output(bev), line);
+	free(line);
+}
+
+/*
+ * admin_accept
+ */
+static void admin_accept(int listener, short what, void *arg)
+{
+	struct event_base *base = (struct event_base*)arg;
+	struct bufferevent *bev;
+	struct timeval tv = { 5, 0 };
+	int fd;
+
+	fd = accept(listener, NULL, NULL);
+	if (fd < 0) {
+		oddsock_log(1, errno, "admin accept failed");
+		return;
+	}
+	if (make_socket_nonblocking(fd) < 0) {
+		close(fd);
+		return;
+	}
+
+	bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+	if (!bev) {
+		close(fd);
+		return;
+	}
+	bufferevent_setcb(bev, admin_readcb, NULL, admin_eventcb, NULL);
+	bufferevent_set_timeouts(bev, &tv, &tv);
+	bufferevent_priority_set(bev, SOCKS5_PRIO_INTERACTIVE);
+	if (bufferevent_enable(bev, EV_READ|EV_WRITE) != 0)
+		bufferevent_free(bev);
+}
+
+/*
+ * admin_init
+ */
+int admin_init(struct event_base *base, const char *path)
+{
+	struct sockaddr_un sun;
+	mode_t mask;
+	int fd, ret;
+
+	if (!path)
+		return 0;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		oddsock_logx(0, "admin socket path too long: %s", path);
+		return -1;
+	}
+	strlcpy(sun.sun_path, path, sizeof(sun.sun_path));
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		oddsock_log(0, errno, "admin socket");
+		return -1;
+	}
+
+	/* A stale socket from an earlier run would make bind fail. Only the
+	 * owner may connect. */
+	unlink(path);
+	mask = umask(S_IRWXG|S_IRWXO);
+	ret = bind(fd, (struct sockaddr*)&sun, sizeof(sun));
+	umask(mask);
+	if (ret < 0 ||
+		listen(fd, 16) < 0 ||
+		make_socket_nonblocking(fd) < 0) {
+		oddsock_log(0, errno, "failed listening on admin socket %s", path);
+		close(fd);
+		return -1;
+	}
+
+	g_admin_ev = event_new(base, fd, EV_READ|EV_PERSIST, admin_accept,
+			(void*)base);
+	if (!g_admin_ev ||
+		event_priority_set(g_admin_ev, SOCKS5_PRIO_INTERACTIVE) != 0 ||
+		event_add(g_admin_ev, NULL) != 0) {
+		close(fd);
+		return -1;
+	}
+	g_admin_path = path;
+
+	return 0;
+}
+
+/*
+ * admin_close
+ */
+void admin_close(void)
+{
+	int fd;
+
+	if (g_admin_ev) {
+		fd = event_get_fd(g_admin_ev);
+		event_free(g_admin_ev);
+		g_admin_ev = NULL;
+		close(fd);
+	}
+	if (g_admin_path) {
+		unlink(g_admin_path);
+		g_admin_path = NULL;
+	}
+}
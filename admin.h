@@ -0,0 +1,71 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#ifndef ODDSOCK_ADMIN_H
+#define ODDSOCK_ADMIN_H
+
+#include <event2/event.h>
+
+/*
+ * Admin socket.
+ *
+ * With --adminSocket <path> oddsock listens on a unix socket, mode 0600,
+ * for one command per connection and closes it after the answer:
+ *
+ *   top clients|destinations [connections|bytes] [n]
+ *   lag
+ *   tcpinfo [conns [n]]
+ *   upstream
+ *   reload
+ *   conns [filter...] [n]
+ *   kill filter...
+ *
+ * e.g. echo top destinations bytes | socat - UNIX-CONNECT:<path>
+ */
+
+#define ADMIN_LINE_MAX	(256)
+
+/*
+ * admin_init
+ * Listen on path; a no-op when path is NULL.
+ */
+int admin_init(struct event_base *base, const char *path);
+
+/*
+ * admin_close
+ * Stop listening and remove the socket file.
+ */
+void admin_close(void);
+
+#endif
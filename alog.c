@@ -0,0 +1,299 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <event2/event.h>
+#include "util.h"
+#include "socks5.h"
+#include "stats.h"
+#include "alog.h"
+
+#define ALOG_PATH_MAX	(1024)
+
+struct alog_segment {
+	int fd; /* -1 when unused */
+	unsigned char *map;
+	size_t size;
+	size_t used; /* bytes, header included */
+	char path[ALOG_PATH_MAX];
+};
+
+static struct alog_segment g_alog_cur = { -1, NULL, 0, 0, "" };
+static struct alog_segment g_alog_spare = { -1, NULL, 0, 0, "" };
+static struct alog_segment g_alog_retired = { -1, NULL, 0, 0, "" };
+static struct event *g_alog_work_ev = NULL;
+static struct event *g_alog_rotate_ev = NULL;
+static const char *g_alog_dir = NULL;
+static size_t g_alog_size = 0;
+static unsigned long g_alog_started = 0;
+static unsigned long g_alog_seq = 0;
+
+/*
+ * alog_now_us
+ */
+static uint64_t alog_now_us(void)
+{
+	struct timeval tv;
+
+	evutil_gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_usec;
+}
+
+/*
+ * alog_segment_create
+ * Create, preallocate and map the next segment file.
+ */
+static int alog_segment_create(struct alog_segment *seg)
+{
+	struct alog_header *hdr;
+
+	evutil_snprintf(seg->path, sizeof(seg->path),
+			"%s/access-%lu-%ld-%06lu.alog", g_alog_dir, g_alog_started,
+			(long)getpid(), g_alog_seq++);
+	seg->fd = open(seg->path, O_RDWR|O_CREAT|O_EXCL, 0640);
+	if (seg->fd < 0) {
+		oddsock_log(0, errno, "failed creating access log %s", seg->path);
+		return -1;
+	}
+	if (ftruncate(seg->fd, (off_t)g_alog_size) < 0)
+		goto fail;
+#ifdef __linux__
+	/* Allocate the blocks now rather than on page faults in the loop. */
+	if (posix_fallocate(seg->fd, 0, (off_t)g_alog_size) != 0)
+		oddsock_logx(1, "posix_fallocate failed for %s", seg->path);
+#endif
+
+	seg->map = (unsigned char*)mmap(NULL, g_alog_size, PROT_READ|PROT_WRITE,
+			MAP_SHARED, seg->fd, 0);
+	if (seg->map == (unsigned char*)MAP_FAILED) {
+		seg->map = NULL;
+		goto fail;
+	}
+	seg->size = g_alog_size;
+	seg->used = sizeof(struct alog_header);
+
+	hdr = (struct alog_header*)seg->map;
+	memcpy(hdr->magic, ALOG_MAGIC, sizeof(hdr->magic));
+	hdr->byte_order = ALOG_BYTE_ORDER;
+	hdr->record_size = sizeof(struct alog_record);
+	hdr->capacity = (g_alog_size - sizeof(*hdr)) / sizeof(struct alog_record);
+
+	return 0;
+
+fail:
+	oddsock_log(0, errno, "failed preparing access log %s", seg->path);
+	close(seg->fd);
+	unlink(seg->path);
+	seg->fd = -1;
+	return -1;
+}
+
+/*
+ * alog_segment_finish
+ * Unmap, trim to the records written and close; unused segments are
+ * removed.
+ */
+static void alog_segment_finish(struct alog_segment *seg)
+{
+	if (seg->fd < 0)
+		return;
+
+	munmap(seg->map, seg->size);
+	if (seg->used > sizeof(struct alog_header)) {
+		if (ftruncate(seg->fd, (off_t)seg->used) < 0)
+			oddsock_log(1, errno, "failed trimming %s", seg->path);
+	} else
+		unlink(seg->path);
+	close(seg->fd);
+
+	seg->fd = -1;
+	seg->map = NULL;
+}
+
+/*
+ * alog_workcb
+ * Close the retired segment and prepare a spare, off the record path.
+ */
+static void alog_workcb(int fd, short what, void *arg)
+{
+	alog_segment_finish(&g_alog_retired);
+	if (g_alog_spare.fd < 0)
+		alog_segment_create(&g_alog_spare);
+}
+
+/*
+ * alog_rotate
+ * Switch to the spare segment. returns -1 if there is none yet.
+ */
+static int alog_rotate(void)
+{
+	struct timeval tv = { 0, 0 };
+
+	if (g_alog_spare.fd < 0 || g_alog_retired.fd >= 0)
+		return -1;
+
+	g_alog_retired = g_alog_cur;
+	g_alog_cur = g_alog_spare;
+	g_alog_spare.fd = -1;
+	g_alog_spare.map = NULL;
+	((struct alog_header*)g_alog_cur.map)->created_us = alog_now_us();
+	++g_stats.alog_segments;
+
+	evtimer_add(g_alog_work_ev, &tv);
+	return 0;
+}
+
+/*
+ * alog_rotatecb
+ */
+static void alog_rotatecb(int fd, short what, void *arg)
+{
+	if (g_alog_cur.used > sizeof(struct alog_header))
+		alog_rotate();
+}
+
+/*
+ * alog_init
+ */
+int alog_init(struct event_base *base, const char *dir,
+		unsigned int segment_mb, unsigned int rotate)
+{
+	struct timeval tv;
+
+	if (!dir)
+		return 0;
+
+	g_alog_dir = dir;
+	g_alog_size = (size_t)segment_mb << 20;
+	g_alog_started = (unsigned long)time(NULL);
+	if (g_alog_size < 2 * sizeof(struct alog_header)) {
+		oddsock_logx(0, "access log segments too small");
+		return -1;
+	}
+
+	g_alog_work_ev = evtimer_new(base, alog_workcb, NULL);
+	if (!g_alog_work_ev ||
+		event_priority_set(g_alog_work_ev, SOCKS5_PRIO_BULK) != 0)
+		return -1;
+	if (rotate > 0) {
+		g_alog_rotate_ev = event_new(base, -1, EV_PERSIST, alog_rotatecb,
+				NULL);
+		tv.tv_sec = rotate;
+		tv.tv_usec = 0;
+		if (!g_alog_rotate_ev ||
+			event_priority_set(g_alog_rotate_ev, SOCKS5_PRIO_BULK) != 0 ||
+			event_add(g_alog_rotate_ev, &tv) != 0)
+			return -1;
+	}
+
+	/* The first segment and its spare are made up front. */
+	if (alog_segment_create(&g_alog_spare) != 0 || alog_rotate() != 0)
+		return -1;
+	evtimer_del(g_alog_work_ev);
+	alog_workcb(-1, 0, NULL);
+
+	return g_alog_spare.fd >= 0 ? 0 : -1;
+}
+
+/*
+ * alog_close
+ */
+void alog_close(void)
+{
+	if (!g_alog_dir)
+		return;
+
+	alog_segment_finish(&g_alog_retired);
+	alog_segment_finish(&g_alog_cur);
+	alog_segment_finish(&g_alog_spare);
+	if (g_alog_work_ev) {
+		event_free(g_alog_work_ev);
+		g_alog_work_ev = NULL;
+	}
+	if (g_alog_rotate_ev) {
+		event_free(g_alog_rotate_ev);
+		g_alog_rotate_ev = NULL;
+	}
+	g_alog_dir = NULL;
+}
+
+/*
+ * alog_enabled
+ */
+bool alog_enabled(void)
+{
+	return g_alog_dir != NULL;
+}
+
+/*
+ * alog_write
+ */
+void alog_write(const struct trace_rec *rec, unsigned char kind)
+{
+	struct alog_record *r;
+
+	if (g_alog_cur.used + sizeof(*r) > g_alog_cur.size && alog_rotate() != 0) {
+		++g_stats.alog_dropped;
+		return;
+	}
+
+	r = (struct alog_record*)(g_alog_cur.map + g_alog_cur.used);
+	r->start_us = (uint64_t)rec->accepted.tv_sec * 1000000 +
+		(uint64_t)rec->accepted.tv_usec;
+	r->duration_us = alog_now_us() - r->start_us;
+	r->bytes_up = rec->bytes[RELAY_UP];
+	r->bytes_down = rec->bytes[RELAY_DOWN];
+	r->client_port = rec->client_port;
+	r->dst_port = rec->dst_port;
+	r->kind = kind;
+	r->client_family = rec->client_family;
+	r->dst_type = rec->dst;
+	r->outcome = rec->outcome;
+	r->reason = rec->reason;
+	r->dst_len = rec->dst_len;
+	memcpy(r->client_addr, rec->client_addr, sizeof(r->client_addr));
+	memcpy(r->dst, rec->dst_addr, rec->dst_len);
+	r->version = ALOG_RECORD_VERSION;
+
+	g_alog_cur.used += sizeof(*r);
+	++g_stats.alog_records;
+}
@@ -0,0 +1,121 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#ifndef ODDSOCK_ALOG_H
+#define ODDSOCK_ALOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <event2/event.h>
+#include "trace.h"
+
+/*
+ * Access log.
+ *
+ * With --accessLog <dir> every connection leaves one fixed size binary
+ * record when it is freed, written straight into a memory mapped segment
+ * file, dir/access-<start>-<pid>-<seq>.alog. Segments are preallocated at
+ * --accessLogSize MB and rotated when full or every --accessLogRotate
+ * seconds. The next segment is created, and the last one trimmed to its
+ * records and closed, from a low priority event, so writing a record is
+ * a copy into memory; the kernel writes the pages back. Records are lost
+ * (alog_dropped) only if a segment fills before its successor exists.
+ * tools/alogdump prints them as text or CSV.
+ *
+ * Fields are in host byte order; byte_order in the header tells readers
+ * which. A record's version is written last and is 0 past the end.
+ */
+
+#define ALOG_MAGIC			"OSALOG1"
+#define ALOG_BYTE_ORDER		(0x01020304)
+#define ALOG_RECORD_VERSION	(1)
+
+#define ALOG_KIND_SOCKS			(0)
+#define ALOG_KIND_TRANSPARENT	(1)
+#define ALOG_KIND_MUX			(2)
+
+/* The header takes the first record slot. */
+struct alog_header {
+	char magic[8];
+	uint32_t byte_order;
+	uint32_t record_size;
+	uint64_t created_us; /* unix time; 0 until the segment is used */
+	uint64_t capacity; /* records */
+	uint8_t pad[96];
+};
+
+struct alog_record {
+	uint64_t start_us; /* accept time, unix */
+	uint64_t duration_us;
+	uint64_t bytes_up; /* client to destination */
+	uint64_t bytes_down;
+	uint16_t version; /* ALOG_RECORD_VERSION */
+	uint16_t client_port;
+	uint16_t dst_port;
+	uint8_t kind; /* ALOG_KIND_* */
+	uint8_t client_family; /* 0 (none), 4 or 6 */
+	uint8_t dst_type; /* TRACE_DST_* */
+	uint8_t outcome; /* TRACE_OUT_* */
+	uint8_t reason; /* TRACE_CLOSE_* */
+	uint8_t dst_len; /* bytes of dst used */
+	uint8_t pad[4];
+	uint8_t client_addr[16];
+	uint8_t dst[TRACE_DST_LEN]; /* address, or name, truncated */
+};
+
+/*
+ * alog_init
+ * Create the first segments in dir; a no-op when dir is NULL.
+ */
+int alog_init(struct event_base *base, const char *dir,
+		unsigned int segment_mb, unsigned int rotate);
+
+/*
+ * alog_close
+ * Trim and close the current segment, remove the unused one.
+ */
+void alog_close(void);
+
+/*
+ * alog_enabled
+ */
+bool alog_enabled(void);
+
+/*
+ * alog_write
+ * Append the record of a finished connection of kind ALOG_KIND_*.
+ */
+void alog_write(const struct trace_rec *rec, unsigned char kind);
+
+#endif
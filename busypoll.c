@@ -0,0 +1,154 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#include <string.h>
+#include <event2/event.h>
+#include "util.h"
+#include "oddsock.h"
+#include "stats.h"
+#include "busypoll.h"
+
+/*
+ * busy_parse_listeners
+ */
+int busy_parse_listeners(const char *list)
+{
+	const char *p = list, *end;
+	size_t len;
+	int mask = 0;
+
+	while (*p) {
+		end = strchr(p, ',');
+		len = end ? (size_t)(end - p) : strlen(p);
+		if (len == 5 && strncmp(p, "socks", len) == 0)
+			mask |= BUSY_LISTEN_SOCKS;
+		else if (len == 11 && strncmp(p, "transparent", len) == 0)
+			mask |= BUSY_LISTEN_TRANSPARENT;
+		else if (len == 3 && strncmp(p, "mux", len) == 0)
+			mask |= BUSY_LISTEN_MUX;
+		else
+			return -1;
+		p += len;
+		if (*p == ',')
+			++p;
+	}
+
+	return mask;
+}
+
+/*
+ * busy_socket
+ */
+void busy_socket(int fd, int listener)
+{
+	static bool warned = false;
+
+	if (g_opts.busy_poll == 0 || !(g_opts.busy_poll_listeners & listener) ||
+		fd < 0)
+		return;
+
+	if (make_socket_busy_poll(fd, g_opts.busy_poll) != 0 && !warned) {
+		oddsock_log(0, errno, "SO_BUSY_POLL not set, spinning only");
+		warned = true;
+	}
+}
+
+/*
+ * busy_activity
+ * Changes whenever a loop iteration did useful work.
+ */
+static unsigned long busy_activity(void)
+{
+	return g_stats.accepted + g_stats.requests + g_stats.connects_ok +
+		g_stats.connects_failed + g_stats.bytes_up + g_stats.bytes_down;
+}
+
+/*
+ * busy_elapsed_us
+ */
+static unsigned long busy_elapsed_us(const struct timeval *from,
+		const struct timeval *to)
+{
+	struct timeval d;
+
+	evutil_timersub(to, from, &d);
+	return (unsigned long)d.tv_sec * 1000000UL + (unsigned long)d.tv_usec;
+}
+
+/*
+ * busy_loop
+ */
+int busy_loop(struct event_base *base)
+{
+	struct timeval now, last_work;
+	unsigned long work, idle, slept;
+	unsigned long budget = BUSY_BUDGET_MIN;
+
+	evutil_gettimeofday(&last_work, NULL);
+
+	while (!event_base_got_exit(base) && !event_base_got_break(base)) {
+		work = busy_activity();
+		if (event_base_loop(base, EVLOOP_NONBLOCK) < 0)
+			return -1;
+		++g_stats.busy_spins;
+		evutil_gettimeofday(&now, NULL);
+
+		idle = busy_elapsed_us(&last_work, &now);
+		if (busy_activity() != work) {
+			++g_stats.busy_hits;
+			g_stats.busy_idle_us += idle;
+			last_work = now;
+			continue;
+		}
+		if (idle < budget)
+			continue;
+
+		/* Nothing for a whole budget: sleep until the next event. */
+		g_stats.busy_idle_us += idle;
+		++g_stats.busy_sleeps;
+		if (event_base_loop(base, EVLOOP_ONCE) < 0)
+			return -1;
+		evutil_gettimeofday(&last_work, NULL);
+
+		slept = busy_elapsed_us(&now, &last_work);
+		if (slept <= g_opts.busy_poll)
+			budget = budget * 2 < g_opts.busy_poll ?
+				budget * 2 : g_opts.busy_poll;
+		else if (budget / 2 >= BUSY_BUDGET_MIN)
+			budget /= 2;
+		g_stats.busy_budget_us = budget;
+	}
+
+	return 0;
+}
@@ -0,0 +1,87 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#ifndef ODDSOCK_BUSYPOLL_H
+#define ODDSOCK_BUSYPOLL_H
+
+#include <event2/event.h>
+
+/*
+ * Busy polling.
+ *
+ * With --busyPoll <usec> the event loop runs non-blocking iterations
+ * instead of sleeping in epoll for as long as work keeps arriving, saving
+ * the scheduler wakeup on the next packet. Sockets of the listeners named
+ * by --busyPollListeners (accepted and destination sockets, and mux
+ * connections for "mux") also get SO_BUSY_POLL and SO_PREFER_BUSY_POLL
+ * so the kernel polls the device queue on their behalf; raising those
+ * needs CAP_NET_ADMIN. oddsock has a single event loop, so spinning is
+ * process wide and only the socket options are per listener.
+ *
+ * The spin budget adapts like KVM's halt polling. It starts at
+ * BUSY_BUDGET_MIN and doubles, up to busy_poll, whenever the loop went to
+ * sleep and was woken again within busy_poll: spinning longer would have
+ * caught that event. It halves after longer sleeps, so an idle proxy soon
+ * stops burning CPU. Work is noticed through the connection and byte
+ * counters in g_stats.
+ */
+
+#define BUSY_LISTEN_SOCKS		(0x01)
+#define BUSY_LISTEN_TRANSPARENT	(0x02)
+#define BUSY_LISTEN_MUX			(0x04)
+
+#define BUSY_BUDGET_MIN	(10) /* usec */
+
+/*
+ * busy_parse_listeners
+ * Parse a comma separated list of socks, transparent and mux into a
+ * mask of BUSY_LISTEN_* bits; returns -1 on an unknown name.
+ */
+int busy_parse_listeners(const char *list);
+
+/*
+ * busy_socket
+ * Set the busy poll socket options on fd if busy polling is enabled for
+ * the listener kind (BUSY_LISTEN_*) it belongs to.
+ */
+void busy_socket(int fd, int listener);
+
+/*
+ * busy_loop
+ * Run the event loop until event_base_loopexit/loopbreak, spinning as
+ * described above. returns -1 on error.
+ */
+int busy_loop(struct event_base *base);
+
+#endif
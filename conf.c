@@ -0,0 +1,290 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/util.h>
+#include "util.h"
+#include "oddsock.h"
+#include "socks5.h"
+#include "lag.h"
+#include "tcpinfo.h"
+#include "upstream.h"
+#include "conf.h"
+
+/*
+ * Settings the file may change. All are unsigned ints.
+ */
+struct conf_setting {
+	const char *name;
+	size_t offset;
+	unsigned int min;
+	unsigned int max;
+};
+
+#define CONF_UINT(name, field, min, max) \
+	{ name, offsetof(struct oddsock_opts, field), min, max }
+
+static const struct conf_setting g_conf_settings[] = {
+	CONF_UINT("connectTimeout", connect_timeout, 1, 3600),
+	CONF_UINT("parkIdle", park_idle, 1, 86400),
+	CONF_UINT("circuitFailures", circuit_failures, 0, 1000000),
+	CONF_UINT("circuitOpen", circuit_open, 1, 86400),
+	CONF_UINT("relayQuantum", relay_quantum, 0, 16 * 1024 * 1024),
+	CONF_UINT("lagProbes", lag_probes, 0, 60000),
+	CONF_UINT("lagAccepts", lag_accepts, 0, 60000),
+	CONF_UINT("lagConnects", lag_connects, 0, 60000),
+	CONF_UINT("tcpinfoSample", tcpinfo_sample, 1, 1000000),
+	CONF_UINT("upstreamPool", upstream_pool, 0, UPSTREAM_POOL_MAX),
+	CONF_UINT("upstreamIdle", upstream_idle, 1, 86400),
+	{ NULL, 0, 0, 0 }
+};
+
+static const char *g_conf_path = NULL;
+static struct event *g_conf_ev = NULL; /* SIGHUP */
+static struct oddsock_opts g_conf_cmdline; /* options before the file */
+static unsigned long g_conf_generation = 0;
+
+/*
+ * conf_set
+ * Apply one "name value" line to opts.
+ */
+static int conf_set(struct oddsock_opts *opts, const char *name,
+		const char *value, char *err, size_t errlen)
+{
+	const struct conf_setting *s;
+	unsigned long v;
+	char *end;
+
+	for (s = g_conf_settings; s->name; ++s)
+		if (strcmp(s->name, name) == 0)
+			break;
+	if (!s->name) {
+		evutil_snprintf(err, errlen, "unknown or startup-only setting '%s'",
+				name);
+		return -1;
+	}
+
+	errno = 0;
+	v = strtoul(value, &end, 10);
+	if (errno != 0 || end == value || *end != '\0' ||
+		v < s->min || v > s->max) {
+		evutil_snprintf(err, errlen, "%s must be %u to %u", name, s->min,
+				s->max);
+		return -1;
+	}
+
+	*(unsigned int*)((char*)opts + s->offset) = (unsigned int)v;
+	return 0;
+}
+
+/*
+ * conf_check
+ * Checks between settings, against what cannot change while running.
+ */
+static int conf_check(const struct oddsock_opts *opts, char *err,
+		size_t errlen)
+{
+	if (!opts->lag_interval &&
+		(opts->lag_probes || opts->lag_accepts || opts->lag_connects)) {
+		evutil_snprintf(err, errlen, "lag shedding needs --lagInterval");
+		return -1;
+	}
+	if ((opts->relay_quantum == 0) != (g_opts.relay_quantum == 0)) {
+		evutil_snprintf(err, errlen, "relayQuantum cannot be turned on or off "
+				"while running");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * conf_load
+ * Parse the file over a copy of the command line options.
+ */
+static int conf_load(struct oddsock_opts *opts, char *err, size_t errlen)
+{
+	char line[CONF_LINE_MAX];
+	char msg[CONF_LINE_MAX];
+	char *name, *value, *p;
+	FILE *f;
+	int lineno = 0;
+	int e = 0;
+
+	*opts = g_conf_cmdline;
+
+	f = fopen(g_conf_path, "r");
+	if (!f) {
+		evutil_snprintf(err, errlen, "%s: %s", g_conf_path, strerror(errno));
+		return -1;
+	}
+
+	while (e == 0 && fgets(line, sizeof(line), f)) {
+		++lineno;
+		if (!strchr(line, '\n') && !feof(f)) {
+			evutil_snprintf(err, errlen, "%s:%d: line too long", g_conf_path,
+					lineno);
+			e = -1;
+			break;
+		}
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+		name = strtok(line, " \t\r\n");
+		if (!name)
+			continue;
+		value = strtok(NULL, " \t\r\n");
+		if (!value || strtok(NULL, " \t\r\n")) {
+			evutil_snprintf(err, errlen, "%s:%d: expected 'name value'",
+					g_conf_path, lineno);
+			e = -1;
+		}
+		else if (conf_set(opts, name, value, msg, sizeof(msg)) != 0) {
+			evutil_snprintf(err, errlen, "%s:%d: %s", g_conf_path, lineno, msg);
+			e = -1;
+		}
+	}
+	if (e == 0 && ferror(f)) {
+		evutil_snprintf(err, errlen, "%s: read error", g_conf_path);
+		e = -1;
+	}
+	fclose(f);
+
+	if (e == 0)
+		e = conf_check(opts, err, errlen);
+	return e;
+}
+
+/*
+ * conf_publish
+ * Make opts the running options and tell the modules that keep a copy.
+ */
+static void conf_publish(const struct oddsock_opts *opts)
+{
+	g_opts = *opts;
+	++g_conf_generation;
+
+	lag_configure();
+	tcpinfo_configure(g_opts.tcpinfo_sample);
+	upstream_configure();
+}
+
+/*
+ * conf_signalcb
+ */
+static void conf_signalcb(evutil_socket_t sig, short what, void *arg)
+{
+	conf_reload(NULL);
+}
+
+/*
+ * conf_reload
+ */
+int conf_reload(struct evbuffer *out)
+{
+	struct oddsock_opts opts;
+	struct timeval start, end;
+	char err[2 * CONF_LINE_MAX];
+	unsigned long us;
+
+	if (!g_conf_path) {
+		if (out)
+			evbuffer_add_printf(out, "error: no --config file\n");
+		return -1;
+	}
+
+	evutil_gettimeofday(&start, NULL);
+	if (conf_load(&opts, err, sizeof(err)) != 0) {
+		oddsock_logx(0, "config not reloaded: %s", err);
+		if (out)
+			evbuffer_add_printf(out, "error: %s\n", err);
+		return -1;
+	}
+	conf_publish(&opts);
+	evutil_gettimeofday(&end, NULL);
+
+	evutil_timersub(&end, &start, &end);
+	us = (unsigned long)end.tv_sec * 1000000UL + (unsigned long)end.tv_usec;
+	oddsock_logx(0, "config generation %lu loaded in %lu us",
+			g_conf_generation, us);
+	if (out)
+		evbuffer_add_printf(out, "generation %lu loaded in %lu us\n",
+				g_conf_generation, us);
+	return 0;
+}
+
+/*
+ * conf_init
+ */
+int conf_init(struct event_base *base, const char *path)
+{
+	struct oddsock_opts opts;
+	char err[2 * CONF_LINE_MAX];
+
+	if (!path)
+		return 0;
+
+	g_conf_path = path;
+	g_conf_cmdline = g_opts;
+	if (conf_load(&opts, err, sizeof(err)) != 0) {
+		oddsock_logx(0, "%s", err);
+		return -1;
+	}
+	g_opts = opts;
+	g_conf_generation = 1;
+
+	g_conf_ev = evsignal_new(base, SIGHUP, conf_signalcb, NULL);
+	if (!g_conf_ev || event_add(g_conf_ev, NULL) != 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * conf_free
+ */
+void conf_free(void)
+{
+	if (g_conf_ev) {
+		event_free(g_conf_ev);
+		g_conf_ev = NULL;
+	}
+	g_conf_path = NULL;
+}
@@ -0,0 +1,87 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#ifndef ODDSOCK_CONF_H
+#define ODDSOCK_CONF_H
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+/*
+ * Runtime configuration file.
+ *
+ * --config <path> names a file of "name value" lines, '#' starting a
+ * comment, where name is the long option of a setting that may change
+ * while running:
+ *
+ *   connectTimeout parkIdle circuitFailures circuitOpen relayQuantum
+ *   lagProbes lagAccepts lagConnects tcpinfoSample upstreamPool
+ *   upstreamIdle
+ *
+ * The file is read once the command line is parsed and again on SIGHUP
+ * or the admin "reload" command; its settings override the command line.
+ * Every load starts over from the command line options and builds and
+ * checks a complete new set in a scratch copy. Only a file without errors
+ * is published, by a single assignment to g_opts, after which modules
+ * that cache settings are told. A bad file is reported and the running
+ * options stay as they are.
+ *
+ * Everything runs on the one event loop, so a reload happens between two
+ * callbacks and no reader can see half of it. Tunnels keep what they
+ * have already armed (connect timer, idle timeouts, relay watermarks)
+ * and pick up new values the next time they arm them; new connections
+ * see the new options throughout.
+ */
+
+#define CONF_LINE_MAX	(256)
+
+/*
+ * conf_init
+ * Load path and reload it on SIGHUP; a no-op when path is NULL.
+ */
+int conf_init(struct event_base *base, const char *path);
+
+/*
+ * conf_free
+ */
+void conf_free(void);
+
+/*
+ * conf_reload
+ * Reload the file, appending the outcome to out if it is not NULL.
+ * returns -1 when the file had errors and nothing changed.
+ */
+int conf_reload(struct evbuffer *out);
+
+#endif
@@ -0,0 +1,362 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/util.h>
+#include "util.h"
+#include "socks5.h"
+#include "relay.h"
+#include "trace.h"
+#include "conntab.h"
+
+#define CONNTAB_ADDR_LEN	(TRACE_DST_LEN + 8)
+
+struct conntab_filter {
+	int state; /* -1 = any */
+	const char *client;
+	const char *dst;
+	unsigned long age_ms;
+	unsigned long id; /* 0 = any */
+};
+
+static TAILQ_HEAD(conntab_list, trace_rec) g_conntab =
+	TAILQ_HEAD_INITIALIZER(g_conntab);
+static bool g_conntab_on = false;
+static unsigned long g_conntab_next_id = 1;
+
+/* Indexed by enum socks5_conn_status; parked tunnels get their own. */
+static const char *g_conntab_states[] = {
+	"init", "must_close", "authorized", "resolving", "connecting",
+	"relaying", "closing", "parked"
+};
+#define CONNTAB_STATES	(sizeof(g_conntab_states) / sizeof(*g_conntab_states))
+#define CONNTAB_PARKED	(CONNTAB_STATES - 1)
+
+/*
+ * conntab_state
+ */
+static unsigned int conntab_state(const struct socks5_conn *sconn)
+{
+	if (sconn->status == SCONN_CONNECT_TRANSMITTING && !sconn->client &&
+		!sconn->dst)
+		return CONNTAB_PARKED;
+	return (unsigned int)sconn->status;
+}
+
+/*
+ * conntab_client
+ */
+static void conntab_client(const struct socks5_conn *sconn,
+		const struct trace_rec *rec, char *buf, size_t len)
+{
+	char addr[INET6_ADDRSTRLEN];
+
+	if (rec->client_family == 4 || rec->client_family == 6) {
+		inet_ntop(rec->client_family == 4 ? AF_INET : AF_INET6,
+				rec->client_addr, addr, sizeof(addr));
+		evutil_snprintf(buf, len, "%s:%u", addr, rec->client_port);
+	}
+	else if (sconn->client_fd < 0)
+		evutil_snprintf(buf, len, "mux");
+	else
+		evutil_snprintf(buf, len, "unix");
+}
+
+/*
+ * conntab_dst
+ */
+static void conntab_dst(const struct trace_rec *rec, char *buf, size_t len)
+{
+	char addr[INET6_ADDRSTRLEN];
+
+	if (rec->dst == TRACE_DST_IPV4 || rec->dst == TRACE_DST_IPV6) {
+		inet_ntop(rec->dst == TRACE_DST_IPV4 ? AF_INET : AF_INET6,
+				rec->dst_addr, addr, sizeof(addr));
+		evutil_snprintf(buf, len, "%s:%u", addr, rec->dst_port);
+	}
+	else if (rec->dst == TRACE_DST_DOMAIN)
+		evutil_snprintf(buf, len, "%.*s:%u", (int)rec->dst_len,
+				(const char*)rec->dst_addr, rec->dst_port);
+	else
+		evutil_snprintf(buf, len, "-");
+}
+
+/*
+ * conntab_queued
+ * Bytes held by the proxy in one direction.
+ */
+static unsigned long conntab_queued(struct bufferevent *from,
+		struct bufferevent *to)
+{
+	unsigned long n = 0;
+
+	if (from)
+		n += (unsigned long)evbuffer_get_length(bufferevent_get_input(from));
+	if (to)
+		n += (unsigned long)evbuffer_get_length(bufferevent_get_output(to));
+	return n;
+}
+
+/*
+ * conntab_age_ms
+ */
+static unsigned long conntab_age_ms(const struct trace_rec *rec,
+		const struct timeval *now)
+{
+	struct timeval d;
+
+	if (evutil_timercmp(now, &rec->accepted, <))
+		return 0;
+	evutil_timersub(now, &rec->accepted, &d);
+	return (unsigned long)d.tv_sec * 1000UL +
+		(unsigned long)d.tv_usec / 1000UL;
+}
+
+/*
+ * conntab_parse
+ * Read filters from args; a bare number is returned in *n. returns -1
+ * on an unknown filter.
+ */
+static int conntab_parse(char *args, struct conntab_filter *f,
+		unsigned int *n, int *nfilters)
+{
+	char *tok, *value;
+	unsigned int i;
+
+	memset(f, 0, sizeof(*f));
+	f->state = -1;
+	*nfilters = 0;
+
+	for (tok = strtok(args, " \t"); tok; tok = strtok(NULL, " \t")) {
+		value = strchr(tok, '=');
+		if (!value) {
+			if (!n || tok[strspn(tok, "0123456789")] != '\0')
+				return -1;
+			*n = (unsigned int)strtoul(tok, NULL, 10);
+			continue;
+		}
+		*value++ = '\0';
+		++*nfilters;
+
+		if (strcmp(tok, "state") == 0) {
+			for (i = 0; i < CONNTAB_STATES; ++i)
+				if (strcmp(value, g_conntab_states[i]) == 0)
+					break;
+			if (i == CONNTAB_STATES)
+				return -1;
+			f->state = (int)i;
+		}
+		else if (strcmp(tok, "client") == 0)
+			f->client = value;
+		else if (strcmp(tok, "dst") == 0)
+			f->dst = value;
+		else if (strcmp(tok, "age") == 0)
+			f->age_ms = strtoul(value, NULL, 10) * 1000UL;
+		else if (strcmp(tok, "id") == 0) {
+			f->id = strtoul(value, NULL, 10);
+			if (f->id == 0)
+				return -1;
+		}
+		else
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * conntab_match
+ */
+static bool conntab_match(const struct conntab_filter *f,
+		const struct trace_rec *rec, const struct timeval *now,
+		const char *client, const char *dst)
+{
+	if (f->state >= 0 && conntab_state(rec->sconn) != (unsigned int)f->state)
+		return false;
+	if (f->client && strncmp(client, f->client, strlen(f->client)) != 0)
+		return false;
+	if (f->dst && !strstr(dst, f->dst))
+		return false;
+	if (f->age_ms && conntab_age_ms(rec, now) < f->age_ms)
+		return false;
+	if (f->id && rec->id != f->id)
+		return false;
+	return true;
+}
+
+/*
+ * conntab_init
+ */
+int conntab_init(bool enable)
+{
+	g_conntab_on = enable;
+	return 0;
+}
+
+/*
+ * conntab_enabled
+ */
+bool conntab_enabled(void)
+{
+	return g_conntab_on;
+}
+
+/*
+ * conntab_add
+ */
+void conntab_add(struct socks5_conn *sconn)
+{
+	if (!g_conntab_on || !sconn->trace)
+		return;
+
+	sconn->trace->sconn = sconn;
+	sconn->trace->id = g_conntab_next_id++;
+	TAILQ_INSERT_TAIL(&g_conntab, sconn->trace, link);
+}
+
+/*
+ * conntab_remove
+ */
+void conntab_remove(struct socks5_conn *sconn)
+{
+	if (!sconn->trace || !sconn->trace->sconn)
+		return;
+
+	TAILQ_REMOVE(&g_conntab, sconn->trace, link);
+	sconn->trace->sconn = NULL;
+}
+
+/*
+ * conntab_list
+ */
+void conntab_list(struct evbuffer *out, char *args)
+{
+	struct conntab_filter f;
+	struct trace_rec *rec;
+	struct socks5_conn *sconn;
+	struct timeval now;
+	unsigned long counts[CONNTAB_STATES];
+	unsigned long total = 0, matched = 0;
+	unsigned int n = CONNTAB_LIST_DEFAULT;
+	unsigned int i;
+	char client[CONNTAB_ADDR_LEN], dst[CONNTAB_ADDR_LEN];
+	int nfilters;
+
+	if (!g_conntab_on) {
+		evbuffer_add_printf(out, "connection table is off\n");
+		return;
+	}
+	if (conntab_parse(args, &f, &n, &nfilters) != 0) {
+		evbuffer_add_printf(out, "error: conns [state=S] [client=A] [dst=D] "
+				"[age=secs] [id=N] [n]\n");
+		return;
+	}
+
+	memset(counts, 0, sizeof(counts));
+	evutil_gettimeofday(&now, NULL);
+	TAILQ_FOREACH(rec, &g_conntab, link) {
+		++total;
+		++counts[conntab_state(rec->sconn)];
+	}
+	evbuffer_add_printf(out, "%lu connections:", total);
+	for (i = 0; i < CONNTAB_STATES; ++i)
+		if (counts[i])
+			evbuffer_add_printf(out, " %s %lu", g_conntab_states[i],
+					counts[i]);
+	evbuffer_add_printf(out, "\nid state age_ms client dst up down "
+			"queued_up queued_down\n");
+
+	TAILQ_FOREACH(rec, &g_conntab, link) {
+		sconn = rec->sconn;
+		conntab_client(sconn, rec, client, sizeof(client));
+		conntab_dst(rec, dst, sizeof(dst));
+		if (!conntab_match(&f, rec, &now, client, dst))
+			continue;
+		if (matched++ >= n)
+			continue;
+		evbuffer_add_printf(out, "%lu %s %lu %s %s %lu %lu %lu %lu\n",
+				rec->id,
+				g_conntab_states[conntab_state(sconn)],
+				conntab_age_ms(rec, &now), client, dst,
+				rec->bytes[RELAY_UP], rec->bytes[RELAY_DOWN],
+				conntab_queued(sconn->client, sconn->dst),
+				conntab_queued(sconn->dst, sconn->client));
+	}
+	if (matched > n)
+		evbuffer_add_printf(out, "... %lu more\n", matched - n);
+}
+
+/*
+ * conntab_kill
+ */
+void conntab_kill(struct evbuffer *out, char *args)
+{
+	struct conntab_filter f;
+	struct trace_rec *rec, *next;
+	struct timeval now;
+	unsigned long killed = 0;
+	char client[CONNTAB_ADDR_LEN], dst[CONNTAB_ADDR_LEN];
+	int nfilters;
+
+	if (!g_conntab_on) {
+		evbuffer_add_printf(out, "connection table is off\n");
+		return;
+	}
+	if (conntab_parse(args, &f, NULL, &nfilters) != 0 || nfilters == 0) {
+		evbuffer_add_printf(out, "error: kill [state=S] [client=A] [dst=D] "
+				"[age=secs] [id=N], at least one\n");
+		return;
+	}
+
+	evutil_gettimeofday(&now, NULL);
+	for (rec = TAILQ_FIRST(&g_conntab); rec; rec = next) {
+		next = TAILQ_NEXT(rec, link);
+		conntab_client(rec->sconn, rec, client, sizeof(client));
+		conntab_dst(rec, dst, sizeof(dst));
+		if (!conntab_match(&f, rec, &now, client, dst))
+			continue;
+		socks5_conn_kill(rec->sconn);
+		++killed;
+	}
+	evbuffer_add_printf(out, "killed %lu\n", killed);
+}
@@ -0,0 +1,100 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#ifndef ODDSOCK_CONNTAB_H
+#define ODDSOCK_CONNTAB_H
+
+#include <stdbool.h>
+#include <event2/buffer.h>
+
+/*
+ * Connection table.
+ *
+ * While the admin socket is on, every connection carries a trace record
+ * (trace.h), which already holds its accept time, addresses and relayed
+ * bytes, and the records are linked into one list: insertion at accept
+ * and removal at free are O(1) and socks5_conn does not grow. The relay
+ * path is untouched; it already counts bytes into the record.
+ *
+ * The admin commands walk the list inside one callback, so what they see
+ * is consistent and the loop is held only for the walk:
+ *
+ *   conns [filter...] [n]	counts by state and the first n (100) matches
+ *   kill filter...		close the matching connections
+ *
+ * Filters are state=<state>, client=<address prefix>, dst=<substring>,
+ * age=<min seconds> and id=<connection id>, all of which must match. Ids
+ * count up from 1 as connections enter the table, so each one, mux
+ * streams included, can be picked out alone.
+ */
+
+#define CONNTAB_LIST_DEFAULT	(100)
+
+struct socks5_conn;
+
+/*
+ * conntab_init
+ * Keep the table when enable is true.
+ */
+int conntab_init(bool enable);
+
+/*
+ * conntab_enabled
+ */
+bool conntab_enabled(void);
+
+/*
+ * conntab_add
+ * Enter a new connection; needs its trace record.
+ */
+void conntab_add(struct socks5_conn *sconn);
+
+/*
+ * conntab_remove
+ */
+void conntab_remove(struct socks5_conn *sconn);
+
+/*
+ * conntab_list
+ * The conns admin command.
+ */
+void conntab_list(struct evbuffer *out, char *args);
+
+/*
+ * conntab_kill
+ * The kill admin command.
+ */
+void conntab_kill(struct evbuffer *out, char *args);
+
+#endif
@@ -0,0 +1,391 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+#include <event2/dns.h>
+#include "util.h"
+#include "oddsock.h"
+#include "socks5.h"
+#include "health.h"
+#include "resolver.h"
+#include "stats.h"
+#include "lag.h"
+
+#define HEALTH_SETS		(256)
+#define HEALTH_WAYS		(4)
+#define HEALTH_WINDOW	(60) /* seconds between failures that still count */
+
+enum health_state {
+	HEALTH_CLOSED = 0,
+	HEALTH_OPEN
+};
+
+struct health_entry {
+	unsigned long key; /* 0 = unused */
+	time_t last_failure;
+	unsigned short failures;
+	unsigned char state;
+	unsigned char reply;
+	unsigned short port;
+	char *host; /* recorded from a request once the destination fails */
+	struct event *probe_ev;
+	struct bufferevent *probe;
+};
+
+static struct health_entry g_health[HEALTH_SETS][HEALTH_WAYS];
+static struct event_base *g_health_base = NULL;
+
+static void health_probe_timercb(int fd, short what, void *arg);
+static void health_probe_eventcb(struct bufferevent *bev, short what,
+		void *arg);
+
+/*
+ * health_init
+ */
+int health_init(struct event_base *base)
+{
+	g_health_base = base;
+	memset(g_health, 0, sizeof(g_health));
+	return 0;
+}
+
+/*
+ * health_key
+ * 32-bit FNV-1a over address type, address and port, so the constants
+ * fit an ILP32 unsigned long too.
+ */
+unsigned long health_key(const struct socks5_request *request)
+{
+	unsigned long h = 2166136261UL;
+	const unsigned char *addr;
+	size_t len, i;
+
+	if (request->atype == SOCKS5_ATYPE_IPV4) {
+		addr = request->addr.ipv4;
+		len = 4;
+	} else if (request->atype == SOCKS5_ATYPE_IPV6) {
+		addr = request->addr.ipv6;
+		len = 16;
+	} else {
+		addr = request->addr.domain;
+		len = request->domain_len;
+	}
+
+	h = (h ^ request->atype) * 16777619UL;
+	for (i = 0; i < len; ++i)
+		h = (h ^ addr[i]) * 16777619UL;
+	h = (h ^ (request->port >> 8)) * 16777619UL;
+	h = (h ^ (request->port & 0xff)) * 16777619UL;
+
+	return h ? h : 1;
+}
+
+static struct health_entry *health_lookup(unsigned long key)
+{
+	struct health_entry *set = g_health[key % HEALTH_SETS];
+	int i;
+
+	for (i = 0; i < HEALTH_WAYS; ++i)
+		if (set[i].key == key)
+			return &set[i];
+	return NULL;
+}
+
+static void health_clear(struct health_entry *e)
+{
+	if (e->probe)
+		bufferevent_free(e->probe);
+	if (e->probe_ev)
+		event_free(e->probe_ev);
+	free(e->host);
+	memset(e, 0, sizeof(*e));
+}
+
+/*
+ * health_insert
+ * Take an unused way, or evict the least recently failed entry, closed
+ * circuits first.
+ */
+static struct health_entry *health_insert(unsigned long key)
+{
+	struct health_entry *set = g_health[key % HEALTH_SETS];
+	struct health_entry *victim = NULL;
+	int i;
+
+	for (i = 0; i < HEALTH_WAYS; ++i) {
+		struct health_entry *e = &set[i];
+		if (e->key == 0) {
+			victim = e;
+			break;
+		}
+		if (!victim ||
+			(e->state < victim->state) ||
+			(e->state == victim->state &&
+			 e->last_failure < victim->last_failure))
+			victim = e;
+	}
+
+	health_clear(victim);
+	victim->key = key;
+	return victim;
+}
+
+/*
+ * health_host_text
+ * Presentation form of the destination, only needed for probing.
+ */
+static char *health_host_text(const struct socks5_request *request)
+{
+	char buf[256];
+
+	if (request->atype == SOCKS5_ATYPE_IPV4) {
+		if (!inet_ntop(AF_INET, request->addr.ipv4, buf, sizeof(buf)))
+			return NULL;
+	} else if (request->atype == SOCKS5_ATYPE_IPV6) {
+		if (!inet_ntop(AF_INET6, request->addr.ipv6, buf, sizeof(buf)))
+			return NULL;
+	} else {
+		memcpy(buf, request->addr.domain, request->domain_len);
+		buf[request->domain_len] = '\0';
+	}
+	return strdup(buf);
+}
+
+static time_t health_now(void)
+{
+	struct timeval tv;
+	event_base_gettimeofday_cached(g_health_base, &tv);
+	return tv.tv_sec;
+}
+
+/*
+ * health_schedule_probe
+ */
+static void health_schedule_probe(struct health_entry *e)
+{
+	struct timeval tv;
+
+	if (!e->host)
+		return;
+	if (!e->probe_ev) {
+		e->probe_ev = evtimer_new(g_health_base, health_probe_timercb,
+				(void*)e);
+		if (!e->probe_ev)
+			return;
+	}
+	tv.tv_sec = g_opts.circuit_open;
+	tv.tv_usec = 0;
+	evtimer_add(e->probe_ev, &tv);
+}
+
+/*
+ * health_check
+ */
+unsigned char health_check(unsigned long key,
+		const struct socks5_request *request)
+{
+	struct health_entry *e;
+	time_t now;
+
+	if (g_opts.circuit_failures == 0)
+		return 0;
+
+	e = health_lookup(key);
+	if (!e)
+		return 0;
+
+	/* Remember how to reach a failing destination for probing. */
+	if (!e->host) {
+		e->host = health_host_text(request);
+		e->port = request->port;
+		if (e->state == HEALTH_OPEN)
+			health_schedule_probe(e);
+	}
+
+	if (e->state != HEALTH_OPEN)
+		return 0;
+
+	/* Without an active probe let one request through per interval. */
+	if (!e->probe_ev) {
+		now = health_now();
+		if (now - e->last_failure >= (time_t)g_opts.circuit_open) {
+			e->last_failure = now;
+			return 0;
+		}
+	}
+
+	return e->reply;
+}
+
+/*
+ * health_report_success
+ */
+void health_report_success(unsigned long key)
+{
+	struct health_entry *e;
+
+	if (g_opts.circuit_failures == 0)
+		return;
+
+	e = health_lookup(key);
+	if (e) {
+		if (e->state == HEALTH_OPEN)
+			oddsock_logx(1, "circuit closed for %s port %u",
+					e->host ? e->host : "(unknown)", e->port);
+		health_clear(e);
+	}
+}
+
+/*
+ * health_report_failure
+ */
+void health_report_failure(unsigned long key, unsigned char reply)
+{
+	struct health_entry *e;
+	time_t now;
+
+	if (g_opts.circuit_failures == 0)
+		return;
+
+	/* Only failures that say something about the destination count. */
+	if (reply != SOCKS5_REP_HOST_UNREACHABLE &&
+		reply != SOCKS5_REP_NET_UNREACHABLE &&
+		reply != SOCKS5_REP_CONN_REFUSED)
+		return;
+
+	e = health_lookup(key);
+	if (!e)
+		e = health_insert(key);
+
+	now = health_now();
+	if (now - e->last_failure > HEALTH_WINDOW)
+		e->failures = 0;
+	if (e->failures < 0xffff)
+		++e->failures;
+	e->last_failure = now;
+	e->reply = reply;
+
+	if (e->state == HEALTH_CLOSED && e->failures >= g_opts.circuit_failures) {
+		e->state = HEALTH_OPEN;
+		oddsock_logx(1, "circuit opened for %s port %u after %u failures",
+				e->host ? e->host : "(unknown)", e->port, e->failures);
+		health_schedule_probe(e);
+	}
+}
+
+/*
+ * health_probe_timercb
+ */
+static void health_probe_timercb(int fd, short what, void *arg)
+{
+	struct health_entry *e = (struct health_entry*)arg;
+	struct timeval tv;
+
+	if (e->probe || !e->host)
+		return;
+
+	/* Probes can wait while the loop is overloaded. */
+	if (lag_shed(LAG_SHED_PROBES)) {
+		++g_stats.lag_probes_skipped;
+		health_schedule_probe(e);
+		return;
+	}
+
+	e->probe = bufferevent_socket_new(g_health_base, -1,
+			BEV_OPT_CLOSE_ON_FREE);
+	if (!e->probe) {
+		health_schedule_probe(e);
+		return;
+	}
+	bufferevent_setcb(e->probe, NULL, NULL, health_probe_eventcb, (void*)e);
+	tv.tv_sec = g_opts.connect_timeout;
+	tv.tv_usec = 0;
+	bufferevent_set_timeouts(e->probe, NULL, &tv);
+
+	if (bufferevent_socket_connect_hostname(e->probe,
+				resolver_get(g_health_base), AF_UNSPEC,
+				e->host, e->port) != 0) {
+		bufferevent_free(e->probe);
+		e->probe = NULL;
+		health_schedule_probe(e);
+	}
+}
+
+/*
+ * health_probe_eventcb
+ */
+static void health_probe_eventcb(struct bufferevent *bev, short what,
+		void *arg)
+{
+	struct health_entry *e = (struct health_entry*)arg;
+
+	if (what & BEV_EVENT_CONNECTED) {
+		oddsock_logx(1, "circuit closed for %s port %u after probe",
+				e->host, e->port);
+		health_clear(e);
+		return;
+	}
+
+	bufferevent_free(e->probe);
+	e->probe = NULL;
+	health_schedule_probe(e);
+}
+
+/*
+ * health_reply_for_error
+ */
+unsigned char health_reply_for_error(int err, int dns_err)
+{
+	if (dns_err != 0)
+		return SOCKS5_REP_HOST_UNREACHABLE;
+
+	switch (err) {
+	case ECONNREFUSED:
+		return SOCKS5_REP_CONN_REFUSED;
+	case ENETUNREACH:
+		return SOCKS5_REP_NET_UNREACHABLE;
+	case EHOSTUNREACH:
+	case ETIMEDOUT:
+		return SOCKS5_REP_HOST_UNREACHABLE;
+	default:
+		return SOCKS5_REP_GENERAL_FAILURE;
+	}
+}
@@ -0,0 +1,81 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#ifndef ODDSOCK_HEALTH_H
+#define ODDSOCK_HEALTH_H
+
+#include <event2/event.h>
+#include "socks5_parse.h"
+
+/*
+ * Destination health cache.
+ *
+ * Destinations are identified by a hash of the request's address type,
+ * address and port. After circuit_failures consecutive connect failures
+ * (within HEALTH_WINDOW seconds of each other) the circuit opens and
+ * requests are answered immediately with the reply code of the last
+ * failure. While open the destination is probed every circuit_open
+ * seconds; a successful probe closes the circuit. The table has a fixed
+ * number of entries, evicting the least recently failed.
+ */
+
+/*
+ * health_init
+ */
+int health_init(struct event_base *base);
+
+/*
+ * health_key
+ * Hash identifying the destination of a request.
+ */
+unsigned long health_key(const struct socks5_request *request);
+
+/*
+ * health_check
+ * returns 0 if the request may proceed, otherwise the SOCKS 5 reply code
+ * to answer with.
+ */
+unsigned char health_check(unsigned long key,
+		const struct socks5_request *request);
+
+void health_report_success(unsigned long key);
+void health_report_failure(unsigned long key, unsigned char reply);
+
+/*
+ * health_reply_for_error
+ * Map a connect errno or DNS error to a SOCKS 5 reply code.
+ */
+unsigned char health_reply_for_error(int err, int dns_err);
+
+#endif
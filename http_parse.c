@@ -0,0 +1,169 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#include <stddef.h>
+#include <string.h>
+#include "socks5.h"
+#include "http_parse.h"
+
+#define HTTP_METHOD			"CONNECT"
+#define HTTP_METHOD_LEN		(sizeof(HTTP_METHOD) - 1)
+#define HTTP_VERSION		"HTTP/1."
+#define HTTP_VERSION_LEN	(sizeof(HTTP_VERSION) - 1)
+
+/*
+ * http_parse_host_char
+ * Characters of a registered name or IPv4 address, or with brackets of
+ * an IPv6 address.
+ */
+static int http_parse_host_char(unsigned char c, int bracketed)
+{
+	if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+		(c >= '0' && c <= '9') || c == '.')
+		return 1;
+	if (bracketed)
+		return c == ':';
+	return c == '-' || c == '_';
+}
+
+/*
+ * http_parse_detect
+ */
+int http_parse_detect(unsigned char c)
+{
+	return c >= 'A' && c <= 'Z';
+}
+
+/*
+ * http_parse_connect
+ */
+int http_parse_connect(const unsigned char *data, size_t len,
+		struct socks5_request *request)
+{
+	const unsigned char *host;
+	size_t i, n, host_len;
+	unsigned long port;
+	int bracketed;
+
+	/* Method, reported as soon as it cannot be CONNECT. */
+	for (i = 0; i < len && i < HTTP_METHOD_LEN; ++i)
+		if (data[i] != (unsigned char)HTTP_METHOD[i])
+			return http_parse_detect(data[i]) || data[i] == ' ' ?
+				HTTP_PARSE_ERR_METHOD : HTTP_PARSE_ERR_MALFORMED;
+	if (len <= HTTP_METHOD_LEN)
+		return 0;
+	if (data[i++] != ' ')
+		return http_parse_detect(data[i - 1]) ?
+			HTTP_PARSE_ERR_METHOD : HTTP_PARSE_ERR_MALFORMED;
+
+	/* Request target in authority form: host:port or [ipv6]:port. */
+	if (i == len)
+		return 0;
+	bracketed = data[i] == '[';
+	if (bracketed)
+		++i;
+	host = &data[i];
+	for (; i < len && http_parse_host_char(data[i], bracketed); ++i)
+		;
+	if (i == len)
+		return 0;
+	host_len = (size_t)(&data[i] - host);
+	if (host_len == 0 || host_len > 255)
+		return HTTP_PARSE_ERR_MALFORMED;
+	if (bracketed) {
+		if (data[i++] != ']')
+			return HTTP_PARSE_ERR_MALFORMED;
+		if (i == len)
+			return 0;
+	}
+	if (data[i++] != ':')
+		return HTTP_PARSE_ERR_MALFORMED;
+	for (port = 0, n = 0; i < len && data[i] >= '0' && data[i] <= '9';
+			++i, ++n) {
+		port = port * 10 + (data[i] - '0');
+		if (port > 65535)
+			return HTTP_PARSE_ERR_MALFORMED;
+	}
+	if (i == len)
+		return 0;
+	if (n == 0 || port == 0 || data[i++] != ' ')
+		return HTTP_PARSE_ERR_MALFORMED;
+
+	/* HTTP/1.x and the end of the request line. */
+	for (n = 0; i < len && n < HTTP_VERSION_LEN; ++i, ++n)
+		if (data[i] != (unsigned char)HTTP_VERSION[n])
+			return HTTP_PARSE_ERR_MALFORMED;
+	if (i == len)
+		return 0;
+	if (data[i] < '0' || data[i] > '9')
+		return HTTP_PARSE_ERR_MALFORMED;
+	if (++i == len)
+		return 0;
+	if (data[i] == '\r' && ++i == len)
+		return 0;
+	if (data[i++] != '\n')
+		return HTTP_PARSE_ERR_MALFORMED;
+
+	/* Header fields up to the empty line. */
+	for (;;) {
+		if (i == len)
+			return 0;
+		if (data[i] == '\r') {
+			if (++i == len)
+				return 0;
+			if (data[i] != '\n')
+				return HTTP_PARSE_ERR_MALFORMED;
+		}
+		if (data[i] == '\n')
+			break;
+		n = i;
+		for (; i < len && data[i] != '\n'; ++i)
+			if (data[i] == '\0')
+				return HTTP_PARSE_ERR_MALFORMED;
+		if (i == len)
+			return 0;
+		/* No obs-fold continuation lines (RFC 9112 5.2). */
+		if (data[n] == ' ' || data[n] == '\t')
+			return HTTP_PARSE_ERR_MALFORMED;
+		++i;
+	}
+
+	request->command = SOCKS5_CMD_CONNECT;
+	request->atype = SOCKS5_ATYPE_DOMAIN;
+	request->addr.domain = host;
+	request->domain_len = (unsigned char)host_len;
+	request->port = (unsigned short)port;
+
+	return (int)(i + 1);
+}
@@ -0,0 +1,84 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#ifndef ODDSOCK_HTTP_PARSE_H
+#define ODDSOCK_HTTP_PARSE_H
+
+#include <stddef.h>
+#include "socks5_parse.h"
+
+/*
+ * Allocation-free HTTP CONNECT request parser.
+ *
+ * Listeners that speak SOCKS 5 also take HTTP proxy clients: a SOCKS 5
+ * greeting starts with 0x05, an HTTP request with the upper case letters
+ * of its method. The request line of a CONNECT request
+ *
+ *	CONNECT host:port HTTP/1.1
+ *	CONNECT [ipv6]:port HTTP/1.1
+ *
+ * is parsed into the same struct socks5_request a SOCKS 5 CONNECT gives,
+ * with the host as a domain (brackets removed) pointing into the input,
+ * so both share the connect path. Header fields are skipped; the head
+ * ends at the first empty line. Bare LF line ends are accepted.
+ *
+ * Like the SOCKS 5 parsers it works in place on a contiguous byte range
+ * and can be called again as more arrives; a method other than CONNECT
+ * or a malformed request line is reported as soon as its bytes are
+ * available. It returns:
+ *	> 0 = complete head, number of bytes it occupies
+ *	0   = incomplete, more input is needed
+ *	< 0 = one of the HTTP_PARSE_ERR_* codes
+ */
+
+#define HTTP_PARSE_ERR_MALFORMED	(-1)
+#define HTTP_PARSE_ERR_METHOD		(-2)
+
+/* Longest request head read; longer ones are refused. */
+#define HTTP_REQUEST_MAX	(4096)
+
+/*
+ * http_parse_detect
+ * Whether a handshake starting with byte c is an HTTP request.
+ */
+int http_parse_detect(unsigned char c);
+
+/*
+ * http_parse_connect
+ * Parse a CONNECT request head.
+ */
+int http_parse_connect(const unsigned char *data, size_t len,
+		struct socks5_request *request);
+
+#endif
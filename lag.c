@@ -0,0 +1,275 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#include <sys/time.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/util.h>
+#include "util.h"
+#include "oddsock.h"
+#include "socks5.h"
+#include "stats.h"
+#include "lag.h"
+
+#define LAG_EWMA_SHIFT	(3) /* new samples weigh 1/8 */
+
+static struct event *g_lag_ev = NULL; /* tick */
+static struct event *g_lag_pass_ev = NULL;
+static struct timeval g_lag_interval;
+static struct timeval g_lag_deadline;
+static struct timeval g_lag_tick; /* when the pass event was activated */
+static bool g_lag_pass_pending = false;
+static unsigned long g_lag_timer_us = 0;
+static unsigned long g_lag_pass_us = 0;
+static unsigned long g_lag_thresholds_us[LAG_SHED_LEVELS];
+static bool g_lag_shedding[LAG_SHED_LEVELS];
+static struct event *g_lag_listeners[LAG_MAX_LISTENERS];
+static int g_lag_nlisteners = 0;
+
+static const char *g_lag_level_names[LAG_SHED_LEVELS] = {
+	"probes", "accepts", "connects"
+};
+
+/*
+ * lag_elapsed_us
+ */
+static unsigned long lag_elapsed_us(const struct timeval *from,
+		const struct timeval *to)
+{
+	struct timeval d;
+
+	if (evutil_timercmp(to, from, <))
+		return 0;
+	evutil_timersub(to, from, &d);
+	return (unsigned long)d.tv_sec * 1000000UL + (unsigned long)d.tv_usec;
+}
+
+/*
+ * lag_pause_listeners
+ */
+static void lag_pause_listeners(bool pause)
+{
+	int i;
+
+	for (i = 0; i < g_lag_nlisteners; ++i) {
+		if (pause)
+			event_del(g_lag_listeners[i]);
+		else if (event_add(g_lag_listeners[i], NULL) != 0)
+			oddsock_logx(0, "failed to resume listener");
+	}
+	if (pause)
+		++g_stats.lag_accept_pauses;
+}
+
+/*
+ * lag_update
+ * Start or stop shedding at each level for the current lag.
+ */
+static void lag_update(void)
+{
+	unsigned long lag = g_stats.lag_us;
+	int i;
+
+	for (i = 0; i < LAG_SHED_LEVELS; ++i) {
+		if (g_lag_thresholds_us[i] == 0)
+			continue;
+		if (!g_lag_shedding[i] && lag >= g_lag_thresholds_us[i])
+			g_lag_shedding[i] = true;
+		else if (g_lag_shedding[i] && lag < g_lag_thresholds_us[i] / 2)
+			g_lag_shedding[i] = false;
+		else
+			continue;
+
+		oddsock_logx(0, "loop lag %lu us, %s shedding %s", lag,
+				g_lag_shedding[i] ? "started" : "stopped",
+				g_lag_level_names[i]);
+		if (i == LAG_SHED_ACCEPTS)
+			lag_pause_listeners(g_lag_shedding[i]);
+	}
+}
+
+/*
+ * lag_passcb
+ * The loop got down to bulk priority.
+ */
+static void lag_passcb(int fd, short what, void *arg)
+{
+	struct timeval now;
+
+	evutil_gettimeofday(&now, NULL);
+	g_lag_pass_us = lag_elapsed_us(&g_lag_tick, &now);
+	g_lag_pass_pending = false;
+}
+
+/*
+ * lag_tickcb
+ */
+static void lag_tickcb(int fd, short what, void *arg)
+{
+	struct timeval now;
+	unsigned long sample;
+
+	evutil_gettimeofday(&now, NULL);
+	g_lag_timer_us = lag_elapsed_us(&g_lag_deadline, &now);
+	/* A pass still under way counts for as long as it has taken. */
+	if (g_lag_pass_pending)
+		g_lag_pass_us = lag_elapsed_us(&g_lag_tick, &now);
+
+	sample = g_lag_timer_us > g_lag_pass_us ? g_lag_timer_us : g_lag_pass_us;
+	g_stats.lag_us = g_stats.lag_us - (g_stats.lag_us >> LAG_EWMA_SHIFT) +
+		(sample >> LAG_EWMA_SHIFT);
+	if (sample > g_stats.lag_max_us)
+		g_stats.lag_max_us = sample;
+	lag_update();
+
+	evutil_timeradd(&now, &g_lag_interval, &g_lag_deadline);
+	event_add(g_lag_ev, &g_lag_interval);
+	if (!g_lag_pass_pending) {
+		g_lag_tick = now;
+		g_lag_pass_pending = true;
+		event_active(g_lag_pass_ev, EV_TIMEOUT, 1);
+	}
+}
+
+/*
+ * lag_configure
+ */
+void lag_configure(void)
+{
+	int i;
+
+	g_lag_thresholds_us[LAG_SHED_PROBES] = g_opts.lag_probes * 1000UL;
+	g_lag_thresholds_us[LAG_SHED_ACCEPTS] = g_opts.lag_accepts * 1000UL;
+	g_lag_thresholds_us[LAG_SHED_CONNECTS] = g_opts.lag_connects * 1000UL;
+
+	/* A level no longer shed stops now, the others at the next tick. */
+	for (i = 0; i < LAG_SHED_LEVELS; ++i) {
+		if (!g_lag_shedding[i] || g_lag_thresholds_us[i] != 0)
+			continue;
+		g_lag_shedding[i] = false;
+		if (i == LAG_SHED_ACCEPTS)
+			lag_pause_listeners(false);
+	}
+}
+
+/*
+ * lag_init
+ */
+int lag_init(struct event_base *base, unsigned int interval_ms)
+{
+	if (interval_ms == 0)
+		return 0;
+
+	lag_configure();
+
+	g_lag_ev = evtimer_new(base, lag_tickcb, NULL);
+	g_lag_pass_ev = event_new(base, -1, 0, lag_passcb, NULL);
+	if (!g_lag_ev || !g_lag_pass_ev ||
+		event_priority_set(g_lag_ev, SOCKS5_PRIO_HANDSHAKE) != 0 ||
+		event_priority_set(g_lag_pass_ev, SOCKS5_PRIO_BULK) != 0)
+		return -1;
+
+	g_lag_interval.tv_sec = interval_ms / 1000;
+	g_lag_interval.tv_usec = (interval_ms % 1000) * 1000;
+	evutil_gettimeofday(&g_lag_deadline, NULL);
+	evutil_timeradd(&g_lag_deadline, &g_lag_interval, &g_lag_deadline);
+	if (event_add(g_lag_ev, &g_lag_interval) != 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * lag_free
+ */
+void lag_free(void)
+{
+	int i;
+
+	if (g_lag_ev) {
+		event_free(g_lag_ev);
+		g_lag_ev = NULL;
+	}
+	if (g_lag_pass_ev) {
+		event_free(g_lag_pass_ev);
+		g_lag_pass_ev = NULL;
+	}
+	g_lag_pass_pending = false;
+	for (i = 0; i < LAG_SHED_LEVELS; ++i)
+		g_lag_shedding[i] = false;
+	g_lag_nlisteners = 0;
+}
+
+/*
+ * lag_listener
+ */
+void lag_listener(struct event *ev)
+{
+	if (g_lag_nlisteners < LAG_MAX_LISTENERS)
+		g_lag_listeners[g_lag_nlisteners++] = ev;
+}
+
+/*
+ * lag_shed
+ */
+bool lag_shed(int level)
+{
+	return g_lag_shedding[level];
+}
+
+/*
+ * lag_report
+ */
+void lag_report(struct evbuffer *out)
+{
+	int i;
+
+	if (!g_lag_ev) {
+		evbuffer_add_printf(out, "lag measurement is off\n");
+		return;
+	}
+
+	evbuffer_add_printf(out, "lag %lu us (timer %lu us, pass %lu us, "
+			"max %lu us)\n", g_stats.lag_us, g_lag_timer_us, g_lag_pass_us,
+			g_stats.lag_max_us);
+	for (i = 0; i < LAG_SHED_LEVELS; ++i) {
+		if (g_lag_thresholds_us[i] == 0)
+			evbuffer_add_printf(out, "%s: not shed\n", g_lag_level_names[i]);
+		else
+			evbuffer_add_printf(out, "%s: %s (threshold %lu us)\n",
+					g_lag_level_names[i],
+					g_lag_shedding[i] ? "shedding" : "accepting",
+					g_lag_thresholds_us[i]);
+	}
+}
@@ -0,0 +1,102 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#ifndef ODDSOCK_LAG_H
+#define ODDSOCK_LAG_H
+
+#include <stdbool.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+/*
+ * Event loop lag.
+ *
+ * Every --lagInterval milliseconds a timer at handshake priority notes how
+ * late it fired, which is how long the iteration running at its deadline
+ * took, and activates an event at bulk priority. That event runs once the
+ * loop has worked through everything of higher priority, so the time it
+ * waits is the length of a full pass over the loop's work. The larger of
+ * the two is averaged (1/8 weight) into the loop lag.
+ *
+ * Past each threshold the proxy sheds load, cheapest first: health probes
+ * are postponed (--lagProbes), listeners stop accepting and leave
+ * connections in the kernel backlog (--lagAccepts), and CONNECT requests
+ * are answered with a general failure (--lagConnects). Shedding stops once
+ * the lag is back under half the threshold. Established tunnels are never
+ * touched.
+ */
+
+#define LAG_SHED_PROBES		(0)
+#define LAG_SHED_ACCEPTS	(1)
+#define LAG_SHED_CONNECTS	(2)
+#define LAG_SHED_LEVELS		(3)
+
+#define LAG_MAX_LISTENERS	(8)
+
+/*
+ * lag_init
+ * Start measuring; an interval of 0 disables measuring and shedding.
+ */
+int lag_init(struct event_base *base, unsigned int interval_ms);
+
+/*
+ * lag_configure
+ * Take up changed shedding thresholds.
+ */
+void lag_configure(void);
+
+/*
+ * lag_free
+ */
+void lag_free(void);
+
+/*
+ * lag_listener
+ * Pause and resume the accept event ev with LAG_SHED_ACCEPTS.
+ */
+void lag_listener(struct event *ev);
+
+/*
+ * lag_shed
+ * Whether the work of a LAG_SHED_* level is being shed.
+ */
+bool lag_shed(int level);
+
+/*
+ * lag_report
+ * Append the current lag and shedding state to out.
+ */
+void lag_report(struct evbuffer *out);
+
+#endif
@@ -33,12 +33,28 @@
  ******************************************************************************/
 
 #include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <event2/event.h>
 #include "util.h"
 #include "oddsock.h"
 #include "socks5.h"
+#include "health.h"
+#include "stats.h"
+#include "mux.h"
+#include "busypoll.h"
+#include "topk.h"
+#include "admin.h"
+#include "alog.h"
+#include "resolver.h"
+#include "lag.h"
+#include "tcpinfo.h"
+#include "upstream.h"
+#include "conf.h"
+#include "conntab.h"
+#include "sockmap.h"
 
 /*
  * Global program options.
@@ -53,9 +69,100 @@ struct oddsock_opts g_opts = {
 	true,	/* use_IPv4 */
 	true,	/* use_IPv6 */
 	"localhost", /* listen_address */
-	"socks"	/* listen_port */
+	"socks",	/* listen_port */
+	false,	/* low_footprint */
+	30,	/* park_idle */
+	10,	/* connect_timeout */
+	5,	/* circuit_failures */
+	10,	/* circuit_open */
+	NULL,	/* transparent_port */
+	false,	/* tproxy */
+	NULL,	/* mux_upstream */
+	2,	/* mux_connections */
+	NULL,	/* mux_listen */
+	32768,	/* relay_quantum */
+	65536,	/* relay_read_max */
+	false,	/* sockmap */
+	NULL,	/* trace_file */
+	0,	/* busy_poll */
+	BUSY_LISTEN_SOCKS | BUSY_LISTEN_TRANSPARENT |
+		BUSY_LISTEN_MUX,	/* busy_poll_listeners */
+	60,	/* topk_window */
+	NULL,	/* admin_socket */
+	NULL,	/* access_log */
+	64,	/* access_log_size */
+	3600,	/* access_log_rotate */
+	NULL,	/* dns_servers */
+	0,	/* dns_timeout */
+	0,	/* dns_attempts */
+	NULL,	/* dns_check */
+	100,	/* lag_interval */
+	0,	/* lag_probes */
+	0,	/* lag_accepts */
+	0,	/* lag_connects */
+	NULL,	/* unix_listen */
+	0660,	/* unix_mode */
+	NULL,	/* unix_uids */
+	0,	/* tcpinfo_interval */
+	16,	/* tcpinfo_sample */
+	NULL,	/* socks_upstream */
+	NULL,	/* socks_upstream_auth */
+	4,	/* upstream_pool */
+	30,	/* upstream_idle */
+	NULL	/* config */
 };
 
+/*
+ * Long-only options.
+ */
+enum {
+	OPT_PARK_IDLE = 256,
+	OPT_CONNECT_TIMEOUT,
+	OPT_CIRCUIT_FAILURES,
+	OPT_CIRCUIT_OPEN,
+	OPT_TRANSPARENT_PORT,
+	OPT_TPROXY,
+	OPT_MUX_UPSTREAM,
+	OPT_MUX_CONNECTIONS,
+	OPT_MUX_LISTEN,
+	OPT_RELAY_QUANTUM,
+	OPT_RELAY_READ_MAX,
+	OPT_SOCKMAP,
+	OPT_TRACE_FILE,
+	OPT_BUSY_POLL,
+	OPT_BUSY_POLL_LISTENERS,
+	OPT_TOPK_WINDOW,
+	OPT_ADMIN_SOCKET,
+	OPT_ACCESS_LOG,
+	OPT_ACCESS_LOG_SIZE,
+	OPT_ACCESS_LOG_ROTATE,
+	OPT_DNS_SERVERS,
+	OPT_DNS_TIMEOUT,
+	OPT_DNS_ATTEMPTS,
+	OPT_DNS_CHECK,
+	OPT_LAG_INTERVAL,
+	OPT_LAG_PROBES,
+	OPT_LAG_ACCEPTS,
+	OPT_LAG_CONNECTS,
+	OPT_UNIX_LISTEN,
+	OPT_UNIX_MODE,
+	OPT_UNIX_UIDS,
+	OPT_TCPINFO_INTERVAL,
+	OPT_TCPINFO_SAMPLE,
+	OPT_SOCKS_UPSTREAM,
+	OPT_SOCKS_UPSTREAM_AUTH,
+	OPT_UPSTREAM_POOL,
+	OPT_UPSTREAM_IDLE,
+	OPT_CONFIG
+};
+
+/*
+ * Listener events, one per address family and port, and the unix listener.
+ */
+#define MAX_LISTENERS	7
+static struct event *g_listeners[MAX_LISTENERS];
+static int g_nlisteners = 0;
+
 /*
  * print_usage
  */
@@ -81,22 +188,122 @@ void libevent_fatalcb(int err)
 	oddsock_error(EXIT_FAILURE, 0, "libevent fatal error %d", err);
 }
 
+/*
+ * add_listener_event
+ * Add the accept event of a listener socket.
+ */
+void add_listener_event(struct event_base *base, int listener,
+		event_callback_fn cb)
+{
+	struct event *ev;
+
+	ev = event_new(base, listener, EV_READ|EV_PERSIST, cb, (void*)base);
+	if (!ev || event_priority_set(ev, SOCKS5_PRIO_HANDSHAKE) != 0) {
+		oddsock_error(EXIT_FAILURE, 0, "failed to create listener event");
+		/*NOTREACHED*/
+	}
+
+	if (event_add(ev, NULL) != 0) {
+		oddsock_error(EXIT_FAILURE, 0, "failed to add listener event");
+		/*NOTREACHED*/
+	}
+
+	g_listeners[g_nlisteners++] = ev;
+	lag_listener(ev);
+}
+
+/*
+ * add_listener
+ * Create a listener socket and add its accept event.
+ */
+void add_listener(struct event_base *base, int af, const char *port,
+		bool transparent, event_callback_fn cb)
+{
+	add_listener_event(base,
+			socks5_create_listener_socket(af, port, transparent), cb);
+}
+
+/*
+ * stats_signalcb
+ */
+void stats_signalcb(evutil_socket_t sig, short what, void *arg)
+{
+	stats_log();
+}
+
+/*
+ * exit_signalcb
+ * Leave the event loop so main cleans up and exits normally, which is
+ * also when profiling runtimes write their data.
+ */
+void exit_signalcb(evutil_socket_t sig, short what, void *arg)
+{
+	oddsock_logx(1, "signal %d, exiting", (int)sig);
+	event_base_loopexit((struct event_base*)arg, NULL);
+}
+
 /*
  * main
  */
 int main(int argc, char* argv[])
 {
 	int opt, e;
-	const char *shortopts = "46vb:p:";
+	const char *shortopts = "46vlb:p:";
 	struct option longopts[] = {
 		{ "listenAddress",	required_argument,	NULL,	'b'	},
 		{ "listenPort",		required_argument,	NULL,	'p'	},
+		{ "lowFootprint",	no_argument,		NULL,	'l'	},
+		{ "parkIdle",		required_argument,	NULL,	OPT_PARK_IDLE	},
+		{ "connectTimeout",	required_argument,	NULL,	OPT_CONNECT_TIMEOUT	},
+		{ "circuitFailures",	required_argument,	NULL,
+			OPT_CIRCUIT_FAILURES	},
+		{ "circuitOpen",	required_argument,	NULL,	OPT_CIRCUIT_OPEN	},
+		{ "transparentPort",	required_argument,	NULL,
+			OPT_TRANSPARENT_PORT	},
+		{ "tproxy",			no_argument,		NULL,	OPT_TPROXY	},
+		{ "muxUpstream",	required_argument,	NULL,	OPT_MUX_UPSTREAM	},
+		{ "muxConnections",	required_argument,	NULL,	OPT_MUX_CONNECTIONS	},
+		{ "muxListen",		required_argument,	NULL,	OPT_MUX_LISTEN	},
+		{ "relayQuantum",	required_argument,	NULL,	OPT_RELAY_QUANTUM	},
+		{ "relayReadMax",	required_argument,	NULL,	OPT_RELAY_READ_MAX	},
+		{ "sockmap",		no_argument,		NULL,	OPT_SOCKMAP	},
+		{ "traceFile",		required_argument,	NULL,	OPT_TRACE_FILE	},
+		{ "busyPoll",		required_argument,	NULL,	OPT_BUSY_POLL	},
+		{ "busyPollListeners",	required_argument,	NULL,
+			OPT_BUSY_POLL_LISTENERS	},
+		{ "topkWindow",		required_argument,	NULL,	OPT_TOPK_WINDOW	},
+		{ "adminSocket",	required_argument,	NULL,	OPT_ADMIN_SOCKET	},
+		{ "accessLog",		required_argument,	NULL,	OPT_ACCESS_LOG	},
+		{ "accessLogSize",	required_argument,	NULL,	OPT_ACCESS_LOG_SIZE	},
+		{ "accessLogRotate",	required_argument,	NULL,
+			OPT_ACCESS_LOG_ROTATE	},
+		{ "dnsServers",		required_argument,	NULL,	OPT_DNS_SERVERS	},
+		{ "dnsTimeout",		required_argument,	NULL,	OPT_DNS_TIMEOUT	},
+		{ "dnsAttempts",	required_argument,	NULL,	OPT_DNS_ATTEMPTS	},
+		{ "dnsCheck",		required_argument,	NULL,	OPT_DNS_CHECK	},
+		{ "lagInterval",	required_argument,	NULL,	OPT_LAG_INTERVAL	},
+		{ "lagProbes",		required_argument,	NULL,	OPT_LAG_PROBES	},
+		{ "lagAccepts",		required_argument,	NULL,	OPT_LAG_ACCEPTS	},
+		{ "lagConnects",	required_argument,	NULL,	OPT_LAG_CONNECTS	},
+		{ "unixListen",		required_argument,	NULL,	OPT_UNIX_LISTEN	},
+		{ "unixMode",		required_argument,	NULL,	OPT_UNIX_MODE	},
+		{ "unixUids",		required_argument,	NULL,	OPT_UNIX_UIDS	},
+		{ "tcpinfoInterval",	required_argument,	NULL,
+			OPT_TCPINFO_INTERVAL	},
+		{ "tcpinfoSample",	required_argument,	NULL,	OPT_TCPINFO_SAMPLE	},
+		{ "socksUpstream",	required_argument,	NULL,	OPT_SOCKS_UPSTREAM	},
+		{ "socksUpstreamAuth",	required_argument,	NULL,
+			OPT_SOCKS_UPSTREAM_AUTH	},
+		{ "upstreamPool",	required_argument,	NULL,	OPT_UPSTREAM_POOL	},
+		{ "upstreamIdle",	required_argument,	NULL,	OPT_UPSTREAM_IDLE	},
+		{ "config",			required_argument,	NULL,	OPT_CONFIG	},
 		{ NULL,				0,					NULL,	0	}};
+	struct event_config *cfg = NULL;
 	struct event_base *base = NULL;
-	struct event *listener4_event = NULL;
-	struct event *listener6_event = NULL;
-	int listener4 = -1;
-	int listener6 = -1;
+	struct event *stats_event = NULL;
+	struct event *term_event = NULL;
+	struct event *int_event = NULL;
+	int i;
 
 	/*
 	 * Parse program options.
@@ -120,6 +327,186 @@ int main(int argc, char* argv[])
 		case 'v':
 			g_opts.verbosity = 1;
 			break;
+		case 'l':
+			g_opts.low_footprint = true;
+			break;
+		case OPT_PARK_IDLE:
+			g_opts.park_idle = (unsigned int)strtoul(optarg, NULL, 10);
+			if (g_opts.park_idle == 0) {
+				oddsock_logx(0, "Invalid argument: --parkIdle must be > 0");
+				print_usage();
+			}
+			break;
+		case OPT_CONNECT_TIMEOUT:
+			g_opts.connect_timeout = (unsigned int)strtoul(optarg, NULL, 10);
+			if (g_opts.connect_timeout == 0) {
+				oddsock_logx(0,
+						"Invalid argument: --connectTimeout must be > 0");
+				print_usage();
+			}
+			break;
+		case OPT_CIRCUIT_FAILURES:
+			/* 0 disables the health cache. */
+			g_opts.circuit_failures = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case OPT_CIRCUIT_OPEN:
+			g_opts.circuit_open = (unsigned int)strtoul(optarg, NULL, 10);
+			if (g_opts.circuit_open == 0) {
+				oddsock_logx(0, "Invalid argument: --circuitOpen must be > 0");
+				print_usage();
+			}
+			break;
+		case OPT_TRANSPARENT_PORT:
+			g_opts.transparent_port = optarg;
+			break;
+		case OPT_TPROXY:
+			g_opts.tproxy = true;
+			break;
+		case OPT_MUX_UPSTREAM:
+			g_opts.mux_upstream = optarg;
+			break;
+		case OPT_MUX_CONNECTIONS:
+			g_opts.mux_connections = (unsigned int)strtoul(optarg, NULL, 10);
+			if (g_opts.mux_connections == 0) {
+				oddsock_logx(0,
+						"Invalid argument: --muxConnections must be > 0");
+				print_usage();
+			}
+			break;
+		case OPT_MUX_LISTEN:
+			g_opts.mux_listen = optarg;
+			break;
+		case OPT_RELAY_QUANTUM:
+			/* 0 relays everything available at once. */
+			g_opts.relay_quantum = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case OPT_RELAY_READ_MAX:
+			/* 0 leaves all reads to libevent. */
+			g_opts.relay_read_max = (unsigned int)strtoul(optarg, NULL, 10);
+			if (g_opts.relay_read_max != 0 &&
+				g_opts.relay_read_max < RELAY_READ_MIN) {
+				oddsock_logx(0, "Invalid argument: --relayReadMax must be 0 "
+						"or >= %d", RELAY_READ_MIN);
+				print_usage();
+			}
+			break;
+		case OPT_SOCKMAP:
+			g_opts.sockmap = true;
+			break;
+		case OPT_TRACE_FILE:
+			g_opts.trace_file = optarg;
+			break;
+		case OPT_BUSY_POLL:
+			g_opts.busy_poll = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case OPT_BUSY_POLL_LISTENERS:
+			g_opts.busy_poll_listeners = busy_parse_listeners(optarg);
+			if (g_opts.busy_poll_listeners < 0) {
+				oddsock_logx(0, "Invalid argument: --busyPollListeners "
+						"takes socks, transparent and mux");
+				print_usage();
+			}
+			break;
+		case OPT_TOPK_WINDOW:
+			/* 0 turns heavy hitter tracking off. */
+			g_opts.topk_window = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case OPT_ADMIN_SOCKET:
+			g_opts.admin_socket = optarg;
+			break;
+		case OPT_ACCESS_LOG:
+			g_opts.access_log = optarg;
+			break;
+		case OPT_ACCESS_LOG_SIZE:
+			g_opts.access_log_size = (unsigned int)strtoul(optarg, NULL, 10);
+			if (g_opts.access_log_size == 0) {
+				oddsock_logx(0,
+						"Invalid argument: --accessLogSize must be > 0");
+				print_usage();
+			}
+			break;
+		case OPT_ACCESS_LOG_ROTATE:
+			/* 0 rotates only when a segment is full. */
+			g_opts.access_log_rotate = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case OPT_DNS_SERVERS:
+			g_opts.dns_servers = optarg;
+			break;
+		case OPT_DNS_TIMEOUT:
+			/* 0 keeps the resolv.conf or libevent default. */
+			g_opts.dns_timeout = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case OPT_DNS_ATTEMPTS:
+			g_opts.dns_attempts = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case OPT_DNS_CHECK:
+			g_opts.dns_check = optarg;
+			break;
+		case OPT_LAG_INTERVAL:
+			/* 0 turns off lag measurement and shedding. */
+			g_opts.lag_interval = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case OPT_LAG_PROBES:
+			g_opts.lag_probes = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case OPT_LAG_ACCEPTS:
+			g_opts.lag_accepts = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case OPT_LAG_CONNECTS:
+			g_opts.lag_connects = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case OPT_UNIX_LISTEN:
+			g_opts.unix_listen = optarg;
+			break;
+		case OPT_UNIX_MODE:
+			/* Octal, like chmod. */
+			g_opts.unix_mode = (unsigned int)strtoul(optarg, NULL, 8) & 0777;
+			break;
+		case OPT_UNIX_UIDS:
+			g_opts.unix_uids = optarg;
+			if (socks5_unix_uids(optarg) != 0) {
+				oddsock_logx(0, "Invalid argument: --unixUids must be a list "
+						"of at most %d user ids", SOCKS5_UNIX_UIDS_MAX);
+				print_usage();
+			}
+			break;
+		case OPT_TCPINFO_INTERVAL:
+			/* 0 turns TCP_INFO sampling off. */
+			g_opts.tcpinfo_interval = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case OPT_TCPINFO_SAMPLE:
+			g_opts.tcpinfo_sample = (unsigned int)strtoul(optarg, NULL, 10);
+			if (g_opts.tcpinfo_sample == 0) {
+				oddsock_logx(0,
+						"Invalid argument: --tcpinfoSample must be > 0");
+				print_usage();
+			}
+			break;
+		case OPT_SOCKS_UPSTREAM:
+			g_opts.socks_upstream = optarg;
+			break;
+		case OPT_SOCKS_UPSTREAM_AUTH:
+			g_opts.socks_upstream_auth = optarg;
+			break;
+		case OPT_UPSTREAM_POOL:
+			g_opts.upstream_pool = (unsigned int)strtoul(optarg, NULL, 10);
+			if (g_opts.upstream_pool > UPSTREAM_POOL_MAX) {
+				oddsock_logx(0, "Invalid argument: --upstreamPool must be "
+						"<= %d", UPSTREAM_POOL_MAX);
+				print_usage();
+			}
+			break;
+		case OPT_UPSTREAM_IDLE:
+			g_opts.upstream_idle = (unsigned int)strtoul(optarg, NULL, 10);
+			if (g_opts.upstream_idle == 0) {
+				oddsock_logx(0,
+						"Invalid argument: --upstreamIdle must be > 0");
+				print_usage();
+			}
+			break;
+		case OPT_CONFIG:
+			g_opts.config = optarg;
+			break;
 		case ':':
 			oddsock_logx(0, "Missing option argument.");
 			print_usage();
@@ -133,14 +520,109 @@ int main(int argc, char* argv[])
 		oddsock_logx(0, "Invalid arguments: -4  and -6");
 		print_usage();
 	}
+	if (!g_opts.lag_interval &&
+		(g_opts.lag_probes || g_opts.lag_accepts || g_opts.lag_connects)) {
+		oddsock_logx(0, "Invalid arguments: lag shedding needs --lagInterval");
+		print_usage();
+	}
+	if (g_opts.unix_uids && !g_opts.unix_listen) {
+		oddsock_logx(0, "Invalid arguments: --unixUids needs --unixListen");
+		print_usage();
+	}
+	if (g_opts.socks_upstream && g_opts.mux_upstream) {
+		oddsock_logx(0, "Invalid arguments: --socksUpstream and --muxUpstream");
+		print_usage();
+	}
+	if (g_opts.socks_upstream_auth && !g_opts.socks_upstream) {
+		oddsock_logx(0,
+				"Invalid arguments: --socksUpstreamAuth needs --socksUpstream");
+		print_usage();
+	}
+	if (g_opts.tproxy && !g_opts.transparent_port) {
+		oddsock_logx(0, "Invalid arguments: --tproxy needs --transparentPort");
+		print_usage();
+	}
 
 	oddsock_logx(1, "Program options:\n"
 			"\tuse_IPv4 = %u\n"
 			"\tuse_IPv6 = %u\n"
 			"\tlisten_address = %s\n"
-			"\tlisten_port = %s",
+			"\tlisten_port = %s\n"
+			"\tlow_footprint = %u\n"
+			"\tpark_idle = %u\n"
+			"\tconnect_timeout = %u\n"
+			"\tcircuit_failures = %u\n"
+			"\tcircuit_open = %u\n"
+			"\ttransparent_port = %s\n"
+			"\ttproxy = %u\n"
+			"\tmux_upstream = %s\n"
+			"\tmux_connections = %u\n"
+			"\tmux_listen = %s\n"
+			"\trelay_quantum = %u\n"
+			"\trelay_read_max = %u\n"
+			"\tsockmap = %u\n"
+			"\ttrace_file = %s\n"
+			"\tbusy_poll = %u\n"
+			"\tbusy_poll_listeners = 0x%x\n"
+			"\ttopk_window = %u\n"
+			"\tadmin_socket = %s\n"
+			"\taccess_log = %s\n"
+			"\taccess_log_size = %u\n"
+			"\taccess_log_rotate = %u",
 			g_opts.use_IPv4, g_opts.use_IPv6,
-			g_opts.listen_address, g_opts.listen_port);
+			g_opts.listen_address, g_opts.listen_port,
+			g_opts.low_footprint, g_opts.park_idle,
+			g_opts.connect_timeout, g_opts.circuit_failures,
+			g_opts.circuit_open,
+			g_opts.transparent_port ? g_opts.transparent_port : "none",
+			g_opts.tproxy,
+			g_opts.mux_upstream ? g_opts.mux_upstream : "none",
+			g_opts.mux_connections,
+			g_opts.mux_listen ? g_opts.mux_listen : "none",
+			g_opts.relay_quantum, g_opts.relay_read_max, g_opts.sockmap,
+			g_opts.trace_file ? g_opts.trace_file : "none",
+			g_opts.busy_poll, (unsigned int)g_opts.busy_poll_listeners,
+			g_opts.topk_window,
+			g_opts.admin_socket ? g_opts.admin_socket : "none",
+			g_opts.access_log ? g_opts.access_log : "none",
+			g_opts.access_log_size, g_opts.access_log_rotate);
+	oddsock_logx(1, "Resolver options:\n"
+			"\tdns_servers = %s\n"
+			"\tdns_timeout = %u\n"
+			"\tdns_attempts = %u\n"
+			"\tdns_check = %s",
+			g_opts.dns_servers ? g_opts.dns_servers : "resolv.conf",
+			g_opts.dns_timeout, g_opts.dns_attempts,
+			g_opts.dns_check ? g_opts.dns_check : "none");
+	oddsock_logx(1, "Lag options:\n"
+			"\tlag_interval = %u\n"
+			"\tlag_probes = %u\n"
+			"\tlag_accepts = %u\n"
+			"\tlag_connects = %u",
+			g_opts.lag_interval, g_opts.lag_probes, g_opts.lag_accepts,
+			g_opts.lag_connects);
+	oddsock_logx(1, "Unix listener options:\n"
+			"\tunix_listen = %s\n"
+			"\tunix_mode = %o\n"
+			"\tunix_uids = %s",
+			g_opts.unix_listen ? g_opts.unix_listen : "none",
+			g_opts.unix_mode, g_opts.unix_uids ? g_opts.unix_uids : "any");
+	oddsock_logx(1, "TCP_INFO options:\n"
+			"\ttcpinfo_interval = %u\n"
+			"\ttcpinfo_sample = %u",
+			g_opts.tcpinfo_interval, g_opts.tcpinfo_sample);
+	oddsock_logx(1, "Upstream options:\n"
+			"\tsocks_upstream = %s\n"
+			"\tsocks_upstream_auth = %s\n"
+			"\tupstream_pool = %u\n"
+			"\tupstream_idle = %u",
+			g_opts.socks_upstream ? g_opts.socks_upstream : "none",
+			g_opts.socks_upstream_auth ? "set" : "none",
+			g_opts.upstream_pool, g_opts.upstream_idle);
+	oddsock_logx(1, "config = %s", g_opts.config ? g_opts.config : "none");
+	if (g_opts.low_footprint)
+		oddsock_logx(1, "bytes per idle tunnel: %lu",
+				(unsigned long)socks5_idle_footprint());
 
 	/*
 	 * Set up libevent.
@@ -152,62 +634,188 @@ int main(int argc, char* argv[])
 	event_enable_debug_mode();
 #endif
 
-	base = event_base_new();
+	/* Poll again after a bounded run of relay callbacks so accepts and
+	 * handshakes are not held up behind them. */
+	cfg = event_config_new();
+	if (!cfg || event_config_set_max_dispatch_interval(cfg, NULL,
+				SOCKS5_RELAY_DISPATCH_MAX, SOCKS5_PRIO_INTERACTIVE) != 0) {
+		oddsock_error(EXIT_FAILURE, 0, "failed to create event_config");
+		/*NOTREACHED*/
+	}
+
+	base = event_base_new_with_config(cfg);
+	event_config_free(cfg);
 	if (!base) {
 		oddsock_error(EXIT_FAILURE, 0, "failed to create event_base");
 		/*NOTREACHED*/
 	}
 
+	if (event_base_priority_init(base, SOCKS5_PRIORITIES) != 0) {
+		oddsock_error(EXIT_FAILURE, 0, "failed to set event priorities");
+		/*NOTREACHED*/
+	}
+
+	/* Peers that go away while a reply or relay write is pending must not
+	 * kill the process. */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* The file overrides the command line for the settings it has. */
+	if (conf_init(base, g_opts.config) != 0) {
+		oddsock_error(EXIT_FAILURE, 0, "failed to load config file");
+		/*NOTREACHED*/
+	}
+
+	if (relay_init(base) != 0) {
+		oddsock_error(EXIT_FAILURE, 0, "failed to initialize relay");
+		/*NOTREACHED*/
+	}
+
+	if (resolver_init(base) != 0) {
+		oddsock_error(EXIT_FAILURE, 0, "failed to initialize resolver");
+		/*NOTREACHED*/
+	}
+
+	if (health_init(base) != 0) {
+		oddsock_error(EXIT_FAILURE, 0, "failed to initialize health cache");
+		/*NOTREACHED*/
+	}
+
+	if (trace_init(base, g_opts.trace_file) != 0) {
+		oddsock_error(EXIT_FAILURE, 0, "failed to initialize trace");
+		/*NOTREACHED*/
+	}
+
+	if (alog_init(base, g_opts.access_log, g_opts.access_log_size,
+				g_opts.access_log_rotate) != 0) {
+		oddsock_error(EXIT_FAILURE, 0, "failed to initialize access log");
+		/*NOTREACHED*/
+	}
+
+	if (topk_init(base, g_opts.topk_window) != 0) {
+		oddsock_error(EXIT_FAILURE, 0, "failed to initialize heavy hitters");
+		/*NOTREACHED*/
+	}
+
+	if (lag_init(base, g_opts.lag_interval) != 0) {
+		oddsock_error(EXIT_FAILURE, 0, "failed to initialize lag measurement");
+		/*NOTREACHED*/
+	}
+
+	if (tcpinfo_init(base, g_opts.tcpinfo_interval,
+				g_opts.tcpinfo_sample) != 0) {
+		oddsock_error(EXIT_FAILURE, 0,
+				"failed to initialize TCP_INFO sampling");
+		/*NOTREACHED*/
+	}
+
+	if (upstream_init(base) != 0) {
+		oddsock_error(EXIT_FAILURE, 0, "failed to initialize upstream pool");
+		/*NOTREACHED*/
+	}
+
+	if (sockmap_init(base, g_opts.sockmap) != 0) {
+		oddsock_error(EXIT_FAILURE, 0, "failed to initialize sockmap");
+		/*NOTREACHED*/
+	}
+
+	/* The admin socket's conns and kill commands need the table. */
+	if (conntab_init(g_opts.admin_socket != NULL) != 0) {
+		oddsock_error(EXIT_FAILURE, 0, "failed to initialize connection table");
+		/*NOTREACHED*/
+	}
+
+	if (admin_init(base, g_opts.admin_socket) != 0) {
+		oddsock_error(EXIT_FAILURE, 0, "failed to initialize admin socket");
+		/*NOTREACHED*/
+	}
+
 	/*
 	 * Create the listener sockets and add events.
 	 */
 
 	if (g_opts.use_IPv4) {
-		listener4 = socks5_create_listener_socket(AF_INET);
-
-		listener4_event = event_new(base, listener4, EV_READ|EV_PERSIST,
-				socks5_listener_accept, (void*)base);
-		if (!listener4_event) {
-			oddsock_error(EXIT_FAILURE, 0, "failed to create listener4_event");
-			/*NOTREACHED*/
-		}
-
-		if (event_add(listener4_event, NULL) != 0) {
-			oddsock_error(EXIT_FAILURE, 0, "failed to add listner4_event");
-			/*NOTREACHED*/
-		}
+		add_listener(base, AF_INET, g_opts.listen_port, false,
+				socks5_listener_accept);
+		if (g_opts.transparent_port)
+			add_listener(base, AF_INET, g_opts.transparent_port, true,
+					socks5_transparent_accept);
+		if (g_opts.mux_listen)
+			add_listener(base, AF_INET, g_opts.mux_listen, false,
+					mux_listener_accept);
 	}
 	if (g_opts.use_IPv6) {
-		listener6 = socks5_create_listener_socket(AF_INET6);
+		add_listener(base, AF_INET6, g_opts.listen_port, false,
+				socks5_listener_accept);
+		if (g_opts.transparent_port)
+			add_listener(base, AF_INET6, g_opts.transparent_port, true,
+					socks5_transparent_accept);
+		if (g_opts.mux_listen)
+			add_listener(base, AF_INET6, g_opts.mux_listen, false,
+					mux_listener_accept);
+	}
+	if (g_opts.unix_listen)
+		add_listener_event(base,
+				socks5_create_unix_listener_socket(g_opts.unix_listen,
+					g_opts.unix_mode), socks5_listener_accept);
 
-		listener6_event = event_new(base, listener6, EV_READ|EV_PERSIST,
-				socks5_listener_accept, (void*)base);
-		if (!listener6_event) {
-			oddsock_error(EXIT_FAILURE, 0, "failed to create listener6_event");
-			/*NOTREACHED*/
-		}
+	if (g_opts.mux_upstream && mux_client_init(base) != 0) {
+		oddsock_error(EXIT_FAILURE, 0,
+				"Invalid argument: --muxUpstream must be host:port");
+		/*NOTREACHED*/
+	}
 
-		if (event_add(listener6_event, NULL) != 0) {
-			oddsock_error(EXIT_FAILURE, 0, "failed to add listner6_event");
-			/*NOTREACHED*/
-		}
+	/* SIGUSR1 logs the connection counters. */
+	stats_event = evsignal_new(base, SIGUSR1, stats_signalcb, NULL);
+	if (!stats_event || event_add(stats_event, NULL) != 0) {
+		oddsock_error(EXIT_FAILURE, 0, "failed to add stats signal event");
+		/*NOTREACHED*/
 	}
 
-	e = event_base_dispatch(base);
-	if (e != 0)
-		oddsock_logx(1, "event_base_dispatch returned %d", e);
+	/* SIGTERM and SIGINT exit through the cleanup below. */
+	term_event = evsignal_new(base, SIGTERM, exit_signalcb, (void*)base);
+	int_event = evsignal_new(base, SIGINT, exit_signalcb, (void*)base);
+	if (!term_event || event_add(term_event, NULL) != 0 ||
+		!int_event || event_add(int_event, NULL) != 0) {
+		oddsock_error(EXIT_FAILURE, 0, "failed to add exit signal events");
+		/*NOTREACHED*/
+	}
+
+	if (g_opts.busy_poll > 0) {
+		e = busy_loop(base);
+		if (e != 0)
+			oddsock_logx(1, "busy_loop returned %d", e);
+	} else {
+		e = event_base_dispatch(base);
+		if (e != 0)
+			oddsock_logx(1, "event_base_dispatch returned %d", e);
+	}
 
 	oddsock_logx(1, "cleanup");
 
 	/* cleanup */
-	if (listener4_event) {
-		event_free(listener4_event);
-		listener4_event = NULL;
-	}
-	if (listener6_event) {
-		event_free(listener6_event);
-		listener6_event = NULL;
+	for (i = 0; i < g_nlisteners; ++i) {
+		event_free(g_listeners[i]);
+		g_listeners[i] = NULL;
 	}
+	g_nlisteners = 0;
+	if (g_opts.unix_listen)
+		unlink(g_opts.unix_listen);
+	event_free(stats_event);
+	stats_event = NULL;
+	event_free(term_event);
+	term_event = NULL;
+	event_free(int_event);
+	int_event = NULL;
+	trace_close();
+	alog_close();
+	admin_close();
+	topk_free();
+	resolver_free();
+	lag_free();
+	tcpinfo_free();
+	upstream_free();
+	sockmap_free();
+	conf_free();
 	event_base_free(base);
 	base = NULL;
 
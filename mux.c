@@ -0,0 +1,600 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/dns.h>
+#include "util.h"
+#include "oddsock.h"
+#include "socks5.h"
+#include "stats.h"
+#include "mux.h"
+#include "busypoll.h"
+#include "resolver.h"
+
+#define MUX_STREAM_BUCKETS	(256)
+#define MUX_CONNECTIONS_MAX	(16)
+#define MUX_RETRY_SECS		(1)
+
+struct mux_conn;
+
+struct mux_stream {
+	struct mux_conn *mc;
+	unsigned long id;
+	struct bufferevent *bev; /* mux end of the pair */
+	unsigned long send_window;
+	unsigned long recv_pending; /* delivered, credit not yet returned */
+	bool local_eof;
+	struct mux_stream *next;
+};
+
+struct mux_conn {
+	struct event_base *base;
+	struct bufferevent *bev;
+	struct event *retry_ev; /* client side reconnect timer */
+	bool client;
+	bool connected;
+	unsigned long next_id;
+	unsigned int nstreams;
+	struct mux_stream *streams[MUX_STREAM_BUCKETS];
+};
+
+static struct mux_conn *g_mux_upstream[MUX_CONNECTIONS_MAX];
+static unsigned int g_mux_nupstream = 0;
+static char g_mux_host[256];
+static unsigned short g_mux_port;
+
+static int mux_conn_connect(struct mux_conn *mc);
+static void mux_conn_reset(struct mux_conn *mc);
+static void mux_conn_retrycb(int fd, short what, void *arg);
+static void mux_conn_readcb(struct bufferevent *bev, void *arg);
+static void mux_conn_eventcb(struct bufferevent *bev, short what, void *arg);
+static void mux_stream_readcb(struct bufferevent *bev, void *arg);
+static void mux_stream_writecb(struct bufferevent *bev, void *arg);
+static void mux_stream_eventcb(struct bufferevent *bev, short what,
+		void *arg);
+
+/*
+ * mux_send_header
+ */
+static void mux_send_header(struct mux_conn *mc, unsigned char type,
+		unsigned long id, size_t len)
+{
+	unsigned char hdr[MUX_HEADER_LEN];
+
+	hdr[0] = type;
+	hdr[1] = 0;
+	hdr[2] = (unsigned char)(len >> 8);
+	hdr[3] = (unsigned char)len;
+	hdr[4] = (unsigned char)(id >> 24);
+	hdr[5] = (unsigned char)(id >> 16);
+	hdr[6] = (unsigned char)(id >> 8);
+	hdr[7] = (unsigned char)id;
+	bufferevent_write(mc->bev, hdr, sizeof(hdr));
+}
+
+/*
+ * mux_send_window
+ */
+static void mux_send_window(struct mux_conn *mc, unsigned long id,
+		unsigned long credit)
+{
+	unsigned char payload[4];
+
+	payload[0] = (unsigned char)(credit >> 24);
+	payload[1] = (unsigned char)(credit >> 16);
+	payload[2] = (unsigned char)(credit >> 8);
+	payload[3] = (unsigned char)credit;
+	mux_send_header(mc, MUX_WINDOW, id, sizeof(payload));
+	bufferevent_write(mc->bev, payload, sizeof(payload));
+}
+
+/*
+ * mux_stream_lookup
+ */
+static struct mux_stream *mux_stream_lookup(struct mux_conn *mc,
+		unsigned long id)
+{
+	struct mux_stream *ms = mc->streams[id % MUX_STREAM_BUCKETS];
+
+	while (ms && ms->id != id)
+		ms = ms->next;
+	return ms;
+}
+
+/*
+ * mux_stream_new
+ * Create a stream and its bufferevent pair. The other end of the pair is
+ * returned in peer for the SOCKS side.
+ */
+static struct mux_stream *mux_stream_new(struct mux_conn *mc,
+		unsigned long id, struct bufferevent **peer)
+{
+	struct mux_stream *ms;
+	struct bufferevent *pair[2];
+
+	ms = (struct mux_stream*)calloc(1, sizeof(struct mux_stream));
+	if (!ms)
+		return NULL;
+
+	if (bufferevent_pair_new(mc->base,
+				BEV_OPT_CLOSE_ON_FREE|BEV_OPT_DEFER_CALLBACKS, pair) != 0) {
+		free(ms);
+		return NULL;
+	}
+
+	ms->mc = mc;
+	ms->id = id;
+	ms->bev = pair[1];
+	ms->send_window = MUX_WINDOW_INITIAL;
+	ms->next = mc->streams[id % MUX_STREAM_BUCKETS];
+	mc->streams[id % MUX_STREAM_BUCKETS] = ms;
+	++mc->nstreams;
+	++g_stats.mux_streams;
+
+	/* Bound what the SOCKS side can queue beyond the send window. */
+	bufferevent_setwatermark(ms->bev, EV_READ, 0, MUX_WINDOW_INITIAL);
+	bufferevent_setcb(ms->bev, mux_stream_readcb, mux_stream_writecb,
+			mux_stream_eventcb, (void*)ms);
+	bufferevent_enable(ms->bev, EV_READ|EV_WRITE);
+
+	*peer = pair[0];
+	return ms;
+}
+
+/*
+ * mux_stream_free
+ * Unlink and free a stream. With finish set the SOCKS side is told the
+ * stream ended after any data still queued for it.
+ */
+static void mux_stream_free(struct mux_stream *ms, bool finish)
+{
+	struct mux_stream **p = &ms->mc->streams[ms->id % MUX_STREAM_BUCKETS];
+
+	while (*p != ms)
+		p = &(*p)->next;
+	*p = ms->next;
+	--ms->mc->nstreams;
+
+	if (finish)
+		bufferevent_flush(ms->bev, EV_WRITE, BEV_FINISHED);
+	bufferevent_free(ms->bev);
+	free(ms);
+}
+
+/*
+ * mux_stream_send
+ * Frame what the SOCKS side wrote, as far as the send window allows.
+ */
+static void mux_stream_send(struct mux_stream *ms)
+{
+	struct mux_conn *mc = ms->mc;
+	struct evbuffer *input = bufferevent_get_input(ms->bev);
+	size_t n;
+
+	while ((n = evbuffer_get_length(input)) > 0 && ms->send_window > 0) {
+		if (n > MUX_FRAME_MAX)
+			n = MUX_FRAME_MAX;
+		if (n > ms->send_window)
+			n = ms->send_window;
+		mux_send_header(mc, MUX_DATA, ms->id, n);
+		evbuffer_remove_buffer(input, bufferevent_get_output(mc->bev), n);
+		ms->send_window -= n;
+	}
+
+	if (ms->local_eof && evbuffer_get_length(input) == 0) {
+		mux_send_header(mc, MUX_CLOSE, ms->id, 0);
+		mux_stream_free(ms, false);
+		return;
+	}
+
+	if (ms->send_window > 0)
+		bufferevent_enable(ms->bev, EV_READ);
+	else
+		bufferevent_disable(ms->bev, EV_READ);
+}
+
+/*
+ * mux_stream_readcb
+ */
+static void mux_stream_readcb(struct bufferevent *bev, void *arg)
+{
+	mux_stream_send((struct mux_stream*)arg);
+}
+
+/*
+ * mux_stream_writecb
+ * The SOCKS side took the data delivered to it; return the credit.
+ */
+static void mux_stream_writecb(struct bufferevent *bev, void *arg)
+{
+	struct mux_stream *ms = (struct mux_stream*)arg;
+
+	if (ms->recv_pending > 0 && !ms->local_eof) {
+		mux_send_window(ms->mc, ms->id, ms->recv_pending);
+		ms->recv_pending = 0;
+	}
+}
+
+/*
+ * mux_stream_eventcb
+ * The SOCKS side is gone: send what it left behind, then CLOSE.
+ */
+static void mux_stream_eventcb(struct bufferevent *bev, short what,
+		void *arg)
+{
+	struct mux_stream *ms = (struct mux_stream*)arg;
+
+	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
+		ms->local_eof = true;
+		mux_stream_send(ms);
+	}
+}
+
+/*
+ * mux_conn_new
+ */
+static struct mux_conn *mux_conn_new(struct event_base *base, bool client)
+{
+	struct mux_conn *mc;
+
+	mc = (struct mux_conn*)calloc(1, sizeof(struct mux_conn));
+	if (!mc)
+		return NULL;
+
+	mc->base = base;
+	mc->client = client;
+	mc->next_id = 1;
+	return mc;
+}
+
+/*
+ * mux_conn_reset
+ * Drop a mux connection and all of its streams. Client connections are
+ * retried, server connections freed.
+ */
+static void mux_conn_reset(struct mux_conn *mc)
+{
+	struct timeval tv;
+	int i;
+
+	for (i = 0; i < MUX_STREAM_BUCKETS; ++i)
+		while (mc->streams[i])
+			mux_stream_free(mc->streams[i], true);
+
+	if (mc->bev) {
+		bufferevent_free(mc->bev);
+		mc->bev = NULL;
+	}
+	mc->connected = false;
+
+	if (!mc->client) {
+		free(mc);
+		return;
+	}
+
+	tv.tv_sec = MUX_RETRY_SECS;
+	tv.tv_usec = 0;
+	if (!mc->retry_ev)
+		mc->retry_ev = evtimer_new(mc->base, mux_conn_retrycb, (void*)mc);
+	if (mc->retry_ev)
+		evtimer_add(mc->retry_ev, &tv);
+}
+
+/*
+ * mux_conn_open_stream
+ * Server side: an OPEN frame arrived; hand the request to a new SOCKS
+ * connection.
+ */
+static int mux_conn_open_stream(struct mux_conn *mc, unsigned long id,
+		struct evbuffer *input, size_t len)
+{
+	struct mux_stream *ms;
+	struct bufferevent *peer;
+
+	if (mc->client || mux_stream_lookup(mc, id)) {
+		oddsock_logx(1, "mux: unexpected OPEN for stream %lu", id);
+		return -1;
+	}
+
+	ms = mux_stream_new(mc, id, &peer);
+	if (!ms || socks5_mux_accept(mc->base, peer) != 0) {
+		if (ms)
+			mux_stream_free(ms, false);
+		evbuffer_drain(input, len);
+		mux_send_header(mc, MUX_CLOSE, id, 0);
+		return 0;
+	}
+
+	/* The request becomes the SOCKS connection's first input. */
+	evbuffer_remove_buffer(input, bufferevent_get_output(ms->bev), len);
+	return 0;
+}
+
+/*
+ * mux_conn_frame
+ * Handle one frame whose payload is at the start of input.
+ */
+static int mux_conn_frame(struct mux_conn *mc, unsigned char type,
+		unsigned long id, struct evbuffer *input, size_t len)
+{
+	struct mux_stream *ms;
+	unsigned char credit[4];
+
+	if (type == MUX_OPEN)
+		return mux_conn_open_stream(mc, id, input, len);
+
+	ms = mux_stream_lookup(mc, id);
+
+	switch (type) {
+	case MUX_DATA:
+		if (!ms || ms->local_eof) {
+			/* Closed on this side; the CLOSE is on its way. */
+			evbuffer_drain(input, len);
+			return 0;
+		}
+		ms->recv_pending += len;
+		evbuffer_remove_buffer(input, bufferevent_get_output(ms->bev), len);
+		return 0;
+	case MUX_WINDOW:
+		if (len != sizeof(credit))
+			return -1;
+		evbuffer_remove(input, credit, sizeof(credit));
+		if (ms) {
+			ms->send_window += ((unsigned long)credit[0] << 24) |
+				((unsigned long)credit[1] << 16) |
+				((unsigned long)credit[2] << 8) | credit[3];
+			mux_stream_send(ms);
+		}
+		return 0;
+	case MUX_CLOSE:
+		evbuffer_drain(input, len);
+		if (ms)
+			mux_stream_free(ms, true);
+		return 0;
+	default:
+		oddsock_logx(1, "mux: unknown frame type %u", type);
+		return -1;
+	}
+}
+
+/*
+ * mux_conn_readcb
+ */
+static void mux_conn_readcb(struct bufferevent *bev, void *arg)
+{
+	struct mux_conn *mc = (struct mux_conn*)arg;
+	struct evbuffer *input = bufferevent_get_input(bev);
+	unsigned char hdr[MUX_HEADER_LEN];
+	unsigned long id;
+	size_t len;
+
+	while (evbuffer_get_length(input) >= MUX_HEADER_LEN) {
+		evbuffer_copyout(input, hdr, sizeof(hdr));
+		len = ((size_t)hdr[2] << 8) | hdr[3];
+		id = ((unsigned long)hdr[4] << 24) | ((unsigned long)hdr[5] << 16) |
+			((unsigned long)hdr[6] << 8) | hdr[7];
+		if (len > MUX_FRAME_MAX) {
+			oddsock_logx(1, "mux: oversized frame");
+			mux_conn_reset(mc);
+			return;
+		}
+		if (evbuffer_get_length(input) < MUX_HEADER_LEN + len)
+			return;
+
+		evbuffer_drain(input, MUX_HEADER_LEN);
+		if (mux_conn_frame(mc, hdr[0], id, input, len) != 0) {
+			mux_conn_reset(mc);
+			return;
+		}
+	}
+}
+
+/*
+ * mux_conn_eventcb
+ */
+static void mux_conn_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	struct mux_conn *mc = (struct mux_conn*)arg;
+
+	if (what & BEV_EVENT_CONNECTED) {
+		make_socket_nodelay(bufferevent_getfd(bev));
+		busy_socket(bufferevent_getfd(bev), BUSY_LISTEN_MUX);
+		mc->connected = true;
+		oddsock_logx(1, "mux: connected to %s port %u",
+				g_mux_host, g_mux_port);
+		return;
+	}
+	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
+		if (what & BEV_EVENT_ERROR)
+			oddsock_log(1, errno, "mux: connection error");
+		else
+			oddsock_logx(1, "mux: connection closed");
+		mux_conn_reset(mc);
+	}
+}
+
+/*
+ * mux_conn_connect
+ * Client side: (re)connect to the upstream oddsock.
+ */
+static int mux_conn_connect(struct mux_conn *mc)
+{
+	mc->bev = bufferevent_socket_new(mc->base, -1, BEV_OPT_CLOSE_ON_FREE);
+	if (!mc->bev)
+		return -1;
+
+	bufferevent_setcb(mc->bev, mux_conn_readcb, NULL, mux_conn_eventcb,
+			(void*)mc);
+	bufferevent_enable(mc->bev, EV_READ|EV_WRITE);
+
+	if (bufferevent_socket_connect_hostname(mc->bev,
+				resolver_get(mc->base), AF_UNSPEC,
+				g_mux_host, g_mux_port) != 0) {
+		oddsock_logx(1, "mux: failed connecting to %s port %u",
+				g_mux_host, g_mux_port);
+		mux_conn_reset(mc);
+	}
+
+	return 0;
+}
+
+/*
+ * mux_conn_retrycb
+ */
+static void mux_conn_retrycb(int fd, short what, void *arg)
+{
+	struct mux_conn *mc = (struct mux_conn*)arg;
+
+	if (mux_conn_connect(mc) != 0)
+		mux_conn_reset(mc);
+}
+
+/*
+ * mux_client_init
+ */
+int mux_client_init(struct event_base *base)
+{
+	const char *upstream = g_opts.mux_upstream;
+	const char *colon = strrchr(upstream, ':');
+	size_t hostlen;
+	unsigned int i;
+
+	if (!colon || colon == upstream || !colon[1])
+		return -1;
+
+	/* Accept [v6addr]:port as well as host:port. */
+	hostlen = (size_t)(colon - upstream);
+	if (upstream[0] == '[' && upstream[hostlen - 1] == ']') {
+		++upstream;
+		hostlen -= 2;
+	}
+	if (hostlen == 0 || hostlen >= sizeof(g_mux_host))
+		return -1;
+	memcpy(g_mux_host, upstream, hostlen);
+	g_mux_host[hostlen] = '\0';
+	g_mux_port = (unsigned short)strtoul(colon + 1, NULL, 10);
+
+	g_mux_nupstream = g_opts.mux_connections;
+	if (g_mux_nupstream > MUX_CONNECTIONS_MAX)
+		g_mux_nupstream = MUX_CONNECTIONS_MAX;
+
+	for (i = 0; i < g_mux_nupstream; ++i) {
+		g_mux_upstream[i] = mux_conn_new(base, true);
+		if (!g_mux_upstream[i] || mux_conn_connect(g_mux_upstream[i]) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * mux_listener_accept
+ */
+void mux_listener_accept(int listener, short what, void *arg)
+{
+	struct event_base *base = (struct event_base*)arg;
+	struct mux_conn *mc;
+	int fd;
+
+	fd = accept(listener, NULL, NULL);
+	if (fd < 0) {
+		oddsock_log(1, errno, "mux: accept failed");
+		return;
+	}
+
+	if (make_socket_nonblocking(fd) < 0 || !(mc = mux_conn_new(base, false))) {
+		close(fd);
+		return;
+	}
+	make_socket_nodelay(fd);
+	busy_socket(fd, BUSY_LISTEN_MUX);
+
+	mc->bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+	if (!mc->bev) {
+		close(fd);
+		free(mc);
+		return;
+	}
+	mc->connected = true;
+	bufferevent_setcb(mc->bev, mux_conn_readcb, NULL, mux_conn_eventcb,
+			(void*)mc);
+	bufferevent_enable(mc->bev, EV_READ|EV_WRITE);
+
+	oddsock_logx(1, "(%d) mux: accepted connection", fd);
+}
+
+/*
+ * mux_stream_open
+ */
+struct bufferevent *mux_stream_open(const unsigned char *request,
+		size_t len)
+{
+	struct mux_conn *mc = NULL;
+	struct mux_stream *ms;
+	struct bufferevent *peer;
+	unsigned int i;
+
+	/* Least loaded connection, preferring established ones; requests on
+	 * a connection still being set up wait in its output buffer. */
+	for (i = 0; i < g_mux_nupstream; ++i) {
+		struct mux_conn *c = g_mux_upstream[i];
+		if (!c->bev)
+			continue;
+		if (!mc || (c->connected && !mc->connected) ||
+			(c->connected == mc->connected && c->nstreams < mc->nstreams))
+			mc = c;
+	}
+	if (!mc)
+		return NULL;
+
+	ms = mux_stream_new(mc, mc->next_id, &peer);
+	if (!ms)
+		return NULL;
+	mc->next_id = (mc->next_id + 1) & 0xffffffffUL;
+	if (mc->next_id == 0)
+		mc->next_id = 1;
+
+	mux_send_header(mc, MUX_OPEN, ms->id, len);
+	bufferevent_write(mc->bev, request, len);
+
+	return peer;
+}
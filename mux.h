@@ -0,0 +1,95 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#ifndef ODDSOCK_MUX_H
+#define ODDSOCK_MUX_H
+
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+
+/*
+ * Multiplexed tunnel between two oddsock instances.
+ *
+ * A client-side oddsock (--muxUpstream) keeps a few persistent TCP
+ * connections to a server-side oddsock (--muxListen) and carries each
+ * SOCKS CONNECT as a stream over one of them. The client answers the
+ * greeting itself and forwards the request in the stream's OPEN frame;
+ * the server runs it through its normal request path and the SOCKS reply
+ * and tunnel data come back as stream data, so opening a stream costs no
+ * round trip beyond the destination connect.
+ *
+ * Frames are an 8 byte header followed by up to MUX_FRAME_MAX bytes:
+ *
+ *	+------+-----+--------+-----------+
+ *	| type | rsv | length | stream id |
+ *	+------+-----+--------+-----------+
+ *	|  1   |  1  |   2    |     4     |
+ *	+------+-----+--------+-----------+
+ *
+ * Each direction of a stream may have at most MUX_WINDOW bytes of DATA
+ * in flight; the receiver returns credit with WINDOW frames as the data
+ * is handed to the tunnel.
+ */
+
+#define MUX_OPEN	(0x01) /* payload: SOCKS 5 request */
+#define MUX_DATA	(0x02)
+#define MUX_WINDOW	(0x03) /* payload: 4 byte credit */
+#define MUX_CLOSE	(0x04)
+
+#define MUX_HEADER_LEN	(8)
+#define MUX_FRAME_MAX	(16 * 1024)
+#define MUX_WINDOW_INITIAL	(256 * 1024)
+
+/*
+ * mux_client_init
+ * Open the connections to the upstream oddsock.
+ */
+int mux_client_init(struct event_base *base);
+
+/*
+ * mux_listener_accept
+ * Accept a connection from a client-side oddsock.
+ */
+void mux_listener_accept(int listener, short what, void *base);
+
+/*
+ * mux_stream_open
+ * Open a stream on the least loaded upstream connection, sending the
+ * request with the OPEN frame. Returns this end's bufferevent of the
+ * stream, or NULL when no upstream connection is available.
+ */
+struct bufferevent *mux_stream_open(const unsigned char *request,
+		size_t len);
+
+#endif
@@ -48,6 +48,45 @@ struct oddsock_opts
 	bool use_IPv6;
 	char *listen_address;
 	char *listen_port;
+	bool low_footprint;
+	unsigned int park_idle;
+	unsigned int connect_timeout;
+	unsigned int circuit_failures;
+	unsigned int circuit_open;
+	char *transparent_port;
+	bool tproxy;
+	char *mux_upstream;
+	unsigned int mux_connections;
+	char *mux_listen;
+	unsigned int relay_quantum;
+	unsigned int relay_read_max;
+	bool sockmap;
+	char *trace_file;
+	unsigned int busy_poll;
+	int busy_poll_listeners;
+	unsigned int topk_window;
+	char *admin_socket;
+	char *access_log;
+	unsigned int access_log_size;
+	unsigned int access_log_rotate;
+	char *dns_servers;
+	unsigned int dns_timeout;
+	unsigned int dns_attempts;
+	char *dns_check;
+	unsigned int lag_interval;
+	unsigned int lag_probes;
+	unsigned int lag_accepts;
+	unsigned int lag_connects;
+	char *unix_listen;
+	unsigned int unix_mode;
+	char *unix_uids;
+	unsigned int tcpinfo_interval;
+	unsigned int tcpinfo_sample;
+	char *socks_upstream;
+	char *socks_upstream_auth;
+	unsigned int upstream_pool;
+	unsigned int upstream_idle;
+	char *config;
 };
 
 extern struct oddsock_opts g_opts;
@@ -0,0 +1,86 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#ifndef ODDSOCK_PROBES_H
+#define ODDSOCK_PROBES_H
+
+/*
+ * USDT probes, compiled in with "make sdt=1" (needs sys/sdt.h, e.g. from
+ * systemtap-sdt-dev). Each probe is a single nop until a tracer attaches,
+ * but its arguments are computed either way, so callers only pass values
+ * they already have: fields and locals, no calls. Without sdt=1 the
+ * macros expand to nothing and their arguments are not evaluated.
+ *
+ * Every probe of provider "oddsock" starts with the socks5_conn address
+ * (unique while the connection lives, use it as the key), the connection
+ * id printed in the log (-1 for mux streams) and the connection state
+ * (enum socks5_conn_status):
+ *
+ *   accept		new connection
+ *   greeting		greeting parsed; auth method
+ *   request		request parsed; command, address type
+ *   dns		domain resolved; getaddrinfo result (0 = ok)
+ *   connected		destination connected
+ *   connect_failed	destination connect failed; SOCKS reply code
+ *   relay_read		transfer starts; direction (0 = up), bytes buffered
+ *   relay_write	bytes handed to the other side; direction, bytes
+ *   timeout		0 = connect timeout, 1 = idle timeout
+ *   free		connection freed
+ *
+ * tools/bpftrace has scripts built on them.
+ */
+
+#ifdef ODDSOCK_SDT
+
+#include <sys/sdt.h>
+
+#define PROBE_CONN(name, sconn) \
+	DTRACE_PROBE3(oddsock, name, (sconn), (sconn)->client_fd, \
+			(int)(sconn)->status)
+#define PROBE_CONN1(name, sconn, a) \
+	DTRACE_PROBE4(oddsock, name, (sconn), (sconn)->client_fd, \
+			(int)(sconn)->status, (a))
+#define PROBE_CONN2(name, sconn, a, b) \
+	DTRACE_PROBE5(oddsock, name, (sconn), (sconn)->client_fd, \
+			(int)(sconn)->status, (a), (b))
+
+#else
+
+#define PROBE_CONN(name, sconn)
+#define PROBE_CONN1(name, sconn, a)
+#define PROBE_CONN2(name, sconn, a, b)
+
+#endif
+
+#endif
@@ -0,0 +1,311 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#include <stddef.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include "util.h"
+#include "oddsock.h"
+#include "socks5.h"
+#include "stats.h"
+#include "relay.h"
+#include "probes.h"
+
+static TAILQ_HEAD(relay_queue, relay_entry) g_relay_ready =
+	TAILQ_HEAD_INITIALIZER(g_relay_ready);
+static unsigned long g_relay_nready = 0;
+static struct event *g_relay_ev = NULL;
+
+static void relay_runcb(int fd, short what, void *arg);
+
+/*
+ * relay_conn
+ */
+static struct socks5_conn *relay_conn(struct relay_entry *e)
+{
+	return (struct socks5_conn*)((char*)(e - e->dir) -
+			offsetof(struct socks5_conn, relay));
+}
+
+/*
+ * relay_transfer
+ * Move up to max bytes (0 = all) in one direction; returns the number of
+ * bytes left behind.
+ */
+static size_t relay_transfer(struct socks5_conn *sconn, int dir, size_t max)
+{
+	struct bufferevent *src = dir == RELAY_UP ? sconn->client : sconn->dst;
+	struct bufferevent *dst = dir == RELAY_UP ? sconn->dst : sconn->client;
+	struct evbuffer *input;
+	size_t len, n;
+
+	if (!src || !dst)
+		return 0;
+
+	input = bufferevent_get_input(src);
+	len = evbuffer_get_length(input);
+	n = (max == 0 || len < max) ? len : max;
+	PROBE_CONN2(relay_read, sconn, dir, (long)len);
+
+	evbuffer_remove_buffer(input, bufferevent_get_output(dst), n);
+	PROBE_CONN2(relay_write, sconn, dir, (long)n);
+	if (sconn->trace)
+		sconn->trace->bytes[dir] += n;
+	topk_add(TOPK_CLIENTS, TOPK_BYTES, sconn->topk_keys[TOPK_CLIENTS], n);
+	topk_add(TOPK_DSTS, TOPK_BYTES, sconn->topk_keys[TOPK_DSTS], n);
+	if (dir == RELAY_UP)
+		g_stats.bytes_up += n;
+	else
+		g_stats.bytes_down += n;
+
+	return len - n;
+}
+
+/*
+ * relay_schedule
+ */
+static void relay_schedule(void)
+{
+	struct timeval tv = { 0, 0 };
+
+	/* A zero timeout runs after the next poll, i.e. next iteration. */
+	if (!evtimer_pending(g_relay_ev, NULL))
+		evtimer_add(g_relay_ev, &tv);
+}
+
+/*
+ * relay_enqueue
+ */
+static void relay_enqueue(struct relay_entry *e)
+{
+	e->queued = true;
+	TAILQ_INSERT_TAIL(&g_relay_ready, e, link);
+	if (++g_relay_nready > g_stats.relay_max_ready)
+		g_stats.relay_max_ready = g_relay_nready;
+	relay_schedule();
+}
+
+/*
+ * relay_dequeue
+ */
+static void relay_dequeue(struct relay_entry *e)
+{
+	TAILQ_REMOVE(&g_relay_ready, e, link);
+	e->queued = false;
+	--g_relay_nready;
+}
+
+/*
+ * relay_init
+ */
+int relay_init(struct event_base *base)
+{
+	/* Not the bulk priority: the round serves every class of tunnel and
+	 * would otherwise wait for interactive traffic to go quiet. */
+	g_relay_ev = evtimer_new(base, relay_runcb, NULL);
+	if (!g_relay_ev ||
+		event_priority_set(g_relay_ev, SOCKS5_PRIO_INTERACTIVE) != 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * relay_attach
+ */
+void relay_attach(struct socks5_conn *sconn)
+{
+	size_t high = (size_t)g_opts.relay_quantum * RELAY_QUEUE_QUANTA;
+
+	sconn->relay[RELAY_UP].dir = RELAY_UP;
+	sconn->relay[RELAY_DOWN].dir = RELAY_DOWN;
+
+	if (g_opts.relay_quantum == 0)
+		return;
+	bufferevent_setwatermark(sconn->client, EV_READ, 0, high);
+	bufferevent_setwatermark(sconn->dst, EV_READ, 0, high);
+}
+
+/*
+ * relay_fill
+ */
+void relay_fill(struct socks5_conn *sconn, int dir)
+{
+	struct bufferevent *src = dir == RELAY_UP ? sconn->client : sconn->dst;
+	struct bufferevent *dst = dir == RELAY_UP ? sconn->dst : sconn->client;
+	struct evbuffer *input;
+	struct evbuffer_iovec vec;
+	size_t size, want, len, high;
+	ssize_t n;
+	int fd, avail;
+
+	if (g_opts.relay_read_max == 0 || !src || !dst ||
+		bufferevent_get_priority(src) != SOCKS5_PRIO_BULK ||
+		!(bufferevent_get_enabled(src) & EV_READ) ||
+		(fd = bufferevent_getfd(src)) < 0)
+		return;
+
+	/* Read exactly what is waiting, so the input never holds chains
+	 * that were sized for more than they got. EOF and errors are left
+	 * for libevent's next read. */
+	if (ioctl(fd, FIONREAD, &avail) < 0 || avail <= 0)
+		return;
+
+	/* Never read further ahead of the peer than the input watermark
+	 * would let the tunnel queue, counting what is still unsent. */
+	input = bufferevent_get_input(src);
+	len = evbuffer_get_length(input) +
+		evbuffer_get_length(bufferevent_get_output(dst));
+	high = g_opts.relay_quantum > 0 ?
+		(size_t)g_opts.relay_quantum * RELAY_QUEUE_QUANTA :
+		(size_t)g_opts.relay_read_max;
+	if (len >= high)
+		return;
+	size = (size_t)bufferevent_get_max_single_read(src);
+	want = size;
+	if ((size_t)avail < want)
+		want = (size_t)avail;
+	if (want > high - len)
+		want = high - len;
+
+	/* Socket bufferevents keep the end of their input frozen outside
+	 * their own reads. */
+	evbuffer_unfreeze(input, 0);
+	if (evbuffer_reserve_space(input, (ev_ssize_t)want, &vec, 1) < 1) {
+		evbuffer_freeze(input, 0);
+		return;
+	}
+	if (vec.iov_len > want)
+		vec.iov_len = want;
+	n = read(fd, vec.iov_base, vec.iov_len);
+	if (n > 0) {
+		vec.iov_len = (size_t)n;
+		evbuffer_commit_space(input, &vec, 1);
+		++g_stats.relay_fills;
+		g_stats.relay_fill_bytes += (unsigned long)n;
+	} else
+		evbuffer_commit_space(input, NULL, 0);
+	evbuffer_freeze(input, 0);
+
+	/* The socket backlog is the flow's signal: a read size it keeps
+	 * filling doubles, one it leaves mostly empty halves. */
+	if ((size_t)avail >= size && size < g_opts.relay_read_max) {
+		size *= 2;
+		++g_stats.relay_read_grows;
+	}
+	else if ((size_t)avail < size / 4 && size > RELAY_READ_MIN) {
+		size /= 2;
+		++g_stats.relay_read_shrinks;
+	}
+	else
+		return;
+	bufferevent_set_max_single_read(src, size);
+	bufferevent_set_max_single_write(dst, size);
+}
+
+/*
+ * relay_move
+ */
+void relay_move(struct socks5_conn *sconn, int dir)
+{
+	struct relay_entry *e = &sconn->relay[dir];
+
+	/* Already waiting for its turn. */
+	if (e->queued)
+		return;
+
+	if (relay_transfer(sconn, dir, g_opts.relay_quantum) > 0) {
+		++g_stats.relay_deferred;
+		relay_enqueue(e);
+	}
+}
+
+/*
+ * relay_flush
+ */
+void relay_flush(struct socks5_conn *sconn)
+{
+	if (sconn->relay[RELAY_UP].queued)
+		relay_transfer(sconn, RELAY_UP, 0);
+	if (sconn->relay[RELAY_DOWN].queued)
+		relay_transfer(sconn, RELAY_DOWN, 0);
+	relay_cancel(sconn);
+}
+
+/*
+ * relay_cancel
+ */
+void relay_cancel(struct socks5_conn *sconn)
+{
+	if (sconn->relay[RELAY_UP].queued)
+		relay_dequeue(&sconn->relay[RELAY_UP]);
+	if (sconn->relay[RELAY_DOWN].queued)
+		relay_dequeue(&sconn->relay[RELAY_DOWN]);
+}
+
+/*
+ * relay_runcb
+ * One round over the directions that were ready when it started. Each
+ * earns a quantum of deficit; transfers are byte granular, so a direction
+ * still queued after its turn has always used all of it and the deficit
+ * never carries over.
+ */
+static void relay_runcb(int fd, short what, void *arg)
+{
+	struct relay_entry *e;
+	struct socks5_conn *sconn;
+	unsigned long n = g_relay_nready;
+
+	++g_stats.relay_rounds;
+
+	while (n-- > 0 && (e = TAILQ_FIRST(&g_relay_ready)) != NULL) {
+		sconn = relay_conn(e);
+		TAILQ_REMOVE(&g_relay_ready, e, link);
+
+		if (relay_transfer(sconn, e->dir, g_opts.relay_quantum) == 0) {
+			e->queued = false;
+			--g_relay_nready;
+			continue;
+		}
+
+		++g_stats.relay_deferred;
+		TAILQ_INSERT_TAIL(&g_relay_ready, e, link);
+	}
+
+	if (g_relay_nready > 0)
+		relay_schedule();
+}
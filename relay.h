@@ -0,0 +1,121 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#ifndef ODDSOCK_RELAY_H
+#define ODDSOCK_RELAY_H
+
+#include <stdbool.h>
+#include <sys/queue.h>
+#include <event2/event.h>
+
+/*
+ * Relay scheduler.
+ *
+ * A read callback moves at most relay_quantum bytes of a tunnel direction
+ * right away; what is left waits on the ready queue. Once per loop
+ * iteration the queue is served by deficit round-robin: every direction
+ * on it earns another quantum and moves up to it, so no tunnel moves much
+ * more than a quantum per iteration however much it has buffered. Relay
+ * bufferevents stop reading at RELAY_QUEUE_QUANTA quanta of input,
+ * pushing back on the sender. A quantum of 0 moves everything at once.
+ *
+ * libevent 2.1 reads at most 4096 bytes from a socket per callback, so
+ * on bulk tunnels (socks5.h) relay_fill reads on from the socket itself.
+ * It takes only what the socket holds and never lets input plus unsent
+ * output pass the input watermark. The size of that read adapts per
+ * direction: it starts at libevent's default max single read of
+ * RELAY_READ_MIN, doubles while the socket holds at least a full read, up
+ * to --relayReadMax, and halves while it holds less than a quarter of one.
+ * It is kept as the source bufferevent's max single read, which libevent
+ * does not otherwise use above 4096, and the sink's max single write
+ * follows it so the data leaves in as few writes. Interactive tunnels
+ * keep libevent's reads and small buffer chunks.
+ *
+ * Socket buffers are left to the kernel: on Linux setting SO_RCVBUF or
+ * SO_SNDBUF turns off autotuning for the socket, which already sizes
+ * each one to its flow's bandwidth-delay product.
+ */
+
+#define RELAY_UP	(0) /* client to destination */
+#define RELAY_DOWN	(1) /* destination to client */
+#define RELAY_QUEUE_QUANTA	(4)
+#define RELAY_READ_MIN	(16384)
+
+struct socks5_conn;
+
+struct relay_entry {
+	TAILQ_ENTRY(relay_entry) link;
+	unsigned char dir;
+	bool queued;
+};
+
+/*
+ * relay_init
+ */
+int relay_init(struct event_base *base);
+
+/*
+ * relay_attach
+ * Set up a tunnel's relay state once it is established and whenever its
+ * bufferevents are recreated.
+ */
+void relay_attach(struct socks5_conn *sconn);
+
+/*
+ * relay_fill
+ * A read callback for one direction of a bulk tunnel fired; read more of
+ * what the socket has.
+ */
+void relay_fill(struct socks5_conn *sconn, int dir);
+
+/*
+ * relay_move
+ * A read callback for one direction of a tunnel fired.
+ */
+void relay_move(struct socks5_conn *sconn, int dir);
+
+/*
+ * relay_flush
+ * Move whatever a closing tunnel still has queued and take it off the
+ * ready queue.
+ */
+void relay_flush(struct socks5_conn *sconn);
+
+/*
+ * relay_cancel
+ * Take a tunnel off the ready queue before its bufferevents go away.
+ */
+void relay_cancel(struct socks5_conn *sconn);
+
+#endif
@@ -0,0 +1,390 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <event2/event.h>
+#include <event2/dns.h>
+#include <event2/util.h>
+#include "util.h"
+#include "oddsock.h"
+#include "resolver.h"
+
+#define RESOLVER_RESOLV_CONF	"/etc/resolv.conf"
+#define RESOLVER_HOSTS_MIN		(256) /* initial table slots */
+
+struct resolver {
+	struct event_base *base;
+	struct evdns_base *dns;
+};
+
+struct resolver_host {
+	char *name; /* NULL = free slot */
+	struct in_addr v4;
+	struct in6_addr v6;
+	bool has_v4;
+	bool has_v6;
+};
+
+static struct resolver g_resolvers[RESOLVER_MAX_BASES];
+static int g_nresolvers = 0;
+
+/* Open addressing, a power of two slots at most half full. */
+static struct resolver_host *g_hosts = NULL;
+static size_t g_hosts_size = 0;
+static size_t g_hosts_count = 0;
+static bool g_hosts_loaded = false;
+
+static struct timeval g_check_start;
+
+/*
+ * resolver_hash
+ * FNV-1a of the lower cased name.
+ */
+static unsigned long resolver_hash(const char *name)
+{
+	const unsigned char *p;
+	unsigned long h = 2166136261UL;
+
+	for (p = (const unsigned char*)name; *p; ++p)
+		h = (h ^ (unsigned long)tolower(*p)) * 16777619UL;
+
+	return h;
+}
+
+/*
+ * resolver_hosts_slot
+ * The slot holding name, or the free slot where it belongs.
+ */
+static struct resolver_host *resolver_hosts_slot(struct resolver_host *table,
+		size_t size, const char *name)
+{
+	size_t i;
+
+	for (i = resolver_hash(name) & (size - 1); table[i].name;
+			i = (i + 1) & (size - 1))
+		if (strcasecmp(table[i].name, name) == 0)
+			break;
+
+	return &table[i];
+}
+
+/*
+ * resolver_hosts_grow
+ */
+static int resolver_hosts_grow(void)
+{
+	struct resolver_host *table, *slot;
+	size_t size, i;
+
+	size = g_hosts_size ? 2 * g_hosts_size : RESOLVER_HOSTS_MIN;
+	table = (struct resolver_host*)calloc(size, sizeof(*table));
+	if (!table)
+		return -1;
+
+	for (i = 0; i < g_hosts_size; ++i) {
+		if (!g_hosts[i].name)
+			continue;
+		slot = resolver_hosts_slot(table, size, g_hosts[i].name);
+		*slot = g_hosts[i];
+	}
+	free(g_hosts);
+	g_hosts = table;
+	g_hosts_size = size;
+
+	return 0;
+}
+
+/*
+ * resolver_hosts_add
+ * The first address of each family listed for a name is used.
+ */
+static int resolver_hosts_add(const char *name, int af, const void *addr)
+{
+	struct resolver_host *h;
+	size_t len;
+
+	if ((g_hosts_count + 1) * 2 > g_hosts_size && resolver_hosts_grow() != 0)
+		return -1;
+
+	h = resolver_hosts_slot(g_hosts, g_hosts_size, name);
+	if (!h->name) {
+		len = strlen(name) + 1;
+		h->name = (char*)malloc(len);
+		if (!h->name)
+			return -1;
+		memcpy(h->name, name, len);
+		++g_hosts_count;
+	}
+
+	if (af == AF_INET && !h->has_v4) {
+		memcpy(&h->v4, addr, sizeof(h->v4));
+		h->has_v4 = true;
+	} else if (af == AF_INET6 && !h->has_v6) {
+		memcpy(&h->v6, addr, sizeof(h->v6));
+		h->has_v6 = true;
+	}
+
+	return 0;
+}
+
+/*
+ * resolver_hosts_load
+ */
+static int resolver_hosts_load(const char *path)
+{
+	FILE *f;
+	char line[1024];
+	char *tok, *hash;
+	unsigned char addr[sizeof(struct in6_addr)];
+	int af;
+
+	f = fopen(path, "r");
+	if (!f) {
+		oddsock_log(1, errno, "resolver: no hosts file %s", path);
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		hash = strchr(line, '#');
+		if (hash)
+			*hash = '\0';
+		tok = strtok(line, " \t\r\n");
+		if (!tok)
+			continue;
+		if (evutil_inet_pton(AF_INET, tok, addr) == 1)
+			af = AF_INET;
+		else if (evutil_inet_pton(AF_INET6, tok, addr) == 1)
+			af = AF_INET6;
+		else
+			continue;
+		while ((tok = strtok(NULL, " \t\r\n")) != NULL) {
+			if (resolver_hosts_add(tok, af, addr) != 0) {
+				fclose(f);
+				return -1;
+			}
+		}
+	}
+	fclose(f);
+
+	return 0;
+}
+
+/*
+ * resolver_hosts_lookup
+ */
+int resolver_hosts_lookup(const char *name, unsigned short port,
+		struct sockaddr_storage *ss, socklen_t *sslen)
+{
+	struct resolver_host *h;
+
+	if (g_hosts_count == 0)
+		return -1;
+
+	h = resolver_hosts_slot(g_hosts, g_hosts_size, name);
+	if (!h->name)
+		return -1;
+
+	memset(ss, 0, sizeof(*ss));
+	if (h->has_v4) {
+		struct sockaddr_in *sin = (struct sockaddr_in*)ss;
+		sin->sin_family = AF_INET;
+		sin->sin_addr = h->v4;
+		sin->sin_port = htons(port);
+		*sslen = sizeof(*sin);
+	} else {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)ss;
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_addr = h->v6;
+		sin6->sin6_port = htons(port);
+		*sslen = sizeof(*sin6);
+	}
+
+	return 0;
+}
+
+/*
+ * resolver_checkcb
+ */
+static void resolver_checkcb(int result, struct evutil_addrinfo *res,
+		void *arg)
+{
+	struct timeval now, d;
+	char addr[INET6_ADDRSTRLEN];
+
+	evutil_gettimeofday(&now, NULL);
+	evutil_timersub(&now, &g_check_start, &d);
+
+	if (result != 0) {
+		oddsock_logx(0, "resolver self-check: %s failed: %s",
+				g_opts.dns_check, evutil_gai_strerror(result));
+		return;
+	}
+
+	sockaddr_to_presentation(res->ai_addr, addr, sizeof(addr), NULL);
+	oddsock_logx(1, "resolver self-check: %s is %s (%ld us)",
+			g_opts.dns_check, addr,
+			(long)d.tv_sec * 1000000L + (long)d.tv_usec);
+	evutil_freeaddrinfo(res);
+}
+
+/*
+ * resolver_init
+ */
+int resolver_init(struct event_base *base)
+{
+	struct evdns_base *dns;
+	struct evutil_addrinfo hints;
+	char *servers, *tok;
+	char val[16];
+	int e, flags = DNS_OPTIONS_ALL;
+
+	if (g_nresolvers == RESOLVER_MAX_BASES) {
+		oddsock_logx(0, "resolver: too many event loops");
+		return -1;
+	}
+
+	dns = evdns_base_new(base, 0);
+	if (!dns) {
+		oddsock_logx(0, "resolver: failed creating evdns_base");
+		return -1;
+	}
+	g_resolvers[g_nresolvers].base = base;
+	g_resolvers[g_nresolvers].dns = dns;
+	++g_nresolvers;
+
+	/* Without --dnsServers resolv.conf names them; with it only its
+	 * options and search list are used. */
+	if (g_opts.dns_servers)
+		flags &= ~DNS_OPTION_NAMESERVERS;
+	e = evdns_base_resolv_conf_parse(dns, flags, RESOLVER_RESOLV_CONF);
+	if (e != 0)
+		oddsock_logx(0, "resolver: reading %s failed (%d)%s",
+				RESOLVER_RESOLV_CONF, e, g_opts.dns_servers ? "" :
+				", using 127.0.0.1");
+
+	if (g_opts.dns_servers) {
+		servers = (char*)malloc(strlen(g_opts.dns_servers) + 1);
+		if (!servers)
+			return -1;
+		strcpy(servers, g_opts.dns_servers);
+		for (tok = strtok(servers, ","); tok; tok = strtok(NULL, ",")) {
+			if (evdns_base_nameserver_ip_add(dns, tok) != 0) {
+				oddsock_logx(0, "resolver: bad nameserver %s", tok);
+				free(servers);
+				return -1;
+			}
+		}
+		free(servers);
+	}
+
+	if (g_opts.dns_timeout > 0) {
+		evutil_snprintf(val, sizeof(val), "%u", g_opts.dns_timeout);
+		evdns_base_set_option(dns, "timeout:", val);
+	}
+	if (g_opts.dns_attempts > 0) {
+		evutil_snprintf(val, sizeof(val), "%u", g_opts.dns_attempts);
+		evdns_base_set_option(dns, "attempts:", val);
+	}
+
+	if (!g_hosts_loaded) {
+		if (resolver_hosts_load(RESOLVER_HOSTS) != 0) {
+			oddsock_logx(0, "resolver: failed loading %s", RESOLVER_HOSTS);
+			return -1;
+		}
+		g_hosts_loaded = true;
+	}
+
+	/* Self-check. */
+	if (evdns_base_count_nameservers(dns) == 0)
+		oddsock_logx(0, "resolver: no nameservers, "
+				"only hosts file names will resolve");
+	oddsock_logx(1, "resolver: %d nameservers, %lu hosts file names",
+			evdns_base_count_nameservers(dns),
+			(unsigned long)g_hosts_count);
+
+	if (g_opts.dns_check) {
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		evutil_gettimeofday(&g_check_start, NULL);
+		evdns_getaddrinfo(dns, g_opts.dns_check, NULL, &hints,
+				resolver_checkcb, NULL);
+	}
+
+	return 0;
+}
+
+/*
+ * resolver_free
+ */
+void resolver_free(void)
+{
+	size_t i;
+
+	while (g_nresolvers > 0) {
+		--g_nresolvers;
+		evdns_base_free(g_resolvers[g_nresolvers].dns, 0);
+		g_resolvers[g_nresolvers].dns = NULL;
+		g_resolvers[g_nresolvers].base = NULL;
+	}
+
+	for (i = 0; i < g_hosts_size; ++i)
+		free(g_hosts[i].name);
+	free(g_hosts);
+	g_hosts = NULL;
+	g_hosts_size = 0;
+	g_hosts_count = 0;
+	g_hosts_loaded = false;
+}
+
+/*
+ * resolver_get
+ */
+struct evdns_base *resolver_get(struct event_base *base)
+{
+	int i;
+
+	for (i = 0; i < g_nresolvers; ++i)
+		if (g_resolvers[i].base == base)
+			return g_resolvers[i].dns;
+
+	oddsock_logx(0, "resolver: no resolver for this event loop");
+	return NULL;
+}
@@ -0,0 +1,86 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#ifndef ODDSOCK_RESOLVER_H
+#define ODDSOCK_RESOLVER_H
+
+#include <sys/socket.h>
+#include <event2/event.h>
+#include <event2/dns.h>
+
+/*
+ * Resolver.
+ *
+ * Each event loop gets its own evdns_base, made at startup by
+ * resolver_init rather than by the first request that needs one. It reads
+ * resolv.conf, or only its options when --dnsServers lists the
+ * nameservers, and applies --dnsTimeout and --dnsAttempts. /etc/hosts is
+ * loaded once into a hash table so requests for names in it connect
+ * without going through evdns at all.
+ *
+ * resolver_init checks what it set up: resolv.conf errors and a missing
+ * nameserver are logged at startup, and with --dnsCheck <name> the name
+ * is resolved once and the outcome and time logged.
+ */
+
+#define RESOLVER_MAX_BASES	(4)
+#define RESOLVER_HOSTS		"/etc/hosts"
+
+/*
+ * resolver_init
+ * Set up the resolver of an event loop. returns -1 on error.
+ */
+int resolver_init(struct event_base *base);
+
+/*
+ * resolver_free
+ * Free every loop's resolver and the hosts table.
+ */
+void resolver_free(void);
+
+/*
+ * resolver_get
+ * The resolver of an event loop; NULL before resolver_init.
+ */
+struct evdns_base *resolver_get(struct event_base *base);
+
+/*
+ * resolver_hosts_lookup
+ * Look name up in the hosts table, IPv4 first, and fill in ss with the
+ * address and port. returns -1 if it is not there.
+ */
+int resolver_hosts_lookup(const char *name, unsigned short port,
+		struct sockaddr_storage *ss, socklen_t *sslen);
+
+#endif
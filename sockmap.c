@@ -0,0 +1,550 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/util.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/sockios.h>
+#include <linux/tcp.h>
+#endif
+#include "util.h"
+#include "socks5.h"
+#include "stats.h"
+#include "topk.h"
+#include "trace.h"
+#include "relay.h"
+#include "sockmap.h"
+
+#define SOCKMAP_CLIENT	(0)
+#define SOCKMAP_DST		(1)
+#define SOCKMAP_DRAIN_MS	(1)
+#define SOCKMAP_DRAIN_MAX	(5000)	/* polls before the client is closed */
+
+#ifdef __linux__
+#ifndef SO_COOKIE
+#define SO_COOKIE (57)
+#endif
+/* glibc only declares it without -ansi. */
+long syscall(long number, ...);
+#endif
+
+struct sockmap_flow {
+	struct socks5_conn *sconn;	/* NULL for a free entry */
+	uint64_t rx[2];		/* bytes each leg had consumed when last counted */
+	uint64_t queued;	/* client send queue total to wait for */
+	struct event *drain_ev;
+	unsigned int drain_polls;
+};
+
+static struct event_base *g_sockmap_base = NULL;
+static int g_sockmap_socks = -1;	/* sockets running the program */
+static int g_sockmap_peers = -1;	/* socket cookie to peer */
+static int g_sockmap_prog = -1;
+static struct sockmap_flow *g_sockmap_flows = NULL;	/* by client fd */
+static int g_sockmap_nflows = 0;
+static unsigned int g_sockmap_used = 0;
+
+#ifdef __linux__
+/*
+ * sockmap_bpf
+ */
+static int sockmap_bpf(int cmd, union bpf_attr *attr)
+{
+	return (int)syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/*
+ * sockmap_map_create
+ */
+static int sockmap_map_create(void)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_SOCKHASH;
+	attr.key_size = sizeof(uint64_t);
+	attr.value_size = sizeof(uint32_t);
+	attr.max_entries = 2 * SOCKMAP_MAX;
+	return sockmap_bpf(BPF_MAP_CREATE, &attr);
+}
+
+/*
+ * sockmap_map_update
+ * Map a socket cookie to the socket fd.
+ */
+static int sockmap_map_update(int map, uint64_t key, int fd)
+{
+	union bpf_attr attr;
+	uint32_t value = (uint32_t)fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = (uint32_t)map;
+	attr.key = (uint64_t)(uintptr_t)&key;
+	attr.value = (uint64_t)(uintptr_t)&value;
+	attr.flags = BPF_NOEXIST;
+	return sockmap_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+/*
+ * sockmap_map_delete
+ */
+static void sockmap_map_delete(int map, uint64_t key)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = (uint32_t)map;
+	attr.key = (uint64_t)(uintptr_t)&key;
+	sockmap_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+/*
+ * sockmap_prog_load
+ * The verdict program: redirect the data to the socket that the peers map
+ * has for the receiving socket's cookie, or leave it to the receiver if
+ * there is none.
+ *
+ *	r6 = r1
+ *	r0 = bpf_get_socket_cookie(r1)
+ *	*(u64 *)(r10 - 8) = r0
+ *	r0 = bpf_sk_redirect_hash(r6, peers, r10 - 8, 0)
+ *	if r0 != SK_DROP goto out
+ *	r0 = SK_PASS
+ * out:
+ *	exit
+ */
+static int sockmap_prog_load(int peers)
+{
+	struct bpf_insn insns[] = {
+		{ BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0 },
+		{ BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_socket_cookie },
+		{ BPF_STX | BPF_MEM | BPF_DW, 10, 0, -8, 0 },
+		{ BPF_ALU64 | BPF_MOV | BPF_X, 1, 6, 0, 0 },
+		{ BPF_LD | BPF_IMM | BPF_DW, 2, BPF_PSEUDO_MAP_FD, 0, 0 },
+		{ 0, 0, 0, 0, 0 },
+		{ BPF_ALU64 | BPF_MOV | BPF_X, 3, 10, 0, 0 },
+		{ BPF_ALU64 | BPF_ADD | BPF_K, 3, 0, 0, -8 },
+		{ BPF_ALU64 | BPF_MOV | BPF_K, 4, 0, 0, 0 },
+		{ BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_hash },
+		{ BPF_JMP | BPF_JNE | BPF_K, 0, 0, 1, SK_DROP },
+		{ BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, SK_PASS },
+		{ BPF_JMP | BPF_EXIT, 0, 0, 0, 0 }
+	};
+	static char license[] = "Dual BSD/GPL";
+	union bpf_attr attr;
+
+	insns[4].imm = peers;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+	attr.insn_cnt = sizeof(insns) / sizeof(insns[0]);
+	attr.insns = (uint64_t)(uintptr_t)insns;
+	attr.license = (uint64_t)(uintptr_t)license;
+	return sockmap_bpf(BPF_PROG_LOAD, &attr);
+}
+
+/*
+ * sockmap_prog_attach
+ */
+static int sockmap_prog_attach(int prog, int map)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.target_fd = (uint32_t)map;
+	attr.attach_bpf_fd = (uint32_t)prog;
+	attr.attach_type = BPF_SK_SKB_VERDICT;
+	return sockmap_bpf(BPF_PROG_ATTACH, &attr);
+}
+
+/*
+ * sockmap_counts
+ * Bytes taken off a socket's receive queue (received less still queued),
+ * and bytes ever put in its send queue (acknowledged plus still queued).
+ */
+static int sockmap_counts(int fd, uint64_t *received, uint64_t *queued)
+{
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+	int inq, outq;
+	char c;
+
+	memset(&ti, 0, sizeof(ti));
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, (void*)&ti, &len) < 0)
+		return -1;
+	/* Read after the totals, so both can only fall short. */
+	if (ioctl(fd, SIOCINQ, &inq) < 0 || ioctl(fd, SIOCOUTQ, &outq) < 0)
+		return -1;
+	*received = ti.tcpi_bytes_received > (uint64_t)inq ?
+		ti.tcpi_bytes_received - (uint64_t)inq : 0;
+	/* A FIN is counted as if it were a byte. */
+	if (*received > 0 && recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0)
+		--*received;
+	*queued = ti.tcpi_bytes_acked + (uint64_t)outq;
+	return 0;
+}
+
+/*
+ * sockmap_cookie
+ */
+static int sockmap_cookie(int fd, uint64_t *cookie)
+{
+	socklen_t len = sizeof(*cookie);
+
+	return getsockopt(fd, SOL_SOCKET, SO_COOKIE, (void*)cookie, &len);
+}
+#endif
+
+/*
+ * sockmap_flow_of
+ * The flow entry of a tunnel forwarded in the kernel, or NULL.
+ */
+static struct sockmap_flow *sockmap_flow_of(struct socks5_conn *sconn)
+{
+	if (g_sockmap_used == 0 || sconn->client_fd < 0 ||
+		sconn->client_fd >= g_sockmap_nflows ||
+		g_sockmap_flows[sconn->client_fd].sconn != sconn)
+		return NULL;
+	return &g_sockmap_flows[sconn->client_fd];
+}
+
+/*
+ * sockmap_account
+ * Count what one leg received in the kernel since it was last counted.
+ */
+static void sockmap_account(struct sockmap_flow *f, int leg, int fd)
+{
+#ifdef __linux__
+	struct socks5_conn *sconn = f->sconn;
+	uint64_t received, queued;
+	unsigned long n;
+	int dir = leg == SOCKMAP_CLIENT ? RELAY_UP : RELAY_DOWN;
+
+	if (sockmap_counts(fd, &received, &queued) != 0 ||
+		received <= f->rx[leg])
+		return;
+	n = (unsigned long)(received - f->rx[leg]);
+	f->rx[leg] = received;
+
+	g_stats.sockmap_bytes += n;
+	if (dir == RELAY_UP)
+		g_stats.bytes_up += n;
+	else
+		g_stats.bytes_down += n;
+	if (sconn->trace)
+		sconn->trace->bytes[dir] += n;
+	topk_add(TOPK_CLIENTS, TOPK_BYTES, sconn->topk_keys[TOPK_CLIENTS], n);
+	topk_add(TOPK_DSTS, TOPK_BYTES, sconn->topk_keys[TOPK_DSTS], n);
+#else
+	(void)f;
+	(void)leg;
+	(void)fd;
+#endif
+}
+
+/*
+ * sockmap_init
+ */
+int sockmap_init(struct event_base *base, bool enabled)
+{
+	g_sockmap_base = base;
+	if (!enabled)
+		return 0;
+#ifdef __linux__
+	g_sockmap_socks = sockmap_map_create();
+	g_sockmap_peers = sockmap_map_create();
+	if (g_sockmap_socks < 0 || g_sockmap_peers < 0) {
+		oddsock_log(0, errno, "sockmap: cannot create maps, "
+				"relaying in userspace");
+		sockmap_free();
+		return 0;
+	}
+	g_sockmap_prog = sockmap_prog_load(g_sockmap_peers);
+	if (g_sockmap_prog < 0 ||
+		sockmap_prog_attach(g_sockmap_prog, g_sockmap_socks) != 0) {
+		oddsock_log(0, errno, "sockmap: cannot load verdict program, "
+				"relaying in userspace");
+		sockmap_free();
+		return 0;
+	}
+	oddsock_logx(1, "sockmap: forwarding established tunnels in the kernel");
+#else
+	oddsock_logx(0, "sockmap is only supported on Linux");
+#endif
+	return 0;
+}
+
+/*
+ * sockmap_free
+ */
+void sockmap_free(void)
+{
+	int i;
+
+	for (i = 0; i < g_sockmap_nflows; ++i)
+		if (g_sockmap_flows[i].drain_ev)
+			event_free(g_sockmap_flows[i].drain_ev);
+	free(g_sockmap_flows);
+	g_sockmap_flows = NULL;
+	g_sockmap_nflows = 0;
+	g_sockmap_used = 0;
+
+	/* Sockets still in the maps leave them when they are closed. */
+	if (g_sockmap_prog >= 0)
+		close(g_sockmap_prog);
+	if (g_sockmap_socks >= 0)
+		close(g_sockmap_socks);
+	if (g_sockmap_peers >= 0)
+		close(g_sockmap_peers);
+	g_sockmap_prog = -1;
+	g_sockmap_socks = -1;
+	g_sockmap_peers = -1;
+}
+
+/*
+ * sockmap_attach
+ */
+int sockmap_attach(struct socks5_conn *sconn)
+{
+#ifdef __linux__
+	struct sockmap_flow *f;
+	struct evbuffer *out;
+	struct sockaddr_storage ss;
+	socklen_t sslen = sizeof(ss);
+	uint64_t cookie[2], queued;
+	int fd[2], one = 1, n;
+
+	if (g_sockmap_prog < 0 || sconn->muxed || sconn->transparent ||
+		!sconn->client || !sconn->dst)
+		return -1;
+	fd[SOCKMAP_CLIENT] = bufferevent_getfd(sconn->client);
+	fd[SOCKMAP_DST] = bufferevent_getfd(sconn->dst);
+	if (fd[SOCKMAP_CLIENT] != sconn->client_fd ||
+		getsockname(fd[SOCKMAP_CLIENT], (struct sockaddr*)&ss, &sslen) < 0 ||
+		(ss.ss_family != AF_INET && ss.ss_family != AF_INET6))
+		return -1;
+
+	if (g_sockmap_used == SOCKMAP_MAX) {
+		++g_stats.sockmap_failed;
+		return -1;
+	}
+
+	/* The reply must be on the wire before any destination data is
+	 * redirected behind it, and nothing may be left for userspace. */
+	out = bufferevent_get_output(sconn->client);
+	if (evbuffer_get_length(out) > 0) {
+		/* Outside its own writes the bufferevent keeps the start of
+		 * its output frozen. */
+		evbuffer_unfreeze(out, 1);
+		evbuffer_write(out, fd[SOCKMAP_CLIENT]);
+		evbuffer_freeze(out, 1);
+	}
+	if (evbuffer_get_length(out) > 0 ||
+		evbuffer_get_length(bufferevent_get_input(sconn->client)) > 0 ||
+		evbuffer_get_length(bufferevent_get_input(sconn->dst)) > 0 ||
+		evbuffer_get_length(bufferevent_get_output(sconn->dst)) > 0) {
+		++g_stats.sockmap_failed;
+		return -1;
+	}
+
+	if (fd[SOCKMAP_CLIENT] >= g_sockmap_nflows) {
+		struct sockmap_flow *flows;
+		n = g_sockmap_nflows ? g_sockmap_nflows : 64;
+		while (n <= fd[SOCKMAP_CLIENT])
+			n *= 2;
+		flows = (struct sockmap_flow*)realloc(g_sockmap_flows,
+				n * sizeof(*flows));
+		if (!flows) {
+			++g_stats.sockmap_failed;
+			return -1;
+		}
+		memset(flows + g_sockmap_nflows, 0,
+				(n - g_sockmap_nflows) * sizeof(*flows));
+		g_sockmap_flows = flows;
+		g_sockmap_nflows = n;
+	}
+	f = &g_sockmap_flows[fd[SOCKMAP_CLIENT]];
+	memset(f, 0, sizeof(*f));
+
+	if (sockmap_cookie(fd[SOCKMAP_CLIENT], &cookie[SOCKMAP_CLIENT]) != 0 ||
+		sockmap_cookie(fd[SOCKMAP_DST], &cookie[SOCKMAP_DST]) != 0 ||
+		sockmap_counts(fd[SOCKMAP_CLIENT], &f->rx[SOCKMAP_CLIENT],
+			&f->queued) != 0 ||
+		sockmap_counts(fd[SOCKMAP_DST], &f->rx[SOCKMAP_DST], &queued) != 0) {
+		++g_stats.sockmap_failed;
+		return -1;
+	}
+
+	/* Peers first: nothing is redirected until a socket joins the
+	 * program's map, and by then its peer is there to receive. */
+	if (sockmap_map_update(g_sockmap_peers, cookie[SOCKMAP_CLIENT],
+				fd[SOCKMAP_DST]) != 0)
+		goto fail;
+	if (sockmap_map_update(g_sockmap_peers, cookie[SOCKMAP_DST],
+				fd[SOCKMAP_CLIENT]) != 0) {
+		sockmap_map_delete(g_sockmap_peers, cookie[SOCKMAP_CLIENT]);
+		goto fail;
+	}
+	if (sockmap_map_update(g_sockmap_socks, cookie[SOCKMAP_DST],
+				fd[SOCKMAP_DST]) != 0) {
+		sockmap_map_delete(g_sockmap_peers, cookie[SOCKMAP_CLIENT]);
+		sockmap_map_delete(g_sockmap_peers, cookie[SOCKMAP_DST]);
+		goto fail;
+	}
+	/* The destination may already be redirecting, so there is no going
+	 * back; the client's data just keeps coming through userspace. */
+	if (sockmap_map_update(g_sockmap_socks, cookie[SOCKMAP_CLIENT],
+				fd[SOCKMAP_CLIENT]) != 0) {
+		oddsock_log(1, errno, "(%d) sockmap: client stays in userspace",
+				socks5_conn_id(sconn));
+		++g_stats.sockmap_failed;
+	}
+
+	/* Data that arrived before a socket joined is still queued; setting
+	 * the low watermark runs it through the program, in order. */
+	setsockopt(fd[SOCKMAP_CLIENT], SOL_SOCKET, SO_RCVLOWAT,
+			(const void*)&one, (socklen_t)sizeof(one));
+	setsockopt(fd[SOCKMAP_DST], SOL_SOCKET, SO_RCVLOWAT,
+			(const void*)&one, (socklen_t)sizeof(one));
+
+	f->sconn = sconn;
+	++g_sockmap_used;
+	++g_stats.sockmap_tunnels;
+	oddsock_logx(1, "(%d) forwarding in the kernel", socks5_conn_id(sconn));
+	return 0;
+
+fail:
+	oddsock_log(1, errno, "(%d) sockmap: relaying in userspace",
+			socks5_conn_id(sconn));
+	++g_stats.sockmap_failed;
+	return -1;
+#else
+	(void)sconn;
+	return -1;
+#endif
+}
+
+/*
+ * sockmap_draincb
+ */
+static void sockmap_draincb(int fd, short what, void *arg)
+{
+	struct socks5_conn *sconn = (struct socks5_conn*)arg;
+	struct sockmap_flow *f = sockmap_flow_of(sconn);
+	struct timeval tv;
+	uint64_t received, queued = 0;
+
+	if (!f)
+		return;
+#ifdef __linux__
+	if (sockmap_counts(sconn->client_fd, &received, &queued) != 0)
+		queued = f->queued;
+#endif
+	if (queued < f->queued && ++f->drain_polls < SOCKMAP_DRAIN_MAX) {
+		tv.tv_sec = 0;
+		tv.tv_usec = SOCKMAP_DRAIN_MS * 1000;
+		evtimer_add(f->drain_ev, &tv);
+		return;
+	}
+	socks5_conn_free(sconn);
+}
+
+/*
+ * sockmap_close
+ */
+int sockmap_close(struct socks5_conn *sconn)
+{
+	struct sockmap_flow *f = sockmap_flow_of(sconn);
+	uint64_t base;
+
+	if (!f)
+		return -1;
+
+	/* Everything the destination received since it joined has to show
+	 * up in the client's send queue. */
+	base = f->rx[SOCKMAP_DST];
+	if (sconn->dst) {
+		sockmap_account(f, SOCKMAP_DST, bufferevent_getfd(sconn->dst));
+		socks5_bev_free(sconn->dst);
+		sconn->dst = NULL;
+	}
+	f->queued += f->rx[SOCKMAP_DST] - base;
+
+	/* Further client data has nowhere to go. */
+	sconn->status = SCONN_CLOSING;
+	bufferevent_disable(sconn->client, EV_READ);
+
+	f->drain_ev = evtimer_new(g_sockmap_base, sockmap_draincb, (void*)sconn);
+	if (!f->drain_ev) {
+		socks5_conn_free(sconn);
+		return 0;
+	}
+	sockmap_draincb(-1, EV_TIMEOUT, (void*)sconn);
+	return 0;
+}
+
+/*
+ * sockmap_forget
+ */
+void sockmap_forget(struct socks5_conn *sconn)
+{
+	struct sockmap_flow *f = sockmap_flow_of(sconn);
+
+	if (!f)
+		return;
+
+	if (sconn->client)
+		sockmap_account(f, SOCKMAP_CLIENT, bufferevent_getfd(sconn->client));
+	if (sconn->dst)
+		sockmap_account(f, SOCKMAP_DST, bufferevent_getfd(sconn->dst));
+	if (f->drain_ev)
+		event_free(f->drain_ev);
+	memset(f, 0, sizeof(*f));
+	--g_sockmap_used;
+}
@@ -0,0 +1,106 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#ifndef ODDSOCK_SOCKMAP_H
+#define ODDSOCK_SOCKMAP_H
+
+#include <stdbool.h>
+#include <event2/event.h>
+
+/*
+ * In-kernel forwarding of established tunnels (Linux, BPF sockmap).
+ *
+ * With --sockmap a CONNECT tunnel whose reply has been sent and which has
+ * nothing buffered in either direction is handed to the kernel: both
+ * sockets go into a BPF_MAP_TYPE_SOCKHASH that carries an sk_skb verdict
+ * program, and every byte either socket receives is redirected to the
+ * other's send queue without waking the process. A second sockhash maps
+ * each socket's cookie to its peer; the program looks up the receiving
+ * socket there. Entries are added peers first, so when the program is
+ * attached to a socket its redirect target already exists, and data that
+ * arrived before is picked up in order by nudging SO_RCVLOWAT.
+ *
+ * Userspace keeps its bufferevents only to see the sockets close. The
+ * bytes each side received in the kernel are counted from TCP_INFO when
+ * the tunnel is freed. A destination that closes first gets its data
+ * delivered before the client is closed: the client's send queue is
+ * polled until everything the destination sent has reached it.
+ *
+ * Redirected data is sent from a kernel worker rather than in the
+ * receiving softirq, so the CPU moves out of oddsock but does not all go
+ * away; on a single CPU the userspace relay can be faster overall.
+ *
+ * Mux, transparent, upstream and unix socket tunnels stay in userspace,
+ * as does everything when the program cannot be loaded (older kernels,
+ * no CAP_BPF); that is logged once at startup.
+ */
+
+#define SOCKMAP_MAX		(16384)	/* tunnels forwarded at once */
+
+struct socks5_conn;
+
+/*
+ * sockmap_init
+ * Create the maps and load the verdict program if enabled. Failing to do
+ * so leaves forwarding in userspace and is not an error.
+ */
+int sockmap_init(struct event_base *base, bool enabled);
+
+/*
+ * sockmap_free
+ */
+void sockmap_free(void);
+
+/*
+ * sockmap_attach
+ * Hand a just established tunnel to the kernel.
+ * returns 0 if it is forwarded there from now on.
+ */
+int sockmap_attach(struct socks5_conn *sconn);
+
+/*
+ * sockmap_close
+ * The destination of a tunnel closed. For a tunnel forwarded in the
+ * kernel wait for its data to reach the client, then free it.
+ * returns -1 if the tunnel is not forwarded in the kernel.
+ */
+int sockmap_close(struct socks5_conn *sconn);
+
+/*
+ * sockmap_forget
+ * Account the bytes of a tunnel that is being freed.
+ */
+void sockmap_forget(struct socks5_conn *sconn);
+
+#endif
@@ -33,8 +33,11 @@
  ******************************************************************************/
 
 #include <stdbool.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <event2/event.h>
@@ -44,28 +47,97 @@
 #include "util.h"
 #include "oddsock.h"
 #include "socks5.h"
+#include "socks5_parse.h"
+#include "http_parse.h"
+#include "health.h"
+#include "stats.h"
+#include "mux.h"
+#include "probes.h"
+#include "busypoll.h"
+#include "resolver.h"
+#include "lag.h"
+#include "tcpinfo.h"
+#include "upstream.h"
+#include "conntab.h"
+#include "sockmap.h"
 
 #define LISTEN_BACKLOG (128)
 
-struct evdns_base *g_dns_base = NULL;
-
-int socks5_conn_id(struct socks5_conn *sconn);
-void socks5_conn_free(struct socks5_conn *sconn);
-
-int socks5_process_greeting(struct socks5_conn *sconn);
+/* Unix listener clients allowed by --unixUids; -1 allows every uid. */
+static uid_t g_unix_uids[SOCKS5_UNIX_UIDS_MAX];
+static int g_unix_nuids = -1;
+
+void socks5_conn_close(struct socks5_conn *sconn);
+void socks5_client_flushedcb(struct bufferevent *bev, void *arg);
+struct socks5_conn *socks5_conn_accept(int listener, struct event_base *base);
+struct socks5_conn *socks5_conn_new(struct event_base *base, int fd);
+int socks5_mux_request(struct socks5_conn *sconn,
+		const unsigned char *data, int n);
+int socks5_upstream_request(struct socks5_conn *sconn,
+		const unsigned char *data, int n);
+void socks5_upstream_cb(struct bufferevent *bev, void *arg);
+int socks5_forward_attach(struct socks5_conn *sconn);
+int socks5_connect_addr(struct socks5_conn *sconn,
+		const struct sockaddr *sa, socklen_t salen);
+unsigned long socks5_topk_key(const struct sockaddr *sa, bool with_port);
+void socks5_topk_dst(struct socks5_conn *sconn, unsigned long key);
+int socks5_transparent_established(struct socks5_conn *sconn);
+bool socks5_transparent_loop(int listener, const struct sockaddr *dst);
+void socks5_conn_touch(struct socks5_conn *sconn);
+
+int socks5_client_write(struct socks5_conn *sconn,
+		const unsigned char *data, size_t len);
+int socks5_client_process(struct socks5_conn *sconn,
+		const unsigned char *data, size_t len);
+int socks5_process_greeting(struct socks5_conn *sconn,
+		const unsigned char *data, size_t len);
 void socks5_choose_auth_method(struct socks5_conn *sconn,
-		unsigned char *methods, unsigned char nmethods);
-int socks5_process_request(struct socks5_conn *sconn);
+		const unsigned char *methods, unsigned char nmethods);
+int socks5_process_request(struct socks5_conn *sconn,
+		const unsigned char *data, size_t len);
+int socks5_process_http(struct socks5_conn *sconn,
+		const unsigned char *data, size_t len);
+int socks5_request_begin(struct socks5_conn *sconn,
+		const struct socks5_request *request);
+int socks5_request_connect(struct socks5_conn *sconn,
+		const struct socks5_request *request);
+socklen_t socks5_request_sockaddr(const struct socks5_request *request,
+		struct sockaddr_storage *ss);
+int socks5_dst_new(struct socks5_conn *sconn);
+int socks5_request_reply(struct socks5_conn *sconn, unsigned char rep);
+int socks5_http_reply(struct socks5_conn *sconn, const char *status);
+int socks5_bound_reply(struct socks5_conn *sconn);
+int socks5_resolve(struct socks5_conn *sconn, const char *host,
+		unsigned short port);
 int socks5_connect_reply(struct socks5_conn *sconn);
+int socks5_relay_attach(struct socks5_conn *sconn, struct bufferevent **bev,
+		int fd, bufferevent_data_cb readcb, bufferevent_event_cb eventcb);
+static int socks5_client_attach(struct socks5_conn *sconn);
+void socks5_conn_set_priority(struct socks5_conn *sconn, int priority);
+void socks5_relay_classify(struct socks5_conn *sconn,
+		struct bufferevent *bev);
+void socks5_relay_set_idle(struct socks5_conn *sconn);
+void socks5_relay_idle_timeout(struct socks5_conn *sconn,
+		struct bufferevent *bev);
+int socks5_conn_park(struct socks5_conn *sconn);
+void socks5_parked_cb(int fd, short what, void *arg);
+void socks5_client_lf_cb(int fd, short what, void *arg);
 void socks5_client_readcb(struct bufferevent *bev, void *arg);
 void socks5_client_eventcb(struct bufferevent *bev, short what, void *arg);
 void socks5_dst_readcb(struct bufferevent *bev, void *arg);
 void socks5_dst_eventcb(struct bufferevent *bev, short what, void *arg);
+void socks5_connect_failed(struct socks5_conn *sconn, short what,
+		int dns_err);
+void socks5_dns_cb(int result, struct evutil_addrinfo *res, void *arg);
+void socks5_connect_timeoutcb(int fd, short what, void *arg);
+void socks5_unix_peer(struct socks5_conn *sconn, char *addr,
+		size_t addrlen);
 
 /*
  * socks5_create_listener_socket
  */
-int socks5_create_listener_socket(int af)
+int socks5_create_listener_socket(int af, const char *port,
+		bool transparent)
 {
 	int e = 0;
 	int s = -1; /* The listen socket. */
@@ -80,8 +152,7 @@ int socks5_create_listener_socket(int af)
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_flags = AI_PASSIVE;
 
-	e = getaddrinfo(g_opts.listen_address, g_opts.listen_port,
-			&hints, &res0);
+	e = getaddrinfo(g_opts.listen_address, port, &hints, &res0);
 	if (e != 0) {
 		oddsock_error(EXIT_FAILURE, 0, "create_listener_socket getaddrinfo %s",
 				gai_strerror(e));
@@ -108,6 +179,13 @@ int socks5_create_listener_socket(int af)
 			s = -1;
 			continue;
 		}
+		/* TPROXY listeners accept connections for foreign addresses. */
+		if (transparent && g_opts.tproxy &&
+			make_socket_transparent(s, res->ai_family) < 0) {
+			cause = "listen socket could not be made transparent";
+			s = -1;
+			continue;
+		}
 
 		/* Try to bind the socket. */
 		e = bind(s, res->ai_addr, res->ai_addrlen);
@@ -119,7 +197,8 @@ int socks5_create_listener_socket(int af)
 
 		sockaddr_to_presentation(res->ai_addr, listen_address,
 				sizeof(listen_address), &listen_port);
-		oddsock_logx(1, "listening socket bound to address %s port %u",
+		oddsock_logx(1, "%slistening socket bound to address %s port %u",
+				transparent ? "transparent " : "",
 				listen_address, listen_port);
 
 		break;
@@ -137,33 +216,119 @@ int socks5_create_listener_socket(int af)
 }
 
 /*
- * socks5_listener_accept
+ * socks5_create_unix_listener_socket
  */
-void socks5_listener_accept(int listener, short what, void *arg)
+int socks5_create_unix_listener_socket(const char *path, unsigned int mode)
+{
+	struct sockaddr_un sun;
+	struct stat st;
+	int s;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path))
+		oddsock_error(EXIT_FAILURE, 0, "unix listener path too long: %s",
+				path);
+	strlcpy(sun.sun_path, path, sizeof(sun.sun_path));
+
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s < 0)
+		oddsock_error(EXIT_FAILURE, errno, "listen socket creation failed");
+	if (make_socket_nonblocking(s) < 0)
+		oddsock_error(EXIT_FAILURE, 0,
+				"listen socket could not be set non-blocking");
+
+	/* Only ever remove a socket, never a file in its place. */
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+	if (bind(s, (struct sockaddr*)&sun, sizeof(sun)) < 0)
+		oddsock_error(EXIT_FAILURE, errno, "listen socket bind failed");
+	if (chmod(path, (mode_t)mode) < 0)
+		oddsock_error(EXIT_FAILURE, errno, "failed setting mode of %s", path);
+	if (listen(s, LISTEN_BACKLOG) < 0)
+		oddsock_error(EXIT_FAILURE, errno, "failed to listen");
+
+	oddsock_logx(1, "listening socket bound to %s mode %o", path, mode);
+
+	return s;
+}
+
+/*
+ * socks5_unix_uids
+ */
+int socks5_unix_uids(const char *list)
+{
+	const char *p = list;
+	char *end;
+	unsigned long uid;
+
+	g_unix_nuids = 0;
+	while (*p) {
+		uid = strtoul(p, &end, 10);
+		if (end == p || (*end && *end != ',') ||
+			g_unix_nuids == SOCKS5_UNIX_UIDS_MAX)
+			return -1;
+		g_unix_uids[g_unix_nuids++] = (uid_t)uid;
+		p = *end ? end + 1 : end;
+	}
+
+	return g_unix_nuids > 0 ? 0 : -1;
+}
+
+/*
+ * socks5_unix_peer
+ * Name a unix client by its uid and decide whether it may authenticate.
+ */
+void socks5_unix_peer(struct socks5_conn *sconn, char *addr,
+		size_t addrlen)
+{
+	uid_t uid;
+	int i;
+
+	if (socket_peer_uid(sconn->client_fd, &uid) < 0) {
+		oddsock_log(1, errno, "(%d) no peer credentials",
+				socks5_conn_id(sconn));
+		strlcpy(addr, "unix", addrlen);
+		if (g_unix_nuids >= 0)
+			sconn->auth_method = SOCKS5_AUTH_UNACCEPTABLE;
+		return;
+	}
+	evutil_snprintf(addr, addrlen, "uid %lu", (unsigned long)uid);
+	oddsock_logx(1, "(%d) accepted unix connection from %s",
+			socks5_conn_id(sconn), addr);
+
+	if (g_unix_nuids < 0)
+		return;
+	for (i = 0; i < g_unix_nuids; ++i)
+		if (g_unix_uids[i] == uid)
+			return;
+	sconn->auth_method = SOCKS5_AUTH_UNACCEPTABLE;
+	oddsock_logx(1, "(%d) %s is not allowed", socks5_conn_id(sconn), addr);
+}
+
+/*
+ * socks5_conn_accept
+ * Accept a connection on a listener and allocate its socks5_conn.
+ */
+struct socks5_conn *socks5_conn_accept(int listener, struct event_base *base)
 {
-	struct event_base *base = (struct event_base*)arg;
 	int fd = -1; /* fd for accepted connection */
 	struct sockaddr_storage ssaddr;
 	socklen_t ssaddr_len = sizeof(ssaddr);
 	char addr[INET6_ADDRSTRLEN];
 	unsigned short port;
 	struct socks5_conn *sconn = NULL;
-	struct timeval tv;
-
-	if (listener < 0 || !base) {
-		oddsock_logx(0, "socks5_listener_accept inavlid args");
-		return;
-	}
 
 	memset(&ssaddr, 0, sizeof(ssaddr));
 
 	fd = accept(listener, (struct sockaddr*)&ssaddr, &ssaddr_len);
 	if (fd < 0) {
 		oddsock_log(1, errno, "accept failed");
-		return;
+		return NULL;
 	}
 
-	if (g_opts.verbosity > 0) {
+	addr[0] = '\0';
+	if (ssaddr.ss_family != AF_UNIX && g_opts.verbosity > 0) {
 		sockaddr_to_presentation((struct sockaddr*)&ssaddr,
 				addr, sizeof(addr), &port);
 		oddsock_logx(1, "(%d) accepted connection from %s port %u",
@@ -173,17 +338,224 @@ void socks5_listener_accept(int listener, short what, void *arg)
 	if (make_socket_nonblocking(fd) < 0) {
 		oddsock_logx(1,
 				"(%d) failed setting accepted socket to nonblocking", fd);
-		return;
+		close(fd);
+		return NULL;
+	}
+
+	sconn = socks5_conn_new(base, fd);
+	if (!sconn) {
+		close(fd);
+		return NULL;
 	}
+	++g_stats.accepted;
+	trace_client(sconn, (struct sockaddr*)&ssaddr);
+	if (ssaddr.ss_family == AF_UNIX) {
+		socks5_unix_peer(sconn, addr, sizeof(addr));
+		sconn->topk_keys[TOPK_CLIENTS] = topk_key(TOPK_ADDR_TEXT, addr,
+				strlen(addr), 0);
+	} else
+		sconn->topk_keys[TOPK_CLIENTS] =
+			socks5_topk_key((struct sockaddr*)&ssaddr, false);
+	topk_add(TOPK_CLIENTS, TOPK_CONNS, sconn->topk_keys[TOPK_CLIENTS], 1);
+
+	return sconn;
+}
+
+/*
+ * socks5_conn_new
+ */
+struct socks5_conn *socks5_conn_new(struct event_base *base, int fd)
+{
+	struct socks5_conn *sconn = NULL;
 
 	sconn = (struct socks5_conn*)malloc(sizeof(struct socks5_conn));
 	if (!sconn) {
 		oddsock_logx(1, "(%d) failed allocating socks5_conn", fd);
-		return;
+		return NULL;
 	}
 	memset(sconn, 0, sizeof(struct socks5_conn));
 
+	sconn->base = base;
+	sconn->client_fd = fd;
+	sconn->dst_fd = -1;
 	sconn->status = SCONN_INIT;
+	sconn->trace = trace_begin();
+	conntab_add(sconn);
+
+	++g_stats.active;
+	PROBE_CONN(accept, sconn);
+
+	return sconn;
+}
+
+/*
+ * socks5_mux_accept
+ */
+int socks5_mux_accept(struct event_base *base, struct bufferevent *bev)
+{
+	struct socks5_conn *sconn = NULL;
+
+	sconn = socks5_conn_new(base, -1);
+	if (!sconn) {
+		bufferevent_free(bev);
+		return -1;
+	}
+
+	/* The client-side oddsock already answered the greeting. */
+	sconn->client = bev;
+	sconn->muxed = true;
+	sconn->status = SCONN_AUTHORIZED;
+	bufferevent_setcb(sconn->client, socks5_client_readcb, NULL,
+			socks5_client_eventcb, (void*)sconn);
+	if (bufferevent_enable(sconn->client, EV_READ|EV_WRITE) != 0) {
+		socks5_conn_free(sconn);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * socks5_mux_request
+ * Send a request to the upstream oddsock instead of connecting; its reply
+ * and the tunnel data come back through the stream.
+ */
+int socks5_mux_request(struct socks5_conn *sconn,
+		const unsigned char *data, int n)
+{
+	sconn->dst = mux_stream_open(data, (size_t)n);
+	if (!sconn->dst) {
+		oddsock_logx(1, "(%d) no upstream mux connection",
+				socks5_conn_id(sconn));
+		return -1;
+	}
+	sconn->muxed = true;
+	if (socks5_forward_attach(sconn) != 0)
+		return -1;
+
+	return n;
+}
+
+/*
+ * socks5_upstream_request
+ * Pass the request to an upstream SOCKS proxy, on a pooled connection if
+ * one is ready or else once a new one is.
+ */
+int socks5_upstream_request(struct socks5_conn *sconn,
+		const unsigned char *data, int n)
+{
+	struct bufferevent *bev = NULL;
+	int e;
+
+	e = upstream_request(data, (size_t)n, socks5_upstream_cb, (void*)sconn,
+			&bev);
+	if (e < 0) {
+		oddsock_logx(1, "(%d) no upstream proxy connection",
+				socks5_conn_id(sconn));
+		return -1;
+	}
+	if (e == 0) {
+		sconn->status = SCONN_CONNECT_WAIT;
+		sconn->upstream_wait = true;
+		return n;
+	}
+
+	sconn->dst = bev;
+	if (socks5_forward_attach(sconn) != 0)
+		return -1;
+	return n;
+}
+
+/*
+ * socks5_upstream_cb
+ * A request that waited for an upstream connection was sent.
+ */
+void socks5_upstream_cb(struct bufferevent *bev, void *arg)
+{
+	struct socks5_conn *sconn = (struct socks5_conn*)arg;
+	unsigned char reply[2] = { 0x05, SOCKS5_REP_GENERAL_FAILURE };
+
+	sconn->upstream_wait = false;
+	if (!bev) {
+		++g_stats.connects_failed;
+		trace_outcome(sconn, TRACE_OUT_FAIL);
+		if (socks5_client_write(sconn, reply, 2) != 0 || !sconn->client)
+			socks5_conn_free(sconn);
+		else
+			socks5_conn_close(sconn);
+		return;
+	}
+
+	sconn->dst = bev;
+	if (socks5_forward_attach(sconn) != 0)
+		socks5_conn_free(sconn);
+}
+
+/*
+ * socks5_forward_attach
+ * Relay through sconn->dst, a connection to an upstream that answers the
+ * request itself; its reply reaches the client as tunnel data.
+ */
+int socks5_forward_attach(struct socks5_conn *sconn)
+{
+	bufferevent_setcb(sconn->dst, socks5_dst_readcb, NULL,
+			socks5_dst_eventcb, (void*)sconn);
+
+	sconn->status = SCONN_CONNECT_TRANSMITTING;
+
+	if (socks5_client_attach(sconn) != 0)
+		return -1;
+	socks5_conn_set_priority(sconn, SOCKS5_PRIO_INTERACTIVE);
+	relay_attach(sconn);
+	if (!sconn->muxed) {
+		busy_socket(bufferevent_getfd(sconn->dst), BUSY_LISTEN_SOCKS);
+		tcpinfo_track(sconn);
+	}
+
+	if (bufferevent_enable(sconn->dst, EV_READ|EV_WRITE) != 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * socks5_listener_accept
+ */
+void socks5_listener_accept(int listener, short what, void *arg)
+{
+	struct event_base *base = (struct event_base*)arg;
+	struct socks5_conn *sconn = NULL;
+	struct timeval tv;
+	int fd;
+
+	if (listener < 0 || !base) {
+		oddsock_logx(0, "socks5_listener_accept inavlid args");
+		return;
+	}
+
+	sconn = socks5_conn_accept(listener, base);
+	if (!sconn)
+		return;
+	fd = sconn->client_fd;
+	busy_socket(fd, BUSY_LISTEN_SOCKS);
+
+	/* Set a read timeout so that clients that connect but don't send
+	 * anything are disconnected. */
+	tv.tv_sec = 5; /* 5 second timeout OPTION */
+	tv.tv_usec = 0;
+
+	if (g_opts.low_footprint) {
+		/* Run the handshake on a bare event and a heap buffer. */
+		sconn->client_ev = event_new(base, fd, EV_READ|EV_PERSIST,
+				socks5_client_lf_cb, (void*)sconn);
+		if (!sconn->client_ev ||
+			event_priority_set(sconn->client_ev, SOCKS5_PRIO_HANDSHAKE) != 0 ||
+			event_add(sconn->client_ev, &tv) != 0) {
+			oddsock_logx(1, "(%d) failed creating client event", fd);
+			socks5_conn_free(sconn);
+		}
+		return;
+	}
 
 	sconn->client = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
 	if (!sconn->client) {
@@ -194,11 +566,8 @@ void socks5_listener_accept(int listener, short what, void *arg)
 
 	bufferevent_setcb(sconn->client, socks5_client_readcb, NULL,
 			socks5_client_eventcb, (void*)sconn);
-	/* Set a read timeout so that clients that connect but don't send
-	 * anything are disconnected. */
-	tv.tv_sec = 5; /* 5 second timeout OPTION */
-	tv.tv_usec = 0;
 	bufferevent_set_timeouts(sconn->client, &tv, NULL);
+	bufferevent_priority_set(sconn->client, SOCKS5_PRIO_HANDSHAKE);
 
 	if (bufferevent_enable(sconn->client, EV_READ|EV_WRITE) != 0) {
 		oddsock_logx(1, "(%d) failed to enable read/write on client", fd);
@@ -207,15 +576,177 @@ void socks5_listener_accept(int listener, short what, void *arg)
 	}
 }
 
+/*
+ * socks5_transparent_accept
+ */
+void socks5_transparent_accept(int listener, short what, void *arg)
+{
+	struct event_base *base = (struct event_base*)arg;
+	struct socks5_conn *sconn = NULL;
+	struct sockaddr_storage dst;
+	socklen_t dstlen;
+	char addr[INET6_ADDRSTRLEN];
+	unsigned short port;
+
+	if (listener < 0 || !base) {
+		oddsock_logx(0, "socks5_transparent_accept inavlid args");
+		return;
+	}
+
+	sconn = socks5_conn_accept(listener, base);
+	if (!sconn)
+		return;
+	sconn->transparent = true;
+	++g_stats.transparent_accepted;
+	busy_socket(sconn->client_fd, BUSY_LISTEN_TRANSPARENT);
+
+	if (socket_original_dst(sconn->client_fd, g_opts.tproxy,
+				&dst, &dstlen) < 0) {
+		oddsock_log(1, errno, "(%d) no original destination",
+				socks5_conn_id(sconn));
+		socks5_conn_free(sconn);
+		return;
+	}
+
+	/* A connection made directly to the transparent port would loop. */
+	if (socks5_transparent_loop(listener, (struct sockaddr*)&dst)) {
+		oddsock_logx(1, "(%d) refusing connection to the transparent port",
+				socks5_conn_id(sconn));
+		socks5_conn_free(sconn);
+		return;
+	}
+	if (g_opts.verbosity > 0) {
+		sockaddr_to_presentation((struct sockaddr*)&dst, addr, sizeof(addr),
+				&port);
+		oddsock_logx(1, "(%d) transparent connection for %s port %u",
+				socks5_conn_id(sconn), addr, port);
+	}
+
+	sconn->client = bufferevent_socket_new(base, sconn->client_fd,
+			BEV_OPT_CLOSE_ON_FREE);
+	if (!sconn->client) {
+		oddsock_logx(1, "(%d) failed creating client bufferevent",
+				socks5_conn_id(sconn));
+		socks5_conn_free(sconn);
+		return;
+	}
+	bufferevent_setcb(sconn->client, socks5_client_readcb, NULL,
+			socks5_client_eventcb, (void*)sconn);
+	bufferevent_priority_set(sconn->client, SOCKS5_PRIO_HANDSHAKE);
+
+	/* The client believes it is connected and may already send; hold at
+	 * most a bounded amount until the destination is. */
+	bufferevent_setwatermark(sconn->client, EV_READ, 0,
+			SOCKS5_TRANSPARENT_PENDING);
+	if (bufferevent_enable(sconn->client, EV_READ|EV_WRITE) != 0) {
+		socks5_conn_free(sconn);
+		return;
+	}
+
+	/* No greeting or request: go straight to the destination connect. */
+	sconn->command = SOCKS5_CMD_CONNECT;
+	if (socks5_connect_addr(sconn, (struct sockaddr*)&dst, dstlen) != 0)
+		socks5_conn_free(sconn);
+}
+
+/*
+ * socks5_transparent_loop
+ * Whether dst is the transparent listener itself: its port and its
+ * address, or any local address when it listens on the wildcard.
+ */
+bool socks5_transparent_loop(int listener, const struct sockaddr *dst)
+{
+	struct sockaddr_storage self;
+	socklen_t selflen = sizeof(self);
+	unsigned short port, self_port;
+
+	if (getsockname(listener, (struct sockaddr*)&self, &selflen) < 0 ||
+		sockaddr_to_presentation((struct sockaddr*)dst, NULL, 0,
+			&port) != 0 ||
+		sockaddr_to_presentation((struct sockaddr*)&self, NULL, 0,
+			&self_port) != 0 ||
+		port != self_port)
+		return false;
+
+	if ((self.ss_family == AF_INET &&
+			((struct sockaddr_in*)&self)->sin_addr.s_addr == INADDR_ANY) ||
+		(self.ss_family == AF_INET6 &&
+			IN6_IS_ADDR_UNSPECIFIED(&((struct sockaddr_in6*)&self)->sin6_addr)))
+		return sockaddr_is_local(dst);
+	return sockaddr_same_addr(dst, (struct sockaddr*)&self);
+}
+
+/*
+ * socks5_connect_addr
+ * Connect to a destination given as a socket address. The health cache
+ * is consulted first.
+ */
+int socks5_connect_addr(struct socks5_conn *sconn,
+		const struct sockaddr *sa, socklen_t salen)
+{
+	struct socks5_request request;
+	unsigned char reply;
+
+	memset(&request, 0, sizeof(request));
+	request.command = SOCKS5_CMD_CONNECT;
+	if (sa->sa_family == AF_INET) {
+		const struct sockaddr_in *sin = (const struct sockaddr_in*)sa;
+		request.atype = SOCKS5_ATYPE_IPV4;
+		request.addr.ipv4 = (const unsigned char*)&sin->sin_addr;
+		request.port = ntohs(sin->sin_port);
+	} else if (sa->sa_family == AF_INET6) {
+		const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6*)sa;
+		request.atype = SOCKS5_ATYPE_IPV6;
+		request.addr.ipv6 = (const unsigned char*)&sin6->sin6_addr;
+		request.port = ntohs(sin6->sin6_port);
+	} else
+		return -1;
+
+	++g_stats.requests;
+	trace_request(sconn, &request);
+	socks5_topk_dst(sconn, socks5_topk_key(sa, true));
+	sconn->dst_key = health_key(&request);
+	reply = health_check(sconn->dst_key, &request);
+	if (reply != 0) {
+		++g_stats.circuit_rejects;
+		trace_outcome(sconn, TRACE_OUT_REJECT);
+		oddsock_logx(1, "(%d) circuit open, refusing",
+				socks5_conn_id(sconn));
+		return -1;
+	}
+
+	if (socks5_dst_new(sconn) != 0)
+		return -1;
+
+	sconn->status = SCONN_CONNECT_WAIT;
+	if (bufferevent_socket_connect(sconn->dst, (struct sockaddr*)sa,
+				(int)salen) != 0) {
+		oddsock_log(1, errno, "(%d) failed connecting to destination",
+				socks5_conn_id(sconn));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * socks5_idle_footprint
+ */
+size_t socks5_idle_footprint(void)
+{
+	/* A parked tunnel is the socks5_conn plus one bare event per socket. */
+	return sizeof(struct socks5_conn) + 2 * event_get_struct_event_size();
+}
+
 /*
  * socks5_conn_id
  */
 int socks5_conn_id(struct socks5_conn *sconn)
 {
-	if (!sconn || !sconn->client)
+	if (!sconn)
 		return -1;
 
-	return bufferevent_getfd(sconn->client);
+	return sconn->client_fd;
 }
 
 /*
@@ -225,75 +756,217 @@ void socks5_conn_free(struct socks5_conn *sconn)
 {
 	if (sconn) {
 		oddsock_logx(1, "(%d) freeing connections", socks5_conn_id(sconn));
+		PROBE_CONN(free, sconn);
+		relay_cancel(sconn);
+		tcpinfo_forget(sconn);
+		sockmap_forget(sconn);
+		if (sconn->upstream_wait)
+			upstream_cancel(sconn);
+		if (sconn->dns_req)
+			evdns_getaddrinfo_cancel(sconn->dns_req);
+		conntab_remove(sconn);
+		trace_end(sconn);
+		if (sconn->client_ev)
+			event_free(sconn->client_ev);
+		if (sconn->dst_ev)
+			event_free(sconn->dst_ev);
+		free(sconn->inbuf);
+		/* Sockets not owned by a bufferevent are closed here. */
 		if (sconn->client)
-			bufferevent_free(sconn->client);
+			socks5_bev_free(sconn->client);
+		else if (sconn->client_fd >= 0)
+			close(sconn->client_fd);
 		if (sconn->dst)
-			bufferevent_free(sconn->dst);
+			socks5_bev_free(sconn->dst);
+		else if (sconn->dst_fd >= 0)
+			close(sconn->dst_fd);
 		memset(sconn, 0, sizeof(struct socks5_conn));
 		free(sconn);
+		--g_stats.active;
 	}
 }
 
+/*
+ * socks5_conn_kill
+ */
+void socks5_conn_kill(struct socks5_conn *sconn)
+{
+	oddsock_logx(1, "(%d) killed", socks5_conn_id(sconn));
+	trace_reason(sconn, TRACE_CLOSE_ADMIN);
+	socks5_conn_free(sconn);
+}
+
+/*
+ * socks5_bev_free
+ * Free one side of a connection. A mux stream's end of a bufferevent pair
+ * is told the stream finished first.
+ */
+void socks5_bev_free(struct bufferevent *bev)
+{
+	bufferevent_flush(bev, EV_WRITE, BEV_FINISHED);
+	bufferevent_free(bev);
+}
+
+/*
+ * socks5_conn_close
+ * Free the connection once any reply or relayed data queued for the
+ * client has been written.
+ */
+void socks5_conn_close(struct socks5_conn *sconn)
+{
+	struct timeval tv;
+
+	relay_flush(sconn);
+	if (sockmap_close(sconn) == 0)
+		return;
+
+	if (!sconn->client ||
+		evbuffer_get_length(bufferevent_get_output(sconn->client)) == 0) {
+		socks5_conn_free(sconn);
+		return;
+	}
+
+	/* Until the tunnel is up dst_ev is the connect timer; a failure it
+	 * would report has already been answered. */
+	if (sconn->status != SCONN_CONNECT_TRANSMITTING && sconn->dst_ev) {
+		event_free(sconn->dst_ev);
+		sconn->dst_ev = NULL;
+	}
+
+	sconn->status = SCONN_CLOSING;
+	/* A lookup answered while the reply drains has nothing to connect. */
+	if (sconn->dns_req) {
+		evdns_getaddrinfo_cancel(sconn->dns_req);
+		sconn->dns_req = NULL;
+	}
+	if (sconn->dst) {
+		socks5_bev_free(sconn->dst);
+		sconn->dst = NULL;
+	}
+
+	bufferevent_disable(sconn->client, EV_READ);
+	bufferevent_setcb(sconn->client, NULL, socks5_client_flushedcb,
+			socks5_client_eventcb, (void*)sconn);
+	tv.tv_sec = 5;
+	tv.tv_usec = 0;
+	bufferevent_set_timeouts(sconn->client, NULL, &tv);
+}
+
+/*
+ * socks5_client_flushedcb
+ */
+void socks5_client_flushedcb(struct bufferevent *bev, void *arg)
+{
+	socks5_conn_free((struct socks5_conn*)arg);
+}
+
+/*
+ * socks5_conn_touch
+ * Record relay activity for idle parking.
+ */
+void socks5_conn_touch(struct socks5_conn *sconn)
+{
+	struct timeval now;
+
+	event_base_gettimeofday_cached(sconn->base, &now);
+	sconn->last_active = now.tv_sec;
+}
+
+/*
+ * socks5_client_write
+ * Write a handshake reply to the client. Without a client bufferevent
+ * (low footprint handshake) the reply is sent directly; replies are tiny so
+ * a short write is treated as an error.
+ */
+int socks5_client_write(struct socks5_conn *sconn,
+		const unsigned char *data, size_t len)
+{
+	ssize_t n;
+
+	if (sconn->client)
+		return bufferevent_write(sconn->client, data, len);
+
+	n = send(sconn->client_fd, data, len, 0);
+	if (n < 0 || (size_t)n != len) {
+		oddsock_log(1, errno, "(%d) failed sending reply",
+				socks5_conn_id(sconn));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * socks5_client_process
+ * Feed handshake bytes from the client to the state machine.
+ * returns:
+ *	-1 = error, the connection must be freed
+ *	0  = incomplete
+ *	n  = number of bytes consumed
+ */
+int socks5_client_process(struct socks5_conn *sconn,
+		const unsigned char *data, size_t len)
+{
+	if (sconn->status == SCONN_INIT) {
+		if (len > 0 && http_parse_detect(data[0]))
+			return socks5_process_http(sconn, data, len);
+		return socks5_process_greeting(sconn, data, len);
+	}
+	else if (sconn->status == SCONN_CLIENT_MUST_CLOSE) {
+		/* The client MUST close the connection yet it is still sending
+		 * something so close the connection. */
+		oddsock_logx(1, "(%d) client not rfc1928 conformant",
+				socks5_conn_id(sconn));
+		return -1;
+	}
+	else if (sconn->status == SCONN_AUTHORIZED) {
+		return socks5_process_request(sconn, data, len);
+	}
+	else if (sconn->status == SCONN_RESOLVE_WAIT ||
+			sconn->status == SCONN_CONNECT_WAIT) {
+		/* Client sent data while waiting on request reply.
+		 * Treat this as an errant client and clost connection. */
+		oddsock_logx(1, "(%d) errant client", socks5_conn_id(sconn));
+		return -1;
+	}
+
+	return -1;
+}
+
 /*
  * socks5_process_greeting
  * returns:
  *	-1 = error
  *	0  = incomplete
- *	1  = complete
+ *	n  = complete, number of bytes consumed
  */
-int socks5_process_greeting(struct socks5_conn *sconn)
+int socks5_process_greeting(struct socks5_conn *sconn,
+		const unsigned char *data, size_t len)
 {
-	struct evbuffer *buffer;
-	size_t have;
-	unsigned char greeting[2];
-	unsigned char nmethods;
-	unsigned char *methods = NULL;
+	struct socks5_greeting greeting;
 	unsigned char greeting_reply[2];
+	int n;
 
 	if (!sconn ||
-		sconn->status != SCONN_INIT ||
-		!sconn->client)
+		sconn->status != SCONN_INIT)
 		return -1;
-	
-	buffer = bufferevent_get_input(sconn->client);
-	have = evbuffer_get_length(buffer);
-
-	if (have < 1)
-		return 0;
-
-	/* Check version field. */
-	evbuffer_copyout(buffer, (void*)greeting, 1);
-	if (greeting[0] != 0x05)
-		return -1;
-
-	if (have < 2)
-		return 0;
-
-	/* Get number of methods. */
-	evbuffer_copyout(buffer, (void*)greeting, 2);
-	nmethods = greeting[1];
 
-	if (have < (2 + nmethods))
+	n = socks5_parse_greeting(data, len, &greeting);
+	if (n == 0)
 		return 0;
-	else if (have > (2 + nmethods))
-		return -1;
-
-	/* Finally, get the list of supported methods. */
-	methods = (unsigned char*)malloc(nmethods);
-	if (!methods)
+	else if (n < 0 || len > (size_t)n) {
+		oddsock_logx(1, "(%d) error processing client greeting",
+				socks5_conn_id(sconn));
 		return -1;
-
-	evbuffer_drain(buffer, sizeof(greeting));
-	evbuffer_remove(buffer, (void*)methods, nmethods); /* XXXerr */
+	}
 
 	/* Choose which auth method to use. */
-	socks5_choose_auth_method(sconn, methods, nmethods);
-	free(methods);
+	socks5_choose_auth_method(sconn, greeting.methods, greeting.nmethods);
+	PROBE_CONN1(greeting, sconn, (int)sconn->auth_method);
 
 	/* Respond with chosen method. */
 	greeting_reply[0] = 0x05;
 	greeting_reply[1] = sconn->auth_method;
-	if (bufferevent_write(sconn->client,
+	if (socks5_client_write(sconn,
 				greeting_reply, sizeof(greeting_reply)) != 0)
 		return -1;
 	
@@ -308,18 +981,22 @@ int socks5_process_greeting(struct socks5_conn *sconn)
 		sconn->status = SCONN_CLIENT_MUST_CLOSE;
 	}
 
-	return 1;
+	return n;
 }
 
 /*
  * socks5_choose_auth_method
  */
 void socks5_choose_auth_method(struct socks5_conn *sconn,
-		unsigned char *methods, unsigned char nmethods)
+		const unsigned char *methods, unsigned char nmethods)
 {
 	unsigned char i;
 	unsigned char method = SOCKS5_AUTH_UNACCEPTABLE;
 
+	/* Unix clients are authenticated by their uid at accept. */
+	if (sconn->auth_method == SOCKS5_AUTH_UNACCEPTABLE)
+		nmethods = 0;
+
 	for (i = 0; i < nmethods; ++i) {
 		if (methods[i] == SOCKS5_AUTH_NONE) {
 			method = SOCKS5_AUTH_NONE;
@@ -332,173 +1009,517 @@ void socks5_choose_auth_method(struct socks5_conn *sconn,
 
 /*
  * socks5_process_request
+ * returns:
+ *	-1 = error
+ *	0  = incomplete
+ *	n  = complete, number of bytes consumed
  */
-int socks5_process_request(struct socks5_conn *sconn)
+int socks5_process_request(struct socks5_conn *sconn,
+		const unsigned char *data, size_t len)
 {
-	struct evbuffer *buffer;
-	size_t have;
-	unsigned char request[6+256]; /* fixed + variable address */
-	unsigned char request_reply[2] = { 0x05, 0x00 };
-	unsigned char atype;
-	int af;
-	char addr[256]; /* max(unsigned char) + NULL terminator */
-	unsigned short port;
+	struct socks5_request request;
+	int n;
 
 	if (!sconn ||
-		sconn->status != SCONN_AUTHORIZED ||
-		!sconn->client)
+		sconn->status != SCONN_AUTHORIZED)
 		return -1;
-	
-	buffer = bufferevent_get_input(sconn->client);
-	have = evbuffer_get_length(buffer);
 
-	if (have < 1)
+	n = socks5_parse_request(data, len, &request);
+	if (n == 0)
 		return 0;
-	evbuffer_copyout(buffer, (void*)request, 1);
+	else if (n == SOCKS5_PARSE_ERR_COMMAND) {
+		socks5_request_reply(sconn, SOCKS5_REP_BAD_COMMAND);
+		return -1;
+	}
+	else if (n == SOCKS5_PARSE_ERR_ATYPE) {
+		socks5_request_reply(sconn, SOCKS5_REP_ATYPE_UNSUPPORTED);
+		return -1;
+	}
+	else if (n < 0 || len > (size_t)n) {
+		oddsock_logx(1, "(%d) error processing client request",
+				socks5_conn_id(sconn));
+		return -1;
+	}
+
+	sconn->command = request.command;
+	if (socks5_request_begin(sconn, &request) != 0)
+		return -1;
+
+	/* The upstream oddsock checks health and connects. */
+	if (g_opts.mux_upstream) {
+		if (socks5_mux_request(sconn, data, n) < 0) {
+			trace_outcome(sconn, TRACE_OUT_REJECT);
+			socks5_request_reply(sconn, SOCKS5_REP_GENERAL_FAILURE);
+			return -1;
+		}
+		return n;
+	}
 
-	/* Check version field. */
-	if (request[0] != 0x05)
+	/* So does an upstream SOCKS proxy. */
+	if (g_opts.socks_upstream) {
+		if (socks5_upstream_request(sconn, data, n) < 0) {
+			trace_outcome(sconn, TRACE_OUT_REJECT);
+			socks5_request_reply(sconn, SOCKS5_REP_GENERAL_FAILURE);
+			return -1;
+		}
+		return n;
+	}
+
+	if (socks5_request_connect(sconn, &request) != 0)
 		return -1;
 
-	if (have < 8)
+	return n;
+}
+
+/*
+ * socks5_process_http
+ * Handle an HTTP CONNECT request head sent in place of a greeting.
+ * returns:
+ *	-1 = error
+ *	0  = incomplete
+ *	n  = complete, number of bytes consumed
+ */
+int socks5_process_http(struct socks5_conn *sconn,
+		const unsigned char *data, size_t len)
+{
+	struct socks5_request request;
+	int n;
+
+	if (!sconn ||
+		sconn->status != SCONN_INIT)
+		return -1;
+
+	/* Replies from here on are HTTP status lines. */
+	sconn->command = SOCKS5_CMD_HTTP_CONNECT;
+
+	/* Unix clients are authenticated by their uid at accept. */
+	if (sconn->auth_method == SOCKS5_AUTH_UNACCEPTABLE) {
+		socks5_request_reply(sconn, SOCKS5_REP_NOT_ALLOWED);
+		return -1;
+	}
+
+	n = http_parse_connect(data, len, &request);
+	if (n == 0 && len < HTTP_REQUEST_MAX)
 		return 0;
-	evbuffer_copyout(buffer, (void*)request, 8);
+	else if (n == 0) {
+		socks5_http_reply(sconn, "431 Request Header Fields Too Large");
+		return -1;
+	}
+	else if (n == HTTP_PARSE_ERR_METHOD) {
+		socks5_request_reply(sconn, SOCKS5_REP_BAD_COMMAND);
+		return -1;
+	}
+	else if (n < 0 || len > (size_t)n) {
+		oddsock_logx(1, "(%d) error processing http request",
+				socks5_conn_id(sconn));
+		socks5_http_reply(sconn, "400 Bad Request");
+		return -1;
+	}
 
-	/* Get command and address type. */
-	if (!SOCKS5_CMD_VALID(request[1])) {
-		request_reply[1] = SOCKS5_REP_BAD_COMMAND;
-		bufferevent_write(sconn->client, request_reply, 2);
+	++g_stats.http_requests;
+	if (socks5_request_begin(sconn, &request) != 0)
+		return -1;
+
+	/* Upstreams answer in SOCKS; only direct connects speak HTTP. */
+	if (g_opts.mux_upstream || g_opts.socks_upstream) {
+		trace_outcome(sconn, TRACE_OUT_REJECT);
+		socks5_request_reply(sconn, SOCKS5_REP_GENERAL_FAILURE);
 		return -1;
 	}
-	sconn->command = request[1];
 
-	if (!SOCKS5_ATYPE_VALID(request[3])) {
-		request_reply[1] = SOCKS5_REP_BAD_COMMAND;
-		bufferevent_write(sconn->client, request_reply, 2);
+	if (socks5_request_connect(sconn, &request) != 0)
+		return -1;
+
+	return n;
+}
+
+/*
+ * socks5_request_begin
+ * Account for a parsed request and shed it while the loop is overloaded.
+ * sconn->command is set by the caller.
+ */
+int socks5_request_begin(struct socks5_conn *sconn,
+		const struct socks5_request *request)
+{
+	++g_stats.requests;
+	PROBE_CONN2(request, sconn, (int)request->command, (int)request->atype);
+	trace_request(sconn, request);
+
+	/* Refuse new tunnels while the loop is overloaded. */
+	if (lag_shed(LAG_SHED_CONNECTS)) {
+		++g_stats.lag_rejects;
+		trace_outcome(sconn, TRACE_OUT_REJECT);
+		socks5_request_reply(sconn, SOCKS5_REP_GENERAL_FAILURE);
 		return -1;
 	}
-	atype = request[3];
 
-	/* Get the address and port. */
-	if (atype == SOCKS5_ATYPE_IPV4) {
-		if (have < 10)
-			return 0;
-		else if (have > 10)
+	return 0;
+}
+
+/*
+ * socks5_request_connect
+ * Check a request against the destination circuits and start resolving
+ * or connecting to it directly. IP addresses, including names that are
+ * address literals, are connected to without going through the resolver.
+ */
+int socks5_request_connect(struct socks5_conn *sconn,
+		const struct socks5_request *request)
+{
+	struct sockaddr_storage ss;
+	socklen_t sslen;
+	char addr[256]; /* max(unsigned char) + NULL terminator */
+	unsigned short port;
+	unsigned char rep;
+
+	port = request->port;
+
+	/* Get the address. Literals need text only for the log. */
+	addr[0] = '\0';
+	sslen = socks5_request_sockaddr(request, &ss);
+	if (sslen == 0) {
+		memcpy(addr, request->addr.domain, request->domain_len);
+		addr[request->domain_len] = '\0';
+		socks5_topk_dst(sconn, topk_key(TOPK_ADDR_TEXT,
+					request->addr.domain, request->domain_len, port));
+	} else {
+		socks5_topk_dst(sconn, socks5_topk_key((struct sockaddr*)&ss, true));
+		if (g_opts.verbosity > 0)
+			sockaddr_to_presentation((struct sockaddr*)&ss, addr,
+					sizeof(addr), NULL);
+	}
+
+	/* Answer right away for destinations whose circuit is open. */
+	sconn->dst_key = health_key(request);
+	rep = health_check(sconn->dst_key, request);
+	if (rep != 0) {
+		++g_stats.circuit_rejects;
+		trace_outcome(sconn, TRACE_OUT_REJECT);
+		oddsock_logx(1, "(%d) circuit open, replying %u",
+				socks5_conn_id(sconn), rep);
+		socks5_request_reply(sconn, rep);
+		return -1;
+	}
+
+	/* Handle request. */
+	if (request->command == SOCKS5_CMD_CONNECT) {
+		/* CONNECT request. */
+		oddsock_logx(1, "(%d) connection request for %s port %u",
+				socks5_conn_id(sconn), addr, port);
+
+		if (socks5_dst_new(sconn) != 0) {
+			socks5_request_reply(sconn, SOCKS5_REP_GENERAL_FAILURE);
 			return -1;
+		}
+
+		/* Connect to destination, resolving a domain first. */
+		if (sslen == 0) {
+			if (socks5_resolve(sconn, addr, port) != 0) {
+				socks5_request_reply(sconn, SOCKS5_REP_GENERAL_FAILURE);
+				return -1;
+			}
+		} else {
+			if (bufferevent_socket_connect(sconn->dst,
+						(struct sockaddr*)&ss, (int)sslen) != 0) {
+				oddsock_log(1, errno, "(%d) failed connecting to destination",
+						socks5_conn_id(sconn));
+				socks5_request_reply(sconn, SOCKS5_REP_GENERAL_FAILURE);
+				return -1;
+			}
+			sconn->status = SCONN_CONNECT_WAIT;
+		}
+	}
+	else {
+		/* Only CONNECT is implemented right now. */
+		trace_outcome(sconn, TRACE_OUT_REJECT);
+		oddsock_log(1, errno,
+				"(%d) unsupported command %u requested",
+				socks5_conn_id(sconn), request->command);
+		socks5_request_reply(sconn, SOCKS5_REP_BAD_COMMAND);
+		return -1;
+	}
 
-		evbuffer_remove(buffer, (void*)request, 10);
+	return 0;
+}
 
+/*
+ * socks5_request_sockaddr
+ * Fill in the socket address of a request's destination. Domains that
+ * are IPv4 or IPv6 literals, such as HTTP CONNECT hosts, count too.
+ * returns:
+ *	0 = the destination is a name and needs resolving
+ *	n = length of the address in ss
+ */
+socklen_t socks5_request_sockaddr(const struct socks5_request *request,
+		struct sockaddr_storage *ss)
+{
+	struct sockaddr_in *sin = (struct sockaddr_in*)ss;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)ss;
+	char literal[INET6_ADDRSTRLEN];
+	int af;
+
+	memset(ss, 0, sizeof(*ss));
+	if (request->atype == SOCKS5_ATYPE_IPV4) {
 		af = AF_INET;
-		if (!inet_ntop(af, &request[4], addr, sizeof(addr))) {
-			oddsock_log(1, errno,
-					"(%d) inet_ntop failed while processing request",
-					socks5_conn_id(sconn));
-			request_reply[1] = SOCKS5_REP_GENERAL_FAILURE;
-			bufferevent_write(sconn->client, request_reply, 2);
+		memcpy(&sin->sin_addr, request->addr.ipv4, 4);
+	}
+	else if (request->atype == SOCKS5_ATYPE_IPV6) {
+		af = AF_INET6;
+		memcpy(&sin6->sin6_addr, request->addr.ipv6, 16);
+	}
+	else {
+		if (request->domain_len >= sizeof(literal))
+			return 0;
+		memcpy(literal, request->addr.domain, request->domain_len);
+		literal[request->domain_len] = '\0';
+		if (inet_pton(AF_INET, literal, &sin->sin_addr) == 1)
+			af = AF_INET;
+		else if (inet_pton(AF_INET6, literal, &sin6->sin6_addr) == 1)
+			af = AF_INET6;
+		else
+			return 0;
+	}
+
+	if (af == AF_INET) {
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(request->port);
+		return (socklen_t)sizeof(*sin);
+	}
+	sin6->sin6_family = AF_INET6;
+	sin6->sin6_port = htons(request->port);
+	return (socklen_t)sizeof(*sin6);
+}
+
+/*
+ * socks5_dst_new
+ * Create the destination bufferevent and bound the resolve and connect
+ * time; dst_ev is not used for parking until the tunnel is established.
+ */
+int socks5_dst_new(struct socks5_conn *sconn)
+{
+	struct timeval tv;
+
+	sconn->dst = bufferevent_socket_new(sconn->base, -1,
+			BEV_OPT_CLOSE_ON_FREE);
+	if (!sconn->dst) {
+		oddsock_log(1, errno, "(%d) failed creating dst bufferevent",
+				socks5_conn_id(sconn));
+		return -1;
+	}
+
+	bufferevent_setcb(sconn->dst, socks5_dst_readcb, NULL,
+			socks5_dst_eventcb, (void*)sconn);
+	bufferevent_priority_set(sconn->dst, SOCKS5_PRIO_HANDSHAKE);
+
+	tv.tv_sec = g_opts.connect_timeout;
+	tv.tv_usec = 0;
+	sconn->dst_ev = evtimer_new(sconn->base, socks5_connect_timeoutcb,
+			(void*)sconn);
+	if (!sconn->dst_ev || evtimer_add(sconn->dst_ev, &tv) != 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * socks5_request_reply
+ * Answer a request with a SOCKS reply code, or the closest HTTP status
+ * for HTTP CONNECT clients. Only SOCKS5_REP_SUCCEEDED keeps an HTTP
+ * client open; SOCKS clients get their bound address from
+ * socks5_bound_reply instead.
+ */
+int socks5_request_reply(struct socks5_conn *sconn, unsigned char rep)
+{
+	unsigned char reply[2];
+
+	if (sconn->command != SOCKS5_CMD_HTTP_CONNECT) {
+		reply[0] = 0x05;
+		reply[1] = rep;
+		return socks5_client_write(sconn, reply, 2);
+	}
+
+	switch (rep) {
+	case SOCKS5_REP_SUCCEEDED:
+		return socks5_http_reply(sconn, "200 Connection established");
+	case SOCKS5_REP_NOT_ALLOWED:
+		return socks5_http_reply(sconn, "403 Forbidden");
+	case SOCKS5_REP_BAD_COMMAND:
+		return socks5_http_reply(sconn, "501 Not Implemented");
+	case SOCKS5_REP_ATYPE_UNSUPPORTED:
+		return socks5_http_reply(sconn, "400 Bad Request");
+	case SOCKS5_REP_TTL_EXPIRED:
+		return socks5_http_reply(sconn, "504 Gateway Timeout");
+	default:
+		return socks5_http_reply(sconn, "502 Bad Gateway");
+	}
+}
+
+/*
+ * socks5_http_reply
+ * Write an HTTP/1.1 response head. Anything but a 2xx closes the
+ * connection afterwards.
+ */
+int socks5_http_reply(struct socks5_conn *sconn, const char *status)
+{
+	char reply[96];
+	int n;
+
+	if (status[0] == '2')
+		n = evutil_snprintf(reply, sizeof(reply),
+				"HTTP/1.1 %s\r\n\r\n", status);
+	else
+		n = evutil_snprintf(reply, sizeof(reply),
+				"HTTP/1.1 %s\r\nContent-Length: 0\r\n"
+				"Connection: close\r\n\r\n", status);
+	if (n < 0 || (size_t)n >= sizeof(reply))
+		return -1;
+
+	return socks5_client_write(sconn, (const unsigned char*)reply,
+			(size_t)n);
+}
+
+/*
+ * socks5_resolve
+ * Look up a requested domain; socks5_dns_cb connects to the first
+ * address. Names in the hosts table connect right away; some errors are
+ * answered before evdns_getaddrinfo returns, while the status is still
+ * SCONN_AUTHORIZED.
+ */
+int socks5_resolve(struct socks5_conn *sconn, const char *host,
+		unsigned short port)
+{
+	struct evutil_addrinfo hints;
+	struct evdns_getaddrinfo_request *req;
+	struct sockaddr_storage ss;
+	socklen_t sslen;
+	char portstr[6];
+
+	/* Hosts file names connect without a trip through evdns. */
+	if (resolver_hosts_lookup(host, port, &ss, &sslen) == 0) {
+		PROBE_CONN1(dns, sconn, 0);
+		if (bufferevent_socket_connect(sconn->dst, (struct sockaddr*)&ss,
+					(int)sslen) != 0) {
+			oddsock_log(1, errno, "(%d) failed connecting to %s",
+					socks5_conn_id(sconn), host);
 			return -1;
 		}
+		sconn->status = SCONN_CONNECT_WAIT;
+		return 0;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	hints.ai_flags = EVUTIL_AI_ADDRCONFIG;
+	evutil_snprintf(portstr, sizeof(portstr), "%u", port);
+
+	req = evdns_getaddrinfo(resolver_get(sconn->base), host, portstr,
+			&hints, socks5_dns_cb, (void*)sconn);
+	if (req) {
+		sconn->dns_req = req;
+		sconn->status = SCONN_RESOLVE_WAIT;
+		return 0;
+	}
+
+	/* Answered already; the callback is connecting unless it failed. */
+	return sconn->status == SCONN_CONNECT_WAIT ? 0 : -1;
+}
 
-		port = ntohs(*((unsigned short*)&request[8]));
-	}
-	else if (atype == SOCKS5_ATYPE_IPV6) {
-		if (have < 22)
-			return 0;
-		else if (have > 22)
-			return -1;
+/*
+ * socks5_dns_cb
+ */
+void socks5_dns_cb(int result, struct evutil_addrinfo *res, void *arg)
+{
+	struct socks5_conn *sconn = (struct socks5_conn*)arg;
+	bool pending;
 
-		evbuffer_remove(buffer, (void*)request, 22);
+	/* Cancelled by socks5_conn_close or socks5_conn_free. */
+	if (result == EVUTIL_EAI_CANCEL)
+		return;
 
-		af = AF_INET6;
-		if (!inet_ntop(af, &request[4], addr, sizeof(addr))) {
-			oddsock_log(1, errno,
-					"(%d) inet_ntop failed while processing request",
-					socks5_conn_id(sconn));
-			request_reply[1] = SOCKS5_REP_GENERAL_FAILURE;
-			bufferevent_write(sconn->client, request_reply, 2);
-			return -1;
-		}
+	pending = sconn->status == SCONN_RESOLVE_WAIT;
+	sconn->dns_req = NULL;
+	PROBE_CONN1(dns, sconn, result);
 
-		port = ntohs(*((unsigned short*)&request[20]));
+	/* The connection is closing and no longer has a destination. */
+	if (!sconn->dst) {
+		if (result == 0)
+			evutil_freeaddrinfo(res);
+		return;
 	}
-	else if (atype == SOCKS5_ATYPE_DOMAIN) {
-		unsigned char addrlen;
 
-		addrlen = request[4];
-		if (have < (7 + addrlen))
-			return 0;
-		else if (have > (7 + addrlen))
-			return -1;
+	if (result == 0) {
+		if (bufferevent_socket_connect(sconn->dst, res->ai_addr,
+					(int)res->ai_addrlen) == 0) {
+			sconn->status = SCONN_CONNECT_WAIT;
+			evutil_freeaddrinfo(res);
+			return;
+		}
+		oddsock_log(1, errno, "(%d) failed connecting to destination",
+				socks5_conn_id(sconn));
+		evutil_freeaddrinfo(res);
+	} else if (!pending)
+		oddsock_logx(1, "(%d) DNS error: %s", socks5_conn_id(sconn),
+				gai_strerror(result));
+
+	/* Failures before socks5_resolve returned are reported by it. */
+	if (pending)
+		socks5_connect_failed(sconn, BEV_EVENT_ERROR, result);
+}
 
-		evbuffer_remove(buffer, (void*)request, (7 + addrlen));
+/*
+ * socks5_connect_reply
+ */
+int socks5_connect_reply(struct socks5_conn *sconn)
+{
+	++g_stats.connects_ok;
 
-		af = AF_UNSPEC;
-		memcpy(addr, &request[5], addrlen);
-		addr[addrlen] = '\0';
-		port = ntohs(*((unsigned short*)&request[5+addrlen]));
-	}
+	/* The destination leg polls like the listener it serves. */
+	busy_socket(bufferevent_getfd(sconn->dst),
+			sconn->transparent ? BUSY_LISTEN_TRANSPARENT :
+			sconn->muxed ? BUSY_LISTEN_MUX : BUSY_LISTEN_SOCKS);
+	tcpinfo_track(sconn);
 
-	/* Handle request. */
-	if (sconn->command == SOCKS5_CMD_CONNECT) {
-		/* CONNECT request. */
-		oddsock_logx(1, "(%d) connection request for %s port %u",
-				socks5_conn_id(sconn), addr, port);
+	/* Transparent clients already think they are connected. */
+	if (sconn->transparent)
+		return socks5_transparent_established(sconn);
 
-		/* Create dst bufferevent. */
-		sconn->dst = bufferevent_socket_new(
-				bufferevent_get_base(sconn->client), -1,
-				BEV_OPT_CLOSE_ON_FREE);
-		if (!sconn->dst) {
-			oddsock_log(1, errno, "(%d) failed creating dst bufferevent",
-					socks5_conn_id(sconn));
-			request_reply[1] = SOCKS5_REP_GENERAL_FAILURE;
-			bufferevent_write(sconn->client, request_reply, 2);
+	if (sconn->command == SOCKS5_CMD_HTTP_CONNECT) {
+		if (socks5_request_reply(sconn, SOCKS5_REP_SUCCEEDED) != 0)
 			return -1;
-		}
+	} else if (socks5_bound_reply(sconn) != 0)
+		return -1;
 
-		bufferevent_setcb(sconn->dst, socks5_dst_readcb, NULL,
-				socks5_dst_eventcb, (void*)sconn);
+	sconn->status = SCONN_CONNECT_TRANSMITTING;
+	socks5_conn_set_priority(sconn, SOCKS5_PRIO_INTERACTIVE);
 
-		/* Make sure the DNS resolver is ready. */
-		if (!g_dns_base) {
-			g_dns_base = evdns_base_new(
-					bufferevent_get_base(sconn->client), 1);
-			if (!g_dns_base) {
-				oddsock_logx(0, "(%d) failed creating evdns_base",
-						socks5_conn_id(sconn));
-			}
-		}
+	if (socks5_client_attach(sconn) != 0)
+		return -1;
+	relay_attach(sconn);
 
-		/* Connect to destination. */
-		if (bufferevent_socket_connect_hostname(
-					sconn->dst, g_dns_base, af, addr, port) != 0) {
-			oddsock_log(1, errno, "(%d) failed creating dst bufferevent",
-					socks5_conn_id(sconn));
-			request_reply[1] = SOCKS5_REP_GENERAL_FAILURE;
-			bufferevent_write(sconn->client, request_reply, 2);
-			return -1;
-		}
+	/* Tunnels forwarded in the kernel look idle and are not parked. */
+	if (sockmap_attach(sconn) != 0 &&
+		g_opts.low_footprint && !sconn->muxed)
+		socks5_relay_set_idle(sconn);
 
-		sconn->status = SCONN_CONNECT_WAIT;
-	}
-	else {
-		/* Only CONNECT is implemented right now. */
-		oddsock_log(1, errno,
-				"(%d) unsupported command %u requested",
-				socks5_conn_id(sconn), sconn->command);
-		request_reply[1] = SOCKS5_REP_BAD_COMMAND;
-		bufferevent_write(sconn->client, request_reply, 2);
+	if (bufferevent_enable(sconn->dst, EV_READ|EV_WRITE) != 0) {
+		oddsock_logx(1, "(%d) failed to enable read/write on dst",
+				socks5_conn_id(sconn));
 		return -1;
 	}
 
-	return 1;
+	return 0;
 }
 
 /*
- * socks5_connect_reply
+ * socks5_bound_reply
+ * Tell a SOCKS client the tunnel is up and which address the proxy
+ * connected from.
  */
-int socks5_connect_reply(struct socks5_conn *sconn)
+int socks5_bound_reply(struct socks5_conn *sconn)
 {
-	unsigned char reply[5];
+	unsigned char reply[4 + 16 + 2];
+	size_t reply_len;
 	struct sockaddr_storage ssaddr;
 	socklen_t sslen = sizeof(ssaddr);
 	int dstfd;
@@ -510,7 +1531,7 @@ int socks5_connect_reply(struct socks5_conn *sconn)
 	if (getsockname(dstfd, (struct sockaddr*)&ssaddr, &sslen) < 0) {
 		/* Notify client of failure and close. */
 		reply[1] = SOCKS5_REP_GENERAL_FAILURE;
-		bufferevent_write(sconn->client, reply, 2);
+		socks5_client_write(sconn, reply, 2);
 		return -1;
 	}
 
@@ -520,27 +1541,69 @@ int socks5_connect_reply(struct socks5_conn *sconn)
 	if (ssaddr.ss_family == AF_INET) {
 		struct sockaddr_in *saddr = (struct sockaddr_in*)&ssaddr;
 		reply[3] = SOCKS5_ATYPE_IPV4;
-		bufferevent_write(sconn->client, reply, 4); 
-		bufferevent_write(sconn->client, &saddr->sin_addr,
-				sizeof(saddr->sin_addr));
-		bufferevent_write(sconn->client, &saddr->sin_port, 2);
+		memcpy(&reply[4], &saddr->sin_addr, 4);
+		memcpy(&reply[8], &saddr->sin_port, 2);
+		reply_len = 10;
 	}
 	else if (ssaddr.ss_family == AF_INET6) {
 		struct sockaddr_in6 *saddr = (struct sockaddr_in6*)&ssaddr;
 		reply[3] = SOCKS5_ATYPE_IPV6;
-		bufferevent_write(sconn->client, reply, 4); 
-		bufferevent_write(sconn->client, &saddr->sin6_addr,
-				sizeof(saddr->sin6_addr));
-		bufferevent_write(sconn->client, &saddr->sin6_port, 2);
+		memcpy(&reply[4], &saddr->sin6_addr, 16);
+		memcpy(&reply[20], &saddr->sin6_port, 2);
+		reply_len = 22;
 	}
 	else {
 		/* Notify client of failure and close. */
 		reply[1] = SOCKS5_REP_GENERAL_FAILURE;
-		bufferevent_write(sconn->client, reply, 2);
+		socks5_client_write(sconn, reply, 2);
 		return -1;
 	}
 
+	return socks5_client_write(sconn, reply, reply_len);
+}
+
+/*
+ * socks5_topk_key
+ * Heavy hitter key of a socket address; clients are counted without
+ * their port.
+ */
+unsigned long socks5_topk_key(const struct sockaddr *sa, bool with_port)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in*)sa;
+	const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6*)sa;
+
+	if (sa->sa_family == AF_INET)
+		return topk_key(TOPK_ADDR_IPV4, &sin->sin_addr, 4,
+				with_port ? ntohs(sin->sin_port) : 0);
+	if (sa->sa_family == AF_INET6)
+		return topk_key(TOPK_ADDR_IPV6, &sin6->sin6_addr, 16,
+				with_port ? ntohs(sin6->sin6_port) : 0);
+	return 0;
+}
+
+/*
+ * socks5_topk_dst
+ * Count a request towards its destination's heavy hitter entries.
+ */
+void socks5_topk_dst(struct socks5_conn *sconn, unsigned long key)
+{
+	sconn->topk_keys[TOPK_DSTS] = key;
+	topk_add(TOPK_DSTS, TOPK_CONNS, key, 1);
+}
+
+/*
+ * socks5_transparent_established
+ * Start relaying, forwarding whatever the client sent while the
+ * destination was being connected.
+ */
+int socks5_transparent_established(struct socks5_conn *sconn)
+{
 	sconn->status = SCONN_CONNECT_TRANSMITTING;
+	socks5_conn_set_priority(sconn, SOCKS5_PRIO_INTERACTIVE);
+	relay_attach(sconn);
+
+	if (g_opts.low_footprint && !sconn->muxed)
+		socks5_relay_set_idle(sconn);
 
 	if (bufferevent_enable(sconn->dst, EV_READ|EV_WRITE) != 0) {
 		oddsock_logx(1, "(%d) failed to enable read/write on dst",
@@ -548,57 +1611,339 @@ int socks5_connect_reply(struct socks5_conn *sconn)
 		return -1;
 	}
 
+	relay_move(sconn, RELAY_UP);
+
 	return 0;
 }
 
 /*
- * socks5_client_readcb
+ * socks5_conn_set_priority
  */
-void socks5_client_readcb(struct bufferevent *bev, void *arg)
+void socks5_conn_set_priority(struct socks5_conn *sconn, int priority)
+{
+	if (sconn->client)
+		bufferevent_priority_set(sconn->client, priority);
+	if (sconn->dst)
+		bufferevent_priority_set(sconn->dst, priority);
+}
+
+/*
+ * socks5_relay_classify
+ * Move a tunnel behind interactive ones once a single read callback finds
+ * a bulk amount of data waiting. The priority itself records the class;
+ * tunnels recreated after parking start out interactive again.
+ */
+void socks5_relay_classify(struct socks5_conn *sconn,
+		struct bufferevent *bev)
+{
+	if (evbuffer_get_length(bufferevent_get_input(bev)) >= SOCKS5_BULK_READ &&
+		bufferevent_get_priority(bev) != SOCKS5_PRIO_BULK) {
+		oddsock_logx(1, "(%d) bulk tunnel", socks5_conn_id(sconn));
+		socks5_conn_set_priority(sconn, SOCKS5_PRIO_BULK);
+	}
+}
+
+/*
+ * socks5_relay_attach
+ * Create a relay bufferevent on an already connected socket.
+ */
+int socks5_relay_attach(struct socks5_conn *sconn, struct bufferevent **bev,
+		int fd, bufferevent_data_cb readcb, bufferevent_event_cb eventcb)
+{
+	*bev = bufferevent_socket_new(sconn->base, fd, BEV_OPT_CLOSE_ON_FREE);
+	if (!*bev)
+		return -1;
+
+	bufferevent_setcb(*bev, readcb, NULL, eventcb, (void*)sconn);
+	bufferevent_priority_set(*bev, SOCKS5_PRIO_INTERACTIVE);
+
+	if (bufferevent_enable(*bev, EV_READ|EV_WRITE) != 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * socks5_client_attach
+ * A low footprint handshake gets its client bufferevent only once the
+ * tunnel is set up; its handshake event and buffer go. A no-op for
+ * clients that already have one.
+ */
+static int socks5_client_attach(struct socks5_conn *sconn)
+{
+	if (sconn->client)
+		return 0;
+
+	event_free(sconn->client_ev);
+	sconn->client_ev = NULL;
+	free(sconn->inbuf);
+	sconn->inbuf = NULL;
+	sconn->inbuf_len = 0;
+	if (socks5_relay_attach(sconn, &sconn->client, sconn->client_fd,
+				socks5_client_readcb, socks5_client_eventcb) != 0) {
+		oddsock_logx(1, "(%d) failed creating client bufferevent",
+				socks5_conn_id(sconn));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * socks5_relay_set_idle
+ * Arm read timeouts on both sides so a quiet tunnel gets parked.
+ */
+void socks5_relay_set_idle(struct socks5_conn *sconn)
+{
+	struct timeval tv;
+
+	tv.tv_sec = g_opts.park_idle;
+	tv.tv_usec = 0;
+
+	bufferevent_set_timeouts(sconn->client, &tv, NULL);
+	bufferevent_set_timeouts(sconn->dst, &tv, NULL);
+	socks5_conn_touch(sconn);
+}
+
+/*
+ * socks5_relay_idle_timeout
+ * One side of the tunnel hit its read timeout. Park the tunnel when both
+ * directions have been quiet and nothing is buffered, otherwise resume
+ * reading on that side.
+ */
+void socks5_relay_idle_timeout(struct socks5_conn *sconn,
+		struct bufferevent *bev)
+{
+	struct timeval now;
+
+	PROBE_CONN1(timeout, sconn, 1);
+	event_base_gettimeofday_cached(sconn->base, &now);
+
+	if (now.tv_sec - sconn->last_active >= (time_t)g_opts.park_idle &&
+		evbuffer_get_length(bufferevent_get_input(sconn->client)) == 0 &&
+		evbuffer_get_length(bufferevent_get_output(sconn->client)) == 0 &&
+		evbuffer_get_length(bufferevent_get_input(sconn->dst)) == 0 &&
+		evbuffer_get_length(bufferevent_get_output(sconn->dst)) == 0) {
+		if (socks5_conn_park(sconn) == 0)
+			return;
+		oddsock_logx(1, "(%d) failed parking tunnel", socks5_conn_id(sconn));
+		socks5_conn_free(sconn);
+		return;
+	}
+
+	bufferevent_enable(bev, EV_READ);
+}
+
+/*
+ * socks5_conn_park
+ * Release both relay bufferevents, and with them their buffers, keeping
+ * the sockets watched by bare events until either side becomes readable.
+ */
+int socks5_conn_park(struct socks5_conn *sconn)
+{
+	relay_cancel(sconn);
+	sconn->dst_fd = bufferevent_getfd(sconn->dst);
+
+	/* Detach the sockets so freeing the bufferevents keeps them open. */
+	bufferevent_setfd(sconn->client, -1);
+	bufferevent_setfd(sconn->dst, -1);
+	bufferevent_free(sconn->client);
+	bufferevent_free(sconn->dst);
+	sconn->client = NULL;
+	sconn->dst = NULL;
+
+	sconn->client_ev = event_new(sconn->base, sconn->client_fd, EV_READ,
+			socks5_parked_cb, (void*)sconn);
+	sconn->dst_ev = event_new(sconn->base, sconn->dst_fd, EV_READ,
+			socks5_parked_cb, (void*)sconn);
+	if (!sconn->client_ev || !sconn->dst_ev ||
+		event_add(sconn->client_ev, NULL) != 0 ||
+		event_add(sconn->dst_ev, NULL) != 0)
+		return -1;
+
+	oddsock_logx(1, "(%d) tunnel parked", socks5_conn_id(sconn));
+	return 0;
+}
+
+/*
+ * socks5_parked_cb
+ * Either side of a parked tunnel is readable (data or EOF): recreate the
+ * relay bufferevents, which then see the pending input.
+ */
+void socks5_parked_cb(int fd, short what, void *arg)
 {
 	struct socks5_conn *sconn = (struct socks5_conn*)arg;
-	int e;
 
-	if (!sconn || !bev) {
-		oddsock_logx(0, "socks5_client_readcb invalid args");
+	event_free(sconn->client_ev);
+	event_free(sconn->dst_ev);
+	sconn->client_ev = NULL;
+	sconn->dst_ev = NULL;
+
+	if (socks5_relay_attach(sconn, &sconn->client, sconn->client_fd,
+				socks5_client_readcb, socks5_client_eventcb) != 0 ||
+		socks5_relay_attach(sconn, &sconn->dst, sconn->dst_fd,
+				socks5_dst_readcb, socks5_dst_eventcb) != 0) {
+		oddsock_logx(1, "(%d) failed unparking tunnel",
+				socks5_conn_id(sconn));
+		socks5_conn_free(sconn);
 		return;
 	}
+	sconn->dst_fd = -1;
 
-	if (sconn->status == SCONN_INIT) {
-		bufferevent_set_timeouts(sconn->client, NULL, NULL);
+	relay_attach(sconn);
+	socks5_relay_set_idle(sconn);
+	oddsock_logx(1, "(%d) tunnel unparked", socks5_conn_id(sconn));
+}
 
-		e = socks5_process_greeting(sconn);
-		if (e < 0) {
-			oddsock_logx(1, "(%d) error processing client greeting",
-					socks5_conn_id(sconn));
+/*
+ * socks5_client_lf_cb
+ * Low footprint handshake: read client bytes into the handshake buffer.
+ */
+void socks5_client_lf_cb(int fd, short what, void *arg)
+{
+	struct socks5_conn *sconn = (struct socks5_conn*)arg;
+	ssize_t n;
+	int e;
+
+	if (what & EV_TIMEOUT) {
+		oddsock_logx(1, "(%d) client timeout", socks5_conn_id(sconn));
+		trace_reason(sconn, TRACE_CLOSE_TIMEOUT);
+		socks5_conn_free(sconn);
+		return;
+	}
+
+	if (!sconn->inbuf) {
+		/* First bytes arrived: drop the connect timeout. A persistent
+		 * event keeps its timeout across event_add(NULL), so replace it.
+		 * The handshake buffer only lives until the tunnel is up. */
+		sconn->inbuf = (unsigned char*)malloc(SOCKS5_REQUEST_MAX);
+		if (!sconn->inbuf) {
+			socks5_conn_free(sconn);
+			return;
+		}
+		event_free(sconn->client_ev);
+		sconn->client_ev = event_new(sconn->base, fd, EV_READ|EV_PERSIST,
+				socks5_client_lf_cb, (void*)sconn);
+		if (!sconn->client_ev ||
+			event_priority_set(sconn->client_ev, SOCKS5_PRIO_HANDSHAKE) != 0 ||
+			event_add(sconn->client_ev, NULL) != 0) {
 			socks5_conn_free(sconn);
+			return;
 		}
 	}
-	else if (sconn->status == SCONN_CLIENT_MUST_CLOSE) {
-		/* The client MUST close the connection yet it is still sending
-		 * something so close the connection. */
-		oddsock_logx(1, "(%d) client not rfc1928 conformant",
+
+	n = recv(fd, sconn->inbuf + sconn->inbuf_len,
+			SOCKS5_REQUEST_MAX - sconn->inbuf_len, 0);
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		oddsock_log(1, errno, "(%d) client connection error",
 				socks5_conn_id(sconn));
+		trace_reason(sconn, TRACE_CLOSE_CLIENT_ERROR);
 		socks5_conn_free(sconn);
+		return;
 	}
-	else if (sconn->status == SCONN_AUTHORIZED) {
-		e = socks5_process_request(sconn);
-		if (e < 0) {
-			oddsock_logx(1,"(%d) error processing client request",
+	if (n == 0) {
+		oddsock_logx(1, "(%d) client closed connection",
+				socks5_conn_id(sconn));
+		trace_reason(sconn, TRACE_CLOSE_CLIENT);
+		socks5_conn_free(sconn);
+		return;
+	}
+	sconn->inbuf_len += (unsigned short)n;
+
+	/* HTTP request heads outgrow the handshake buffer; read them through
+	 * the client bufferevent the tunnel needs anyway. Its input end is
+	 * frozen outside of socket reads. */
+	if (sconn->status == SCONN_INIT && http_parse_detect(sconn->inbuf[0])) {
+		event_free(sconn->client_ev);
+		sconn->client_ev = NULL;
+		if (socks5_relay_attach(sconn, &sconn->client, fd,
+					socks5_client_readcb, socks5_client_eventcb) != 0) {
+			oddsock_logx(1, "(%d) failed creating client bufferevent",
 					socks5_conn_id(sconn));
 			socks5_conn_free(sconn);
+			return;
+		}
+		bufferevent_priority_set(sconn->client, SOCKS5_PRIO_HANDSHAKE);
+		evbuffer_unfreeze(bufferevent_get_input(sconn->client), 0);
+		e = evbuffer_add(bufferevent_get_input(sconn->client),
+				sconn->inbuf, sconn->inbuf_len);
+		evbuffer_freeze(bufferevent_get_input(sconn->client), 0);
+		if (e != 0) {
+			socks5_conn_free(sconn);
+			return;
 		}
+		free(sconn->inbuf);
+		sconn->inbuf = NULL;
+		sconn->inbuf_len = 0;
+		socks5_client_readcb(sconn->client, (void*)sconn);
+		return;
 	}
-	else if (sconn->status == SCONN_CONNECT_WAIT) {
-		/* Client sent data while waiting on request reply.
-		 * Treat this as an errant client and clost connection. */
-		oddsock_logx(1, "(%d) errant client", socks5_conn_id(sconn));
+
+	e = socks5_client_process(sconn, sconn->inbuf, sconn->inbuf_len);
+	if (e < 0 || (e == 0 && sconn->inbuf_len == SOCKS5_REQUEST_MAX)) {
+		trace_reason(sconn, TRACE_CLOSE_REQUEST);
 		socks5_conn_free(sconn);
+		return;
+	}
+
+	/* A pooled upstream or mux stream can take the request at once; the
+	 * tunnel has its client bufferevent then and the buffer is gone. */
+	if (!sconn->inbuf)
+		return;
+
+	sconn->inbuf_len -= (unsigned short)e;
+	memmove(sconn->inbuf, sconn->inbuf + e, sconn->inbuf_len);
+}
+
+/*
+ * socks5_client_readcb
+ */
+void socks5_client_readcb(struct bufferevent *bev, void *arg)
+{
+	struct socks5_conn *sconn = (struct socks5_conn*)arg;
+	struct evbuffer *buffer;
+	size_t len;
+	unsigned char *data;
+	int e;
+
+	if (!sconn || !bev) {
+		oddsock_logx(0, "socks5_client_readcb invalid args");
+		return;
+	}
+
+	if (sconn->status == SCONN_CONNECT_TRANSMITTING) {
+		socks5_relay_classify(sconn, bev);
+		relay_fill(sconn, RELAY_UP);
+		relay_move(sconn, RELAY_UP);
+		if (g_opts.low_footprint)
+			socks5_conn_touch(sconn);
+		return;
 	}
-	else if (sconn->status == SCONN_CONNECT_TRANSMITTING) {
-		bufferevent_read_buffer(sconn->client,
-				bufferevent_get_output(sconn->dst));
+
+	/* Transparent clients may send before the destination is connected;
+	 * keep it buffered. */
+	if (sconn->transparent)
+		return;
+
+	if (sconn->status == SCONN_INIT)
+		bufferevent_set_timeouts(sconn->client, NULL, NULL);
+
+	/* Parse in place; no handshake message is longer than
+	 * HTTP_REQUEST_MAX. */
+	buffer = bufferevent_get_input(sconn->client);
+	len = evbuffer_get_length(buffer);
+	if (len > HTTP_REQUEST_MAX)
+		len = HTTP_REQUEST_MAX;
+	data = evbuffer_pullup(buffer, len);
+
+	e = data ? socks5_client_process(sconn, data, len) : -1;
+	if (e < 0) {
+		trace_reason(sconn, TRACE_CLOSE_REQUEST);
+		socks5_conn_close(sconn);
+		return;
 	}
+	evbuffer_drain(buffer, e);
 }
 
 /*
@@ -614,7 +1959,13 @@ void socks5_client_eventcb(struct bufferevent *bev, short what, void *arg)
 	}
 
 	if (what & BEV_EVENT_TIMEOUT) {
+		if (sconn->status == SCONN_CONNECT_TRANSMITTING &&
+			g_opts.low_footprint) {
+			socks5_relay_idle_timeout(sconn, bev);
+			return;
+		}
 		oddsock_logx(1, "(%d) client timeout", socks5_conn_id(sconn));
+		trace_reason(sconn, TRACE_CLOSE_TIMEOUT);
 		socks5_conn_free(sconn);
 		return;
 	}
@@ -622,12 +1973,14 @@ void socks5_client_eventcb(struct bufferevent *bev, short what, void *arg)
 		/* Client closed the connection. */
 		oddsock_logx(1, "(%d) client closed connection",
 				socks5_conn_id(sconn));
+		trace_reason(sconn, TRACE_CLOSE_CLIENT);
 		socks5_conn_free(sconn);
 		return;
 	}
 	if (what & BEV_EVENT_ERROR) {
 		oddsock_log(1, errno, "(%d) client connection error",
 				socks5_conn_id(sconn));
+		trace_reason(sconn, TRACE_CLOSE_CLIENT_ERROR);
 		socks5_conn_free(sconn);
 		return;
 	}
@@ -646,9 +1999,78 @@ void socks5_dst_readcb(struct bufferevent *bev, void *arg)
 		return;
 
 	if (sconn->status == SCONN_CONNECT_TRANSMITTING) {
-		bufferevent_read_buffer(sconn->dst,
-				bufferevent_get_output(sconn->client));
+		socks5_relay_classify(sconn, bev);
+		relay_fill(sconn, RELAY_DOWN);
+		relay_move(sconn, RELAY_DOWN);
+		if (g_opts.low_footprint)
+			socks5_conn_touch(sconn);
+	}
+}
+
+/*
+ * socks5_connect_failed
+ * Tell the client why the destination could not be reached, feed the
+ * health cache and close.
+ */
+void socks5_connect_failed(struct socks5_conn *sconn, short what,
+		int dns_err)
+{
+	unsigned char rep = SOCKS5_REP_GENERAL_FAILURE;
+	int err = errno;
+
+	if (what & BEV_EVENT_TIMEOUT) {
+		oddsock_logx(1, "(%d) destination connect timeout",
+				socks5_conn_id(sconn));
+		rep = SOCKS5_REP_HOST_UNREACHABLE;
+	} else {
+		if (dns_err != 0)
+			oddsock_logx(1, "(%d) DNS error: %s",
+					socks5_conn_id(sconn), gai_strerror(dns_err));
+		else
+			oddsock_log(1, err, "(%d) destination connection error",
+					socks5_conn_id(sconn));
+		rep = health_reply_for_error(err, dns_err);
+	}
+
+	health_report_failure(sconn->dst_key, rep);
+	++g_stats.connects_failed;
+	PROBE_CONN1(connect_failed, sconn, (int)rep);
+	trace_outcome(sconn, TRACE_OUT_FAIL);
+
+	/* Transparent clients learn about it through a reset. */
+	if (sconn->transparent) {
+		struct linger lg;
+		lg.l_onoff = 1;
+		lg.l_linger = 0;
+		setsockopt(sconn->client_fd, SOL_SOCKET, SO_LINGER,
+				(const void*)&lg, (socklen_t)sizeof(lg));
+		socks5_conn_free(sconn);
+		return;
+	}
+
+	if (socks5_request_reply(sconn, rep) != 0) {
+		socks5_conn_free(sconn);
+		return;
 	}
+	if (sconn->client)
+		socks5_conn_close(sconn);
+	else
+		socks5_conn_free(sconn);
+}
+
+/*
+ * socks5_connect_timeoutcb
+ */
+void socks5_connect_timeoutcb(int fd, short what, void *arg)
+{
+	struct socks5_conn *sconn = (struct socks5_conn*)arg;
+
+	if (sconn->status != SCONN_RESOLVE_WAIT &&
+		sconn->status != SCONN_CONNECT_WAIT)
+		return;
+
+	PROBE_CONN1(timeout, sconn, 0);
+	socks5_connect_failed(sconn, BEV_EVENT_TIMEOUT, 0);
 }
 
 /*
@@ -664,6 +2086,11 @@ void socks5_dst_eventcb(struct bufferevent *bev, short what, void *arg)
 	}
 
 	if (what & BEV_EVENT_CONNECTED) {
+		health_report_success(sconn->dst_key);
+		trace_outcome(sconn, TRACE_OUT_OK);
+		PROBE_CONN(connected, sconn);
+		event_free(sconn->dst_ev);
+		sconn->dst_ev = NULL;
 		if (socks5_connect_reply(sconn) < 0) {
 			oddsock_logx(1, "(%d) failed sending request reply",
 					socks5_conn_id(sconn));
@@ -673,11 +2100,25 @@ void socks5_dst_eventcb(struct bufferevent *bev, short what, void *arg)
 		oddsock_logx(1, "(%d) CONNECT succeeded", socks5_conn_id(sconn));
 		return;
 	}
+	if (sconn->status == SCONN_CONNECT_WAIT &&
+		(what & (BEV_EVENT_ERROR|BEV_EVENT_TIMEOUT|BEV_EVENT_EOF))) {
+		socks5_connect_failed(sconn, what,
+				bufferevent_socket_get_dns_error(bev));
+		return;
+	}
+	if (what & BEV_EVENT_TIMEOUT) {
+		if (sconn->status == SCONN_CONNECT_TRANSMITTING &&
+			g_opts.low_footprint) {
+			socks5_relay_idle_timeout(sconn, bev);
+			return;
+		}
+	}
 	if (what & BEV_EVENT_EOF) {
-		/* Destination closed the connection. */
+		/* Destination closed the connection; deliver what it sent. */
 		oddsock_logx(1, "(%d) destination closed connection",
 				socks5_conn_id(sconn));
-		socks5_conn_free(sconn);
+		trace_reason(sconn, TRACE_CLOSE_DST);
+		socks5_conn_close(sconn);
 		return;
 	}
 	if (what & BEV_EVENT_ERROR) {
@@ -688,8 +2129,8 @@ void socks5_dst_eventcb(struct bufferevent *bev, short what, void *arg)
 		else
 			oddsock_log(1, errno, "(%d) destination connection error",
 					socks5_conn_id(sconn));
+		trace_reason(sconn, TRACE_CLOSE_DST_ERROR);
 		socks5_conn_free(sconn);
 		return;
 	}
 }
-
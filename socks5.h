@@ -35,17 +35,28 @@
 #ifndef ODDSOCK_SOCKS5_H
 #define ODDSOCK_SOCKS5_H
 
+#include <stdbool.h>
+#include <time.h>
+#include <event2/event.h>
 #include <event2/bufferevent.h>
+#include <event2/dns.h>
+#include "socks5_parse.h"
+#include "relay.h"
+#include "trace.h"
+#include "topk.h"
 
 enum socks5_conn_status {
 	SCONN_INIT = 0,
 	SCONN_CLIENT_MUST_CLOSE,
 	SCONN_AUTHORIZED,
+	SCONN_RESOLVE_WAIT,
 	SCONN_CONNECT_WAIT,
-	SCONN_CONNECT_TRANSMITTING
+	SCONN_CONNECT_TRANSMITTING,
+	SCONN_CLOSING
 };
 
 #define SOCKS5_AUTH_NONE			(0x00)
+#define SOCKS5_AUTH_USERPASS		(0x02)
 #define SOCKS5_AUTH_UNACCEPTABLE	(0xFF)
 
 #define SOCKS5_CMD_CONNECT		(0x01)
@@ -53,6 +64,8 @@ enum socks5_conn_status {
 #define SOCKS5_CMD_UDP_ASSOC	(0x03)
 #define SOCKS5_CMD_VALID(cmd) \
 	(((cmd) > 0x00) && ((cmd) < 0x04))
+/* Not on the wire; marks a client that sent an HTTP CONNECT request. */
+#define SOCKS5_CMD_HTTP_CONNECT	(0x80)
 
 #define SOCKS5_ATYPE_IPV4	(0x01)
 #define SOCKS5_ATYPE_DOMAIN	(0x03)
@@ -70,22 +83,88 @@ enum socks5_conn_status {
 #define SOCKS5_REP_BAD_COMMAND			(0x07)
 #define SOCKS5_REP_ATYPE_UNSUPPORTED	(0x08)
 
+/*
+ * Event priorities. Accepts and handshakes (SCONN_INIT through
+ * SCONN_CONNECT_WAIT) run ahead of relaying, and tunnels seen moving
+ * SOCKS5_BULK_READ or more per read callback drop behind interactive
+ * ones. libevent 2.1 reads at most 4096 bytes from a socket per callback,
+ * so a callback finding that much means the sender is outrunning us.
+ * After SOCKS5_RELAY_DISPATCH_MAX relay callbacks the loop polls
+ * again so newly readable handshakes are not stuck behind a long batch.
+ */
+#define SOCKS5_PRIO_HANDSHAKE	(0)
+#define SOCKS5_PRIO_INTERACTIVE	(1)
+#define SOCKS5_PRIO_BULK		(2)
+#define SOCKS5_PRIORITIES		(3)
+#define SOCKS5_BULK_READ		(4096)
+#define SOCKS5_RELAY_DISPATCH_MAX	(64)
+
+/* Client bytes buffered by a transparent connection before the
+ * destination is connected. */
+#define SOCKS5_TRANSPARENT_PENDING	(64 * 1024)
+
+/* User ids --unixUids can list. */
+#define SOCKS5_UNIX_UIDS_MAX	(16)
+
 /*
  * socks5_conn
+ *
+ * In low footprint mode the handshake runs on client_ev and inbuf, and
+ * the client bufferevent is only created once the tunnel is established;
+ * inbuf is freed at that point. A tunnel that stays quiet for park_idle
+ * seconds is parked: both bufferevents are freed and client_ev/dst_ev
+ * watch the sockets. Until the destination is connected dst_ev is the
+ * connect timer.
+ *
+ * Tracked bytes per idle (parked) tunnel, see socks5_idle_footprint(),
+ * amd64 with libevent 2.1: 168 (socks5_conn) + 2 * 128 (event) = 424,
+ * against roughly 1.9 KB (heap usage, empty buffers) for the two
+ * bufferevents it replaces. Kernel socket memory is not included.
  */
 struct socks5_conn {
+	struct event_base *base;
 	struct bufferevent *client;
 	struct bufferevent *dst;
+	struct event *client_ev;
+	struct event *dst_ev;
+	int client_fd;
+	int dst_fd; /* only valid while parked */
+	time_t last_active;
+	unsigned long dst_key; /* health cache key */
 	enum socks5_conn_status status;
-	unsigned char auth_method;
+	unsigned char auth_method; /* set early for a refused unix uid */
 	unsigned char command;
+	bool transparent; /* accepted on a transparent listener */
+	bool muxed; /* one side is a mux stream */
+	bool upstream_wait; /* queued for a pooled upstream connection */
+	unsigned short inbuf_len;
+	unsigned char *inbuf; /* SOCKS5_REQUEST_MAX bytes during the handshake */
+	struct relay_entry relay[2]; /* RELAY_UP, RELAY_DOWN */
+	struct trace_rec *trace; /* NULL unless tracing */
+	struct evdns_getaddrinfo_request *dns_req; /* while resolving */
+	unsigned long topk_keys[TOPK_KINDS]; /* heavy hitter keys, 0 = none */
 };
 
 /*
  * socks5_create_listener_socket
  * Create and bind the server listener socket.
  */
-int socks5_create_listener_socket(int af);
+int socks5_create_listener_socket(int af, const char *port,
+		bool transparent);
+
+/*
+ * socks5_create_unix_listener_socket
+ * Create the AF_UNIX listener socket at path with permissions mode,
+ * replacing a stale socket left by an earlier run.
+ */
+int socks5_create_unix_listener_socket(const char *path, unsigned int mode);
+
+/*
+ * socks5_unix_uids
+ * Allow only the comma separated user ids on the unix listener; other
+ * clients are refused every auth method. returns -1 on a bad list.
+ */
+int socks5_unix_uids(const char *list);
 
 /*
  * socks5_listener_accept
@@ -93,5 +172,50 @@ int socks5_create_listener_socket(int af);
  */
 void socks5_listener_accept(int listener, short what, void *base);
 
+/*
+ * socks5_transparent_accept
+ * Accept a connection redirected by iptables REDIRECT or TPROXY, recover
+ * its original destination and connect to it without a SOCKS handshake.
+ */
+void socks5_transparent_accept(int listener, short what, void *base);
+
+/*
+ * socks5_mux_accept
+ * Start a SOCKS connection on the server end of a mux stream. Its first
+ * input is the request the client-side oddsock forwarded.
+ */
+int socks5_mux_accept(struct event_base *base, struct bufferevent *bev);
+
+/*
+ * socks5_conn_id
+ * The id used in log messages and probes: the client socket, or -1 for
+ * the server end of a mux stream.
+ */
+int socks5_conn_id(struct socks5_conn *sconn);
+
+/*
+ * socks5_conn_kill
+ * Close a connection at once, for the admin socket.
+ */
+void socks5_conn_kill(struct socks5_conn *sconn);
+
+/*
+ * socks5_conn_free
+ * Close both sides of a connection and free it.
+ */
+void socks5_conn_free(struct socks5_conn *sconn);
+
+/*
+ * socks5_bev_free
+ * Free one side of a connection.
+ */
+void socks5_bev_free(struct bufferevent *bev);
+
+/*
+ * socks5_idle_footprint
+ * Bytes of userspace memory held by one parked tunnel.
+ */
+size_t socks5_idle_footprint(void);
+
 #endif
 
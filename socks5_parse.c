@@ -0,0 +1,164 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#include "socks5.h"
+#include "socks5_parse.h"
+
+/*
+ * socks5_parse_greeting
+ */
+int socks5_parse_greeting(const unsigned char *data, size_t len,
+		struct socks5_greeting *greeting)
+{
+	size_t need;
+
+	if (len < 1)
+		return 0;
+
+	/* Check version field. */
+	if (data[0] != 0x05)
+		return SOCKS5_PARSE_ERR_MALFORMED;
+
+	if (len < 2)
+		return 0;
+
+	need = 2 + (size_t)data[1];
+	if (len < need)
+		return 0;
+
+	greeting->nmethods = data[1];
+	greeting->methods = &data[2];
+
+	return (int)need;
+}
+
+/*
+ * socks5_parse_auth
+ */
+int socks5_parse_auth(const unsigned char *data, size_t len,
+		struct socks5_auth *auth)
+{
+	size_t need;
+	unsigned char ulen;
+
+	if (len < 1)
+		return 0;
+
+	/* Check sub-negotiation version field. */
+	if (data[0] != 0x01)
+		return SOCKS5_PARSE_ERR_MALFORMED;
+
+	if (len < 2)
+		return 0;
+
+	ulen = data[1];
+	if (ulen == 0)
+		return SOCKS5_PARSE_ERR_MALFORMED;
+
+	need = 2 + (size_t)ulen + 1;
+	if (len < need)
+		return 0;
+
+	need += data[2 + ulen];
+	if (len < need)
+		return 0;
+
+	auth->ulen = ulen;
+	auth->uname = &data[2];
+	auth->plen = data[2 + ulen];
+	auth->passwd = &data[3 + ulen];
+
+	return (int)need;
+}
+
+/*
+ * socks5_parse_request
+ */
+int socks5_parse_request(const unsigned char *data, size_t len,
+		struct socks5_request *request)
+{
+	size_t need;
+
+	if (len < 1)
+		return 0;
+
+	/* Check version field. */
+	if (data[0] != 0x05)
+		return SOCKS5_PARSE_ERR_MALFORMED;
+
+	if (len < 2)
+		return 0;
+	if (!SOCKS5_CMD_VALID(data[1]))
+		return SOCKS5_PARSE_ERR_COMMAND;
+
+	/* data[2] is reserved and ignored. */
+	if (len < 4)
+		return 0;
+
+	switch (data[3]) {
+	case SOCKS5_ATYPE_IPV4:
+		need = 4 + 4 + 2;
+		if (len < need)
+			return 0;
+		request->addr.ipv4 = &data[4];
+		request->domain_len = 0;
+		break;
+	case SOCKS5_ATYPE_IPV6:
+		need = 4 + 16 + 2;
+		if (len < need)
+			return 0;
+		request->addr.ipv6 = &data[4];
+		request->domain_len = 0;
+		break;
+	case SOCKS5_ATYPE_DOMAIN:
+		if (len < 5)
+			return 0;
+		if (data[4] == 0)
+			return SOCKS5_PARSE_ERR_MALFORMED;
+		need = 4 + 1 + (size_t)data[4] + 2;
+		if (len < need)
+			return 0;
+		request->addr.domain = &data[5];
+		request->domain_len = data[4];
+		break;
+	default:
+		return SOCKS5_PARSE_ERR_ATYPE;
+	}
+
+	request->command = data[1];
+	request->atype = data[3];
+	request->port = (unsigned short)((data[need - 2] << 8) | data[need - 1]);
+
+	return (int)need;
+}
@@ -0,0 +1,111 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#ifndef ODDSOCK_SOCKS5_PARSE_H
+#define ODDSOCK_SOCKS5_PARSE_H
+
+#include <stddef.h>
+
+/*
+ * Allocation-free SOCKS 5 message parsers.
+ *
+ * Each parser works in place on a contiguous byte range (for example the
+ * result of evbuffer_pullup) and never copies, allocates or converts
+ * addresses to text. Pointers in the parsed structures refer back into
+ * the input and are only valid as long as it is.
+ *
+ * All parsers return:
+ *	> 0 = complete message, number of bytes it occupies
+ *	0   = incomplete, more input is needed
+ *	< 0 = one of the SOCKS5_PARSE_ERR_* codes
+ */
+
+#define SOCKS5_PARSE_ERR_MALFORMED	(-1)
+#define SOCKS5_PARSE_ERR_COMMAND	(-2)
+#define SOCKS5_PARSE_ERR_ATYPE		(-3)
+
+/* Largest possible message of each kind. */
+#define SOCKS5_GREETING_MAX	(2 + 255)
+#define SOCKS5_AUTH_MAX		(3 + 255 + 255)
+#define SOCKS5_REQUEST_MAX	(4 + 1 + 255 + 2)
+
+struct socks5_greeting {
+	unsigned char nmethods;
+	const unsigned char *methods;
+};
+
+/* rfc1929 username/password sub-negotiation. */
+struct socks5_auth {
+	unsigned char ulen;
+	const unsigned char *uname;
+	unsigned char plen;
+	const unsigned char *passwd;
+};
+
+struct socks5_request {
+	unsigned char command;
+	unsigned char atype;
+	union {
+		const unsigned char *ipv4; /* 4 bytes, network order */
+		const unsigned char *ipv6; /* 16 bytes, network order */
+		const unsigned char *domain; /* domain_len bytes, no terminator */
+	} addr;
+	unsigned char domain_len;
+	unsigned short port; /* host order */
+};
+
+/*
+ * socks5_parse_greeting
+ * Parse the version identifier/method selection message.
+ */
+int socks5_parse_greeting(const unsigned char *data, size_t len,
+		struct socks5_greeting *greeting);
+
+/*
+ * socks5_parse_auth
+ * Parse an rfc1929 username/password request.
+ */
+int socks5_parse_auth(const unsigned char *data, size_t len,
+		struct socks5_auth *auth);
+
+/*
+ * socks5_parse_request
+ * Parse a request message. Unknown commands and address types are reported
+ * as soon as their byte is available so the caller can send the matching
+ * reply code.
+ */
+int socks5_parse_request(const unsigned char *data, size_t len,
+		struct socks5_request *request);
+
+#endif
@@ -0,0 +1,108 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#include "util.h"
+#include "stats.h"
+
+struct oddsock_stats g_stats;
+
+/*
+ * stats_log
+ */
+void stats_log(void)
+{
+	oddsock_logx(0, "stats:\n"
+			"\taccepted = %lu\n"
+			"\ttransparent_accepted = %lu\n"
+			"\tactive = %lu\n"
+			"\trequests = %lu\n"
+			"\thttp_requests = %lu\n"
+			"\tconnects_ok = %lu\n"
+			"\tconnects_failed = %lu\n"
+			"\tcircuit_rejects = %lu\n"
+			"\tbytes_up = %lu\n"
+			"\tbytes_down = %lu\n"
+			"\tmux_streams = %lu\n"
+			"\trelay_rounds = %lu\n"
+			"\trelay_deferred = %lu\n"
+			"\trelay_max_ready = %lu\n"
+			"\tbusy_spins = %lu\n"
+			"\tbusy_hits = %lu\n"
+			"\tbusy_sleeps = %lu\n"
+			"\tbusy_idle_us = %lu\n"
+			"\tbusy_budget_us = %lu\n"
+			"\talog_records = %lu\n"
+			"\talog_dropped = %lu\n"
+			"\talog_segments = %lu",
+			g_stats.accepted, g_stats.transparent_accepted, g_stats.active,
+			g_stats.requests, g_stats.http_requests, g_stats.connects_ok,
+			g_stats.connects_failed, g_stats.circuit_rejects,
+			g_stats.bytes_up, g_stats.bytes_down,
+			g_stats.mux_streams, g_stats.relay_rounds,
+			g_stats.relay_deferred, g_stats.relay_max_ready,
+			g_stats.busy_spins, g_stats.busy_hits, g_stats.busy_sleeps,
+			g_stats.busy_idle_us, g_stats.busy_budget_us,
+			g_stats.alog_records, g_stats.alog_dropped, g_stats.alog_segments);
+	oddsock_logx(0, "stats (loop lag):\n"
+			"\tlag_us = %lu\n"
+			"\tlag_max_us = %lu\n"
+			"\tlag_accept_pauses = %lu\n"
+			"\tlag_rejects = %lu\n"
+			"\tlag_probes_skipped = %lu",
+			g_stats.lag_us, g_stats.lag_max_us, g_stats.lag_accept_pauses,
+			g_stats.lag_rejects, g_stats.lag_probes_skipped);
+	oddsock_logx(0, "stats (upstream pool):\n"
+			"\tupstream_hits = %lu\n"
+			"\tupstream_misses = %lu\n"
+			"\tupstream_expired = %lu\n"
+			"\tupstream_failed = %lu\n"
+			"\tupstream_saved_us = %lu\n"
+			"\tupstream_pooled = %lu",
+			g_stats.upstream_hits, g_stats.upstream_misses,
+			g_stats.upstream_expired, g_stats.upstream_failed,
+			g_stats.upstream_saved_us, g_stats.upstream_pooled);
+	oddsock_logx(0, "stats (relay reads):\n"
+			"\trelay_fills = %lu\n"
+			"\trelay_fill_bytes = %lu\n"
+			"\trelay_read_grows = %lu\n"
+			"\trelay_read_shrinks = %lu",
+			g_stats.relay_fills, g_stats.relay_fill_bytes,
+			g_stats.relay_read_grows, g_stats.relay_read_shrinks);
+	oddsock_logx(0, "stats (sockmap):\n"
+			"\tsockmap_tunnels = %lu\n"
+			"\tsockmap_failed = %lu\n"
+			"\tsockmap_bytes = %lu",
+			g_stats.sockmap_tunnels, g_stats.sockmap_failed,
+			g_stats.sockmap_bytes);
+}
@@ -0,0 +1,94 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#ifndef ODDSOCK_STATS_H
+#define ODDSOCK_STATS_H
+
+/*
+ * Process-wide counters. Everything runs on the one event loop so plain
+ * increments suffice. Dumped to the log on SIGUSR1.
+ */
+
+struct oddsock_stats
+{
+	unsigned long accepted;
+	unsigned long transparent_accepted;
+	unsigned long active;
+	unsigned long requests;
+	unsigned long http_requests;	/* of which HTTP CONNECT */
+	unsigned long connects_ok;
+	unsigned long connects_failed;
+	unsigned long circuit_rejects;
+	unsigned long bytes_up;	/* client to destination */
+	unsigned long bytes_down;	/* destination to client */
+	unsigned long mux_streams;
+	unsigned long relay_rounds;	/* scheduler passes */
+	unsigned long relay_deferred;	/* directions with data after a quantum */
+	unsigned long relay_max_ready;	/* most directions waiting at once */
+	unsigned long busy_spins;	/* non-blocking loop passes */
+	unsigned long busy_hits;	/* passes that found work */
+	unsigned long busy_sleeps;	/* budget ran out, slept in the backend */
+	unsigned long busy_idle_us;	/* time spent spinning without work */
+	unsigned long busy_budget_us;	/* current spin budget */
+	unsigned long alog_records;
+	unsigned long alog_dropped;	/* no segment to write to */
+	unsigned long alog_segments;
+	unsigned long lag_us;	/* averaged event loop lag */
+	unsigned long lag_max_us;
+	unsigned long lag_accept_pauses;
+	unsigned long lag_rejects;	/* CONNECTs refused while lagging */
+	unsigned long lag_probes_skipped;
+	unsigned long upstream_hits;	/* requests sent on a pooled connection */
+	unsigned long upstream_misses;
+	unsigned long upstream_expired;	/* idle pooled connections closed */
+	unsigned long upstream_failed;
+	unsigned long upstream_saved_us;	/* handshake time of the hits */
+	unsigned long upstream_pooled;	/* ready connections */
+	unsigned long relay_fills;	/* reads past libevent's on bulk tunnels */
+	unsigned long relay_fill_bytes;
+	unsigned long relay_read_grows;
+	unsigned long relay_read_shrinks;
+	unsigned long sockmap_tunnels;	/* handed to the kernel */
+	unsigned long sockmap_failed;	/* kept in userspace with --sockmap */
+	unsigned long sockmap_bytes;	/* forwarded in the kernel */
+};
+
+extern struct oddsock_stats g_stats;
+
+/*
+ * stats_log
+ */
+void stats_log(void);
+
+#endif
@@ -0,0 +1,440 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/util.h>
+#include "util.h"
+#include "socks5.h"
+#include "tcpinfo.h"
+
+#define TCPINFO_SLOTS	(2 * TCPINFO_MAX)	/* index size, a power of two */
+
+#ifdef __linux__
+#ifndef TCP_INFO
+#define TCP_INFO (11)
+#endif
+/*
+ * The head of the kernel's struct tcp_info (linux/tcp.h) up to
+ * tcpi_delivery_rate; netinet/tcp.h stops short of the newer fields.
+ * Older kernels fill in less and leave the rest zero.
+ */
+struct oddsock_tcp_info {
+	uint8_t state[8];
+	uint32_t rto;
+	uint32_t ato;
+	uint32_t snd_mss;
+	uint32_t rcv_mss;
+	uint32_t unacked;
+	uint32_t sacked;
+	uint32_t lost;
+	uint32_t retrans;
+	uint32_t fackets;
+	uint32_t last[4];
+	uint32_t pmtu;
+	uint32_t rcv_ssthresh;
+	uint32_t rtt;
+	uint32_t rttvar;
+	uint32_t snd_ssthresh;
+	uint32_t snd_cwnd;
+	uint32_t advmss;
+	uint32_t reordering;
+	uint32_t rcv_rtt;
+	uint32_t rcv_space;
+	uint32_t total_retrans;
+	uint64_t pacing_rate;
+	uint64_t max_pacing_rate;
+	uint64_t bytes_acked;
+	uint64_t bytes_received;
+	uint32_t segs_out;
+	uint32_t segs_in;
+	uint32_t notsent_bytes;
+	uint32_t min_rtt;
+	uint32_t data_segs_in;
+	uint32_t data_segs_out;
+	uint64_t delivery_rate;
+};
+#endif
+
+struct tcpinfo_conn {
+	struct socks5_conn *sconn;
+	unsigned long last[TCPINFO_LEGS][TCPINFO_METRICS];
+	unsigned long total_retrans[TCPINFO_LEGS];
+	bool valid[TCPINFO_LEGS]; /* last holds a sample */
+};
+
+static struct tcpinfo_conn *g_tcpinfo_conns = NULL;
+static unsigned short g_tcpinfo_index[TCPINFO_SLOTS]; /* entry + 1 */
+static unsigned int g_tcpinfo_used = 0;
+static unsigned long g_tcpinfo_hist[TCPINFO_LEGS][TCPINFO_METRICS]
+		[TCPINFO_BUCKETS];
+static struct event *g_tcpinfo_ev = NULL;
+static unsigned int g_tcpinfo_sample = 1;
+static unsigned long g_tcpinfo_seen = 0; /* established tunnels */
+static unsigned long g_tcpinfo_pass_us = 0; /* last sampling pass */
+
+static const char *g_tcpinfo_legs[] = { "client", "dst" };
+static const char *g_tcpinfo_metrics[] = {
+	"rtt_us", "cwnd", "retrans", "rate_Bps", "queue_bytes"
+};
+
+/*
+ * tcpinfo_home
+ */
+static unsigned int tcpinfo_home(const struct socks5_conn *sconn)
+{
+	unsigned long h = (unsigned long)sconn >> 4;
+
+	return (unsigned int)((h * 2654435761UL) >> 7) & (TCPINFO_SLOTS - 1);
+}
+
+/*
+ * tcpinfo_find
+ * The index slot of a tracked tunnel, or TCPINFO_SLOTS.
+ */
+static unsigned int tcpinfo_find(const struct socks5_conn *sconn)
+{
+	unsigned int i;
+
+	for (i = tcpinfo_home(sconn); g_tcpinfo_index[i];
+			i = (i + 1) & (TCPINFO_SLOTS - 1))
+		if (g_tcpinfo_conns[g_tcpinfo_index[i] - 1].sconn == sconn)
+			return i;
+
+	return TCPINFO_SLOTS;
+}
+
+/*
+ * tcpinfo_unindex
+ * Empty slot i, shifting back later slots of its probe run.
+ */
+static void tcpinfo_unindex(unsigned int i)
+{
+	unsigned int j, k;
+
+	g_tcpinfo_index[i] = 0;
+	for (j = (i + 1) & (TCPINFO_SLOTS - 1); g_tcpinfo_index[j];
+			j = (j + 1) & (TCPINFO_SLOTS - 1)) {
+		k = tcpinfo_home(g_tcpinfo_conns[g_tcpinfo_index[j] - 1].sconn);
+		/* Leave slots whose home lies cyclically in (i, j]. */
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		g_tcpinfo_index[i] = g_tcpinfo_index[j];
+		g_tcpinfo_index[j] = 0;
+		i = j;
+	}
+}
+
+/*
+ * tcpinfo_bucket
+ */
+static unsigned int tcpinfo_bucket(unsigned long v)
+{
+	unsigned int b = 0;
+
+	while (v && b < TCPINFO_BUCKETS - 1) {
+		v >>= 1;
+		++b;
+	}
+	return b;
+}
+
+/*
+ * tcpinfo_leg_fd
+ * The socket of a leg, wherever it lives right now; -1 for mux streams.
+ */
+static int tcpinfo_leg_fd(struct socks5_conn *sconn, int leg)
+{
+	if (leg == TCPINFO_CLIENT)
+		return sconn->client ? bufferevent_getfd(sconn->client) :
+			sconn->client_fd;
+	return sconn->dst ? bufferevent_getfd(sconn->dst) : sconn->dst_fd;
+}
+
+/*
+ * tcpinfo_sample
+ * Read TCP_INFO for one leg and record it. returns -1 if it has none.
+ */
+static int tcpinfo_sample(struct tcpinfo_conn *c, int leg)
+{
+#ifdef __linux__
+	struct oddsock_tcp_info ti;
+	socklen_t len = sizeof(ti);
+	unsigned long *v = c->last[leg];
+	int fd, m;
+
+	fd = tcpinfo_leg_fd(c->sconn, leg);
+	if (fd < 0)
+		return -1;
+	memset(&ti, 0, sizeof(ti));
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, (void*)&ti, &len) < 0)
+		return -1;
+
+	v[TCPINFO_RTT] = ti.rtt;
+	v[TCPINFO_CWND] = ti.snd_cwnd;
+	v[TCPINFO_RETRANS] = ti.total_retrans - c->total_retrans[leg];
+	v[TCPINFO_RATE] = (unsigned long)ti.delivery_rate;
+	v[TCPINFO_QUEUE] = (unsigned long)ti.notsent_bytes +
+		(unsigned long)ti.unacked * ti.snd_mss;
+	c->total_retrans[leg] = ti.total_retrans;
+	c->valid[leg] = true;
+
+	for (m = 0; m < TCPINFO_METRICS; ++m)
+		++g_tcpinfo_hist[leg][m][tcpinfo_bucket(v[m])];
+	return 0;
+#else
+	(void)c;
+	(void)leg;
+	return -1;
+#endif
+}
+
+/*
+ * tcpinfo_timercb
+ */
+static void tcpinfo_timercb(int fd, short what, void *arg)
+{
+	struct timeval start, end, d;
+	unsigned int i;
+
+	evutil_gettimeofday(&start, NULL);
+	for (i = 0; i < g_tcpinfo_used; ++i) {
+		tcpinfo_sample(&g_tcpinfo_conns[i], TCPINFO_CLIENT);
+		tcpinfo_sample(&g_tcpinfo_conns[i], TCPINFO_DST);
+	}
+	evutil_gettimeofday(&end, NULL);
+	evutil_timersub(&end, &start, &d);
+	g_tcpinfo_pass_us = (unsigned long)d.tv_sec * 1000000UL +
+		(unsigned long)d.tv_usec;
+}
+
+/*
+ * tcpinfo_init
+ */
+int tcpinfo_init(struct event_base *base, unsigned int interval_ms,
+		unsigned int sample)
+{
+	struct timeval tv;
+
+	if (interval_ms == 0)
+		return 0;
+#ifndef __linux__
+	oddsock_logx(0, "TCP_INFO sampling is only supported on Linux");
+	return 0;
+#endif
+
+	g_tcpinfo_conns = (struct tcpinfo_conn*)calloc(TCPINFO_MAX,
+			sizeof(*g_tcpinfo_conns));
+	if (!g_tcpinfo_conns)
+		return -1;
+	g_tcpinfo_sample = sample > 0 ? sample : 1;
+
+	tv.tv_sec = interval_ms / 1000;
+	tv.tv_usec = (interval_ms % 1000) * 1000;
+	g_tcpinfo_ev = event_new(base, -1, EV_PERSIST, tcpinfo_timercb, NULL);
+	if (!g_tcpinfo_ev ||
+		event_priority_set(g_tcpinfo_ev, SOCKS5_PRIO_BULK) != 0 ||
+		event_add(g_tcpinfo_ev, &tv) != 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * tcpinfo_configure
+ */
+void tcpinfo_configure(unsigned int sample)
+{
+	g_tcpinfo_sample = sample > 0 ? sample : 1;
+}
+
+/*
+ * tcpinfo_free
+ */
+void tcpinfo_free(void)
+{
+	if (g_tcpinfo_ev) {
+		event_free(g_tcpinfo_ev);
+		g_tcpinfo_ev = NULL;
+	}
+	free(g_tcpinfo_conns);
+	g_tcpinfo_conns = NULL;
+	g_tcpinfo_used = 0;
+	memset(g_tcpinfo_index, 0, sizeof(g_tcpinfo_index));
+}
+
+/*
+ * tcpinfo_track
+ */
+void tcpinfo_track(struct socks5_conn *sconn)
+{
+	struct tcpinfo_conn *c;
+	unsigned int i;
+
+	if (!g_tcpinfo_conns || g_tcpinfo_seen++ % g_tcpinfo_sample != 0 ||
+		g_tcpinfo_used == TCPINFO_MAX || tcpinfo_find(sconn) != TCPINFO_SLOTS)
+		return;
+
+	c = &g_tcpinfo_conns[g_tcpinfo_used];
+	memset(c, 0, sizeof(*c));
+	c->sconn = sconn;
+	for (i = tcpinfo_home(sconn); g_tcpinfo_index[i];
+			i = (i + 1) & (TCPINFO_SLOTS - 1))
+		;
+	g_tcpinfo_index[i] = (unsigned short)(++g_tcpinfo_used);
+}
+
+/*
+ * tcpinfo_forget
+ */
+void tcpinfo_forget(struct socks5_conn *sconn)
+{
+	unsigned int i, e, last;
+
+	if (g_tcpinfo_used == 0)
+		return;
+	i = tcpinfo_find(sconn);
+	if (i == TCPINFO_SLOTS)
+		return;
+
+	/* Move the last entry into the hole. */
+	e = g_tcpinfo_index[i] - 1;
+	tcpinfo_unindex(i);
+	last = --g_tcpinfo_used;
+	if (e != last) {
+		i = tcpinfo_find(g_tcpinfo_conns[last].sconn);
+		g_tcpinfo_conns[e] = g_tcpinfo_conns[last];
+		g_tcpinfo_index[i] = (unsigned short)(e + 1);
+	}
+}
+
+/*
+ * tcpinfo_report_conns
+ */
+static void tcpinfo_report_conns(struct evbuffer *out, unsigned int n)
+{
+	struct tcpinfo_conn *c;
+	unsigned int i;
+	int leg;
+
+	for (i = 0; i < g_tcpinfo_used && i < n; ++i) {
+		c = &g_tcpinfo_conns[i];
+		evbuffer_add_printf(out, "(%d)", socks5_conn_id(c->sconn));
+		for (leg = 0; leg < TCPINFO_LEGS; ++leg) {
+			if (!c->valid[leg]) {
+				evbuffer_add_printf(out, " %s -", g_tcpinfo_legs[leg]);
+				continue;
+			}
+			evbuffer_add_printf(out, " %s rtt %lu cwnd %lu retrans %lu "
+					"rate %lu queue %lu", g_tcpinfo_legs[leg],
+					c->last[leg][TCPINFO_RTT], c->last[leg][TCPINFO_CWND],
+					c->last[leg][TCPINFO_RETRANS],
+					c->last[leg][TCPINFO_RATE], c->last[leg][TCPINFO_QUEUE]);
+		}
+		evbuffer_add_printf(out, "\n");
+	}
+}
+
+/*
+ * tcpinfo_percentile
+ * The upper bound of the bucket holding the p-th percentile.
+ */
+static unsigned long tcpinfo_percentile(const unsigned long *hist,
+		unsigned long total, unsigned int p)
+{
+	unsigned long want, seen = 0;
+	unsigned int b;
+
+	want = (total * p + 99) / 100;
+	for (b = 0; b < TCPINFO_BUCKETS; ++b) {
+		seen += hist[b];
+		if (seen >= want)
+			break;
+	}
+	return b == 0 ? 0 : (1UL << (b - 1)) * 2 - 1;
+}
+
+/*
+ * tcpinfo_report
+ */
+void tcpinfo_report(struct evbuffer *out, char *args)
+{
+	const unsigned long *hist;
+	unsigned long total;
+	unsigned int b, n;
+	int leg, m;
+	char *arg;
+
+	if (!g_tcpinfo_conns) {
+		evbuffer_add_printf(out, "tcpinfo sampling is off\n");
+		return;
+	}
+
+	arg = strtok(args, " \t");
+	if (arg && strcmp(arg, "conns") == 0) {
+		arg = strtok(NULL, " \t");
+		n = arg ? (unsigned int)strtoul(arg, NULL, 10) : TCPINFO_MAX;
+		tcpinfo_report_conns(out, n);
+		return;
+	} else if (arg) {
+		evbuffer_add_printf(out, "usage: tcpinfo [conns [n]]\n");
+		return;
+	}
+
+	evbuffer_add_printf(out, "%u tunnels tracked of %lu, last pass %lu us\n",
+			g_tcpinfo_used, g_tcpinfo_seen, g_tcpinfo_pass_us);
+	for (leg = 0; leg < TCPINFO_LEGS; ++leg) {
+		for (m = 0; m < TCPINFO_METRICS; ++m) {
+			hist = g_tcpinfo_hist[leg][m];
+			for (total = 0, b = 0; b < TCPINFO_BUCKETS; ++b)
+				total += hist[b];
+			if (total == 0)
+				continue;
+			evbuffer_add_printf(out, "%s %s: %lu samples, p50 <= %lu, "
+					"p90 <= %lu, p99 <= %lu, max <= %lu\n",
+					g_tcpinfo_legs[leg], g_tcpinfo_metrics[m], total,
+					tcpinfo_percentile(hist, total, 50),
+					tcpinfo_percentile(hist, total, 90),
+					tcpinfo_percentile(hist, total, 99),
+					tcpinfo_percentile(hist, total, 100));
+		}
+	}
+}
@@ -0,0 +1,109 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#ifndef ODDSOCK_TCPINFO_H
+#define ODDSOCK_TCPINFO_H
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+/*
+ * TCP_INFO telemetry.
+ *
+ * One in --tcpinfoSample established tunnels is tracked, up to
+ * TCPINFO_MAX at a time. Every --tcpinfoInterval milliseconds both legs
+ * of each tracked tunnel are read with getsockopt(TCP_INFO) and the
+ * smoothed RTT, congestion window, retransmits since the last sample,
+ * delivery rate and bytes queued in the kernel (unsent plus in flight)
+ * go into power of two histograms kept per leg. Legs that are not TCP
+ * sockets (mux streams, unix clients) are skipped.
+ *
+ * The admin socket shows the histograms ("tcpinfo") and the last sample
+ * of every tracked tunnel ("tcpinfo conns [n]").
+ */
+
+#define TCPINFO_CLIENT	(0)
+#define TCPINFO_DST		(1)
+#define TCPINFO_LEGS	(2)
+
+#define TCPINFO_RTT		(0)	/* us */
+#define TCPINFO_CWND	(1)	/* segments */
+#define TCPINFO_RETRANS	(2)	/* segments since the last sample */
+#define TCPINFO_RATE	(3)	/* delivery rate, bytes/s */
+#define TCPINFO_QUEUE	(4)	/* bytes unsent or unacknowledged */
+#define TCPINFO_METRICS	(5)
+
+#define TCPINFO_MAX		(1024)	/* tracked tunnels */
+#define TCPINFO_BUCKETS	(8 * sizeof(unsigned long) + 1) /* 0, [2^i, 2^(i+1)) */
+
+struct socks5_conn;
+
+/*
+ * tcpinfo_init
+ * Start the sampling timer; an interval of 0 disables sampling.
+ */
+int tcpinfo_init(struct event_base *base, unsigned int interval_ms,
+		unsigned int sample);
+
+/*
+ * tcpinfo_configure
+ * Track one in sample tunnels from now on.
+ */
+void tcpinfo_configure(unsigned int sample);
+
+/*
+ * tcpinfo_free
+ */
+void tcpinfo_free(void);
+
+/*
+ * tcpinfo_track
+ * Consider a newly established tunnel for sampling.
+ */
+void tcpinfo_track(struct socks5_conn *sconn);
+
+/*
+ * tcpinfo_forget
+ * Stop sampling a tunnel that is being freed.
+ */
+void tcpinfo_forget(struct socks5_conn *sconn);
+
+/*
+ * tcpinfo_report
+ * Append the per-leg histograms, or with "conns [n]" the last samples of
+ * up to n tracked tunnels, to out.
+ */
+void tcpinfo_report(struct evbuffer *out, char *args);
+
+#endif
@@ -0,0 +1,191 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+/*
+ * alogdump
+ * Print the records of oddsock --accessLog segments as text, one line per
+ * connection, or as CSV with -c:
+ *
+ *   start duration_us kind client dst up down outcome reason
+ *
+ * start is unix time with microseconds. client and dst are addr:port
+ * ([addr]:port for IPv6), - when unknown; domain names longer than the
+ * record holds end in "...".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../alog.h"
+
+static const char *kinds[] = { "socks", "transparent", "mux" };
+static const char *outcomes[] = { "-", "ok", "fail", "reject" };
+static const char *reasons[] = { "-", "client", "dst", "client_error",
+	"dst_error", "timeout", "request", "connect", "admin" };
+
+static int csv = 0;
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: alogdump [-c] segment...\n");
+	exit(EXIT_FAILURE);
+}
+
+static const char *name(const char **names, size_t n, unsigned int i)
+{
+	return i < n ? names[i] : "?";
+}
+
+static void format_addr(char *buf, size_t len, int family,
+		const unsigned char *addr, unsigned int addr_len, unsigned int port)
+{
+	char a[INET6_ADDRSTRLEN];
+
+	if (family == 4 && inet_ntop(AF_INET, addr, a, sizeof(a)))
+		snprintf(buf, len, "%s:%u", a, port);
+	else if (family == 6 && inet_ntop(AF_INET6, addr, a, sizeof(a)))
+		snprintf(buf, len, "[%s]:%u", a, port);
+	else if (family == TRACE_DST_DOMAIN)
+		snprintf(buf, len, "%.*s%s:%u", (int)addr_len, (const char*)addr,
+				addr_len == TRACE_DST_LEN ? "..." : "", port);
+	else
+		snprintf(buf, len, "-");
+}
+
+static void print_record(const struct alog_record *r)
+{
+	char client[INET6_ADDRSTRLEN + 16], dst[TRACE_DST_LEN + 16];
+	int dst_family;
+
+	format_addr(client, sizeof(client), r->client_family, r->client_addr,
+			16, r->client_port);
+	dst_family = r->dst_type == TRACE_DST_IPV4 ? 4 :
+		r->dst_type == TRACE_DST_IPV6 ? 6 :
+		r->dst_type == TRACE_DST_DOMAIN ? TRACE_DST_DOMAIN : 0;
+	format_addr(dst, sizeof(dst), dst_family, r->dst, r->dst_len,
+			r->dst_port);
+
+	printf(csv ? "%lu.%06lu,%lu,%s,%s,%s,%lu,%lu,%s,%s\n" :
+			"%lu.%06lu %lu %s %s %s %lu %lu %s %s\n",
+			(unsigned long)(r->start_us / 1000000),
+			(unsigned long)(r->start_us % 1000000),
+			(unsigned long)r->duration_us,
+			name(kinds, sizeof(kinds) / sizeof(*kinds), r->kind),
+			client, dst,
+			(unsigned long)r->bytes_up, (unsigned long)r->bytes_down,
+			name(outcomes, sizeof(outcomes) / sizeof(*outcomes), r->outcome),
+			name(reasons, sizeof(reasons) / sizeof(*reasons), r->reason));
+}
+
+static int dump(const char *path)
+{
+	const struct alog_header *hdr;
+	const struct alog_record *r;
+	struct stat st;
+	unsigned char *map;
+	size_t off;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	if ((size_t)st.st_size < sizeof(*hdr)) {
+		fprintf(stderr, "alogdump: %s: too short\n", path);
+		close(fd);
+		return -1;
+	}
+	map = (unsigned char*)mmap(NULL, (size_t)st.st_size, PROT_READ,
+			MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == (unsigned char*)MAP_FAILED) {
+		perror(path);
+		return -1;
+	}
+
+	hdr = (const struct alog_header*)map;
+	if (memcmp(hdr->magic, ALOG_MAGIC, sizeof(hdr->magic)) != 0 ||
+		hdr->byte_order != ALOG_BYTE_ORDER ||
+		hdr->record_size != sizeof(*r)) {
+		fprintf(stderr, "alogdump: %s: not an access log of this layout "
+				"and byte order\n", path);
+		munmap(map, (size_t)st.st_size);
+		return -1;
+	}
+
+	/* A segment still being written ends at the first empty record. */
+	for (off = sizeof(*hdr); off + sizeof(*r) <= (size_t)st.st_size;
+			off += sizeof(*r)) {
+		r = (const struct alog_record*)(map + off);
+		if (r->version != ALOG_RECORD_VERSION)
+			break;
+		print_record(r);
+	}
+
+	munmap(map, (size_t)st.st_size);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, i, ret = EXIT_SUCCESS;
+
+	while ((opt = getopt(argc, argv, "c")) != -1) {
+		switch (opt) {
+		case 'c': csv = 1; break;
+		default: usage();
+		}
+	}
+	if (optind == argc)
+		usage();
+
+	if (csv)
+		printf("start,duration_us,kind,client,dst,up,down,outcome,reason\n");
+	for (i = optind; i < argc; ++i)
+		if (dump(argv[i]) != 0)
+			ret = EXIT_FAILURE;
+
+	return ret;
+}
@@ -0,0 +1,451 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <event2/buffer.h>
+#include <event2/listener.h>
+#include "harness.h"
+
+enum {
+	HT_CONNECTING = 0,
+	HT_GREETING,
+	HT_REQUEST,
+	HT_DONE
+};
+
+double harness_now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+}
+
+long harness_raise_nofile(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) != 0)
+		return -1;
+	rl.rlim_cur = rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl) != 0)
+		return -1;
+	return (long)rl.rlim_cur;
+}
+
+int harness_parse_addr(const char *host, unsigned short port,
+		struct sockaddr_storage *ss, socklen_t *sslen)
+{
+	struct sockaddr_in *sin = (struct sockaddr_in*)ss;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)ss;
+	struct sockaddr_un *sun = (struct sockaddr_un*)ss;
+
+	memset(ss, 0, sizeof(*ss));
+	if (host[0] == '/') {
+		if (strlen(host) >= sizeof(sun->sun_path))
+			return -1;
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, host);
+		*sslen = sizeof(*sun);
+		return 0;
+	}
+	if (inet_pton(AF_INET, host, &sin->sin_addr) == 1) {
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+		*sslen = sizeof(*sin);
+		return 0;
+	}
+	if (inet_pton(AF_INET6, host, &sin6->sin6_addr) == 1) {
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		*sslen = sizeof(*sin6);
+		return 0;
+	}
+	return -1;
+}
+
+/*
+ * Sink: echoes everything back.
+ */
+
+static void sink_readcb(struct bufferevent *bev, void *arg)
+{
+	bufferevent_read_buffer(bev, bufferevent_get_output(bev));
+}
+
+static void sink_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR))
+		bufferevent_free(bev);
+}
+
+static void sink_acceptcb(struct evconnlistener *listener, evutil_socket_t fd,
+		struct sockaddr *sa, int salen, void *arg)
+{
+	struct bufferevent *bev;
+
+	bev = bufferevent_socket_new(evconnlistener_get_base(listener), fd,
+			BEV_OPT_CLOSE_ON_FREE);
+	if (!bev) {
+		close(fd);
+		return;
+	}
+	bufferevent_setcb(bev, sink_readcb, NULL, sink_eventcb, NULL);
+	bufferevent_enable(bev, EV_READ|EV_WRITE);
+}
+
+int harness_sink_listen(struct event_base *base, int nports,
+		unsigned short *ports)
+{
+	struct sockaddr_in sin;
+	socklen_t len;
+	struct evconnlistener *listener;
+	int i;
+
+	for (i = 0; i < nports; ++i) {
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		listener = evconnlistener_new_bind(base, sink_acceptcb, NULL,
+				LEV_OPT_CLOSE_ON_FREE|LEV_OPT_REUSEABLE, 4096,
+				(struct sockaddr*)&sin, sizeof(sin));
+		if (!listener)
+			return -1;
+
+		len = sizeof(sin);
+		getsockname(evconnlistener_get_fd(listener),
+				(struct sockaddr*)&sin, &len);
+		ports[i] = ntohs(sin.sin_port);
+	}
+	return 0;
+}
+
+pid_t harness_sink_spawn(int nports, unsigned short *ports)
+{
+	struct event_base *base;
+	int fds[2];
+	pid_t pid;
+
+	if (pipe(fds) != 0)
+		return -1;
+
+	pid = fork();
+	if (pid == 0) {
+		close(fds[0]);
+		base = event_base_new();
+		if (!base || harness_sink_listen(base, nports, ports) != 0)
+			_exit(1);
+		if (write(fds[1], ports, nports * sizeof(*ports)) < 0)
+			_exit(1);
+		close(fds[1]);
+		event_base_dispatch(base);
+		_exit(0);
+	}
+
+	close(fds[1]);
+	if (pid < 0 ||
+		read(fds[0], ports, nports * sizeof(*ports)) !=
+			(ssize_t)(nports * sizeof(*ports))) {
+		close(fds[0]);
+		return -1;
+	}
+	close(fds[0]);
+	return pid;
+}
+
+/*
+ * SOCKS 5 client handshake.
+ */
+
+static void tunnel_done(struct harness_tunnel *t, int ok)
+{
+	t->state = HT_DONE;
+	t->connect_us = harness_now_us() - t->start_us;
+	if (!ok) {
+		bufferevent_free(t->bev);
+		t->bev = NULL;
+	} else
+		bufferevent_setcb(t->bev, NULL, NULL, NULL, NULL);
+	t->cb(t, ok, t->arg);
+}
+
+static void tunnel_readcb(struct bufferevent *bev, void *arg)
+{
+	struct harness_tunnel *t = (struct harness_tunnel*)arg;
+	struct evbuffer *in = bufferevent_get_input(bev);
+	unsigned char reply[4];
+	size_t need;
+
+	if (t->state == HT_GREETING) {
+		if (evbuffer_get_length(in) < 2)
+			return;
+		evbuffer_remove(in, reply, 2);
+		if (reply[0] != 0x05 || reply[1] != 0x00) {
+			tunnel_done(t, 0);
+			return;
+		}
+		t->state = HT_REQUEST;
+		bufferevent_write(bev, t->request, t->request_len);
+		return;
+	}
+
+	if (t->state == HT_REQUEST) {
+		/* Failure replies from oddsock are only two bytes long. */
+		if (evbuffer_get_length(in) < 2)
+			return;
+		evbuffer_copyout(in, reply, 2);
+		t->reply = reply[1];
+		if (reply[1] != 0x00) {
+			tunnel_done(t, 0);
+			return;
+		}
+		if (evbuffer_get_length(in) < 4)
+			return;
+		evbuffer_copyout(in, reply, 4);
+		need = reply[3] == 0x04 ? 22 : 10;
+		if (evbuffer_get_length(in) < need)
+			return;
+		evbuffer_drain(in, need);
+		tunnel_done(t, 1);
+	}
+}
+
+static void tunnel_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	struct harness_tunnel *t = (struct harness_tunnel*)arg;
+	static const unsigned char greeting[3] = { 0x05, 0x01, 0x00 };
+
+	if (what & BEV_EVENT_CONNECTED) {
+		t->state = HT_GREETING;
+		bufferevent_write(bev, greeting, sizeof(greeting));
+		return;
+	}
+	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR|BEV_EVENT_TIMEOUT))
+		tunnel_done(t, 0);
+}
+
+int harness_tunnel_open(struct harness_tunnel *t, struct event_base *base,
+		const struct sockaddr *proxy, socklen_t proxylen,
+		const struct sockaddr *src, socklen_t srclen,
+		const char *dst_host, unsigned short dst_port,
+		harness_tunnel_cb cb, void *arg)
+{
+	unsigned char *r = t->request;
+	size_t hlen;
+	evutil_socket_t fd = -1;
+
+	r[0] = 0x05;
+	r[1] = 0x01;
+	r[2] = 0x00;
+	if (inet_pton(AF_INET, dst_host, &r[4]) == 1) {
+		r[3] = 0x01;
+		t->request_len = 4 + 4;
+	} else if (inet_pton(AF_INET6, dst_host, &r[4]) == 1) {
+		r[3] = 0x04;
+		t->request_len = 4 + 16;
+	} else {
+		hlen = strlen(dst_host);
+		if (hlen == 0 || hlen > 255)
+			return -1;
+		r[3] = 0x03;
+		r[4] = (unsigned char)hlen;
+		memcpy(&r[5], dst_host, hlen);
+		t->request_len = 5 + hlen;
+	}
+	r[t->request_len++] = (unsigned char)(dst_port >> 8);
+	r[t->request_len++] = (unsigned char)(dst_port & 0xff);
+
+	if (src) {
+		fd = socket(src->sa_family, SOCK_STREAM, 0);
+		if (fd < 0)
+			return -1;
+		evutil_make_socket_nonblocking(fd);
+		if (bind(fd, src, srclen) != 0) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	t->bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+	if (!t->bev) {
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	t->state = HT_CONNECTING;
+	t->cb = cb;
+	t->arg = arg;
+	t->start_us = harness_now_us();
+	bufferevent_setcb(t->bev, tunnel_readcb, NULL, tunnel_eventcb, t);
+	bufferevent_enable(t->bev, EV_READ|EV_WRITE);
+
+	if (bufferevent_socket_connect(t->bev, (struct sockaddr*)proxy,
+				(int)proxylen) != 0) {
+		bufferevent_free(t->bev);
+		t->bev = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Statistics and process sampling.
+ */
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+double harness_percentile(double *v, size_t n, double p)
+{
+	size_t i;
+
+	if (n == 0)
+		return 0.0;
+	qsort(v, n, sizeof(double), cmp_double);
+	i = (size_t)(p / 100.0 * (double)(n - 1) + 0.5);
+	return v[i < n ? i : n - 1];
+}
+
+pid_t harness_spawn(char *const argv[])
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid == 0) {
+		execv(argv[0], argv);
+		perror(argv[0]);
+		_exit(127);
+	}
+	return pid;
+}
+
+pid_t harness_spawn_oddsock(const char *path, const char *addr,
+		unsigned short port, char **args, int nargs)
+{
+	char **argv = (char**)calloc(nargs + 7, sizeof(char*));
+	char portstr[8];
+	pid_t pid;
+	int i;
+
+	if (!argv)
+		return -1;
+
+	snprintf(portstr, sizeof(portstr), "%u", port);
+	argv[0] = (char*)path;
+	argv[1] = "-4";
+	argv[2] = "-b";
+	argv[3] = (char*)addr;
+	argv[4] = "-p";
+	argv[5] = portstr;
+	for (i = 0; i < nargs; ++i)
+		argv[6 + i] = args[i];
+	pid = harness_spawn(argv);
+	free(argv);
+	usleep(300000);
+	return pid;
+}
+
+long harness_proc_rss_kb(pid_t pid)
+{
+	char path[64], line[256];
+	FILE *f;
+	long kb = -1;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "VmRSS: %ld kB", &kb) == 1)
+			break;
+	fclose(f);
+	return kb;
+}
+
+int harness_proc_fds(pid_t pid)
+{
+	char path[64];
+	DIR *dir;
+	struct dirent *ent;
+	int n = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/fd", (int)pid);
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+	while ((ent = readdir(dir)) != NULL)
+		if (ent->d_name[0] != '.')
+			++n;
+	closedir(dir);
+	return n;
+}
+
+double harness_proc_cpu_us(pid_t pid)
+{
+	char path[64], buf[1024];
+	char *p;
+	FILE *f;
+	unsigned long utime, stime;
+	size_t n;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	f = fopen(path, "r");
+	if (!f)
+		return -1.0;
+	n = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[n] = '\0';
+
+	/* Skip "pid (comm) "; comm may contain spaces. */
+	p = strrchr(buf, ')');
+	if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+				"%lu %lu", &utime, &stime) != 2)
+		return -1.0;
+
+	return (double)(utime + stime) * 1e6 / (double)sysconf(_SC_CLK_TCK);
+}
@@ -0,0 +1,144 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#ifndef ODDSOCK_TOOLS_HARNESS_H
+#define ODDSOCK_TOOLS_HARNESS_H
+
+/*
+ * Shared pieces of the benchmark and soak tools: a loopback sink server,
+ * an asynchronous SOCKS 5 tunnel opener, statistics and sampling of the
+ * proxy process. The /proc based helpers are Linux only.
+ */
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+
+struct harness_tunnel;
+
+/* ok is 1 once the SOCKS reply arrived, 0 on any failure. */
+typedef void (*harness_tunnel_cb)(struct harness_tunnel *t, int ok, void *arg);
+
+/*
+ * harness_tunnel
+ * Embedded by the tools in their own per connection structure. After a
+ * successful callback bev belongs to the caller, who installs its own
+ * callbacks; after a failed one bev has been freed.
+ */
+struct harness_tunnel {
+	struct bufferevent *bev;
+	int state;
+	unsigned char reply;
+	double start_us;
+	double connect_us; /* time from open to SOCKS reply */
+	harness_tunnel_cb cb;
+	void *arg;
+	unsigned char request[4 + 1 + 255 + 2];
+	size_t request_len;
+};
+
+double harness_now_us(void);
+
+/*
+ * harness_raise_nofile
+ * Raise RLIMIT_NOFILE to its hard limit and return the new soft limit.
+ */
+long harness_raise_nofile(void);
+
+/*
+ * harness_parse_addr
+ * Fill a sockaddr from a numeric host and port, or from a unix socket
+ * path (anything starting with '/').
+ */
+int harness_parse_addr(const char *host, unsigned short port,
+		struct sockaddr_storage *ss, socklen_t *sslen);
+
+/*
+ * harness_sink_listen
+ * Start nports echo listeners on 127.0.0.1 with kernel chosen ports.
+ */
+int harness_sink_listen(struct event_base *base, int nports,
+		unsigned short *ports);
+
+/*
+ * harness_sink_spawn
+ * Run the echo listeners in a child process with its own event loop, so
+ * echoing bulk traffic does not compete with the driver's loop.
+ */
+pid_t harness_sink_spawn(int nports, unsigned short *ports);
+
+/*
+ * harness_tunnel_open
+ * Connect to the proxy (optionally from src) and run the SOCKS 5 handshake
+ * for dst_host:dst_port. Numeric hosts are sent as address literals, other
+ * names as domains.
+ */
+int harness_tunnel_open(struct harness_tunnel *t, struct event_base *base,
+		const struct sockaddr *proxy, socklen_t proxylen,
+		const struct sockaddr *src, socklen_t srclen,
+		const char *dst_host, unsigned short dst_port,
+		harness_tunnel_cb cb, void *arg);
+
+/*
+ * harness_percentile
+ * p in [0, 100]; sorts v in place.
+ */
+double harness_percentile(double *v, size_t n, double p);
+
+/*
+ * harness_spawn
+ * fork/exec argv, returns the child pid.
+ */
+pid_t harness_spawn(char *const argv[]);
+
+/*
+ * harness_spawn_oddsock
+ * Start oddsock listening on addr:port (IPv4) with extra arguments and
+ * give it time to bind.
+ */
+pid_t harness_spawn_oddsock(const char *path, const char *addr,
+		unsigned short port, char **args, int nargs);
+
+long harness_proc_rss_kb(pid_t pid);
+int harness_proc_fds(pid_t pid);
+
+/*
+ * harness_proc_cpu_us
+ * User plus system CPU time consumed by pid.
+ */
+double harness_proc_cpu_us(pid_t pid);
+
+#endif
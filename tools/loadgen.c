@@ -0,0 +1,469 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+/*
+ * loadgen
+ * Benchmark driver. Keeps a number of bulk (elephant) tunnels streaming
+ * through a local oddsock to a loopback echo sink and meanwhile opens
+ * short-lived tunnels at a fixed rate, recording the handshake latency of
+ * each (TCP connect through SOCKS reply). Heavy elephants keep eight
+ * times as much data in flight as the others. Mouse tunnels send a small
+ * message at a fixed interval and record its echo round trip. Reports
+ * handshake and mouse percentiles, bulk throughput and how evenly it is
+ * shared (Jain's index over the elephants, 1.0 = perfectly even).
+ *
+ * A path as the address (-a /path) connects to oddsock's unix listener;
+ * an oddsock started with -x is then given --unixListen /path.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include "harness.h"
+
+#define TICK_MS (10)
+#define MAX_SAMPLES (1000000)
+#define BULK_CHUNK (64 * 1024)
+#define BULK_QUEUE (4 * BULK_CHUNK)
+#define MOUSE_MSG (64)
+#define HEAVY_FACTOR (8)
+
+/* The driver's own bulk tunnels run behind its handshakes, which keep the
+ * default (middle) priority, so its loop adds little to what is measured. */
+#define LG_PRIORITIES (3)
+#define LG_PRIO_BULK (2)
+
+struct lg_tunnel {
+	struct harness_tunnel t;
+	unsigned long bytes; /* received through the tunnel */
+	unsigned long bytes_start; /* at the start of the measurement */
+	double sent_us; /* mice: outstanding message */
+	size_t queue; /* elephants: bytes kept queued towards the sink */
+	int up;
+};
+
+static struct {
+	const char *proxy_path;
+	char **proxy_args;
+	int proxy_nargs;
+	pid_t pid;
+	const char *addr;
+	unsigned short port;
+	unsigned int bulk;
+	unsigned long rate;
+	unsigned int duration;
+	unsigned int warmup;
+	unsigned int mice;
+	unsigned int mouse_interval; /* ms */
+	unsigned int heavy; /* elephants with HEAVY_FACTOR times the queue */
+} opts = {
+	NULL, NULL, 0, 0, "127.0.0.1", 11080, 8, 200, 10, 1, 0, 10, 0
+};
+
+static struct event_base *base;
+static struct sockaddr_storage proxy_ss;
+static socklen_t proxy_len;
+static unsigned short sink_port;
+static char sink_host[] = "127.0.0.1";
+
+static struct lg_tunnel *bulk;
+static unsigned int bulk_up;
+static unsigned long bulk_bytes_start;
+static double start_us, measure_us, end_us;
+static double cpu_start_us;
+
+static double *samples;
+static size_t nsamples;
+static struct lg_tunnel *mice;
+static double *mouse_samples;
+static size_t nmouse_samples;
+static unsigned long mice_failed;
+static double mouse_last_us;
+static unsigned long hs_opened, hs_failed, bulk_failed;
+
+static unsigned char chunk[BULK_CHUNK];
+
+static void usage(void)
+{
+	fprintf(stderr,
+			"usage: loadgen [-x oddsock-path | -P pid]\n"
+			"               [-a addr | -a unix-path] [-p port]\n"
+			"               [-b bulk-tunnels] [-H heavy-bulk-tunnels]\n"
+			"               [-h handshakes/sec]\n"
+			"               [-m mice] [-i mouse-interval-ms]\n"
+			"               [-d secs] [-w warmup-secs]\n"
+			"               [-- extra oddsock args]\n");
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Bulk tunnels: keep BULK_QUEUE bytes queued towards the sink and count
+ * what comes back.
+ */
+
+static void bulk_fill(struct bufferevent *bev, struct lg_tunnel *lt)
+{
+	struct evbuffer *out = bufferevent_get_output(bev);
+
+	while (evbuffer_get_length(out) < lt->queue)
+		evbuffer_add(out, chunk, sizeof(chunk));
+}
+
+static void bulk_readcb(struct bufferevent *bev, void *arg)
+{
+	struct lg_tunnel *lt = (struct lg_tunnel*)arg;
+	struct evbuffer *in = bufferevent_get_input(bev);
+
+	lt->bytes += evbuffer_get_length(in);
+	evbuffer_drain(in, evbuffer_get_length(in));
+}
+
+static void bulk_writecb(struct bufferevent *bev, void *arg)
+{
+	bulk_fill(bev, (struct lg_tunnel*)arg);
+}
+
+static void bulk_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	struct lg_tunnel *lt = (struct lg_tunnel*)arg;
+
+	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
+		bufferevent_free(lt->t.bev);
+		lt->t.bev = NULL;
+		++bulk_failed;
+		--bulk_up;
+	}
+}
+
+static void bulk_cb(struct harness_tunnel *t, int ok, void *arg)
+{
+	if (!ok) {
+		++bulk_failed;
+		return;
+	}
+	++bulk_up;
+	bufferevent_priority_set(t->bev, LG_PRIO_BULK);
+	bufferevent_setcb(t->bev, bulk_readcb, bulk_writecb, bulk_eventcb, arg);
+	bufferevent_setwatermark(t->bev, EV_WRITE,
+			((struct lg_tunnel*)arg)->queue / 2, 0);
+	bufferevent_enable(t->bev, EV_READ|EV_WRITE);
+	bulk_fill(t->bev, (struct lg_tunnel*)arg);
+}
+
+static unsigned long bulk_bytes(void)
+{
+	unsigned long sum = 0;
+	unsigned int i;
+
+	for (i = 0; i < opts.bulk; ++i)
+		sum += bulk[i].bytes;
+	return sum;
+}
+
+/*
+ * Mouse tunnels: one small message in flight, timed until it is echoed.
+ */
+
+static void mouse_readcb(struct bufferevent *bev, void *arg)
+{
+	struct lg_tunnel *lt = (struct lg_tunnel*)arg;
+	struct evbuffer *in = bufferevent_get_input(bev);
+
+	if (evbuffer_get_length(in) < MOUSE_MSG)
+		return;
+	evbuffer_drain(in, MOUSE_MSG);
+	if (measure_us > 0 && nmouse_samples < MAX_SAMPLES)
+		mouse_samples[nmouse_samples++] = harness_now_us() - lt->sent_us;
+	lt->sent_us = 0;
+}
+
+static void mouse_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	struct lg_tunnel *lt = (struct lg_tunnel*)arg;
+
+	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
+		bufferevent_free(lt->t.bev);
+		lt->t.bev = NULL;
+		lt->up = 0;
+		++mice_failed;
+	}
+}
+
+static void mouse_cb(struct harness_tunnel *t, int ok, void *arg)
+{
+	if (!ok) {
+		++mice_failed;
+		return;
+	}
+	((struct lg_tunnel*)arg)->up = 1;
+	bufferevent_setcb(t->bev, mouse_readcb, NULL, mouse_eventcb, arg);
+	bufferevent_enable(t->bev, EV_READ|EV_WRITE);
+}
+
+static void mouse_send(double now)
+{
+	unsigned int i;
+
+	for (i = 0; i < opts.mice; ++i) {
+		struct lg_tunnel *lt = &mice[i];
+		if (!lt->up || lt->sent_us > 0)
+			continue;
+		lt->sent_us = now;
+		bufferevent_write(lt->t.bev, chunk, MOUSE_MSG);
+	}
+}
+
+/*
+ * jain_index
+ * (sum x)^2 / (n * sum x^2) over the elephants' bytes in the window.
+ */
+static double jain_index(double *min, double *max)
+{
+	double sum = 0, sq = 0, x;
+	unsigned int i;
+
+	*min = *max = 0;
+	for (i = 0; i < opts.bulk; ++i) {
+		x = (double)(bulk[i].bytes - bulk[i].bytes_start);
+		sum += x;
+		sq += x * x;
+		if (i == 0 || x < *min)
+			*min = x;
+		if (x > *max)
+			*max = x;
+	}
+	return sq > 0 ? sum * sum / (opts.bulk * sq) : 0;
+}
+
+/*
+ * Handshake tunnels: record the time to the SOCKS reply and close.
+ */
+
+static void handshake_cb(struct harness_tunnel *t, int ok, void *arg)
+{
+	if (!ok)
+		++hs_failed;
+	else {
+		if (nsamples < MAX_SAMPLES)
+			samples[nsamples++] = t->connect_us;
+		bufferevent_free(t->bev);
+	}
+	free(t);
+}
+
+static void open_handshakes(unsigned long count)
+{
+	struct harness_tunnel *t;
+	unsigned long i;
+
+	for (i = 0; i < count; ++i) {
+		t = (struct harness_tunnel*)calloc(1, sizeof(*t));
+		if (!t)
+			return;
+		++hs_opened;
+		if (harness_tunnel_open(t, base, (struct sockaddr*)&proxy_ss,
+					proxy_len, NULL, 0, sink_host, sink_port,
+					handshake_cb, NULL) != 0)
+			handshake_cb(t, 0, NULL);
+	}
+}
+
+static void tick_cb(evutil_socket_t fd, short what, void *arg)
+{
+	static double carry;
+	double now = harness_now_us();
+
+	if (now >= end_us) {
+		event_base_loopexit(base, NULL);
+		return;
+	}
+	if (measure_us == 0 && now - start_us >= opts.warmup * 1e6) {
+		unsigned int i;
+		measure_us = now;
+		cpu_start_us = harness_proc_cpu_us(opts.pid);
+		bulk_bytes_start = bulk_bytes();
+		for (i = 0; i < opts.bulk; ++i)
+			bulk[i].bytes_start = bulk[i].bytes;
+	}
+	if (measure_us == 0)
+		return;
+
+	if (opts.mice > 0 && now - mouse_last_us >= opts.mouse_interval * 1e3) {
+		mouse_last_us = now;
+		mouse_send(now);
+	}
+
+	carry += (double)opts.rate * TICK_MS / 1000.0;
+	open_handshakes((unsigned long)carry);
+	carry -= (double)(unsigned long)carry;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, ret = EXIT_SUCCESS;
+	unsigned int i;
+	struct timeval tv;
+	struct event *tick;
+	pid_t sink_pid;
+	double secs, jain, min, max;
+	char **unix_args;
+
+	while ((opt = getopt(argc, argv, "x:P:a:p:b:H:h:m:i:d:w:")) != -1) {
+		switch (opt) {
+		case 'x': opts.proxy_path = optarg; break;
+		case 'P': opts.pid = (pid_t)atoi(optarg); break;
+		case 'a': opts.addr = optarg; break;
+		case 'p': opts.port = (unsigned short)atoi(optarg); break;
+		case 'b': opts.bulk = (unsigned int)atoi(optarg); break;
+		case 'H': opts.heavy = (unsigned int)atoi(optarg); break;
+		case 'h': opts.rate = strtoul(optarg, NULL, 10); break;
+		case 'm': opts.mice = (unsigned int)atoi(optarg); break;
+		case 'i': opts.mouse_interval = (unsigned int)atoi(optarg); break;
+		case 'd': opts.duration = (unsigned int)atoi(optarg); break;
+		case 'w': opts.warmup = (unsigned int)atoi(optarg); break;
+		default: usage();
+		}
+	}
+	opts.proxy_args = &argv[optind];
+	opts.proxy_nargs = argc - optind;
+
+	if ((!opts.proxy_path && opts.pid == 0) || opts.duration == 0)
+		usage();
+
+	harness_raise_nofile();
+	signal(SIGPIPE, SIG_IGN);
+
+	if (harness_parse_addr(opts.addr, opts.port, &proxy_ss, &proxy_len) != 0)
+		usage();
+
+	sink_pid = harness_sink_spawn(1, &sink_port);
+	if (sink_pid < 0) {
+		fprintf(stderr, "loadgen: failed to start sink\n");
+		return EXIT_FAILURE;
+	}
+	if (opts.proxy_path && proxy_ss.ss_family == AF_UNIX) {
+		unix_args = (char**)calloc(opts.proxy_nargs + 2, sizeof(char*));
+		if (!unix_args)
+			return EXIT_FAILURE;
+		unix_args[0] = "--unixListen";
+		unix_args[1] = (char*)opts.addr;
+		for (i = 0; i < (unsigned int)opts.proxy_nargs; ++i)
+			unix_args[2 + i] = opts.proxy_args[i];
+		opts.pid = harness_spawn_oddsock(opts.proxy_path, "127.0.0.1",
+				opts.port, unix_args, opts.proxy_nargs + 2);
+		free(unix_args);
+	} else if (opts.proxy_path)
+		opts.pid = harness_spawn_oddsock(opts.proxy_path, opts.addr,
+				opts.port, opts.proxy_args, opts.proxy_nargs);
+
+	bulk = (struct lg_tunnel*)calloc(opts.bulk + 1, sizeof(*bulk));
+	samples = (double*)calloc(MAX_SAMPLES, sizeof(*samples));
+	mice = (struct lg_tunnel*)calloc(opts.mice + 1, sizeof(*mice));
+	mouse_samples = (double*)calloc(MAX_SAMPLES, sizeof(*mouse_samples));
+	base = event_base_new();
+	if (!bulk || !samples || !mice || !mouse_samples || !base ||
+		event_base_priority_init(base, LG_PRIORITIES) != 0) {
+		fprintf(stderr, "loadgen: setup failed\n");
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+	memset(chunk, 'x', sizeof(chunk));
+
+	for (i = 0; i < opts.bulk; ++i) {
+		bulk[i].queue = BULK_QUEUE * (i < opts.heavy ? HEAVY_FACTOR : 1);
+		if (harness_tunnel_open(&bulk[i].t, base,
+					(struct sockaddr*)&proxy_ss, proxy_len, NULL, 0,
+					sink_host, sink_port, bulk_cb, &bulk[i]) != 0)
+			++bulk_failed;
+	}
+	for (i = 0; i < opts.mice; ++i)
+		if (harness_tunnel_open(&mice[i].t, base,
+					(struct sockaddr*)&proxy_ss, proxy_len, NULL, 0,
+					sink_host, sink_port, mouse_cb, &mice[i]) != 0)
+			++mice_failed;
+
+	start_us = harness_now_us();
+	end_us = start_us + (opts.warmup + opts.duration) * 1e6;
+	tick = event_new(base, -1, EV_PERSIST, tick_cb, NULL);
+	tv.tv_sec = 0;
+	tv.tv_usec = TICK_MS * 1000;
+	event_add(tick, &tv);
+
+	event_base_dispatch(base);
+
+	secs = (harness_now_us() - measure_us) / 1e6;
+	jain = jain_index(&min, &max);
+	printf("loadgen: %u bulk tunnels, %.1f MB/s through the proxy; "
+			"per tunnel %.1f-%.1f MB/s, fairness %.3f\n",
+			bulk_up, (double)(bulk_bytes() - bulk_bytes_start) / secs / 1e6,
+			min / secs / 1e6, max / secs / 1e6, jain);
+	if (opts.mice > 0)
+		printf("loadgen: %u mice, %lu round trips; "
+				"p50 %.0f us, p99 %.0f us, p99.9 %.0f us, max %.0f us\n",
+				opts.mice, (unsigned long)nmouse_samples,
+				harness_percentile(mouse_samples, nmouse_samples, 50),
+				harness_percentile(mouse_samples, nmouse_samples, 99),
+				harness_percentile(mouse_samples, nmouse_samples, 99.9),
+				harness_percentile(mouse_samples, nmouse_samples, 100));
+	printf("loadgen: handshakes %lu ok, %lu failed of %lu; "
+			"p50 %.0f us, p99 %.0f us, p99.9 %.0f us, max %.0f us\n",
+			(unsigned long)nsamples, hs_failed, hs_opened,
+			harness_percentile(samples, nsamples, 50),
+			harness_percentile(samples, nsamples, 99),
+			harness_percentile(samples, nsamples, 99.9),
+			harness_percentile(samples, nsamples, 100));
+	if (cpu_start_us >= 0)
+		printf("loadgen: proxy CPU %.1f%%\n",
+				(harness_proc_cpu_us(opts.pid) - cpu_start_us) / secs / 1e4);
+	if (hs_failed > 0 || bulk_failed > 0 || mice_failed > 0) {
+		printf("loadgen: FAIL %lu handshakes, %lu bulk tunnels and %lu mice "
+				"failed\n", hs_failed, bulk_failed, mice_failed);
+		ret = EXIT_FAILURE;
+	}
+
+out:
+	if (opts.proxy_path && opts.pid > 0) {
+		kill(opts.pid, SIGTERM);
+		waitpid(opts.pid, NULL, 0);
+	}
+	kill(sink_pid, SIGTERM);
+	waitpid(sink_pid, NULL, 0);
+	return ret;
+}
@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# Exercise the transparent listener inside a throwaway network namespace.
+#
+# Runs oddsock with --transparentPort, redirects connections from 127.0.0.2
+# to it with iptables REDIRECT, and fetches a page from a local HTTP server
+# through the redirect. Needs root (or unshare -rn), iptables and python3.
+#
+# usage: tools/netns-transparent.sh [path to oddsock]
+#
+
+set -e
+
+ODDSOCK=${1:-./oddsock}
+TPORT=12345
+HPORT=18080
+
+if [ -z "$ODDSOCK_NETNS" ]; then
+	ODDSOCK_NETNS=1 exec unshare -rn "$0" "$@"
+fi
+
+ip link set lo up
+ip addr add 127.0.0.2/8 dev lo 2>/dev/null || true
+iptables -t nat -A OUTPUT -p tcp -s 127.0.0.2 --dport $HPORT \
+	-j REDIRECT --to-ports $TPORT
+
+python3 -m http.server -b 127.0.0.1 $HPORT >/dev/null 2>&1 &
+HTTP=$!
+"$ODDSOCK" -4 -b 127.0.0.1 --transparentPort $TPORT -v &
+PROXY=$!
+trap 'kill $HTTP $PROXY 2>/dev/null' EXIT
+sleep 1
+
+curl -sf --interface 127.0.0.2 -o /dev/null http://127.0.0.1:$HPORT/
+kill -USR1 $PROXY
+sleep 1
+echo "transparent fetch ok"
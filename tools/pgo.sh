@@ -0,0 +1,87 @@
+#!/bin/sh
+#
+# Profile guided, link time optimized oddsock, trained and measured with
+# tools/loadgen on loopback.
+#
+#  1. Build a plain release oddsock and loadgen; both are kept in
+#     $PGO_DIR for the comparison.
+#  2. Build an instrumented oddsock (mode=pgo-gen) and train it with
+#     $PGO_TRAIN_ARGS: a handshake storm next to bulk tunnels and mice.
+#  3. Rebuild with the profile and -flto (mode=pgo), leaving ./oddsock.
+#  4. Run loadgen $PGO_BENCH_ARGS against both binaries, alternating,
+#     $PGO_RUNS times each, and report the medians.
+#
+# usage: make pgo [CC=clang|gcc]
+#
+
+set -e
+
+CC=${CC:-clang}
+MAKE=${MAKE:-make}
+PGO_DIR=${PGO_DIR:-pgo}
+PGO_TRAIN_ARGS=${PGO_TRAIN_ARGS:--b 4 -m 20 -h 2000 -d 10}
+PGO_BENCH_ARGS=${PGO_BENCH_ARGS:--b 8 -h 1000 -d 5}
+PGO_RUNS=${PGO_RUNS:-3}
+
+rm -rf "$PGO_DIR"
+mkdir -p "$PGO_DIR"
+
+echo "pgo: release build"
+rm -f ./*.o oddsock tools/*.o tools/loadgen
+$MAKE CC="$CC" mode=release oddsock tools/loadgen
+cp oddsock "$PGO_DIR/oddsock-release"
+cp tools/loadgen "$PGO_DIR/loadgen"
+
+echo "pgo: instrumented build and training"
+rm -f ./*.o oddsock
+$MAKE CC="$CC" mode=pgo-gen oddsock
+LLVM_PROFILE_FILE="$PGO_DIR/oddsock-%p.profraw" \
+	"$PGO_DIR/loadgen" -x ./oddsock $PGO_TRAIN_ARGS ||
+	echo "pgo: training run reported failures, continuing"
+case "$CC" in
+*clang*)
+	llvm-profdata merge -output="$PGO_DIR/oddsock.profdata" \
+		"$PGO_DIR"/*.profraw
+	;;
+esac
+
+echo "pgo: optimized build"
+rm -f ./*.o oddsock
+$MAKE CC="$CC" mode=pgo oddsock
+
+# median FILE
+median() {
+	n=$(wc -l < "$1")
+	sort -n "$1" | sed -n "$(( (n + 1) / 2 ))p"
+}
+
+# bench NAME BINARY: one loadgen run, appending to $PGO_DIR/NAME.*
+bench() {
+	"$PGO_DIR/loadgen" -x "$2" $PGO_BENCH_ARGS > "$PGO_DIR/run.out" || true
+	awk '/bulk tunnels/ { print $5 }' "$PGO_DIR/run.out" >> "$PGO_DIR/$1.mbs"
+	for p in p50 p99; do
+		awk -v p=$p '/handshakes/ {
+			for (i = 1; i < NF; ++i) if ($i == p) print $(i + 1) }' \
+			"$PGO_DIR/run.out" >> "$PGO_DIR/$1.$p"
+	done
+}
+
+echo "pgo: comparing, $PGO_RUNS runs of loadgen $PGO_BENCH_ARGS each"
+i=0
+while [ $i -lt "$PGO_RUNS" ]; do
+	bench release "$PGO_DIR/oddsock-release"
+	bench pgo ./oddsock
+	i=$((i + 1))
+done
+
+for b in release pgo; do
+	printf "pgo: %-8s %8s MB/s  handshake p50 %6s us  p99 %6s us\n" "$b" \
+		"$(median "$PGO_DIR/$b.mbs")" "$(median "$PGO_DIR/$b.p50")" \
+		"$(median "$PGO_DIR/$b.p99")"
+done
+awk -v r="$(median "$PGO_DIR/release.mbs")" \
+	-v p="$(median "$PGO_DIR/pgo.mbs")" \
+	-v rl="$(median "$PGO_DIR/release.p50")" \
+	-v pl="$(median "$PGO_DIR/pgo.p50")" 'BEGIN {
+		printf "pgo: gain %+.1f%% throughput, %+.1f%% handshake p50\n",
+			(p - r) * 100 / r, (pl - rl) * 100 / rl }'
@@ -0,0 +1,604 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+/*
+ * replay
+ * Regenerate the workload recorded by oddsock --traceFile against a local
+ * oddsock. Each session is opened at its recorded start time divided by
+ * the speed factor, asks for a destination of the same class (domains as
+ * "localhost", IPv6 as IPv4 since the sink is IPv4 only), moves the same
+ * number of bytes each way and is closed no earlier than its scaled
+ * lifetime. Sessions that failed or were rejected go to a closed port, so
+ * they fail again and drive the health cache the same way. Sessions that
+ * never made a request only connect and hold. Transparent and mux
+ * sessions are replayed as plain SOCKS ones.
+ *
+ * The sink reads an 8 byte header with the number of bytes to send back,
+ * discards the rest of what it receives and sends that many bytes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+#include "harness.h"
+
+#define TICK_MS (1)
+#define CHUNK (16 * 1024)
+#define QUEUE (4 * CHUNK)
+#define HEADER (8)
+#define DRAIN_SECS (30)
+
+enum {
+	RP_DST_NONE = 0,
+	RP_DST_IP,
+	RP_DST_DOMAIN
+};
+
+struct rp_rec {
+	double start_us;
+	double life_us;
+	unsigned long up;
+	unsigned long down;
+	int dst;
+	int ok; /* connected in the trace */
+};
+
+struct rp_conn {
+	struct harness_tunnel t;
+	struct rp_rec *rec;
+	struct event *hold_ev;
+	double open_us;
+	unsigned long sent;
+	unsigned long received;
+	int held; /* scaled lifetime is over */
+};
+
+static struct {
+	const char *proxy_path;
+	char **proxy_args;
+	int proxy_nargs;
+	pid_t pid;
+	const char *addr;
+	unsigned short port;
+	const char *trace;
+	double speed;
+} opts = {
+	NULL, NULL, 0, 0, "127.0.0.1", 11080, NULL, 1.0
+};
+
+static struct event_base *base;
+static struct sockaddr_storage proxy_ss;
+static socklen_t proxy_len;
+static unsigned short sink_port, dead_port;
+
+static struct rp_rec *recs;
+static size_t nrecs, next_rec;
+static double start_us, last_start_us;
+static unsigned long active, peak_active;
+static unsigned long ok, failed, trace_ok, late;
+static double bytes_up, bytes_down;
+static double *samples;
+static size_t nsamples;
+
+static unsigned char chunk[CHUNK];
+
+static void usage(void)
+{
+	fprintf(stderr,
+			"usage: replay -t trace [-x oddsock-path | -P pid] [-a addr]\n"
+			"              [-p port] [-s speed] [-- extra oddsock args]\n");
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Sink: header, then the requested bytes back.
+ */
+
+struct sink_conn {
+	unsigned char header[HEADER];
+	size_t header_len;
+	unsigned long remaining;
+};
+
+static void sink_fill(struct bufferevent *bev, struct sink_conn *sc)
+{
+	struct evbuffer *out = bufferevent_get_output(bev);
+	size_t n;
+
+	while (sc->remaining > 0 && evbuffer_get_length(out) < QUEUE) {
+		n = sc->remaining < CHUNK ? sc->remaining : CHUNK;
+		evbuffer_add(out, chunk, n);
+		sc->remaining -= n;
+	}
+}
+
+static void sink_readcb(struct bufferevent *bev, void *arg)
+{
+	struct sink_conn *sc = (struct sink_conn*)arg;
+	struct evbuffer *in = bufferevent_get_input(bev);
+	int i;
+
+	if (sc->header_len < HEADER) {
+		sc->header_len += evbuffer_remove(in, sc->header + sc->header_len,
+				HEADER - sc->header_len);
+		if (sc->header_len < HEADER)
+			return;
+		for (i = 0; i < HEADER; ++i)
+			sc->remaining = (sc->remaining << 8) | sc->header[i];
+		sink_fill(bev, sc);
+	}
+	evbuffer_drain(in, evbuffer_get_length(in));
+}
+
+static void sink_writecb(struct bufferevent *bev, void *arg)
+{
+	sink_fill(bev, (struct sink_conn*)arg);
+}
+
+static void sink_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
+		bufferevent_free(bev);
+		free(arg);
+	}
+}
+
+static void sink_acceptcb(struct evconnlistener *listener, evutil_socket_t fd,
+		struct sockaddr *sa, int salen, void *arg)
+{
+	struct bufferevent *bev;
+	struct sink_conn *sc;
+
+	sc = (struct sink_conn*)calloc(1, sizeof(*sc));
+	bev = bufferevent_socket_new(evconnlistener_get_base(listener), fd,
+			BEV_OPT_CLOSE_ON_FREE);
+	if (!sc || !bev) {
+		free(sc);
+		close(fd);
+		return;
+	}
+	bufferevent_setcb(bev, sink_readcb, sink_writecb, sink_eventcb, sc);
+	bufferevent_setwatermark(bev, EV_WRITE, QUEUE / 2, 0);
+	bufferevent_enable(bev, EV_READ|EV_WRITE);
+}
+
+static pid_t sink_spawn(unsigned short *port)
+{
+	struct event_base *sbase;
+	struct evconnlistener *listener;
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	int fds[2];
+	pid_t pid;
+
+	if (pipe(fds) != 0)
+		return -1;
+
+	pid = fork();
+	if (pid == 0) {
+		close(fds[0]);
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		sbase = event_base_new();
+		listener = sbase ? evconnlistener_new_bind(sbase, sink_acceptcb,
+				NULL, LEV_OPT_CLOSE_ON_FREE|LEV_OPT_REUSEABLE, 4096,
+				(struct sockaddr*)&sin, sizeof(sin)) : NULL;
+		if (!listener)
+			_exit(1);
+		getsockname(evconnlistener_get_fd(listener),
+				(struct sockaddr*)&sin, &len);
+		*port = ntohs(sin.sin_port);
+		if (write(fds[1], port, sizeof(*port)) < 0)
+			_exit(1);
+		close(fds[1]);
+		event_base_dispatch(sbase);
+		_exit(0);
+	}
+
+	close(fds[1]);
+	if (pid < 0 || read(fds[0], port, sizeof(*port)) != sizeof(*port)) {
+		close(fds[0]);
+		return -1;
+	}
+	close(fds[0]);
+	return pid;
+}
+
+/*
+ * closed_port
+ * A loopback port nothing listens on.
+ */
+static unsigned short closed_port(void)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	int fd;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr*)&sin, sizeof(sin)) != 0 ||
+		getsockname(fd, (struct sockaddr*)&sin, &len) != 0) {
+		if (fd >= 0)
+			close(fd);
+		return 0;
+	}
+	close(fd);
+	return ntohs(sin.sin_port);
+}
+
+/*
+ * Trace
+ */
+
+static int cmp_start(const void *a, const void *b)
+{
+	double x = ((const struct rp_rec*)a)->start_us;
+	double y = ((const struct rp_rec*)b)->start_us;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static int load_trace(const char *path)
+{
+	FILE *f;
+	char line[256], kind[16], dst[16], outcome[16], request[32], connect[32];
+	struct rp_rec r, *p;
+	size_t cap = 0;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#')
+			continue;
+		memset(&r, 0, sizeof(r));
+		if (sscanf(line, "%lf %15s %15s %15s %31s %31s %lf %lu %lu",
+					&r.start_us, kind, dst, outcome, request, connect,
+					&r.life_us, &r.up, &r.down) != 9)
+			continue;
+		if (strcmp(dst, "-") == 0)
+			r.dst = RP_DST_NONE;
+		else if (strcmp(dst, "domain") == 0)
+			r.dst = RP_DST_DOMAIN;
+		else
+			r.dst = RP_DST_IP;
+		r.ok = strcmp(outcome, "ok") == 0 || strcmp(outcome, "-") == 0;
+
+		if (nrecs == cap) {
+			cap = cap ? cap * 2 : 1024;
+			p = (struct rp_rec*)realloc(recs, cap * sizeof(*recs));
+			if (!p) {
+				fclose(f);
+				return -1;
+			}
+			recs = p;
+		}
+		recs[nrecs++] = r;
+	}
+	fclose(f);
+
+	qsort(recs, nrecs, sizeof(*recs), cmp_start);
+	return 0;
+}
+
+/*
+ * Sessions
+ */
+
+static void conn_close(struct rp_conn *c)
+{
+	if (c->t.bev)
+		bufferevent_free(c->t.bev);
+	if (c->hold_ev)
+		event_free(c->hold_ev);
+	free(c);
+	--active;
+}
+
+static int conn_done(struct rp_conn *c)
+{
+	return c->rec->dst == RP_DST_NONE ||
+		(c->sent == c->rec->up && c->received >= c->rec->down &&
+		 evbuffer_get_length(bufferevent_get_output(c->t.bev)) == 0);
+}
+
+static void conn_fill(struct rp_conn *c)
+{
+	struct evbuffer *out = bufferevent_get_output(c->t.bev);
+	unsigned long n;
+
+	while (c->sent < c->rec->up && evbuffer_get_length(out) < QUEUE) {
+		n = c->rec->up - c->sent;
+		if (n > CHUNK)
+			n = CHUNK;
+		evbuffer_add(out, chunk, n);
+		c->sent += n;
+		bytes_up += n;
+	}
+}
+
+static void conn_readcb(struct bufferevent *bev, void *arg)
+{
+	struct rp_conn *c = (struct rp_conn*)arg;
+	struct evbuffer *in = bufferevent_get_input(bev);
+	size_t len = evbuffer_get_length(in);
+
+	c->received += len;
+	bytes_down += len;
+	evbuffer_drain(in, len);
+	if (c->held && conn_done(c))
+		conn_close(c);
+}
+
+static void conn_writecb(struct bufferevent *bev, void *arg)
+{
+	struct rp_conn *c = (struct rp_conn*)arg;
+
+	conn_fill(c);
+	if (c->held && conn_done(c))
+		conn_close(c);
+}
+
+static void conn_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	struct rp_conn *c = (struct rp_conn*)arg;
+
+	if (what & BEV_EVENT_CONNECTED)
+		return;
+	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
+		/* Closed before the session's bytes were through. */
+		if (!conn_done(c)) {
+			--ok;
+			++failed;
+		}
+		conn_close(c);
+	}
+}
+
+static void conn_holdcb(evutil_socket_t fd, short what, void *arg)
+{
+	struct rp_conn *c = (struct rp_conn*)arg;
+
+	c->held = 1;
+	if (conn_done(c))
+		conn_close(c);
+	else
+		++late;
+}
+
+static void conn_hold(struct rp_conn *c)
+{
+	double left = c->rec->life_us / opts.speed -
+		(harness_now_us() - c->open_us);
+	struct timeval tv;
+
+	if (left < 0)
+		left = 0;
+	tv.tv_sec = (long)(left / 1e6);
+	tv.tv_usec = (long)left % 1000000;
+	c->hold_ev = evtimer_new(base, conn_holdcb, c);
+	if (c->hold_ev)
+		evtimer_add(c->hold_ev, &tv);
+	else
+		c->held = 1;
+}
+
+static void conn_cb(struct harness_tunnel *t, int ok_, void *arg)
+{
+	struct rp_conn *c = (struct rp_conn*)arg;
+	unsigned char header[HEADER];
+	unsigned long down = c->rec->down;
+	int i;
+
+	if (!ok_) {
+		++failed;
+		conn_close(c);
+		return;
+	}
+	++ok;
+	if (nsamples < nrecs)
+		samples[nsamples++] = t->connect_us;
+
+	for (i = HEADER - 1; i >= 0; --i) {
+		header[i] = (unsigned char)(down & 0xff);
+		down >>= 8;
+	}
+	bufferevent_setcb(t->bev, conn_readcb, conn_writecb, conn_eventcb, c);
+	bufferevent_setwatermark(t->bev, EV_WRITE, QUEUE / 2, 0);
+	bufferevent_enable(t->bev, EV_READ|EV_WRITE);
+	bufferevent_write(t->bev, header, HEADER);
+	conn_fill(c);
+	conn_hold(c);
+}
+
+static void conn_open(struct rp_rec *r)
+{
+	struct rp_conn *c;
+
+	c = (struct rp_conn*)calloc(1, sizeof(*c));
+	if (!c) {
+		++failed;
+		return;
+	}
+	c->rec = r;
+	c->open_us = harness_now_us();
+	if (++active > peak_active)
+		peak_active = active;
+
+	/* No request: connect to the proxy and hold. */
+	if (r->dst == RP_DST_NONE) {
+		c->t.bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
+		if (!c->t.bev || bufferevent_socket_connect(c->t.bev,
+					(struct sockaddr*)&proxy_ss, (int)proxy_len) != 0) {
+			++failed;
+			conn_close(c);
+			return;
+		}
+		++ok;
+		bufferevent_setcb(c->t.bev, conn_readcb, NULL, conn_eventcb, c);
+		bufferevent_enable(c->t.bev, EV_READ);
+		conn_hold(c);
+		return;
+	}
+
+	if (harness_tunnel_open(&c->t, base, (struct sockaddr*)&proxy_ss,
+				proxy_len, NULL, 0,
+				r->dst == RP_DST_DOMAIN ? "localhost" : "127.0.0.1",
+				r->ok ? sink_port : dead_port, conn_cb, c) != 0)
+		conn_cb(&c->t, 0, c);
+}
+
+static void tick_cb(evutil_socket_t fd, short what, void *arg)
+{
+	double now = harness_now_us() - start_us;
+
+	while (next_rec < nrecs &&
+		recs[next_rec].start_us / opts.speed <= now) {
+		if (recs[next_rec].ok)
+			++trace_ok;
+		conn_open(&recs[next_rec++]);
+	}
+
+	if (next_rec == nrecs &&
+		(active == 0 || now > last_start_us + DRAIN_SECS * 1e6))
+		event_base_loopexit(base, NULL);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, ret = EXIT_SUCCESS;
+	struct timeval tv;
+	struct event *tick;
+	pid_t sink_pid;
+	double secs;
+
+	while ((opt = getopt(argc, argv, "x:P:a:p:t:s:")) != -1) {
+		switch (opt) {
+		case 'x': opts.proxy_path = optarg; break;
+		case 'P': opts.pid = (pid_t)atoi(optarg); break;
+		case 'a': opts.addr = optarg; break;
+		case 'p': opts.port = (unsigned short)atoi(optarg); break;
+		case 't': opts.trace = optarg; break;
+		case 's': opts.speed = atof(optarg); break;
+		default: usage();
+		}
+	}
+	opts.proxy_args = &argv[optind];
+	opts.proxy_nargs = argc - optind;
+
+	if ((!opts.proxy_path && opts.pid == 0) || !opts.trace ||
+		opts.speed <= 0)
+		usage();
+
+	harness_raise_nofile();
+	signal(SIGPIPE, SIG_IGN);
+
+	if (harness_parse_addr(opts.addr, opts.port, &proxy_ss, &proxy_len) != 0)
+		usage();
+
+	if (load_trace(opts.trace) != 0 || nrecs == 0) {
+		fprintf(stderr, "replay: no sessions in %s\n", opts.trace);
+		return EXIT_FAILURE;
+	}
+	last_start_us = recs[nrecs - 1].start_us / opts.speed;
+
+	memset(chunk, 'x', sizeof(chunk));
+	dead_port = closed_port();
+	sink_pid = sink_spawn(&sink_port);
+	if (sink_pid < 0 || dead_port == 0) {
+		fprintf(stderr, "replay: failed to start sink\n");
+		return EXIT_FAILURE;
+	}
+	if (opts.proxy_path)
+		opts.pid = harness_spawn_oddsock(opts.proxy_path, opts.addr,
+				opts.port, opts.proxy_args, opts.proxy_nargs);
+
+	samples = (double*)calloc(nrecs, sizeof(*samples));
+	base = event_base_new();
+	if (!samples || !base) {
+		fprintf(stderr, "replay: setup failed\n");
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	start_us = harness_now_us() - recs[0].start_us / opts.speed;
+	tick = event_new(base, -1, EV_PERSIST, tick_cb, NULL);
+	tv.tv_sec = 0;
+	tv.tv_usec = TICK_MS * 1000;
+	event_add(tick, &tv);
+
+	event_base_dispatch(base);
+
+	secs = (harness_now_us() - start_us) / 1e6 - recs[0].start_us /
+		opts.speed / 1e6;
+	printf("replay: %lu sessions in %.1f s at %gx (trace span %.1f s)\n",
+			(unsigned long)nrecs, secs, opts.speed,
+			(recs[nrecs - 1].start_us - recs[0].start_us) / 1e6);
+	printf("replay: %lu ok, %lu failed (trace %lu ok, %lu failed); "
+			"%lu outlived their lifetime, %lu still open, peak %lu open\n",
+			ok, failed, trace_ok, (unsigned long)nrecs - trace_ok, late,
+			active, peak_active);
+	printf("replay: %.1f MB up, %.1f MB down\n",
+			bytes_up / 1e6, bytes_down / 1e6);
+	printf("replay: handshakes p50 %.0f us, p99 %.0f us, p99.9 %.0f us, "
+			"max %.0f us\n",
+			harness_percentile(samples, nsamples, 50),
+			harness_percentile(samples, nsamples, 99),
+			harness_percentile(samples, nsamples, 99.9),
+			harness_percentile(samples, nsamples, 100));
+	if (ok != trace_ok || active > 0)
+		ret = EXIT_FAILURE;
+
+out:
+	if (opts.proxy_path && opts.pid > 0) {
+		kill(opts.pid, SIGTERM);
+		waitpid(opts.pid, NULL, 0);
+	}
+	kill(sink_pid, SIGTERM);
+	waitpid(sink_pid, NULL, 0);
+	return ret;
+}
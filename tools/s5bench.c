@@ -0,0 +1,212 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+/*
+ * s5bench
+ * Microbenchmark for the SOCKS 5 handshake parsers. Reports nanoseconds per
+ * handshake (greeting + request) for the in-place parser on flat memory, the
+ * in-place parser on an evbuffer as socks5.c drives it, and the previous
+ * copyout/malloc/inet_ntop approach for comparison.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <event2/buffer.h>
+#include "../socks5.h"
+#include "../socks5_parse.h"
+
+struct handshake {
+	const char *name;
+	unsigned char greeting[8];
+	size_t greeting_len;
+	unsigned char request[SOCKS5_REQUEST_MAX];
+	size_t request_len;
+};
+
+static struct handshake handshakes[] = {
+	{ "ipv4",
+		{ 0x05, 0x01, 0x00 }, 3,
+		{ 0x05, 0x01, 0x00, 0x01, 127, 0, 0, 1, 0x1f, 0x90 }, 10 },
+	{ "ipv6",
+		{ 0x05, 0x02, 0x00, 0x02 }, 4,
+		{ 0x05, 0x01, 0x00, 0x04, 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0,
+			0, 0, 0, 0, 0, 0, 0, 1, 0x01, 0xbb }, 22 },
+	{ "domain",
+		{ 0x05, 0x01, 0x00 }, 3,
+		{ 0x05, 0x01, 0x00, 0x03, 15, 'w', 'w', 'w', '.', 'e', 'x', 'a',
+			'm', 'p', 'l', 'e', '.', 'c', 'o', 'm', 0x00, 0x50 }, 22 }
+};
+
+#define NHANDSHAKES (sizeof(handshakes) / sizeof(handshakes[0]))
+
+/* Keeps the optimizer from discarding parse results. */
+static volatile unsigned long sink;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/*
+ * run_flat
+ * Parse both messages directly from contiguous memory.
+ */
+static void run_flat(const struct handshake *h)
+{
+	struct socks5_greeting greeting;
+	struct socks5_request request;
+
+	if (socks5_parse_greeting(h->greeting, h->greeting_len, &greeting) <= 0 ||
+		socks5_parse_request(h->request, h->request_len, &request) <= 0) {
+		fprintf(stderr, "s5bench: parse failed for %s\n", h->name);
+		exit(EXIT_FAILURE);
+	}
+	sink += greeting.nmethods + request.port;
+}
+
+/*
+ * run_evbuffer
+ * Mirror socks5_process_greeting/socks5_process_request: pullup, parse in
+ * place, drain.
+ */
+static void run_evbuffer(const struct handshake *h, struct evbuffer *buf)
+{
+	struct socks5_greeting greeting;
+	struct socks5_request request;
+	unsigned char *data;
+	int n;
+
+	evbuffer_add(buf, h->greeting, h->greeting_len);
+	data = evbuffer_pullup(buf, h->greeting_len);
+	n = socks5_parse_greeting(data, h->greeting_len, &greeting);
+	sink += greeting.nmethods;
+	evbuffer_drain(buf, n);
+
+	evbuffer_add(buf, h->request, h->request_len);
+	data = evbuffer_pullup(buf, h->request_len);
+	n = socks5_parse_request(data, h->request_len, &request);
+	sink += request.port;
+	evbuffer_drain(buf, n);
+}
+
+/*
+ * run_legacy
+ * The parsing strategy oddsock used before socks5_parse: repeated
+ * evbuffer_copyout, a malloc'd method list and inet_ntop of literals.
+ */
+static void run_legacy(const struct handshake *h, struct evbuffer *buf)
+{
+	unsigned char greeting[2];
+	unsigned char *methods;
+	unsigned char request[6+256];
+	char addr[256];
+	size_t have;
+
+	evbuffer_add(buf, h->greeting, h->greeting_len);
+	evbuffer_copyout(buf, greeting, 1);
+	evbuffer_copyout(buf, greeting, 2);
+	methods = (unsigned char*)malloc(greeting[1]);
+	evbuffer_drain(buf, sizeof(greeting));
+	evbuffer_remove(buf, methods, greeting[1]);
+	sink += methods[0];
+	free(methods);
+
+	evbuffer_add(buf, h->request, h->request_len);
+	have = evbuffer_get_length(buf);
+	evbuffer_copyout(buf, request, 1);
+	evbuffer_copyout(buf, request, 8);
+	evbuffer_remove(buf, request, have);
+	if (request[3] == SOCKS5_ATYPE_IPV4)
+		inet_ntop(AF_INET, &request[4], addr, sizeof(addr));
+	else if (request[3] == SOCKS5_ATYPE_IPV6)
+		inet_ntop(AF_INET6, &request[4], addr, sizeof(addr));
+	else {
+		memcpy(addr, &request[5], request[4]);
+		addr[request[4]] = '\0';
+	}
+	sink += (unsigned char)addr[0];
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long iterations = 2000000;
+	unsigned long i;
+	size_t h;
+	double start, flat, evb, legacy;
+	struct evbuffer *buf;
+
+	if (argc > 1)
+		iterations = strtoul(argv[1], NULL, 10);
+	if (iterations == 0) {
+		fprintf(stderr, "usage: s5bench [iterations]\n");
+		return EXIT_FAILURE;
+	}
+
+	buf = evbuffer_new();
+	if (!buf) {
+		fprintf(stderr, "s5bench: evbuffer_new failed\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("%-8s %12s %12s %12s   (ns/handshake, %lu iterations)\n",
+			"atype", "flat", "evbuffer", "legacy", iterations);
+
+	for (h = 0; h < NHANDSHAKES; ++h) {
+		start = now_ns();
+		for (i = 0; i < iterations; ++i)
+			run_flat(&handshakes[h]);
+		flat = (now_ns() - start) / iterations;
+
+		start = now_ns();
+		for (i = 0; i < iterations; ++i)
+			run_evbuffer(&handshakes[h], buf);
+		evb = (now_ns() - start) / iterations;
+
+		start = now_ns();
+		for (i = 0; i < iterations; ++i)
+			run_legacy(&handshakes[h], buf);
+		legacy = (now_ns() - start) / iterations;
+
+		printf("%-8s %12.1f %12.1f %12.1f\n",
+				handshakes[h].name, flat, evb, legacy);
+	}
+
+	evbuffer_free(buf);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,276 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+/*
+ * s5fuzz
+ * Fuzz target for the SOCKS 5 and HTTP CONNECT parsers. Built with
+ * -DODDSOCK_LIBFUZZER it is a libFuzzer target; otherwise main() replays
+ * the corpus given on the command line together with every truncation and
+ * single byte mutation of each entry. Every input is copied into an exactly sized heap block so that
+ * sanitizers catch any read past the end.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "../socks5.h"
+#include "../socks5_parse.h"
+#include "../http_parse.h"
+
+#define FUZZ_MAX_INPUT (4096)
+
+static void fuzz_fail(const char *parser, const char *why, size_t size)
+{
+	fprintf(stderr, "s5fuzz: %s: %s (input size %lu)\n",
+			parser, why, (unsigned long)size);
+	abort();
+}
+
+static int within(const unsigned char *p, size_t n,
+		const unsigned char *data, size_t size)
+{
+	return p >= data && p + n <= data + size;
+}
+
+/*
+ * check_prefixes
+ * A parser that accepted n bytes must ask for more on every shorter prefix
+ * and must never report an error there, except for the early command and
+ * address type errors which are reported as soon as their byte is seen.
+ */
+static void check_prefixes(const char *parser, const unsigned char *data,
+		int n, int (*parse)(const unsigned char*, size_t, void*), void *out)
+{
+	int i;
+
+	for (i = 0; i < n; ++i)
+		if (parse(data, (size_t)i, out) != 0)
+			fuzz_fail(parser, "prefix of a complete message did not need more",
+					(size_t)n);
+}
+
+static int parse_greeting(const unsigned char *d, size_t n, void *out)
+{
+	return socks5_parse_greeting(d, n, (struct socks5_greeting*)out);
+}
+
+static int parse_auth(const unsigned char *d, size_t n, void *out)
+{
+	return socks5_parse_auth(d, n, (struct socks5_auth*)out);
+}
+
+static int parse_request(const unsigned char *d, size_t n, void *out)
+{
+	return socks5_parse_request(d, n, (struct socks5_request*)out);
+}
+
+static int parse_http(const unsigned char *d, size_t n, void *out)
+{
+	return http_parse_connect(d, n, (struct socks5_request*)out);
+}
+
+static void fuzz_one(const unsigned char *data, size_t size)
+{
+	struct socks5_greeting greeting;
+	struct socks5_auth auth;
+	struct socks5_request request;
+	int n;
+
+	n = socks5_parse_greeting(data, size, &greeting);
+	if (n > 0) {
+		if ((size_t)n > size || n > SOCKS5_GREETING_MAX ||
+			!within(greeting.methods, greeting.nmethods, data, size))
+			fuzz_fail("greeting", "result outside input", size);
+		check_prefixes("greeting", data, n, parse_greeting, &greeting);
+	}
+
+	n = socks5_parse_auth(data, size, &auth);
+	if (n > 0) {
+		if ((size_t)n > size || n > SOCKS5_AUTH_MAX ||
+			!within(auth.uname, auth.ulen, data, size) ||
+			!within(auth.passwd, auth.plen, data, size))
+			fuzz_fail("auth", "result outside input", size);
+		check_prefixes("auth", data, n, parse_auth, &auth);
+	}
+
+	n = socks5_parse_request(data, size, &request);
+	if (n > 0) {
+		if ((size_t)n > size || n > SOCKS5_REQUEST_MAX ||
+			!SOCKS5_CMD_VALID(request.command))
+			fuzz_fail("request", "result outside input", size);
+		if (request.atype == SOCKS5_ATYPE_IPV4) {
+			if (!within(request.addr.ipv4, 4, data, size) || n != 10)
+				fuzz_fail("request", "bad ipv4 address", size);
+		} else if (request.atype == SOCKS5_ATYPE_IPV6) {
+			if (!within(request.addr.ipv6, 16, data, size) || n != 22)
+				fuzz_fail("request", "bad ipv6 address", size);
+		} else if (request.atype == SOCKS5_ATYPE_DOMAIN) {
+			if (request.domain_len == 0 ||
+				!within(request.addr.domain, request.domain_len, data, size) ||
+				n != 7 + request.domain_len)
+				fuzz_fail("request", "bad domain address", size);
+		} else
+			fuzz_fail("request", "unknown address type accepted", size);
+		check_prefixes("request", data, n, parse_request, &request);
+	}
+
+	n = http_parse_connect(data, size, &request);
+	if (n > 0) {
+		if ((size_t)n > size || request.command != SOCKS5_CMD_CONNECT ||
+			request.atype != SOCKS5_ATYPE_DOMAIN ||
+			request.domain_len == 0 || request.port == 0 ||
+			!within(request.addr.domain, request.domain_len, data, size) ||
+			data[n - 1] != '\n')
+			fuzz_fail("http", "result outside input", size);
+		check_prefixes("http", data, n, parse_http, &request);
+	}
+}
+
+/*
+ * LLVMFuzzerTestOneInput
+ */
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size)
+{
+	unsigned char *copy;
+
+	/* Parse from an exactly sized block so overreads are caught. */
+	copy = (unsigned char*)malloc(size ? size : 1);
+	if (!copy)
+		return 0;
+	memcpy(copy, data, size);
+	fuzz_one(copy, size);
+	free(copy);
+
+	return 0;
+}
+
+#ifndef ODDSOCK_LIBFUZZER
+
+static unsigned long runs;
+
+/*
+ * replay_entry
+ * Run one corpus entry, all of its truncations and all single byte
+ * mutations.
+ */
+static void replay_entry(const unsigned char *data, size_t size)
+{
+	unsigned char mutated[FUZZ_MAX_INPUT];
+	size_t i;
+	unsigned int v;
+
+	for (i = 0; i <= size; ++i, ++runs)
+		LLVMFuzzerTestOneInput(data, i);
+
+	memcpy(mutated, data, size);
+	for (i = 0; i < size; ++i) {
+		for (v = 0; v < 256; ++v, ++runs) {
+			mutated[i] = (unsigned char)v;
+			LLVMFuzzerTestOneInput(mutated, size);
+		}
+		mutated[i] = data[i];
+	}
+}
+
+static int replay_file(const char *path)
+{
+	unsigned char data[FUZZ_MAX_INPUT];
+	size_t size;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	size = fread(data, 1, sizeof(data), f);
+	fclose(f);
+
+	replay_entry(data, size);
+	return 0;
+}
+
+static int replay_path(const char *path)
+{
+	struct stat st;
+	DIR *dir;
+	struct dirent *ent;
+	char file[1024];
+	int e = 0;
+
+	if (stat(path, &st) != 0) {
+		perror(path);
+		return -1;
+	}
+	if (!S_ISDIR(st.st_mode))
+		return replay_file(path);
+
+	dir = opendir(path);
+	if (!dir) {
+		perror(path);
+		return -1;
+	}
+	while ((ent = readdir(dir)) != NULL) {
+		if (ent->d_name[0] == '.')
+			continue;
+		snprintf(file, sizeof(file), "%s/%s", path, ent->d_name);
+		if (replay_file(file) != 0)
+			e = -1;
+	}
+	closedir(dir);
+
+	return e;
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+	int e = 0;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: s5fuzz corpus-dir-or-file ...\n");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 1; i < argc; ++i)
+		if (replay_path(argv[i]) != 0)
+			e = -1;
+
+	printf("s5fuzz: %lu inputs, no failures\n", runs);
+	return e == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#endif
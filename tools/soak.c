@@ -0,0 +1,399 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+/*
+ * soak
+ * Connection-scale soak test. Opens a configurable number of long-lived
+ * tunnels through a local oddsock to a loopback echo sink, keeps them alive
+ * with small periodic pings and samples the proxy's RSS, fd count and the
+ * ping round trip through its event loop. Fails when bytes per connection
+ * or p99 round trip exceed the thresholds file.
+ *
+ * Linux only: the proxy is sampled through /proc, and above 20000 tunnels
+ * the client side binds to further 127.0.0.x addresses.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include "harness.h"
+
+#define TUNNELS_PER_ADDR (20000)
+#define TICK_MS (50)
+#define MAX_SAMPLES (200000)
+
+struct soak_tunnel {
+	struct harness_tunnel t;
+	int up;
+	double ping_sent;
+};
+
+static struct {
+	const char *proxy_path;
+	char **proxy_args;
+	int proxy_nargs;
+	pid_t pid;
+	const char *addr;
+	unsigned short port;
+	unsigned long conns;
+	unsigned long rate;
+	unsigned int hold;
+	unsigned int ping_interval;
+	unsigned int sample_interval;
+	const char *thresholds;
+} opts = {
+	NULL, NULL, 0, 0, "127.0.0.1", 11080, 10000, 5000, 60, 10, 5, NULL
+};
+
+static struct event_base *base;
+static struct soak_tunnel *tunnels;
+static unsigned short *sink_ports;
+static int nsinks;
+static struct sockaddr_storage proxy_ss;
+static socklen_t proxy_len;
+
+static unsigned long opened, established, failed, closed;
+static unsigned long ping_cursor;
+static double ramp_done_us, start_us;
+static long rss_base_kb;
+
+static double window[MAX_SAMPLES];
+static size_t nwindow;
+static double hold[MAX_SAMPLES];
+static size_t nhold;
+static unsigned long nhold_seen;
+
+static double worst_bytes_per_conn;
+
+static void usage(void)
+{
+	fprintf(stderr,
+			"usage: soak [-x oddsock-path | -P pid] [-a addr] [-p port]\n"
+			"            [-n tunnels] [-r opens/sec] [-d hold-secs]\n"
+			"            [-i ping-secs] [-s sample-secs] [-t thresholds]\n"
+			"            [-- extra oddsock args]\n");
+	exit(EXIT_FAILURE);
+}
+
+static void record_rtt(double us)
+{
+	if (nwindow < MAX_SAMPLES)
+		window[nwindow++] = us;
+
+	/* Reservoir sample of the hold phase for the final verdict. */
+	if (ramp_done_us > 0) {
+		++nhold_seen;
+		if (nhold < MAX_SAMPLES)
+			hold[nhold++] = us;
+		else {
+			unsigned long j = (unsigned long)random() % nhold_seen;
+			if (j < MAX_SAMPLES)
+				hold[j] = us;
+		}
+	}
+}
+
+static void tunnel_readcb(struct bufferevent *bev, void *arg)
+{
+	struct soak_tunnel *st = (struct soak_tunnel*)arg;
+	struct evbuffer *in = bufferevent_get_input(bev);
+
+	if (evbuffer_get_length(in) < 8)
+		return;
+	evbuffer_drain(in, evbuffer_get_length(in));
+	if (st->ping_sent > 0) {
+		record_rtt(harness_now_us() - st->ping_sent);
+		st->ping_sent = 0;
+	}
+}
+
+static void tunnel_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	struct soak_tunnel *st = (struct soak_tunnel*)arg;
+
+	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
+		bufferevent_free(st->t.bev);
+		st->t.bev = NULL;
+		st->up = 0;
+		++closed;
+		--established;
+	}
+}
+
+static void tunnel_cb(struct harness_tunnel *t, int ok, void *arg)
+{
+	struct soak_tunnel *st = (struct soak_tunnel*)arg;
+
+	if (!ok)
+		++failed;
+	else {
+		st->up = 1;
+		++established;
+		bufferevent_setcb(t->bev, tunnel_readcb, NULL, tunnel_eventcb, st);
+		bufferevent_enable(t->bev, EV_READ|EV_WRITE);
+	}
+
+	/* The hold phase starts once every open attempt has resolved. */
+	if (established + failed + closed == opts.conns)
+		ramp_done_us = harness_now_us();
+}
+
+static void open_tunnels(unsigned long count)
+{
+	struct sockaddr_in src;
+	unsigned long i;
+	char sink[16];
+
+	memset(&src, 0, sizeof(src));
+	src.sin_family = AF_INET;
+	strcpy(sink, "127.0.0.1");
+
+	for (i = 0; i < count && opened < opts.conns; ++i, ++opened) {
+		struct soak_tunnel *st = &tunnels[opened];
+		unsigned long a = opened / TUNNELS_PER_ADDR;
+
+		src.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 + a);
+		if (harness_tunnel_open(&st->t, base,
+					(struct sockaddr*)&proxy_ss, proxy_len,
+					a > 0 ? (struct sockaddr*)&src : NULL, sizeof(src),
+					sink, sink_ports[opened % nsinks],
+					tunnel_cb, st) != 0)
+			tunnel_cb(&st->t, 0, st);
+	}
+}
+
+static void tick_cb(evutil_socket_t fd, short what, void *arg)
+{
+	double per_tick;
+	unsigned long n, i;
+	static const unsigned char ping[8] = "soakping";
+
+	/* Ramp up. */
+	if (opened < opts.conns)
+		open_tunnels((unsigned long)((double)opts.rate * TICK_MS / 1000.0) + 1);
+
+	/* Ping a slice of the tunnels so each one sees one ping per interval. */
+	per_tick = (double)opts.conns * TICK_MS / (opts.ping_interval * 1000.0);
+	n = (unsigned long)per_tick + 1;
+	for (i = 0; i < n && opened > 0; ++i) {
+		struct soak_tunnel *st = &tunnels[ping_cursor++ % opened];
+		if (st->up && st->ping_sent == 0) {
+			st->ping_sent = harness_now_us();
+			bufferevent_write(st->t.bev, ping, sizeof(ping));
+		}
+	}
+}
+
+static void sample_cb(evutil_socket_t fd, short what, void *arg)
+{
+	double now = harness_now_us();
+	long rss = harness_proc_rss_kb(opts.pid);
+	int fds = harness_proc_fds(opts.pid);
+	double bpc = 0.0;
+	double p50, p99;
+
+	if (established > 0 && rss > 0)
+		bpc = (double)(rss - rss_base_kb) * 1024.0 / (double)established;
+	if (ramp_done_us > 0 && bpc > worst_bytes_per_conn)
+		worst_bytes_per_conn = bpc;
+
+	p50 = harness_percentile(window, nwindow, 50);
+	p99 = harness_percentile(window, nwindow, 99);
+
+	printf("%7.1fs tunnels %7lu failed %5lu closed %5lu rss %8ld kB "
+			"fds %7d bytes/conn %7.0f rtt p50 %7.0f us p99 %7.0f us\n",
+			(now - start_us) / 1e6, established, failed, closed, rss, fds,
+			bpc, p50, p99);
+	fflush(stdout);
+	nwindow = 0;
+
+	if (ramp_done_us > 0 && now - ramp_done_us >= opts.hold * 1e6)
+		event_base_loopbreak(base);
+	if (rss < 0) {
+		int status = 0;
+		if (opts.proxy_path && waitpid(opts.pid, &status, WNOHANG) > 0) {
+			opts.pid = 0;
+			if (WIFSIGNALED(status))
+				fprintf(stderr, "soak: proxy killed by signal %d\n",
+						WTERMSIG(status));
+			else
+				fprintf(stderr, "soak: proxy exited with %d\n",
+						WEXITSTATUS(status));
+		} else
+			fprintf(stderr, "soak: proxy %d is gone\n", (int)opts.pid);
+		event_base_loopbreak(base);
+	}
+}
+
+/*
+ * read_thresholds
+ * "name value" per line, '#' starts a comment.
+ */
+static void read_thresholds(double *max_bpc, double *max_p99)
+{
+	FILE *f;
+	char line[256], name[64];
+	double v;
+
+	f = fopen(opts.thresholds, "r");
+	if (!f) {
+		perror(opts.thresholds);
+		exit(EXIT_FAILURE);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || sscanf(line, "%63s %lf", name, &v) != 2)
+			continue;
+		if (strcmp(name, "bytes_per_conn") == 0)
+			*max_bpc = v;
+		else if (strcmp(name, "p99_us") == 0)
+			*max_p99 = v;
+	}
+	fclose(f);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, ret = EXIT_SUCCESS;
+	long nofile;
+	struct timeval tv;
+	struct event *tick, *sample;
+	double max_bpc = 0, max_p99 = 0, p99;
+
+	while ((opt = getopt(argc, argv, "x:P:a:p:n:r:d:i:s:t:")) != -1) {
+		switch (opt) {
+		case 'x': opts.proxy_path = optarg; break;
+		case 'P': opts.pid = (pid_t)atoi(optarg); break;
+		case 'a': opts.addr = optarg; break;
+		case 'p': opts.port = (unsigned short)atoi(optarg); break;
+		case 'n': opts.conns = strtoul(optarg, NULL, 10); break;
+		case 'r': opts.rate = strtoul(optarg, NULL, 10); break;
+		case 'd': opts.hold = (unsigned int)atoi(optarg); break;
+		case 'i': opts.ping_interval = (unsigned int)atoi(optarg); break;
+		case 's': opts.sample_interval = (unsigned int)atoi(optarg); break;
+		case 't': opts.thresholds = optarg; break;
+		default: usage();
+		}
+	}
+	opts.proxy_args = &argv[optind];
+	opts.proxy_nargs = argc - optind;
+
+	if ((!opts.proxy_path && opts.pid == 0) || opts.conns == 0 ||
+		opts.rate == 0 || opts.ping_interval == 0 ||
+		opts.sample_interval == 0)
+		usage();
+	if (opts.thresholds)
+		read_thresholds(&max_bpc, &max_p99);
+
+	/* Both ends of every tunnel live in this process, plus sampling. */
+	nofile = harness_raise_nofile();
+	if (nofile < (long)(2 * opts.conns + 64)) {
+		fprintf(stderr, "soak: RLIMIT_NOFILE %ld is too low for %lu tunnels\n",
+				nofile, opts.conns);
+		return EXIT_FAILURE;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	if (harness_parse_addr(opts.addr, opts.port, &proxy_ss, &proxy_len) != 0)
+		usage();
+
+	/* Spawn the proxy; it inherits the raised fd limit. */
+	if (opts.proxy_path)
+		opts.pid = harness_spawn_oddsock(opts.proxy_path, opts.addr,
+				opts.port, opts.proxy_args, opts.proxy_nargs);
+
+	tunnels = (struct soak_tunnel*)calloc(opts.conns, sizeof(*tunnels));
+	nsinks = (int)(opts.conns / TUNNELS_PER_ADDR) + 1;
+	sink_ports = (unsigned short*)calloc(nsinks, sizeof(*sink_ports));
+	base = event_base_new();
+	if (!tunnels || !sink_ports || !base ||
+		harness_sink_listen(base, nsinks, sink_ports) != 0) {
+		fprintf(stderr, "soak: setup failed\n");
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	rss_base_kb = harness_proc_rss_kb(opts.pid);
+	printf("soak: proxy pid %d, base rss %ld kB, %lu tunnels at %lu/s, "
+			"hold %us\n", (int)opts.pid, rss_base_kb, opts.conns, opts.rate,
+			opts.hold);
+
+	start_us = harness_now_us();
+	tick = event_new(base, -1, EV_PERSIST, tick_cb, NULL);
+	sample = event_new(base, -1, EV_PERSIST, sample_cb, NULL);
+	tv.tv_sec = 0;
+	tv.tv_usec = TICK_MS * 1000;
+	event_add(tick, &tv);
+	tv.tv_sec = opts.sample_interval;
+	tv.tv_usec = 0;
+	event_add(sample, &tv);
+
+	event_base_dispatch(base);
+
+	p99 = harness_percentile(hold, nhold, 99);
+	printf("soak: established %lu/%lu, worst bytes/conn %.0f, "
+			"hold p99 %.0f us\n",
+			established, opts.conns, worst_bytes_per_conn, p99);
+
+	if (failed > 0 || closed > 0) {
+		printf("soak: FAIL %lu tunnels failed to open, %lu closed early\n",
+				failed, closed);
+		ret = EXIT_FAILURE;
+	}
+	if (max_bpc > 0 && worst_bytes_per_conn > max_bpc) {
+		printf("soak: FAIL bytes/conn %.0f > threshold %.0f\n",
+				worst_bytes_per_conn, max_bpc);
+		ret = EXIT_FAILURE;
+	}
+	if (max_p99 > 0 && p99 > max_p99) {
+		printf("soak: FAIL p99 %.0f us > threshold %.0f us\n", p99, max_p99);
+		ret = EXIT_FAILURE;
+	}
+	if (ret == EXIT_SUCCESS)
+		printf("soak: PASS\n");
+
+out:
+	if (opts.proxy_path && opts.pid > 0) {
+		kill(opts.pid, SIGTERM);
+		waitpid(opts.pid, NULL, 0);
+	}
+	return ret;
+}
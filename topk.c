@@ -0,0 +1,344 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include "util.h"
+#include "socks5.h"
+#include "topk.h"
+
+#define TOPK_SLOTS	(2 * TOPK_CAPACITY)	/* index size, a power of two */
+
+struct topk_entry {
+	unsigned long key;
+	unsigned long count;
+	unsigned long error; /* count may overstate the key by this much */
+};
+
+/*
+ * Counts are kept apart from the keys, so the scan for the smallest on a
+ * miss reads one dense array; hits only touch the index and one count.
+ */
+struct topk_table {
+	unsigned long count[TOPK_CAPACITY];
+	unsigned long key[TOPK_CAPACITY];
+	unsigned long error[TOPK_CAPACITY];
+	unsigned char index[TOPK_SLOTS]; /* entry + 1, 0 = empty */
+	unsigned int used;
+};
+
+struct topk_name {
+	unsigned long key;
+	unsigned char type; /* TOPK_ADDR_* */
+	unsigned char len;
+	unsigned short port;
+	unsigned char addr[TOPK_NAME_LEN];
+};
+
+static struct topk_table g_topk[TOPK_BUCKETS][TOPK_KINDS][2];
+static unsigned int g_topk_cur = 0;
+static struct topk_name g_topk_names[TOPK_NAMES];
+static struct event *g_topk_ev = NULL;
+static unsigned int g_topk_window = 0;
+
+static const char *g_topk_kinds[] = { "clients", "destinations" };
+static const char *g_topk_metrics[] = { "connections", "bytes" };
+
+/*
+ * topk_slidecb
+ * Start a new bucket, dropping the oldest.
+ */
+static void topk_slidecb(int fd, short what, void *arg)
+{
+	g_topk_cur = (g_topk_cur + 1) % TOPK_BUCKETS;
+	memset(g_topk[g_topk_cur], 0, sizeof(g_topk[g_topk_cur]));
+}
+
+/*
+ * topk_init
+ */
+int topk_init(struct event_base *base, unsigned int window)
+{
+	struct timeval tv;
+
+	g_topk_window = window;
+	if (window == 0)
+		return 0;
+
+	tv.tv_sec = window >= TOPK_BUCKETS ? window / TOPK_BUCKETS : 1;
+	tv.tv_usec = 0;
+	g_topk_ev = event_new(base, -1, EV_PERSIST, topk_slidecb, NULL);
+	if (!g_topk_ev ||
+		event_priority_set(g_topk_ev, SOCKS5_PRIO_BULK) != 0 ||
+		event_add(g_topk_ev, &tv) != 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * topk_free
+ */
+void topk_free(void)
+{
+	if (g_topk_ev) {
+		event_free(g_topk_ev);
+		g_topk_ev = NULL;
+	}
+	g_topk_window = 0;
+}
+
+/*
+ * topk_key
+ */
+unsigned long topk_key(int type, const void *addr, size_t len,
+		unsigned short port)
+{
+	struct topk_name *slot;
+	const unsigned char *p = (const unsigned char*)addr;
+	unsigned long h = 2166136261UL; /* FNV-1a */
+	size_t i;
+
+	if (g_topk_window == 0)
+		return 0;
+
+	h = (h ^ (unsigned char)type) * 16777619UL;
+	for (i = 0; i < len; ++i)
+		h = (h ^ p[i]) * 16777619UL;
+	h = (h ^ (port >> 8)) * 16777619UL;
+	h = (h ^ (port & 0xff)) * 16777619UL;
+	if (h == 0)
+		h = 1;
+
+	slot = &g_topk_names[h % TOPK_NAMES];
+	if (slot->key != h) {
+		if (len > sizeof(slot->addr))
+			len = sizeof(slot->addr);
+		slot->key = h;
+		slot->type = (unsigned char)type;
+		slot->len = (unsigned char)len;
+		slot->port = port;
+		memcpy(slot->addr, p, len);
+	}
+
+	return h;
+}
+
+/*
+ * topk_print_name
+ */
+static void topk_print_name(struct evbuffer *out,
+		const struct topk_name *name)
+{
+	char buf[INET6_ADDRSTRLEN];
+
+	if (name->type == TOPK_ADDR_TEXT)
+		evbuffer_add_printf(out, "%.*s", (int)name->len,
+				(const char*)name->addr);
+	else if (inet_ntop(name->type == TOPK_ADDR_IPV4 ? AF_INET : AF_INET6,
+				name->addr, buf, sizeof(buf)))
+		evbuffer_add_printf(out, "%s", buf);
+	if (name->port)
+		evbuffer_add_printf(out, " %u", name->port);
+}
+
+/*
+ * topk_home
+ */
+static unsigned int topk_home(unsigned long key)
+{
+	return (unsigned int)(key ^ (key >> 15)) & (TOPK_SLOTS - 1);
+}
+
+/*
+ * topk_index
+ * Point the first free slot from key's home at entry.
+ */
+static void topk_index(struct topk_table *t, unsigned long key,
+		unsigned int entry)
+{
+	unsigned int i;
+
+	for (i = topk_home(key); t->index[i]; i = (i + 1) & (TOPK_SLOTS - 1))
+		;
+	t->index[i] = (unsigned char)(entry + 1);
+}
+
+/*
+ * topk_unindex
+ * Remove key from the index, shifting back later slots of its probe run.
+ */
+static void topk_unindex(struct topk_table *t, unsigned long key)
+{
+	unsigned int i, j, k;
+
+	for (i = topk_home(key); t->key[t->index[i] - 1] != key;
+			i = (i + 1) & (TOPK_SLOTS - 1))
+		;
+	t->index[i] = 0;
+
+	for (j = (i + 1) & (TOPK_SLOTS - 1); t->index[j];
+			j = (j + 1) & (TOPK_SLOTS - 1)) {
+		k = topk_home(t->key[t->index[j] - 1]);
+		/* Leave slots whose home lies cyclically in (i, j]. */
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		t->index[i] = t->index[j];
+		t->index[j] = 0;
+		i = j;
+	}
+}
+
+/*
+ * topk_add
+ */
+void topk_add(int kind, int metric, unsigned long key, unsigned long n)
+{
+	struct topk_table *t;
+	unsigned long low;
+	unsigned int i, e, min;
+
+	if (key == 0)
+		return;
+
+	t = &g_topk[g_topk_cur][kind][metric];
+	for (i = topk_home(key); t->index[i]; i = (i + 1) & (TOPK_SLOTS - 1)) {
+		e = t->index[i] - 1;
+		if (t->key[e] == key) {
+			t->count[e] += n;
+			return;
+		}
+	}
+
+	if (t->used < TOPK_CAPACITY) {
+		e = t->used++;
+		t->key[e] = key;
+		t->count[e] = n;
+		t->error[e] = 0;
+		t->index[i] = (unsigned char)t->used;
+		return;
+	}
+
+	/* Full: the new key takes over the smallest count. */
+	min = 0;
+	low = t->count[0];
+	for (i = 1; i < TOPK_CAPACITY; ++i)
+		if (t->count[i] < low) {
+			low = t->count[i];
+			min = i;
+		}
+	topk_unindex(t, t->key[min]);
+	t->key[min] = key;
+	t->error[min] = low;
+	t->count[min] = low + n;
+	topk_index(t, key, min);
+}
+
+/*
+ * topk_cmp_key
+ */
+static int topk_cmp_key(const void *a, const void *b)
+{
+	const struct topk_entry *x = (const struct topk_entry*)a;
+	const struct topk_entry *y = (const struct topk_entry*)b;
+
+	return x->key < y->key ? -1 : x->key > y->key;
+}
+
+/*
+ * topk_cmp_count
+ * Largest first.
+ */
+static int topk_cmp_count(const void *a, const void *b)
+{
+	const struct topk_entry *x = (const struct topk_entry*)a;
+	const struct topk_entry *y = (const struct topk_entry*)b;
+
+	return x->count > y->count ? -1 : x->count < y->count;
+}
+
+/*
+ * topk_report
+ */
+void topk_report(struct evbuffer *out, int kind, int metric, unsigned int n)
+{
+	static struct topk_entry all[TOPK_BUCKETS * TOPK_CAPACITY];
+	struct topk_table *t;
+	struct topk_name *name;
+	size_t nall = 0, i, j;
+	unsigned int e;
+
+	if (g_topk_window == 0) {
+		evbuffer_add_printf(out, "error: tracking is off (--topkWindow 0)\n");
+		return;
+	}
+
+	/* Sum each key over the buckets. */
+	for (i = 0; i < TOPK_BUCKETS; ++i) {
+		t = &g_topk[i][kind][metric];
+		for (e = 0; e < t->used; ++e, ++nall) {
+			all[nall].key = t->key[e];
+			all[nall].count = t->count[e];
+			all[nall].error = t->error[e];
+		}
+	}
+	qsort(all, nall, sizeof(*all), topk_cmp_key);
+	for (i = 0, j = 0; i < nall; ++i) {
+		if (j > 0 && all[j - 1].key == all[i].key) {
+			all[j - 1].count += all[i].count;
+			all[j - 1].error += all[i].error;
+		} else
+			all[j++] = all[i];
+	}
+	nall = j;
+	qsort(all, nall, sizeof(*all), topk_cmp_count);
+
+	evbuffer_add_printf(out, "# %s by %s, last %u s: count error name\n",
+			g_topk_kinds[kind], g_topk_metrics[metric], g_topk_window);
+	for (i = 0; i < nall && i < n; ++i) {
+		name = &g_topk_names[all[i].key % TOPK_NAMES];
+		if (name->key == all[i].key) {
+			evbuffer_add_printf(out, "%lu %lu ",
+					all[i].count, all[i].error);
+			topk_print_name(out, name);
+			evbuffer_add_printf(out, "\n");
+		} else
+			evbuffer_add_printf(out, "%lu %lu #%08lx\n",
+					all[i].count, all[i].error, all[i].key);
+	}
+}
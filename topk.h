@@ -0,0 +1,107 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#ifndef ODDSOCK_TOPK_H
+#define ODDSOCK_TOPK_H
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+/*
+ * Heavy hitters.
+ *
+ * Connections and relayed bytes are counted per client address and per
+ * requested destination with the space-saving algorithm: each table keeps
+ * TOPK_CAPACITY keys, and a new key takes the place of the smallest one,
+ * inheriting its count as the error bound. Any key with more than
+ * 1/TOPK_CAPACITY of the total is guaranteed to be in the table.
+ *
+ * The window (--topkWindow) is split into TOPK_BUCKETS buckets of tables;
+ * updates go to the newest bucket and the oldest is cleared as the window
+ * slides, so memory is fixed. Keys are hashes of the binary address, and
+ * the port for destinations. The address bytes go into a direct mapped
+ * cache when a key is first seen and are only formatted for reports; a
+ * key whose slot was overwritten is shown as #hash. Connections remember
+ * their keys, so relay updates only hash into a small index.
+ */
+
+#define TOPK_CLIENTS	(0)
+#define TOPK_DSTS		(1)
+#define TOPK_KINDS		(2)
+
+#define TOPK_CONNS	(0)
+#define TOPK_BYTES	(1)
+
+#define TOPK_CAPACITY	(64)	/* keys per table */
+#define TOPK_BUCKETS	(6)
+#define TOPK_NAMES		(1024)	/* name cache slots */
+#define TOPK_NAME_LEN	(64)	/* longer names are cut */
+
+#define TOPK_ADDR_TEXT	(0)	/* a domain or other name */
+#define TOPK_ADDR_IPV4	(1)	/* 4 bytes, network order */
+#define TOPK_ADDR_IPV6	(2)	/* 16 bytes, network order */
+
+/*
+ * topk_init
+ * Start the window timer; window 0 disables tracking.
+ */
+int topk_init(struct event_base *base, unsigned int window);
+
+/*
+ * topk_free
+ */
+void topk_free(void);
+
+/*
+ * topk_key
+ * Hash len bytes of an address of type (TOPK_ADDR_*) and port, 0 for
+ * none, and remember them for reports. returns 0 when tracking is off.
+ */
+unsigned long topk_key(int type, const void *addr, size_t len,
+		unsigned short port);
+
+/*
+ * topk_add
+ * Count n connections or bytes (TOPK_CONNS, TOPK_BYTES) for key in the
+ * kind's table. A zero key is ignored.
+ */
+void topk_add(int kind, int metric, unsigned long key, unsigned long n);
+
+/*
+ * topk_report
+ * Append the top n keys of a table over the whole window to out.
+ */
+void topk_report(struct evbuffer *out, int kind, int metric, unsigned int n);
+
+#endif
@@ -0,0 +1,268 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <event2/event.h>
+#include "util.h"
+#include "socks5.h"
+#include "socks5_parse.h"
+#include "trace.h"
+#include "alog.h"
+#include "conntab.h"
+
+static FILE *g_trace_file = NULL;
+static struct event *g_trace_flush_ev = NULL;
+static struct timeval g_trace_start;
+
+static const char *g_trace_dst[] = { "-", "ip4", "ip6", "domain" };
+static const char *g_trace_out[] = { "-", "ok", "fail", "reject" };
+static const char *g_trace_kind[] = { "socks", "transparent", "mux" };
+
+/*
+ * trace_flushcb
+ */
+static void trace_flushcb(int fd, short what, void *arg)
+{
+	if (fflush(g_trace_file) != 0)
+		oddsock_log(1, errno, "failed writing trace");
+}
+
+/*
+ * trace_init
+ */
+int trace_init(struct event_base *base, const char *path)
+{
+	struct timeval tv = { 1, 0 };
+
+	if (!path)
+		return 0;
+
+	g_trace_file = fopen(path, "a");
+	if (!g_trace_file) {
+		oddsock_log(0, errno, "failed opening trace file %s", path);
+		return -1;
+	}
+	fprintf(g_trace_file, "# oddsock trace 1\n"
+			"# start_us kind dst outcome request_us connect_us life_us"
+			" up down\n");
+
+	g_trace_flush_ev = event_new(base, -1, EV_PERSIST, trace_flushcb, NULL);
+	if (!g_trace_flush_ev ||
+		event_priority_set(g_trace_flush_ev, SOCKS5_PRIO_BULK) != 0 ||
+		event_add(g_trace_flush_ev, &tv) != 0)
+		return -1;
+
+	evutil_gettimeofday(&g_trace_start, NULL);
+
+	return 0;
+}
+
+/*
+ * trace_close
+ */
+void trace_close(void)
+{
+	if (g_trace_flush_ev) {
+		event_free(g_trace_flush_ev);
+		g_trace_flush_ev = NULL;
+	}
+	if (g_trace_file) {
+		fclose(g_trace_file);
+		g_trace_file = NULL;
+	}
+}
+
+/*
+ * trace_since_us
+ * Microseconds from then to now. The loop's cached time comes from a
+ * coarse clock with a resolution of a few milliseconds, too coarse for
+ * handshakes.
+ */
+static long trace_since_us(const struct timeval *then)
+{
+	struct timeval now, d;
+
+	evutil_gettimeofday(&now, NULL);
+	evutil_timersub(&now, then, &d);
+
+	return (long)d.tv_sec * 1000000L + (long)d.tv_usec;
+}
+
+/*
+ * trace_begin
+ */
+struct trace_rec *trace_begin(void)
+{
+	struct trace_rec *rec;
+
+	if (!g_trace_file && !alog_enabled() && !conntab_enabled())
+		return NULL;
+
+	rec = (struct trace_rec*)malloc(sizeof(struct trace_rec));
+	if (!rec)
+		return NULL;
+	memset(rec, 0, sizeof(struct trace_rec));
+
+	evutil_gettimeofday(&rec->accepted, NULL);
+	rec->request_us = -1;
+	rec->connect_us = -1;
+
+	return rec;
+}
+
+/*
+ * trace_client
+ */
+void trace_client(struct socks5_conn *sconn, const struct sockaddr *sa)
+{
+	struct trace_rec *rec = sconn->trace;
+
+	if (!rec)
+		return;
+
+	if (sa->sa_family == AF_INET) {
+		const struct sockaddr_in *sin = (const struct sockaddr_in*)sa;
+		rec->client_family = 4;
+		rec->client_port = ntohs(sin->sin_port);
+		memcpy(rec->client_addr, &sin->sin_addr, 4);
+	} else if (sa->sa_family == AF_INET6) {
+		const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6*)sa;
+		rec->client_family = 6;
+		rec->client_port = ntohs(sin6->sin6_port);
+		memcpy(rec->client_addr, &sin6->sin6_addr, 16);
+	}
+}
+
+/*
+ * trace_request
+ */
+void trace_request(struct socks5_conn *sconn,
+		const struct socks5_request *request)
+{
+	struct trace_rec *rec = sconn->trace;
+
+	if (!rec)
+		return;
+
+	if (request->atype == SOCKS5_ATYPE_IPV4) {
+		rec->dst = TRACE_DST_IPV4;
+		rec->dst_len = 4;
+		memcpy(rec->dst_addr, request->addr.ipv4, 4);
+	} else if (request->atype == SOCKS5_ATYPE_IPV6) {
+		rec->dst = TRACE_DST_IPV6;
+		rec->dst_len = 16;
+		memcpy(rec->dst_addr, request->addr.ipv6, 16);
+	} else {
+		rec->dst = TRACE_DST_DOMAIN;
+		rec->dst_len = request->domain_len < TRACE_DST_LEN ?
+			request->domain_len : TRACE_DST_LEN;
+		memcpy(rec->dst_addr, request->addr.domain, rec->dst_len);
+	}
+	rec->dst_port = request->port;
+	rec->request_us = trace_since_us(&rec->accepted);
+}
+
+/*
+ * trace_reason
+ */
+void trace_reason(struct socks5_conn *sconn, unsigned char reason)
+{
+	if (sconn->trace && sconn->trace->reason == TRACE_CLOSE_NONE)
+		sconn->trace->reason = reason;
+}
+
+/*
+ * trace_outcome
+ */
+void trace_outcome(struct socks5_conn *sconn, unsigned char outcome)
+{
+	if (!sconn->trace || sconn->trace->outcome != TRACE_OUT_NONE)
+		return;
+
+	sconn->trace->outcome = outcome;
+	sconn->trace->connect_us = trace_since_us(&sconn->trace->accepted);
+}
+
+/*
+ * trace_end
+ */
+void trace_end(struct socks5_conn *sconn)
+{
+	struct trace_rec *rec = sconn->trace;
+	struct timeval start;
+	unsigned char kind;
+	char request[24], connect[24];
+
+	if (!rec)
+		return;
+	sconn->trace = NULL;
+
+	if (sconn->transparent)
+		kind = ALOG_KIND_TRANSPARENT;
+	else if (sconn->client_fd < 0)
+		kind = ALOG_KIND_MUX;
+	else
+		kind = ALOG_KIND_SOCKS;
+
+	if (rec->reason == TRACE_CLOSE_NONE &&
+		(rec->outcome == TRACE_OUT_FAIL || rec->outcome == TRACE_OUT_REJECT))
+		rec->reason = TRACE_CLOSE_CONNECT;
+	if (alog_enabled())
+		alog_write(rec, kind);
+	if (!g_trace_file) {
+		free(rec);
+		return;
+	}
+
+	strcpy(request, "-");
+	if (rec->request_us >= 0)
+		sprintf(request, "%ld", rec->request_us);
+	strcpy(connect, "-");
+	if (rec->connect_us >= 0)
+		sprintf(connect, "%ld", rec->connect_us);
+
+	evutil_timersub(&rec->accepted, &g_trace_start, &start);
+	fprintf(g_trace_file, "%ld %s %s %s %s %s %ld %lu %lu\n",
+			(long)start.tv_sec * 1000000L + (long)start.tv_usec,
+			g_trace_kind[kind], g_trace_dst[rec->dst],
+			g_trace_out[rec->outcome],
+			request, connect, trace_since_us(&rec->accepted),
+			rec->bytes[RELAY_UP], rec->bytes[RELAY_DOWN]);
+
+	free(rec);
+}
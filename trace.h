@@ -0,0 +1,164 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#ifndef ODDSOCK_TRACE_H
+#define ODDSOCK_TRACE_H
+
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <event2/event.h>
+
+/*
+ * Session trace.
+ *
+ * With --traceFile every connection appends one line when it is freed:
+ *
+ *   start_us kind dst outcome request_us connect_us life_us up down
+ *
+ * start_us is the accept time relative to trace_init. kind is socks,
+ * transparent or mux (accepted from a mux peer). dst is the class of the
+ * requested destination: ip4, ip6, domain or - when no request was made.
+ * outcome is ok, fail (connect failed or timed out), reject (answered
+ * from the health cache, an unsupported request, or no mux upstream) or
+ * - (closed before connecting). request_us and connect_us are the times
+ * from accept to the request and to the connect outcome, - when not
+ * reached. Requests forwarded to a mux upstream leave outcome at -; the
+ * upstream's own trace has it. up and down are the bytes relayed each
+ * way.
+ *
+ * Addresses, ports and names are never written, so traces can be taken
+ * from production and replayed with tools/replay. Lines are buffered and
+ * flushed once a second.
+ *
+ * The same per-connection record, with the addresses, feeds the access
+ * log (alog.h) and the connection table (conntab.h); records exist while
+ * any of them is on.
+ */
+
+#define TRACE_DST_NONE		(0)
+#define TRACE_DST_IPV4		(1)
+#define TRACE_DST_IPV6		(2)
+#define TRACE_DST_DOMAIN	(3)
+
+#define TRACE_OUT_NONE		(0)
+#define TRACE_OUT_OK		(1)
+#define TRACE_OUT_FAIL		(2)
+#define TRACE_OUT_REJECT	(3)
+
+/* Why the connection was closed; the first reason recorded sticks. */
+#define TRACE_CLOSE_NONE			(0)
+#define TRACE_CLOSE_CLIENT			(1)	/* client EOF */
+#define TRACE_CLOSE_DST				(2)	/* destination EOF */
+#define TRACE_CLOSE_CLIENT_ERROR	(3)
+#define TRACE_CLOSE_DST_ERROR		(4)
+#define TRACE_CLOSE_TIMEOUT			(5)	/* handshake or idle */
+#define TRACE_CLOSE_REQUEST		(6)	/* handshake or request failed */
+#define TRACE_CLOSE_CONNECT			(7)	/* connect failed or rejected */
+#define TRACE_CLOSE_ADMIN			(8)	/* killed over the admin socket */
+
+#define TRACE_DST_LEN	(64)
+
+struct socks5_conn;
+struct socks5_request;
+
+struct trace_rec {
+	struct timeval accepted;
+	long request_us; /* -1 until the request */
+	long connect_us; /* -1 until the connect outcome */
+	unsigned long bytes[2]; /* RELAY_UP, RELAY_DOWN */
+	unsigned char dst;
+	unsigned char outcome;
+	unsigned char reason;
+	unsigned char client_family; /* 0, 4 or 6 */
+	unsigned short client_port;
+	unsigned short dst_port;
+	unsigned char client_addr[16];
+	unsigned char dst_len;
+	unsigned char dst_addr[TRACE_DST_LEN]; /* address or name */
+	struct socks5_conn *sconn; /* while in the connection table */
+	unsigned long id; /* connection table id, never reused */
+	TAILQ_ENTRY(trace_rec) link;
+};
+
+/*
+ * trace_init
+ * Open path for appending; a no-op when path is NULL.
+ */
+int trace_init(struct event_base *base, const char *path);
+
+/*
+ * trace_close
+ * Flush and close the trace file.
+ */
+void trace_close(void);
+
+/*
+ * trace_begin
+ * Start a record for a new connection; NULL when tracing is off.
+ */
+struct trace_rec *trace_begin(void);
+
+/*
+ * trace_client
+ * Remember the client's address.
+ */
+void trace_client(struct socks5_conn *sconn, const struct sockaddr *sa);
+
+/*
+ * trace_request
+ * The connection asked for a destination.
+ */
+void trace_request(struct socks5_conn *sconn,
+		const struct socks5_request *request);
+
+/*
+ * trace_reason
+ * Record why the connection is being closed, TRACE_CLOSE_*.
+ */
+void trace_reason(struct socks5_conn *sconn, unsigned char reason);
+
+/*
+ * trace_outcome
+ * The connect attempt ended.
+ */
+void trace_outcome(struct socks5_conn *sconn, unsigned char outcome);
+
+/*
+ * trace_end
+ * Write the connection's line and free its record.
+ */
+void trace_end(struct socks5_conn *sconn);
+
+#endif
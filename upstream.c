@@ -0,0 +1,668 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/util.h>
+#include "util.h"
+#include "oddsock.h"
+#include "socks5.h"
+#include "stats.h"
+#include "upstream.h"
+
+#define UPSTREAM_TICK_SECS	(1)
+#define UPSTREAM_AUTH_MAX	(3 + 255 + 255)
+
+enum upstream_state {
+	UPC_CONNECTING = 0,
+	UPC_GREETING,
+	UPC_AUTH,
+	UPC_READY
+};
+
+struct upstream;
+
+struct upstream_conn {
+	struct upstream *up;
+	struct bufferevent *bev;
+	enum upstream_state state;
+	struct timeval started;
+	unsigned long handshake_us;
+	time_t idle_since;
+	upstream_cb cb; /* set while a request waits on this connection */
+	void *arg;
+	unsigned char request[UPSTREAM_REQUEST_MAX];
+	size_t request_len;
+	struct upstream_conn *prev;
+	struct upstream_conn *next;
+};
+
+struct upstream {
+	char name[256 + 8];
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	struct upstream_conn *idle; /* ready, most recently readied first */
+	struct upstream_conn *pending; /* being set up */
+	unsigned int nidle;
+	unsigned int nspare; /* pending and not claimed by a request */
+	unsigned int target;
+	unsigned int misses; /* since the last tick */
+	bool failing; /* last connection failed to set up */
+	unsigned long hits_total;
+	unsigned long misses_total;
+};
+
+static struct event_base *g_upstream_base = NULL;
+static struct event *g_upstream_ev = NULL;
+static struct upstream g_upstreams[UPSTREAM_MAX];
+static unsigned int g_nupstreams = 0;
+static unsigned int g_upstream_next = 0; /* round robin */
+static unsigned char g_upstream_auth[UPSTREAM_AUTH_MAX];
+static size_t g_upstream_auth_len = 0;
+
+static void upstream_conn_readcb(struct bufferevent *bev, void *arg);
+static void upstream_conn_eventcb(struct bufferevent *bev, short what,
+		void *arg);
+
+/*
+ * upstream_list_push
+ */
+static void upstream_list_push(struct upstream_conn **head,
+		struct upstream_conn *c)
+{
+	c->prev = NULL;
+	c->next = *head;
+	if (*head)
+		(*head)->prev = c;
+	*head = c;
+}
+
+/*
+ * upstream_list_remove
+ */
+static void upstream_list_remove(struct upstream_conn **head,
+		struct upstream_conn *c)
+{
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		*head = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	c->prev = NULL;
+	c->next = NULL;
+}
+
+/*
+ * upstream_conn_unlink
+ * Take a connection off its pool list.
+ */
+static void upstream_conn_unlink(struct upstream_conn *c)
+{
+	struct upstream *up = c->up;
+
+	if (c->state == UPC_READY) {
+		upstream_list_remove(&up->idle, c);
+		--up->nidle;
+		--g_stats.upstream_pooled;
+	} else {
+		upstream_list_remove(&up->pending, c);
+		if (!c->cb)
+			--up->nspare;
+	}
+}
+
+/*
+ * upstream_conn_free
+ */
+static void upstream_conn_free(struct upstream_conn *c)
+{
+	upstream_conn_unlink(c);
+	if (c->bev)
+		bufferevent_free(c->bev);
+	free(c);
+}
+
+/*
+ * upstream_conn_new
+ * Start a spare connection to up.
+ */
+static struct upstream_conn *upstream_conn_new(struct upstream *up)
+{
+	struct upstream_conn *c;
+	struct timeval tv;
+
+	c = (struct upstream_conn*)calloc(1, sizeof(struct upstream_conn));
+	if (!c)
+		return NULL;
+	c->up = up;
+	c->bev = bufferevent_socket_new(g_upstream_base, -1,
+			BEV_OPT_CLOSE_ON_FREE);
+	if (!c->bev) {
+		free(c);
+		return NULL;
+	}
+	bufferevent_setcb(c->bev, upstream_conn_readcb, NULL,
+			upstream_conn_eventcb, (void*)c);
+	bufferevent_priority_set(c->bev, SOCKS5_PRIO_HANDSHAKE);
+	tv.tv_sec = g_opts.connect_timeout;
+	tv.tv_usec = 0;
+	bufferevent_set_timeouts(c->bev, &tv, &tv);
+	bufferevent_enable(c->bev, EV_READ|EV_WRITE);
+
+	evutil_gettimeofday(&c->started, NULL);
+	upstream_list_push(&up->pending, c);
+	++up->nspare;
+
+	/* A refused connect is reported through the event callback. */
+	if (bufferevent_socket_connect(c->bev, (struct sockaddr*)&up->addr,
+				(int)up->addrlen) != 0) {
+		oddsock_log(1, errno, "upstream %s: connect failed", up->name);
+		upstream_conn_free(c);
+		return NULL;
+	}
+
+	return c;
+}
+
+/*
+ * upstream_refill
+ * Top the pool of up back up to its target.
+ */
+static void upstream_refill(struct upstream *up)
+{
+	while (up->nidle + up->nspare < up->target)
+		if (!upstream_conn_new(up))
+			break;
+}
+
+/*
+ * upstream_conn_failed
+ * Drop a connection that failed to set up or was closed while idle; a
+ * request waiting on it is told.
+ */
+static void upstream_conn_failed(struct upstream_conn *c)
+{
+	upstream_cb cb = c->cb;
+	void *arg = c->arg;
+
+	++g_stats.upstream_failed;
+	if (c->state != UPC_READY)
+		c->up->failing = true;
+	upstream_conn_free(c);
+	if (cb)
+		cb(NULL, arg);
+}
+
+/*
+ * upstream_conn_take
+ * Hand a ready connection over with the request written to it.
+ */
+static struct bufferevent *upstream_conn_take(struct upstream_conn *c,
+		const unsigned char *request, size_t len)
+{
+	struct bufferevent *bev = c->bev;
+	int e;
+
+	bufferevent_setcb(bev, NULL, NULL, NULL, NULL);
+	bufferevent_set_timeouts(bev, NULL, NULL);
+
+	/* The request may be the one kept in c; write it before c goes. */
+	e = bufferevent_write(bev, request, len);
+	upstream_conn_unlink(c);
+	c->bev = NULL;
+	free(c);
+	if (e != 0) {
+		bufferevent_free(bev);
+		return NULL;
+	}
+
+	return bev;
+}
+
+/*
+ * upstream_conn_ready
+ * The greeting (and authentication) completed.
+ */
+static void upstream_conn_ready(struct upstream_conn *c)
+{
+	struct upstream *up = c->up;
+	struct bufferevent *bev;
+	struct timeval now;
+	upstream_cb cb = c->cb;
+	void *arg = c->arg;
+
+	evutil_gettimeofday(&now, NULL);
+	evutil_timersub(&now, &c->started, &now);
+	c->handshake_us = (unsigned long)now.tv_sec * 1000000UL +
+		(unsigned long)now.tv_usec;
+	up->failing = false;
+
+	if (cb) {
+		/* A request that missed the pool has been waiting. */
+		bev = upstream_conn_take(c, c->request, c->request_len);
+		cb(bev, arg);
+		return;
+	}
+
+	upstream_list_remove(&up->pending, c);
+	--up->nspare;
+	c->state = UPC_READY;
+	event_base_gettimeofday_cached(g_upstream_base, &now);
+	c->idle_since = now.tv_sec;
+	bufferevent_set_timeouts(c->bev, NULL, NULL);
+	bufferevent_priority_set(c->bev, SOCKS5_PRIO_BULK);
+	upstream_list_push(&up->idle, c);
+	++up->nidle;
+	++g_stats.upstream_pooled;
+}
+
+/*
+ * upstream_conn_readcb
+ */
+static void upstream_conn_readcb(struct bufferevent *bev, void *arg)
+{
+	struct upstream_conn *c = (struct upstream_conn*)arg;
+	struct evbuffer *input = bufferevent_get_input(bev);
+	unsigned char reply[2];
+
+	if (c->state == UPC_READY) {
+		oddsock_logx(1, "upstream %s: data on an idle connection",
+				c->up->name);
+		upstream_conn_failed(c);
+		return;
+	}
+	if (evbuffer_get_length(input) < 2)
+		return;
+	evbuffer_remove(input, reply, 2);
+
+	if (c->state == UPC_GREETING && reply[0] == 0x05) {
+		if (reply[1] == SOCKS5_AUTH_NONE && g_upstream_auth_len == 0) {
+			upstream_conn_ready(c);
+			return;
+		}
+		if (reply[1] == SOCKS5_AUTH_USERPASS && g_upstream_auth_len > 0 &&
+			bufferevent_write(bev, g_upstream_auth,
+				g_upstream_auth_len) == 0) {
+			c->state = UPC_AUTH;
+			return;
+		}
+	}
+	else if (c->state == UPC_AUTH && reply[0] == 0x01 && reply[1] == 0x00) {
+		upstream_conn_ready(c);
+		return;
+	}
+
+	oddsock_logx(1, "upstream %s: refused, reply %02x %02x", c->up->name,
+			reply[0], reply[1]);
+	upstream_conn_failed(c);
+}
+
+/*
+ * upstream_conn_eventcb
+ */
+static void upstream_conn_eventcb(struct bufferevent *bev, short what,
+		void *arg)
+{
+	struct upstream_conn *c = (struct upstream_conn*)arg;
+	unsigned char greeting[4] = { 0x05, 0x01, SOCKS5_AUTH_NONE, 0 };
+
+	if (what & BEV_EVENT_CONNECTED) {
+		make_socket_nodelay(bufferevent_getfd(bev));
+		if (g_upstream_auth_len > 0)
+			greeting[2] = SOCKS5_AUTH_USERPASS;
+		c->state = UPC_GREETING;
+		if (bufferevent_write(bev, greeting, 3) != 0)
+			upstream_conn_failed(c);
+		return;
+	}
+
+	if (what & BEV_EVENT_TIMEOUT)
+		oddsock_logx(1, "upstream %s: timed out", c->up->name);
+	else if (what & BEV_EVENT_ERROR)
+		oddsock_log(1, errno, "upstream %s: connection error", c->up->name);
+	else
+		oddsock_logx(1, "upstream %s: connection closed", c->up->name);
+	upstream_conn_failed(c);
+}
+
+/*
+ * upstream_tickcb
+ * Grow each pool by the last second's misses, expire idle connections
+ * and refill.
+ */
+static void upstream_tickcb(int fd, short what, void *arg)
+{
+	struct upstream *up;
+	struct upstream_conn *c, *next;
+	struct timeval now;
+	unsigned int i;
+
+	event_base_gettimeofday_cached(g_upstream_base, &now);
+
+	for (i = 0; i < g_nupstreams; ++i) {
+		up = &g_upstreams[i];
+
+		up->target += up->misses;
+		if (up->target > UPSTREAM_POOL_MAX)
+			up->target = UPSTREAM_POOL_MAX;
+		up->misses = 0;
+
+		for (c = up->idle; c; c = next) {
+			next = c->next;
+			if (now.tv_sec - c->idle_since < (time_t)g_opts.upstream_idle)
+				continue;
+			++g_stats.upstream_expired;
+			upstream_conn_free(c);
+			if (up->target > g_opts.upstream_pool)
+				--up->target;
+		}
+
+		upstream_refill(up);
+	}
+}
+
+/*
+ * upstream_parse
+ * Resolve one host:port or [v6addr]:port.
+ */
+static int upstream_parse(struct upstream *up, const char *spec,
+		size_t len)
+{
+	char host[256];
+	char port[8];
+	const char *colon;
+	size_t hostlen;
+	struct addrinfo hints, *res;
+	int e;
+
+	if (len >= sizeof(up->name))
+		return -1;
+	memcpy(up->name, spec, len);
+	up->name[len] = '\0';
+
+	colon = strrchr(up->name, ':');
+	if (!colon || colon == up->name || !colon[1] ||
+		strlen(colon + 1) >= sizeof(port))
+		return -1;
+	strcpy(port, colon + 1);
+
+	spec = up->name;
+	hostlen = (size_t)(colon - spec);
+	if (spec[0] == '[' && spec[hostlen - 1] == ']') {
+		++spec;
+		hostlen -= 2;
+	}
+	if (hostlen == 0 || hostlen >= sizeof(host))
+		return -1;
+	memcpy(host, spec, hostlen);
+	host[hostlen] = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	e = getaddrinfo(host, port, &hints, &res);
+	if (e != 0) {
+		oddsock_logx(0, "upstream %s: %s", up->name, gai_strerror(e));
+		return -1;
+	}
+	memcpy(&up->addr, res->ai_addr, res->ai_addrlen);
+	up->addrlen = (socklen_t)res->ai_addrlen;
+	freeaddrinfo(res);
+
+	return 0;
+}
+
+/*
+ * upstream_parse_auth
+ * Build the RFC 1929 request from user:pass.
+ */
+static int upstream_parse_auth(const char *auth)
+{
+	const char *colon = strchr(auth, ':');
+	size_t ulen, plen;
+
+	if (!colon)
+		return -1;
+	ulen = (size_t)(colon - auth);
+	plen = strlen(colon + 1);
+	if (ulen == 0 || ulen > 255 || plen == 0 || plen > 255)
+		return -1;
+
+	g_upstream_auth[0] = 0x01;
+	g_upstream_auth[1] = (unsigned char)ulen;
+	memcpy(g_upstream_auth + 2, auth, ulen);
+	g_upstream_auth[2 + ulen] = (unsigned char)plen;
+	memcpy(g_upstream_auth + 3 + ulen, colon + 1, plen);
+	g_upstream_auth_len = 3 + ulen + plen;
+
+	return 0;
+}
+
+/*
+ * upstream_init
+ */
+int upstream_init(struct event_base *base)
+{
+	const char *spec = g_opts.socks_upstream;
+	const char *comma;
+	struct timeval tv;
+	unsigned int i;
+
+	if (!spec)
+		return 0;
+
+	if (g_opts.socks_upstream_auth &&
+		upstream_parse_auth(g_opts.socks_upstream_auth) != 0) {
+		oddsock_logx(0, "--socksUpstreamAuth must be user:pass");
+		return -1;
+	}
+
+	while (*spec) {
+		comma = strchr(spec, ',');
+		if (!comma)
+			comma = spec + strlen(spec);
+		if (g_nupstreams == UPSTREAM_MAX ||
+			upstream_parse(&g_upstreams[g_nupstreams], spec,
+				(size_t)(comma - spec)) != 0) {
+			oddsock_logx(0, "--socksUpstream must be at most %d host:port",
+					UPSTREAM_MAX);
+			return -1;
+		}
+		++g_nupstreams;
+		spec = *comma ? comma + 1 : comma;
+	}
+	if (g_nupstreams == 0)
+		return -1;
+
+	g_upstream_base = base;
+	g_upstream_ev = event_new(base, -1, EV_PERSIST, upstream_tickcb, NULL);
+	if (!g_upstream_ev ||
+		event_priority_set(g_upstream_ev, SOCKS5_PRIO_BULK) != 0)
+		return -1;
+	tv.tv_sec = UPSTREAM_TICK_SECS;
+	tv.tv_usec = 0;
+	if (event_add(g_upstream_ev, &tv) != 0)
+		return -1;
+
+	for (i = 0; i < g_nupstreams; ++i) {
+		g_upstreams[i].target = g_opts.upstream_pool;
+		upstream_refill(&g_upstreams[i]);
+	}
+
+	return 0;
+}
+
+/*
+ * upstream_free
+ */
+void upstream_free(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < g_nupstreams; ++i) {
+		while (g_upstreams[i].idle)
+			upstream_conn_free(g_upstreams[i].idle);
+		while (g_upstreams[i].pending)
+			upstream_conn_free(g_upstreams[i].pending);
+	}
+	g_nupstreams = 0;
+	if (g_upstream_ev) {
+		event_free(g_upstream_ev);
+		g_upstream_ev = NULL;
+	}
+}
+
+/*
+ * upstream_configure
+ */
+void upstream_configure(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < g_nupstreams; ++i) {
+		if (g_upstreams[i].target < g_opts.upstream_pool)
+			g_upstreams[i].target = g_opts.upstream_pool;
+		upstream_refill(&g_upstreams[i]);
+	}
+}
+
+/*
+ * upstream_request
+ */
+int upstream_request(const unsigned char *request, size_t len,
+		upstream_cb cb, void *arg, struct bufferevent **bev)
+{
+	struct upstream *up;
+	struct upstream_conn *c;
+	unsigned int i;
+
+	if (g_nupstreams == 0 || len > UPSTREAM_REQUEST_MAX)
+		return -1;
+
+	for (i = 0; i < g_nupstreams; ++i) {
+		up = &g_upstreams[(g_upstream_next + i) % g_nupstreams];
+		if (up->idle)
+			break;
+	}
+
+	if (i < g_nupstreams) {
+		g_upstream_next = (g_upstream_next + i + 1) % g_nupstreams;
+		c = up->idle;
+		++up->hits_total;
+		++g_stats.upstream_hits;
+		g_stats.upstream_saved_us += c->handshake_us;
+		*bev = upstream_conn_take(c, request, len);
+		upstream_refill(up);
+		return *bev ? 1 : -1;
+	}
+
+	/* Nothing ready: wait on a spare being set up or start one. */
+	up = &g_upstreams[g_upstream_next];
+	g_upstream_next = (g_upstream_next + 1) % g_nupstreams;
+	++up->misses;
+	++up->misses_total;
+	++g_stats.upstream_misses;
+
+	for (c = up->pending; c; c = c->next)
+		if (!c->cb)
+			break;
+	if (!c)
+		c = upstream_conn_new(up);
+	if (!c)
+		return -1;
+
+	--up->nspare;
+	c->cb = cb;
+	c->arg = arg;
+	memcpy(c->request, request, len);
+	c->request_len = len;
+
+	/* An upstream that is failing is only retried by the tick. */
+	if (!up->failing)
+		upstream_refill(up);
+	return 0;
+}
+
+/*
+ * upstream_cancel
+ */
+void upstream_cancel(void *arg)
+{
+	struct upstream_conn *c;
+	unsigned int i;
+
+	for (i = 0; i < g_nupstreams; ++i)
+		for (c = g_upstreams[i].pending; c; c = c->next)
+			if (c->cb && c->arg == arg) {
+				c->cb = NULL;
+				c->arg = NULL;
+				++g_upstreams[i].nspare;
+				return;
+			}
+}
+
+/*
+ * upstream_report
+ */
+void upstream_report(struct evbuffer *out)
+{
+	struct upstream *up;
+	unsigned int i;
+
+	if (g_nupstreams == 0) {
+		evbuffer_add_printf(out, "no upstream proxies\n");
+		return;
+	}
+
+	evbuffer_add_printf(out, "hits %lu misses %lu expired %lu failed %lu "
+			"saved %lu us\n", g_stats.upstream_hits, g_stats.upstream_misses,
+			g_stats.upstream_expired, g_stats.upstream_failed,
+			g_stats.upstream_saved_us);
+	for (i = 0; i < g_nupstreams; ++i) {
+		up = &g_upstreams[i];
+		evbuffer_add_printf(out, "%s: idle %u spare %u target %u "
+				"hits %lu misses %lu\n", up->name, up->nidle, up->nspare,
+				up->target, up->hits_total, up->misses_total);
+	}
+}
@@ -0,0 +1,116 @@
+/*******************************************************************************
+ *
+ * oddsock
+ * A flexible SOCKS proxy server.
+ *
+ * Copyright 2011 Stephen Larew. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright notice,
+ *  this list of conditions and the following disclaimer.
+ *
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *  notice, this list of conditions and the following disclaimer in the
+ *  documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY STEPHEN LAREW ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL STEPHEN LAREW OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * The views and conclusions contained in the software and documentation are
+ * those of the authors and should not be interpreted as representing official
+ * policies, either expressed or implied, of Stephen Larew.
+ *
+ ******************************************************************************/
+
+#ifndef ODDSOCK_UPSTREAM_H
+#define ODDSOCK_UPSTREAM_H
+
+#include <stddef.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+/*
+ * Upstream SOCKS 5 proxies.
+ *
+ * With --socksUpstream host:port[,host:port...] CONNECT requests are
+ * forwarded to other SOCKS 5 proxies instead of being connected here. The
+ * client's greeting is answered locally and its request is passed on
+ * unchanged; the upstream's reply and the tunnel data come back as tunnel
+ * data, as with --muxUpstream.
+ *
+ * For each upstream a pool of connections is kept that have already
+ * completed the TCP handshake, the greeting and, with --socksUpstreamAuth,
+ * the username/password subnegotiation (RFC 1929), so a request taken
+ * from the pool costs only its own round trip. The pool holds at least
+ * --upstreamPool connections. Every second it grows by the requests that
+ * found it empty, up to UPSTREAM_POOL_MAX, and connections idle for
+ * --upstreamIdle seconds are closed, shrinking it back. A request that
+ * misses claims a connection still being set up or opens a new one and
+ * is sent once that connection is ready.
+ *
+ * Upstream names are resolved once at startup.
+ */
+
+#define UPSTREAM_MAX		(4)
+#define UPSTREAM_POOL_MAX	(64)
+#define UPSTREAM_REQUEST_MAX	(4 + 1 + 255 + 2)
+
+/*
+ * upstream_cb
+ * A request that missed the pool was sent on bev, or bev is NULL when
+ * its connection failed.
+ */
+typedef void (*upstream_cb)(struct bufferevent *bev, void *arg);
+
+/*
+ * upstream_init
+ * Resolve the upstreams and fill the pools; a no-op without
+ * --socksUpstream.
+ */
+int upstream_init(struct event_base *base);
+
+/*
+ * upstream_free
+ */
+void upstream_free(void);
+
+/*
+ * upstream_configure
+ * Take up a changed --upstreamPool and --upstreamIdle.
+ */
+void upstream_configure(void);
+
+/*
+ * upstream_request
+ * Send a SOCKS 5 request to an upstream, round robin over the upstreams
+ * with a ready connection. Returns 1 with *bev set when a pooled
+ * connection took the request, 0 when cb will be called with arg once a
+ * connection is ready, or -1 on error.
+ */
+int upstream_request(const unsigned char *request, size_t len,
+		upstream_cb cb, void *arg, struct bufferevent **bev);
+
+/*
+ * upstream_cancel
+ * Drop the request waiting with arg; its connection joins the pool.
+ */
+void upstream_cancel(void *arg);
+
+/*
+ * upstream_report
+ * Append the state of each pool to out.
+ */
+void upstream_report(struct evbuffer *out);
+
+#endif
@@ -34,7 +34,11 @@
 
 #include <stdarg.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <ifaddrs.h>
 #include "util.h"
 #include "oddsock.h"
 
@@ -128,6 +132,150 @@ int make_listen_socket_reuseable(int s)
 	return 0;
 }
 
+int make_socket_nodelay(int s)
+{
+	const int one = 1;
+	if (setsockopt(s, IPPROTO_TCP, TCP_NODELAY,
+			(const void*)&one, (socklen_t)sizeof(one)) < 0) {
+		oddsock_log(0, errno, __FUNCTION__);
+		return -1;
+	}
+	return 0;
+}
+
+#ifdef __linux__
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL (46)
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL (69)
+#endif
+#endif
+
+/*
+ * make_socket_busy_poll
+ * Let the kernel busy poll the device queue for up to usec when reading
+ * s. Does not log: raising the value needs CAP_NET_ADMIN and the caller
+ * decides how loudly to fail.
+ */
+int make_socket_busy_poll(int s, unsigned int usec)
+{
+#ifdef __linux__
+	const int one = 1;
+	const int val = (int)usec;
+
+	if (setsockopt(s, SOL_SOCKET, SO_BUSY_POLL,
+			(const void*)&val, (socklen_t)sizeof(val)) < 0)
+		return -1;
+	/* Kernels before 5.11 lack the preference; busy polling still works. */
+	if (setsockopt(s, SOL_SOCKET, SO_PREFER_BUSY_POLL,
+			(const void*)&one, (socklen_t)sizeof(one)) < 0 &&
+		errno != ENOPROTOOPT)
+		return -1;
+	return 0;
+#else
+	(void)s;
+	(void)usec;
+	errno = ENOPROTOOPT;
+	return -1;
+#endif
+}
+
+#ifdef __linux__
+#ifndef IP_TRANSPARENT
+#define IP_TRANSPARENT (19)
+#endif
+#ifndef IPV6_TRANSPARENT
+#define IPV6_TRANSPARENT (75)
+#endif
+#ifndef SO_ORIGINAL_DST
+#define SO_ORIGINAL_DST (80) /* linux/netfilter_ipv4.h */
+#endif
+#ifndef IP6T_SO_ORIGINAL_DST
+#define IP6T_SO_ORIGINAL_DST (80) /* linux/netfilter_ipv6/ip6_tables.h */
+#endif
+#endif
+
+int make_socket_transparent(int s, int af)
+{
+#ifdef __linux__
+	const int one = 1;
+	int e;
+
+	if (af == AF_INET6)
+		e = setsockopt(s, IPPROTO_IPV6, IPV6_TRANSPARENT,
+				(const void*)&one, (socklen_t)sizeof(one));
+	else
+		e = setsockopt(s, IPPROTO_IP, IP_TRANSPARENT,
+				(const void*)&one, (socklen_t)sizeof(one));
+	if (e < 0) {
+		oddsock_log(0, errno, __FUNCTION__);
+		return -1;
+	}
+	return 0;
+#else
+	oddsock_logx(0, "%s: transparent sockets are not supported", __FUNCTION__);
+	return -1;
+#endif
+}
+
+int socket_original_dst(int s, bool tproxy, struct sockaddr_storage *ss,
+		socklen_t *sslen)
+{
+	*sslen = sizeof(*ss);
+	memset(ss, 0, sizeof(*ss));
+
+	/* TPROXY keeps the original destination as the local address. */
+	if (tproxy)
+		return getsockname(s, (struct sockaddr*)ss, sslen);
+
+#ifdef __linux__
+	/* REDIRECT rewrote the destination; ask conntrack for the original. */
+	if (getsockname(s, (struct sockaddr*)ss, sslen) < 0)
+		return -1;
+	*sslen = sizeof(*ss);
+	if (ss->ss_family == AF_INET6)
+		return getsockopt(s, IPPROTO_IPV6, IP6T_SO_ORIGINAL_DST, ss, sslen);
+	return getsockopt(s, IPPROTO_IP, SO_ORIGINAL_DST, ss, sslen);
+#else
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
+#ifdef __linux__
+#ifndef SO_PEERCRED
+#define SO_PEERCRED (17)
+#endif
+/* struct ucred, which glibc only declares with _GNU_SOURCE. */
+struct oddsock_ucred {
+	pid_t pid;
+	uid_t uid;
+	gid_t gid;
+};
+#endif
+
+/*
+ * socket_peer_uid
+ * The user id of the process at the other end of a unix socket.
+ */
+int socket_peer_uid(int s, uid_t *uid)
+{
+#ifdef __linux__
+	struct oddsock_ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(s, SOL_SOCKET, SO_PEERCRED, (void*)&cred, &len) < 0)
+		return -1;
+	*uid = cred.uid;
+	return 0;
+#else
+	gid_t gid;
+
+	return getpeereid(s, uid, &gid);
+#endif
+}
+
 int sockaddr_to_presentation(struct sockaddr *saddr, char *addr,
 		int addrlen, unsigned short *port)
 {
@@ -161,3 +309,46 @@ int sockaddr_to_presentation(struct sockaddr *saddr, char *addr,
 	return 0;
 }
 
+/*
+ * sockaddr_same_addr
+ * Whether a and b hold the same address, ports aside.
+ */
+bool sockaddr_same_addr(const struct sockaddr *a, const struct sockaddr *b)
+{
+	if (a->sa_family != b->sa_family)
+		return false;
+	if (a->sa_family == AF_INET)
+		return memcmp(&((const struct sockaddr_in*)a)->sin_addr,
+				&((const struct sockaddr_in*)b)->sin_addr, 4) == 0;
+	if (a->sa_family == AF_INET6)
+		return memcmp(&((const struct sockaddr_in6*)a)->sin6_addr,
+				&((const struct sockaddr_in6*)b)->sin6_addr, 16) == 0;
+	return false;
+}
+
+/*
+ * sockaddr_is_local
+ * Whether sa is a loopback address or one of the host's interface
+ * addresses. Walks the interfaces, so it is for rare paths only.
+ */
+bool sockaddr_is_local(const struct sockaddr *sa)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in*)sa;
+	const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6*)sa;
+	struct ifaddrs *ifs, *ifa;
+	bool local = false;
+
+	if (sa->sa_family == AF_INET &&
+		(ntohl(sin->sin_addr.s_addr) >> 24) == 127)
+		return true;
+	if (sa->sa_family == AF_INET6 && IN6_IS_ADDR_LOOPBACK(&sin6->sin6_addr))
+		return true;
+
+	if (getifaddrs(&ifs) < 0)
+		return false;
+	for (ifa = ifs; ifa && !local; ifa = ifa->ifa_next)
+		if (ifa->ifa_addr && sockaddr_same_addr(ifa->ifa_addr, sa))
+			local = true;
+	freeifaddrs(ifs);
+	return local;
+}
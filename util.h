@@ -50,8 +50,16 @@ void oddsock_error(int status, int errnum, const char *fmt, ...);
 
 int make_socket_nonblocking(int s);
 int make_listen_socket_reuseable(int s);
+int make_socket_nodelay(int s);
+int make_socket_busy_poll(int s, unsigned int usec);
+int make_socket_transparent(int s, int af);
+int socket_original_dst(int s, bool tproxy, struct sockaddr_storage *ss,
+		socklen_t *sslen);
+int socket_peer_uid(int s, uid_t *uid);
 int sockaddr_to_presentation(struct sockaddr *saddr, char *addr,
 		int addrlen, unsigned short *port);
+bool sockaddr_same_addr(const struct sockaddr *a, const struct sockaddr *b);
+bool sockaddr_is_local(const struct sockaddr *sa);
 
 #endif
 